@@ -0,0 +1,46 @@
+#include "benchutil.h"
+#define ARENA_ALLOCATOR_IMPL
+#include "arena.h"
+
+#define BENCH_ARENA_ROUNDS 20000
+
+// Allocation sizes of the server at startup and per watch event: connection buffers,
+// workspace buffer, token stream, client stack and small config data
+static const size_t bench_arena_sizes[] = { 1024, 1024, 496, 256, 120, 24 };
+#define BENCH_ARENA_SIZE_COUNT (sizeof(bench_arena_sizes) / sizeof(bench_arena_sizes[0]))
+
+static void* bench_arena_ptrs[BENCH_ARENA_ROUNDS * BENCH_ARENA_SIZE_COUNT];
+
+BENCH_SUITE(arena,
+    BENCH_CASE("malloc, server allocation pattern", BENCH_ARENA_ROUNDS,
+        for (int s = 0; s < BENCH_ARENA_SIZE_COUNT; s++) {
+            bench_arena_ptrs[bench_i * BENCH_ARENA_SIZE_COUNT + s] = malloc(bench_arena_sizes[s]);
+        }
+    );
+    for (long i = 0; i < BENCH_ARENA_ROUNDS * BENCH_ARENA_SIZE_COUNT; i++) {
+        free(bench_arena_ptrs[i]);
+    }
+
+    arena_init(65536, 2, 0);
+    BENCH_CASE("arena_alloc, server allocation pattern", BENCH_ARENA_ROUNDS,
+        for (int s = 0; s < BENCH_ARENA_SIZE_COUNT; s++) {
+            bench_arena_ptrs[bench_i * BENCH_ARENA_SIZE_COUNT + s] = arena_alloc(bench_arena_sizes[s]);
+        }
+    );
+    BENCH_KEEP(bench_arena_ptrs[0]);
+    arena_free();
+
+    BENCH_CASE("malloc, 32 byte objects", BENCH_ARENA_ROUNDS * BENCH_ARENA_SIZE_COUNT,
+        bench_arena_ptrs[bench_i] = malloc(32);
+    );
+    for (long i = 0; i < BENCH_ARENA_ROUNDS * BENCH_ARENA_SIZE_COUNT; i++) {
+        free(bench_arena_ptrs[i]);
+    }
+
+    arena_init(65536, 2, 0);
+    BENCH_CASE("arena_alloc, 32 byte objects", BENCH_ARENA_ROUNDS * BENCH_ARENA_SIZE_COUNT,
+        bench_arena_ptrs[bench_i] = arena_alloc(32);
+    );
+    BENCH_KEEP(bench_arena_ptrs[0]);
+    arena_free();
+)
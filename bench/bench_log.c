@@ -0,0 +1,37 @@
+#include "benchutil.h"
+#include <fcntl.h>
+#include "log.h"
+
+#define BENCH_LOG_LINES 100000
+
+// Every task output line goes through log__print on the event loop, so its cost is paid per line
+BENCH_SUITE(log,
+    LogOptions options;
+    options.async     = 1;
+    options.policy    = LOG_POLICY_BLOCK;
+    options.ring_size = 16 * 1024 * 1024;
+    options.flush_ms  = 10;
+    options.format    = LOG_FORMAT_TEXT;
+    options.rotate_size        = 0;
+    options.rotate_interval_ms = 0;
+    options.rotate_keep        = 0;
+
+    // Lines go to /dev/null, so the writes themselves are as cheap as they ever get
+    __log_console_fd = open("/dev/null", O_WRONLY);
+    BENCH_CASE("log, synchronous write per line", BENCH_LOG_LINES,
+        log__print(LOG_LVL_INFO, LOG_CTX(LOG_COMP_TASK, "bench", 1, LOG_STREAM_STDOUT), "task output line %ld", bench_i);
+    );
+    log_init(NULL, &options);
+    BENCH_CASE("log, push into writer ring", BENCH_LOG_LINES,
+        log__print(LOG_LVL_INFO, LOG_CTX(LOG_COMP_TASK, "bench", 1, LOG_STREAM_STDOUT), "task output line %ld", bench_i);
+    );
+    log_close();
+
+    __log_format = LOG_FORMAT_JSON;
+    BENCH_CASE("log, synchronous JSON line", BENCH_LOG_LINES,
+        log__print(LOG_LVL_INFO, LOG_CTX(LOG_COMP_TASK, "bench", 1, LOG_STREAM_STDOUT), "task \"output\" line %ld", bench_i);
+    );
+    __log_format = LOG_FORMAT_TEXT;
+    close(__log_console_fd);
+    __log_console_fd = STDOUT_FILENO;
+)
@@ -0,0 +1,22 @@
+#include "benchutil.h"
+#define METRICS_IMPL
+#include "metrics.h"
+
+#define BENCH_METRICS_ADDS 10000000
+
+// Counters are bumped on the event loop for every request, launch and chunk of task output
+BENCH_SUITE(metrics,
+    uint64_t shared = 0;
+
+    BENCH_CASE("metrics, per-thread counter add", BENCH_METRICS_ADDS,
+        metrics_add(METRIC_OUTPUT_BYTES, bench_i);
+    );
+    BENCH_CASE("atomic add on a shared counter", BENCH_METRICS_ADDS,
+        __atomic_add_fetch(&shared, bench_i, __ATOMIC_RELAXED);
+    );
+    BENCH_CASE("histogram, record a latency", BENCH_METRICS_ADDS,
+        histogram_record(HISTOGRAM_REQUEST, bench_i & 0xfffff);
+    );
+    BENCH_KEEP(shared);
+    BENCH_KEEP(metrics_value(METRIC_OUTPUT_BYTES));
+)
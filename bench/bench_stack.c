@@ -0,0 +1,29 @@
+#include "benchutil.h"
+#define STACK_IMPL
+#include "stack.h"
+
+#define BENCH_STACK_CAPACITY 1024
+#define BENCH_STACK_ROUNDS 20000
+
+DEFINE_STACK(bench_int_stack, int)
+
+// Client sockets are kept in an int stack, which the server walks every poll round
+BENCH_SUITE(stack,
+    Stack* stack = stack_new(BENCH_STACK_CAPACITY, sizeof(int));
+    bench_int_stack* typed = bench_int_stack_new(BENCH_STACK_CAPACITY);
+    long sum = 0;
+
+    BENCH_CASE("stack, push/get/pop 1024 ints", BENCH_STACK_ROUNDS,
+        for (int i = 0; i < BENCH_STACK_CAPACITY; i++) stack_push(stack, &i);
+        for (int i = stack->count - 1; i >= 0; i--) sum += *(int*)stack_get(stack, i);
+        while (stack->count > 0) sum += *(int*)stack_pop(stack);
+    );
+    BENCH_CASE("DEFINE_STACK, push/get/pop 1024 ints", BENCH_STACK_ROUNDS,
+        for (int i = 0; i < BENCH_STACK_CAPACITY; i++) bench_int_stack_push(typed, i);
+        for (int i = typed->count - 1; i >= 0; i--) sum += *bench_int_stack_get(typed, i);
+        while (typed->count > 0) sum += *bench_int_stack_pop(typed);
+    );
+    BENCH_KEEP(sum);
+    free(stack);
+    free(typed);
+)
@@ -0,0 +1,64 @@
+#include "benchutil.h"
+#define STORE_IMPL
+#include "store.h"
+
+#define BENCH_STORE_CAPACITY 10000
+#define BENCH_STORE_LIVE 16
+#define BENCH_STORE_ROUNDS 20000
+
+// Same layout as TaskProcess in server.h
+typedef struct {
+    uint64_t start_ms;
+    int pid;
+    int out_fd_r;
+    int err_fd_r;
+    int timer_id;
+    unsigned int cgroup_id;
+    unsigned char kill_stage;
+    char* task_name;
+} BenchProcess;
+
+DEFINE_STORE(bench_proc_store, BenchProcess)
+
+BENCH_SUITE(store,
+    Store* store = store_new(BENCH_STORE_CAPACITY, sizeof(BenchProcess));
+    // Spread a handful of live entries over the whole store, like a few running tasks in a large process table
+    for (int i = 0; i < BENCH_STORE_CAPACITY; i++) store_push_empty(store);
+    for (int i = 0; i < BENCH_STORE_CAPACITY; i++) {
+        if (i % (BENCH_STORE_CAPACITY / BENCH_STORE_LIVE) != 0) store_remove_at(store, i);
+    }
+
+    long sum = 0;
+    BENCH_CASE("store_get over capacity, 16 live in 10k slots", BENCH_STORE_ROUNDS,
+        for (int i = 0; i < store->capacity; i++) {
+            KeyValue res = store_get(store, i);
+            if (res.value) sum += ((BenchProcess*)res.value)->pid + i;
+        }
+    );
+    BENCH_CASE("store_foreach, 16 live in 10k slots", BENCH_STORE_ROUNDS,
+        store_foreach(store, i) {
+            KeyValue res = store_get(store, i);
+            sum += ((BenchProcess*)res.value)->pid + i;
+        }
+    );
+    BENCH_KEEP(sum);
+    store_free(store);
+
+    Store* generic = store_new(BENCH_STORE_LIVE, sizeof(BenchProcess));
+    bench_proc_store* typed = bench_proc_store_new(BENCH_STORE_LIVE);
+    BenchProcess proc = { .pid = 1 };
+
+    BENCH_CASE("store, push/get/remove 16 processes", BENCH_STORE_ROUNDS,
+        for (int i = 0; i < BENCH_STORE_LIVE; i++) store_push(generic, &proc);
+        for (int i = 0; i < BENCH_STORE_LIVE; i++) sum += ((BenchProcess*)store_get(generic, i).value)->pid;
+        for (int i = 0; i < BENCH_STORE_LIVE; i++) store_remove_at(generic, i);
+    );
+    BENCH_CASE("DEFINE_STORE, push/get/remove 16 processes", BENCH_STORE_ROUNDS,
+        for (int i = 0; i < BENCH_STORE_LIVE; i++) bench_proc_store_push(typed, &proc);
+        for (int i = 0; i < BENCH_STORE_LIVE; i++) sum += bench_proc_store_get(typed, i)->pid;
+        for (int i = 0; i < BENCH_STORE_LIVE; i++) bench_proc_store_remove_at(typed, i);
+    );
+    BENCH_KEEP(sum);
+    store_free(generic);
+    store_free((Store*)typed);
+)
@@ -0,0 +1,171 @@
+#include "benchutil.h"
+#include <signal.h>
+#include <sys/wait.h>
+#define PROTOCOL_IMPL
+#include "protocol.h"
+#define SHM_IMPL
+#include "shm.h"
+
+#define BENCH_TRANSPORT_CONNECT_REQUESTS 5000
+#define BENCH_TRANSPORT_REQUESTS 50000
+#define BENCH_TRANSPORT_BUF 1024
+#define BENCH_TRANSPORT_RING (64 * 1024)
+
+static char bench_transport_in[BENCH_TRANSPORT_BUF];
+static char bench_transport_out[BENCH_TRANSPORT_BUF];
+
+/// Answer a request the way the agent answers a task run, so both transports carry the same messages
+static int
+bench_transport_reply(char* msg, int len, ProtocolTokenStream* stream, char* out) {
+    if (protocol_read(msg, len, stream) != 0) return -1;
+    protocol_tokenstream_reset(stream);
+    stream->type = PROTOCOL_MSG_SUCCESS;
+    protocol_tokenstream_add_token(stream, PROTOCOL_TOKEN_ARG, "Task 'build' started succesfully");
+    return protocol_tokenstream_to_buf(stream, out, BENCH_TRANSPORT_BUF, 0);
+}
+
+static void
+bench_transport_request(ProtocolTokenStream* stream) {
+    protocol_tokenstream_reset(stream);
+    stream->type = PROTOCOL_MSG_TASK_RUN;
+    protocol_tokenstream_add_token(stream, PROTOCOL_TOKEN_ARG, "build");
+    protocol_tokenstream_add_token(stream, PROTOCOL_TOKEN_VAR, "N=1");
+}
+
+/// Serve TCP clients until killed, closing each connection after its reply like the agent does if asked to
+static void
+bench_tcp_responder(int listen_sock, int close_after_reply) {
+    ProtocolTokenStream* stream = protocol_tokenstream_alloc(4);
+    fcntl(listen_sock, F_SETFL, 0);
+    while (1) {
+        int sock = accept(listen_sock, NULL, NULL);
+        if (sock < 0) continue;
+
+        ProtocolReader reader;
+        ProtocolHeader header;
+        char* msg;
+        protocol_reader_init(&reader, sock, bench_transport_in, BENCH_TRANSPORT_BUF);
+        while ((msg = protocol_reader_next(&reader, &header)) != NULL) {
+            int len = bench_transport_reply(msg, header.size + header.length, stream, bench_transport_out);
+            if (len < 1 || socket_send(sock, bench_transport_out, len) != len || close_after_reply) break;
+        }
+        close(sock);
+    }
+}
+
+/// Serve a channel until killed, sleeping on the doorbell between requests the way the agent loop does
+static void
+bench_shm_responder(ShmChannel* channel) {
+    ProtocolTokenStream* stream = protocol_tokenstream_alloc(4);
+    while (1) {
+        __atomic_store_n(&channel->requests->consumer_sleeping, 1, __ATOMIC_SEQ_CST);
+        if (!shm_ring_pending(channel->requests)) {
+            struct pollfd fd = { .fd = channel->agent_fd, .events = POLLIN };
+            poll(&fd, 1, 1000);
+        }
+        __atomic_store_n(&channel->requests->consumer_sleeping, 0, __ATOMIC_RELAXED);
+        shm_drain(channel->agent_fd);
+
+        int len;
+        while ((len = shm_ring_read(channel->requests, channel->ring_size, bench_transport_in, BENCH_TRANSPORT_BUF)) > 0) {
+            shm_notify(&channel->requests->producer_sleeping, channel->client_fd);
+            len = bench_transport_reply(bench_transport_in, len, stream, bench_transport_out);
+            if (len < 1 || shm_ring_write(channel->responses, channel->ring_size, bench_transport_out, len) != 0) break;
+            shm_notify(&channel->responses->consumer_sleeping, channel->client_fd);
+        }
+    }
+}
+
+static int
+bench_tcp_round_trip(Connection* conn, ProtocolTokenStream* stream) {
+    bench_transport_request(stream);
+    if (protocol_send(conn->socket, conn->out_buf, BENCH_TRANSPORT_BUF, stream) < 1) return -1;
+
+    ProtocolReader reader;
+    ProtocolHeader header;
+    protocol_reader_init(&reader, conn->socket, conn->in_buf, BENCH_TRANSPORT_BUF);
+    char* msg = protocol_reader_next(&reader, &header);
+    return msg ? protocol_read(msg, header.size + header.length, stream) : -1;
+}
+
+static int
+bench_shm_round_trip(ShmChannel* channel, char* buf, ProtocolTokenStream* stream) {
+    bench_transport_request(stream);
+    int len = protocol_tokenstream_to_buf(stream, buf, BENCH_TRANSPORT_BUF, 0);
+    if (shm_ring_write(channel->requests, channel->ring_size, buf, len) != 0) return -1;
+    shm_notify(&channel->requests->consumer_sleeping, channel->agent_fd);
+
+    if (shm_ring_wait(channel->responses, channel->ring_size, 0, channel->client_fd, 5000) != 0) return -1;
+    len = shm_ring_read(channel->responses, channel->ring_size, buf, BENCH_TRANSPORT_BUF);
+    shm_notify(&channel->responses->producer_sleeping, channel->agent_fd);
+    return len > 0 ? protocol_read(buf, len, stream) : -1;
+}
+
+/// Fork a responder of given kind, returns its pid
+static pid_t
+bench_transport_fork(int listen_sock, int close_after_reply, ShmChannel* channel) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        if (channel) bench_shm_responder(channel);
+        else bench_tcp_responder(listen_sock, close_after_reply);
+        _exit(0);
+    }
+    return pid;
+}
+
+static void
+bench_transport_stop(pid_t pid) {
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+}
+
+// A tight submit loop of one local client, every request waits for its reply. The CLI opens a connection per
+// command, a persistent connection shows how much of that is connection setup and how much the transport itself.
+BENCH_SUITE(transport,
+    ProtocolTokenStream* stream = protocol_tokenstream_alloc(4);
+    char in_buf[BENCH_TRANSPORT_BUF];
+    char out_buf[BENCH_TRANSPORT_BUF];
+    Config config;
+    memset(&config, 0, sizeof(config));
+    config.args.run_mode = RUNMODE_CMD;
+    config.settings.connection.sock_timeout_sec = 5;
+
+    int listen_sock = socket_listen_local(0, 128);
+    struct sockaddr_in address;
+    socklen_t address_len = sizeof(address);
+    getsockname(listen_sock, (struct sockaddr*)&address, &address_len);
+    config.args.port = ntohs(address.sin_port);
+
+    long failed = 0;
+    Connection conn;
+    pid_t pid = bench_transport_fork(listen_sock, 1, NULL);
+    BENCH_CASE("tcp, connection per request", BENCH_TRANSPORT_CONNECT_REQUESTS,
+        if (connection_init_buffers(&config, &conn, in_buf, out_buf) < 1 || bench_tcp_round_trip(&conn, stream) != 0) {
+            failed++;
+        }
+        connection_close(&conn);
+    );
+    bench_transport_stop(pid);
+
+    pid = bench_transport_fork(listen_sock, 0, NULL);
+    if (connection_init_buffers(&config, &conn, in_buf, out_buf) < 1) failed++;
+    BENCH_CASE("tcp, persistent connection", BENCH_TRANSPORT_REQUESTS,
+        if (bench_tcp_round_trip(&conn, stream) != 0) failed++;
+    );
+    connection_close(&conn);
+    bench_transport_stop(pid);
+    close(listen_sock);
+
+    // The responder inherits the mapping and doorbells, the agent hands them over through its Unix socket instead
+    ShmChannel channel;
+    if (shm_channel_create(&channel, BENCH_TRANSPORT_RING) != 0) failed++;
+    pid = bench_transport_fork(-1, 0, &channel);
+    BENCH_CASE("shm, channel ring pair", BENCH_TRANSPORT_REQUESTS,
+        if (bench_shm_round_trip(&channel, in_buf, stream) != 0) failed++;
+    );
+    bench_transport_stop(pid);
+    shm_channel_close(&channel);
+
+    if (failed) printf("%ld requests failed\n", failed);
+)
@@ -0,0 +1,39 @@
+#ifndef BENCH_UTIL_H
+#define BENCH_UTIL_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+
+#define RUN_BENCH(suite) (suite ## _bench_body())
+
+#define BENCH_SUITE(name, expr) \
+int name ## _bench_body() {\
+    printf("\nBenchmark suite: '%s'\n===================================\n", #name);\
+    {\
+        expr\
+    }\
+    return 0;\
+}\
+
+/// Run an expression given amount of times and print the average time per iteration
+#define BENCH_CASE(case, iterations, expr) {\
+    uint64_t bench_start = bench_now_ns();\
+    for (long bench_i = 0; bench_i < (iterations); bench_i++) {\
+        expr\
+    }\
+    uint64_t bench_total = bench_now_ns() - bench_start;\
+    printf("%-48s %10.2f ns/op (%ld ops)\n", case, (double)bench_total / (iterations), (long)(iterations));\
+}
+
+/// Prevent the compiler from optimizing away a computed value
+#define BENCH_KEEP(value) __asm__ __volatile__("" : : "g"(value) : "memory")
+
+static inline uint64_t
+bench_now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+#endif
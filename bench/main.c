@@ -0,0 +1,17 @@
+#include "benchutil.h"
+#include "bench_arena.c"
+#include "bench_store.c"
+#include "bench_stack.c"
+#include "bench_log.c"
+#include "bench_metrics.c"
+#include "bench_transport.c"
+
+int main(int argc, char** argv) {
+    RUN_BENCH(arena);
+    RUN_BENCH(store);
+    RUN_BENCH(stack);
+    RUN_BENCH(log);
+    RUN_BENCH(metrics);
+    RUN_BENCH(transport);
+    return 0;
+}
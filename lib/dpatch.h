@@ -0,0 +1,78 @@
+#ifndef DPATCH_H
+#define DPATCH_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// In-process task runner: the scheduler and process manager of the dpatch agent, driven by function calls
+// instead of a socket. Tasks still run as child processes, but the program embedding the runner submits them,
+// receives their output and reaps them itself.
+//
+// The runner shares process-wide state with the agent (allocator, log and metrics), so there is only one
+// runner per process, used from the thread that created it. Its child processes are reaped by the runner,
+// the embedding program must not wait on them or ignore SIGCHLD.
+
+typedef struct DpRunner_st DpRunner;
+
+typedef enum {
+    DP_STDOUT = 1,
+    DP_STDERR = 2,
+} DpStream;
+
+typedef enum {
+    DP_OK            =  0,
+    DP_ERR_ARG       = -1,
+    DP_ERR_NOT_FOUND = -2,
+    DP_ERR_FULL      = -3,
+    DP_ERR_LAUNCH    = -4,
+    DP_ERR_TIMEOUT   = -5,
+} DpRetCode;
+
+/// Called with each line a task writes, without the line break. 'line' is only valid during the call, may hold
+/// NUL bytes, and a line longer than the agent connection buffer is passed on in parts.
+typedef void (*DpOutputFunc)(void* ctx, long run_id, const char* task_name, DpStream stream, const char* line, size_t len);
+/// Called once a task process is reaped, with its wait status or -1 if it could not be waited on
+typedef void (*DpExitFunc)(void* ctx, long run_id, const char* task_name, pid_t pid, int status);
+
+// Zeroed fields keep the agent defaults
+typedef struct DpOptions_st {
+    int max_processes;          // Tasks running at once
+    int queue_max;              // Tasks queued in memory before spilling to disk
+    long task_timeout_ms;       // Default for tasks without a 'timeout'
+    const char* cgroup_root;    // Delegated cgroup v2 directory to isolate tasks in
+    const char* log_file;       // Agent log, nothing is logged if not set
+    int port;                   // Also accept dpatch clients on this TCP port
+    const char* local_path;     // Also accept dpatch clients through shared memory at this Unix socket
+    DpOutputFunc output;
+    DpExitFunc exit;
+    void* ctx;                  // Passed to both callbacks
+} DpOptions;
+
+/// Create the runner, 'options' may be NULL. Returns NULL if failed, or if a runner already exists.
+DpRunner* dp_runner_new(const DpOptions* options);
+/// Kill and reap every task still running, then release the runner
+void dp_runner_free(DpRunner* runner);
+/// Make the workspace file at 'path' the active one, returns DP_OK or DP_ERR_NOT_FOUND
+int dp_workspace_load(DpRunner* runner, const char* path);
+/// Start a task of the active workspace, or queue it if it has to wait. 'env' is a NULL terminated list of
+/// NAME=value variables added to the task, or NULL. Returns the run id of the task (> 0) or an error code.
+long dp_submit(DpRunner* runner, const char* task_name, const char* const* env);
+/// Forward task output and reap finished tasks until at least one finishes or 'timeout_ms' passes.
+/// A negative timeout waits indefinitely. Returns the amount of tasks finished.
+int dp_poll(DpRunner* runner, int timeout_ms);
+/// Run until the task with given run id finishes, writing its wait status into 'status' if not NULL.
+/// A negative timeout waits indefinitely. Returns DP_OK, DP_ERR_TIMEOUT, or DP_ERR_NOT_FOUND if the run is not
+/// known or finished too long ago to be remembered.
+int dp_wait(DpRunner* runner, long run_id, int timeout_ms, int* status);
+/// Get the amount of tasks running or queued
+int dp_pending(DpRunner* runner);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,257 @@
+#include <errno.h>
+#include <signal.h>
+#define ARENA_ALLOCATOR_IMPL
+#define ALLOC_FUNC arena_alloc
+#define ALLOC_TAG_FUNC arena_alloc_tagged
+// Global arena pages are fresh anonymous mappings, so allocations from it are already zeroed
+#define ALLOC_ZEROED
+#include "arena.h"
+#define CONFIG_IMPL
+#include "config.h"
+#include "log.h"
+#include "server.h"
+
+// The library is built with hidden visibility, only the public API is exported
+#pragma GCC visibility push(default)
+#include "dpatch.h"
+#pragma GCC visibility pop
+
+#ifndef DP_PAGE_SIZE
+#define DP_PAGE_SIZE 65536
+#endif
+
+#ifndef DP_PAGE_COUNT
+#define DP_PAGE_COUNT 2
+#endif
+
+// Finished runs remembered for dp_wait
+#define DP_DONE_MAX 256
+
+typedef struct DpDone_st {
+    long run_id;
+    int status;
+} DpDone;
+
+struct DpRunner_st {
+    Server server;
+    Config config;
+    DpOptions options;
+    uint64_t done_count;
+    DpDone done[DP_DONE_MAX];
+};
+
+static DpRunner* __dp_runner = NULL;
+
+/// Copy a string given by the embedding program into the arena, returns the copy or NULL if not given
+static char*
+dp_strdup(const char* str) {
+    if (!str) return NULL;
+    size_t len = strlen(str);
+    char* copy = MMALLOC_TAG(len + 1, CONFIG);
+    if (copy) memcpy(copy, str, len + 1);
+    return copy;
+}
+
+static void
+dp_hook_output(void* ctx, TaskProcess* process, LogStream stream, const char* line, int len) {
+    DpRunner* runner = ctx;
+    runner->options.output(runner->options.ctx,
+                           process->trace_id,
+                           process->task_name,
+                           stream == LOG_STREAM_STDERR ? DP_STDERR : DP_STDOUT,
+                           line,
+                           len);
+}
+
+static void
+dp_hook_exit(void* ctx, TaskProcess* process, int status) {
+    DpRunner* runner = ctx;
+    DpDone* done = &runner->done[runner->done_count++ % DP_DONE_MAX];
+    done->run_id = process->trace_id;
+    done->status = status;
+
+    if (runner->options.exit) {
+        runner->options.exit(runner->options.ctx, process->trace_id, process->task_name, process->pid, status);
+    }
+}
+
+/// Get how long the next loop iteration may wait, given the deadline of the call. The agent never sleeps past
+/// its select timeout, so task deadlines are checked just as often in-process.
+static long
+dp_slice_us(DpRunner* runner, uint64_t deadline_ms, int timeout_ms) {
+    long slice_us = runner->config.settings.connection.select_timeout_sec * 1000000L +
+                    runner->config.settings.connection.select_timeout_usec;
+    if (timeout_ms < 0) return slice_us;
+
+    uint64_t now_ms = timer_now_ms();
+    if (now_ms >= deadline_ms) return 0;
+    long left_us = (long)(deadline_ms - now_ms) * 1000;
+    return left_us < slice_us ? left_us : slice_us;
+}
+
+/// Check if a run is still running or queued. Spilled tasks are not looked into, so anything in the spill
+/// counts as a possible match.
+static unsigned char
+dp_run_active(DpRunner* runner, long run_id) {
+    Server* server = &runner->server;
+    store_foreach(server->process_store, i) {
+        if (proc_store_get(server->process_store, i)->trace_id == run_id) return 1;
+    }
+    for (TaskRecord* task = server->queue_head; task; task = task->next) {
+        if (task->trace_id == run_id) return 1;
+    }
+    return server->spill && server->spill->count > 0;
+}
+
+static DpDone*
+dp_run_done(DpRunner* runner, long run_id) {
+    uint64_t count = runner->done_count < DP_DONE_MAX ? runner->done_count : DP_DONE_MAX;
+    for (uint64_t i = 0; i < count; i++) {
+        DpDone* done = &runner->done[(runner->done_count - 1 - i) % DP_DONE_MAX];
+        if (done->run_id == run_id) return done;
+    }
+    return NULL;
+}
+
+DpRunner*
+dp_runner_new(const DpOptions* options) {
+    if (__dp_runner) return NULL;
+    if (arena_init_flags(DP_PAGE_SIZE, DP_PAGE_COUNT, 1, ARENA_FLAG_NONE) != ARENA_OK) return NULL;
+
+    DpRunner* runner = MMALLOC_TAG(sizeof(DpRunner), SERVER);
+    if (!runner) {
+        arena_free();
+        return NULL;
+    }
+    memset(runner, 0, sizeof(DpRunner));
+    if (options) runner->options = *options;
+
+    Config* config = &runner->config;
+    config_default_settings(config);
+    config->args.run_mode   = RUNMODE_SERVER;
+    config->args.port       = runner->options.port;
+    config->args.local_path = dp_strdup(runner->options.local_path);
+    config->settings.general.cgroup_root = dp_strdup(runner->options.cgroup_root);
+    if (runner->options.max_processes > 0)   config->settings.general.process_store_count = runner->options.max_processes;
+    if (runner->options.queue_max > 0)       config->settings.general.task_queue_max = runner->options.queue_max;
+    if (runner->options.task_timeout_ms > 0) config->settings.general.task_timeout_ms = runner->options.task_timeout_ms;
+
+    // The embedding program owns the console, the agent only logs into a file if given one
+    LogOptions log_options = {
+        .format             = LOG_FORMAT_TEXT,
+        .rotate_size        = config->settings.log.rotate_size,
+        .rotate_interval_ms = config->settings.log.rotate_interval_ms,
+        .rotate_keep        = config->settings.log.rotate_keep,
+    };
+    __log_console_fd = -1;
+    if (log_init((char*)runner->options.log_file, &log_options) != 0 ||
+        server_init(&runner->server, config) != 0)
+    {
+        log_close();
+        __log_console_fd = STDOUT_FILENO;
+        arena_free();
+        return NULL;
+    }
+
+    runner->server.hooks.exit   = dp_hook_exit;
+    runner->server.hooks.output = runner->options.output ? dp_hook_output : NULL;
+    runner->server.hooks.ctx    = runner;
+    __dp_runner = runner;
+    return runner;
+}
+
+void
+dp_runner_free(DpRunner* runner) {
+    if (!runner || runner != __dp_runner) return;
+    Server* server = &runner->server;
+
+    store_foreach(server->process_store, i) {
+        TaskProcess* process = proc_store_get(server->process_store, i);
+        kill(-process->pid, SIGKILL);
+        waitpid(process->pid, NULL, 0);
+
+        if (process->out_fd_r >= 0) close(process->out_fd_r);
+        if (process->err_fd_r >= 0) close(process->err_fd_r);
+        if (process->exec_fd_r >= 0) close(process->exec_fd_r);
+        if (process->pid_fd >= 0) close(process->pid_fd);
+        if (process->cgroup_id) cgroup_remove(server->cgroup_root, process->cgroup_id);
+    }
+
+    // Slabs go back all at once, only tasks large enough to have a mapping of their own are freed one by one
+    for (TaskRecord* task = server->queue_head; task;) {
+        TaskRecord* next = task->next;
+        task_free(server, task);
+        task = next;
+    }
+    server_cleanup(server);
+    strheap_release(server->strings);
+
+    log_close();
+    __log_console_fd = STDOUT_FILENO;
+    __dp_runner = NULL;
+    arena_free();
+}
+
+int
+dp_workspace_load(DpRunner* runner, const char* path) {
+    if (!runner || !path) return DP_ERR_ARG;
+    return server_workspace_set(&runner->server, &runner->config, path) == 0 ? DP_OK : DP_ERR_NOT_FOUND;
+}
+
+long
+dp_submit(DpRunner* runner, const char* task_name, const char* const* env) {
+    if (!runner || !task_name) return DP_ERR_ARG;
+
+    // Variables are copied into the task, neither the name nor them are written to
+    uint32_t run_id = 0;
+    switch (server_task_submit(&runner->server, &runner->config, (char*)task_name, (char**)env, &run_id)) {
+        case SUBMIT_STARTED:
+        case SUBMIT_QUEUED:
+            return run_id;
+        case SUBMIT_NOT_FOUND:
+            return DP_ERR_NOT_FOUND;
+        case SUBMIT_REJECTED:
+            return DP_ERR_FULL;
+        case SUBMIT_FAILED:
+            break;
+    }
+    return DP_ERR_LAUNCH;
+}
+
+int
+dp_poll(DpRunner* runner, int timeout_ms) {
+    if (!runner) return DP_ERR_ARG;
+
+    uint64_t deadline_ms = timer_now_ms() + (timeout_ms > 0 ? timeout_ms : 0);
+    int finished = 0;
+    do {
+        finished += server_step(&runner->server, &runner->config, dp_slice_us(runner, deadline_ms, timeout_ms));
+    } while (!finished && (timeout_ms < 0 || timer_now_ms() < deadline_ms));
+    return finished;
+}
+
+int
+dp_wait(DpRunner* runner, long run_id, int timeout_ms, int* status) {
+    if (!runner || run_id <= 0) return DP_ERR_ARG;
+
+    uint64_t deadline_ms = timer_now_ms() + (timeout_ms > 0 ? timeout_ms : 0);
+    while (1) {
+        DpDone* done = dp_run_done(runner, run_id);
+        if (done) {
+            if (status) *status = done->status;
+            return DP_OK;
+        }
+        if (run_id > runner->server.task_seq || !dp_run_active(runner, run_id)) return DP_ERR_NOT_FOUND;
+        if (timeout_ms >= 0 && timer_now_ms() >= deadline_ms) return DP_ERR_TIMEOUT;
+
+        server_step(&runner->server, &runner->config, dp_slice_us(runner, deadline_ms, timeout_ms));
+    }
+}
+
+int
+dp_pending(DpRunner* runner) {
+    if (!runner) return DP_ERR_ARG;
+    Server* server = &runner->server;
+    int running = server->process_store->capacity - server->process_store->open_cnt;
+    return running + server->queue_count + (server->spill ? server->spill->count : 0);
+}
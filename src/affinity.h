@@ -0,0 +1,127 @@
+#ifndef DPATCH_AFFINITY_H
+#define DPATCH_AFFINITY_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#define AFFINITY_NODE_MAX 64
+#define AFFINITY_PATH_MAX 128
+#define AFFINITY_LIST_MAX 1024
+#define AFFINITY_MPOL_BIND 2
+
+typedef struct Placement_st {
+    cpu_set_t cpus;
+    unsigned char has_cpus;
+    int numa_node;
+} Placement;
+
+/// Parse a CPU list such as "0-3,8,10-11" into a CPU set, returns the amount of CPUs or -1 if invalid
+int affinity_parse_cpulist(char* list, cpu_set_t* set);
+/// Read the CPUs of given NUMA node, returns the amount of CPUs or -1 if the node does not exist
+int affinity_node_cpus(int node, cpu_set_t* set);
+/// Get the amount of NUMA nodes on this host (at least 1)
+int affinity_node_count();
+/// Get the n:th CPU (wrapping around) in given CPU set, returns the CPU number or -1 if set is empty
+int affinity_nth_cpu(cpu_set_t* set, unsigned int n);
+/// Apply a placement to the calling process, returns 0 on success and -1 if any part of it failed
+int affinity_apply(Placement* placement);
+
+#ifdef AFFINITY_IMPL
+
+int
+affinity_parse_cpulist(char* list, cpu_set_t* set) {
+    if (!list || !set) return -1;
+    CPU_ZERO(set);
+
+    char* cur = list;
+    while (*cur != '\0') {
+        while (*cur == ' ' || *cur == ',' || *cur == '\n') cur++;
+        if (*cur == '\0') break;
+
+        char* end = NULL;
+        long first = strtol(cur, &end, 10);
+        if (end == cur || first < 0) return -1;
+
+        long last = first;
+        cur = end;
+        if (*cur == '-') {
+            cur++;
+            last = strtol(cur, &end, 10);
+            if (end == cur || last < first) return -1;
+            cur = end;
+        }
+        if (last >= CPU_SETSIZE) return -1;
+        if (*cur != '\0' && *cur != ',' && *cur != ' ' && *cur != '\n') return -1;
+
+        for (long cpu = first; cpu <= last; cpu++) {
+            CPU_SET(cpu, set);
+        }
+    }
+
+    return CPU_COUNT(set) > 0 ? CPU_COUNT(set) : -1;
+}
+
+int
+affinity_node_cpus(int node, cpu_set_t* set) {
+    char path[AFFINITY_PATH_MAX];
+    snprintf(path, AFFINITY_PATH_MAX, "/sys/devices/system/node/node%d/cpulist", node);
+    FILE* fp = fopen(path, "r");
+    if (!fp) return -1;
+
+    char buf[AFFINITY_LIST_MAX] = {0};
+    char* res = fgets(buf, AFFINITY_LIST_MAX, fp);
+    fclose(fp);
+    if (!res) return -1;
+    return affinity_parse_cpulist(buf, set);
+}
+
+int
+affinity_node_count() {
+    int count = 0;
+    char path[AFFINITY_PATH_MAX];
+    for (int i = 0; i < AFFINITY_NODE_MAX; i++) {
+        snprintf(path, AFFINITY_PATH_MAX, "/sys/devices/system/node/node%d", i);
+        if (access(path, F_OK) != 0) break;
+        count++;
+    }
+    return count > 0 ? count : 1;
+}
+
+int
+affinity_nth_cpu(cpu_set_t* set, unsigned int n) {
+    int count = CPU_COUNT(set);
+    if (count < 1) return -1;
+
+    int target = n % count;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (!CPU_ISSET(cpu, set)) continue;
+        if (target == 0) return cpu;
+        target--;
+    }
+    return -1;
+}
+
+int
+affinity_apply(Placement* placement) {
+    int status = 0;
+    if (placement->has_cpus && sched_setaffinity(0, sizeof(cpu_set_t), &placement->cpus) != 0) {
+        status = -1;
+    }
+
+    // Bind memory allocations to the node, no libnuma needed for a single node mask
+    if (placement->numa_node >= 0) {
+        unsigned long mask = 1UL << placement->numa_node;
+        if (syscall(SYS_set_mempolicy, AFFINITY_MPOL_BIND, &mask, AFFINITY_NODE_MAX + 1) != 0) {
+            status = -1;
+        }
+    }
+    return status;
+}
+
+#endif
+
+#endif
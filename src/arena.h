@@ -3,7 +3,10 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <memory.h>
+#include <unistd.h>
+#include <sys/mman.h>
 
 #ifdef ARENA_DEBUG
 #define DEBUG_PRINT(fmt, ...) {\
@@ -13,8 +16,32 @@
 #define DEBUG_PRINT(fmt, ...)
 #endif
 
+#ifndef ARENA_DEFAULT_ALIGN
+#define ARENA_DEFAULT_ALIGN 16
+#endif
+
+#ifndef ARENA_GROW_MAX
+#define ARENA_GROW_MAX (4 * 1024 * 1024)
+#endif
+
+#ifndef ARENA_HUGEPAGE_MIN
+#define ARENA_HUGEPAGE_MIN (2 * 1024 * 1024)
+#endif
+
+#ifndef ARENA_POOL_MAX
+#define ARENA_POOL_MAX 256
+#endif
+
+#define ARENA_ALIGN_UP(value, align) (((value) + ((align) - 1)) & ~((uintptr_t)(align) - 1))
+
 typedef unsigned char ARENA_BOOL;
 
+typedef enum {
+    ARENA_FLAG_NONE = 0,
+    ARENA_FLAG_POPULATE = 1 << 0,
+    ARENA_FLAG_HUGEPAGE = 1 << 1,
+} ArenaFlags;
+
 typedef enum {
     ARENA_OK = 0,
     ARENA_NULL = -1,
@@ -22,46 +49,236 @@ typedef enum {
     ARENA_FULL = -3,
 } ArenaRetCode;
 
+typedef enum {
+    ARENA_TAG_OTHER,
+    ARENA_TAG_CONFIG,
+    ARENA_TAG_NET,
+    ARENA_TAG_PROTOCOL,
+    ARENA_TAG_STORE,
+    ARENA_TAG_STACK,
+    ARENA_TAG_INI,
+    ARENA_TAG_LOG,
+    ARENA_TAG_TIMER,
+    ARENA_TAG_SERVER,
+    ARENA_TAG_SCRATCH,
+    ARENA_TAG_HEAP,
+    ARENA_TAG_SPILL,
+    __ARENA_TAG_COUNT
+} ArenaTag;
+
+// Arena memory is only given back all at once, so the bytes of a tag add up over the lifetime of the arena.
+// Memory reused within a tag, like scratch arenas or the string heap, keeps its own peak.
+typedef struct ArenaTagStats_st {
+    size_t bytes;
+    size_t count;
+    size_t failed;
+} ArenaTagStats;
+
 typedef struct ArenaAllocator_st ArenaAllocator;
+typedef struct Arena_st Arena;
+
+typedef struct ArenaMark_st {
+    size_t offset;
+} ArenaMark;
 
 ArenaRetCode arena_free();
 void* arena_alloc(size_t size);
+void* arena_alloc_aligned(size_t size, size_t align);
+void* arena_alloc_tagged(size_t size, ArenaTag tag);
 ArenaRetCode arena_init(size_t size, int prealloc_count, ARENA_BOOL lock);
+ArenaRetCode arena_init_flags(size_t size, int prealloc_count, ARENA_BOOL lock, int flags);
+size_t arena_trim();
+/// Give the calling thread its own arena, taking its first page from the global page pool.
+/// Threads also get one lazily on their first allocation. Returns operation result code.
+ArenaRetCode arena_thread_init();
+/// Return the pages of the calling thread's arena into the global page pool, returns operation result code
+ArenaRetCode arena_thread_release();
+/// Get the amount of free pages waiting in the global page pool
+int arena_pool_count();
+/// Get allocation statistics of given subsystem tag in the calling thread's arena
+ArenaTagStats arena_tag_stats(ArenaTag tag);
+/// Get a printable name of given subsystem tag
+const char* arena_tag_name(ArenaTag tag);
+/// Get the amount of pages and total bytes of page regions in the calling thread's arena
+size_t arena_page_stats(int* page_count);
+
+/// Create a fixed capacity child arena carved from the global arena, returns a pointer to it or NULL if failed
+Arena* arena_child_new(size_t size);
+/// Allocate data from a child arena with default alignment, returns NULL if the child arena is full
+void* arena_child_alloc(Arena* arena, size_t size);
+/// Allocate data from a child arena with given power-of-two alignment, returns NULL if the child arena is full
+void* arena_child_alloc_aligned(Arena* arena, size_t size, size_t align);
+/// Get the current allocation position of a child arena
+ArenaMark arena_mark(Arena* arena);
+/// Release everything allocated from a child arena after given mark
+void arena_reset_to(Arena* arena, ArenaMark mark);
+/// Release everything allocated from a child arena
+void arena_reset(Arena* arena);
+/// Get the capacity and highest amount of bytes ever in use of a child arena
+size_t arena_child_peak(Arena* arena, size_t* capacity);
 
 #ifdef ARENA_ALLOCATOR_IMPL
 
 typedef struct ArenaAllocator_st {
     size_t size;
+    size_t mapped_size;
     size_t current;
     char eom;
+    int pool_index;
     ArenaAllocator* next;
     void* region;
 } ArenaAllocator;
 
-static ArenaAllocator* __arena_root;
+typedef struct Arena_st {
+    ArenaAllocator page;
+    size_t peak;
+} Arena;
+
+// Every thread bumps its own pages, so allocation never contends. Only the page pool is shared.
+static __thread ArenaTagStats __arena_tag_stats[__ARENA_TAG_COUNT];
+static const char* __arena_tag_names[__ARENA_TAG_COUNT] = {
+    "other", "config", "net", "protocol", "store", "stack", "ini", "log", "timer", "server", "scratch", "heap", "spill",
+};
+
+static __thread ArenaAllocator* __arena_root;
+static __thread ArenaAllocator* __arena_current;
+static __thread size_t __arena_grow_size;
+static __thread ARENA_BOOL __arena_owner;
+static size_t __arena_page_size;
+static int __arena_flags;
+
+// Lock-free page pool: a stack of base sized pages linked by pool index. The head packs a generation
+// counter above the top index (stored +1, 0 means empty) so a page popped and pushed back between a
+// load and a compare-and-swap is not mistaken for an unchanged stack.
+static ArenaAllocator* __arena_pool_pages[ARENA_POOL_MAX];
+static uint32_t __arena_pool_next[ARENA_POOL_MAX];
+static uint64_t __arena_pool_head;
+static int __arena_pool_registered;
+static int __arena_pool_free;
+
+static inline void
+_arena_pool_push(ArenaAllocator* page) {
+    uint64_t old = __atomic_load_n(&__arena_pool_head, __ATOMIC_ACQUIRE);
+    uint64_t new;
+    do {
+        __atomic_store_n(&__arena_pool_next[page->pool_index], (uint32_t)old, __ATOMIC_RELAXED);
+        new = (((old >> 32) + 1) << 32) | (uint32_t)(page->pool_index + 1);
+    } while (!__atomic_compare_exchange_n(&__arena_pool_head, &old, new, 1, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE));
+    __atomic_add_fetch(&__arena_pool_free, 1, __ATOMIC_RELAXED);
+}
+
+static inline ArenaAllocator*
+_arena_pool_pop() {
+    uint64_t old = __atomic_load_n(&__arena_pool_head, __ATOMIC_ACQUIRE);
+    uint64_t new;
+    uint32_t top;
+    do {
+        top = (uint32_t)old;
+        if (top == 0) return NULL;
+        uint32_t next = __atomic_load_n(&__arena_pool_next[top - 1], __ATOMIC_RELAXED);
+        new = (((old >> 32) + 1) << 32) | next;
+    } while (!__atomic_compare_exchange_n(&__arena_pool_head, &old, new, 1, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+    __atomic_sub_fetch(&__arena_pool_free, 1, __ATOMIC_RELAXED);
+    return __arena_pool_pages[top - 1];
+}
 
 static ArenaAllocator*
 _arena_create(size_t size) {
-    ArenaAllocator* new_arena = (ArenaAllocator*)malloc(sizeof(ArenaAllocator) + (sizeof(char) * (size)));
-    if (!new_arena) return 0;
+    // Keep the region start aligned, so default aligned allocations can use the full page
+    size_t header_size = ARENA_ALIGN_UP(sizeof(ArenaAllocator), ARENA_DEFAULT_ALIGN);
+    size_t os_page = sysconf(_SC_PAGESIZE);
+    size_t mapped_size = ARENA_ALIGN_UP(header_size + (sizeof(char) * size), os_page);
+
+    // Anonymous mappings are already zeroed and only get backed by memory once touched
+    int map_flags = MAP_PRIVATE | MAP_ANONYMOUS;
+    if (__arena_flags & ARENA_FLAG_POPULATE) map_flags |= MAP_POPULATE;
 
+    void* mem = mmap(NULL, mapped_size, PROT_READ | PROT_WRITE, map_flags, -1, 0);
+    if (mem == MAP_FAILED) return 0;
+
+#ifdef MADV_HUGEPAGE
+    if ((__arena_flags & ARENA_FLAG_HUGEPAGE) && mapped_size >= ARENA_HUGEPAGE_MIN) {
+        madvise(mem, mapped_size, MADV_HUGEPAGE);
+    }
+#endif
+
+    ArenaAllocator* new_arena = (ArenaAllocator*)mem;
     new_arena->size = size;
+    new_arena->mapped_size = mapped_size;
     new_arena->current = 0;
     new_arena->next = 0;
     new_arena->eom = 0;
-    new_arena->region = (void*)((ArenaAllocator*)new_arena + 1);
-    memset(new_arena->region, 0, size);
+    new_arena->pool_index = -1;
+    new_arena->region = (void*)((char*)new_arena + header_size);
+
+    // Base sized pages get a permanent pool slot, so they can be handed between threads
+    if (size == __arena_page_size) {
+        int index = __atomic_fetch_add(&__arena_pool_registered, 1, __ATOMIC_RELAXED);
+        if (index < ARENA_POOL_MAX) {
+            new_arena->pool_index = index;
+            __arena_pool_pages[index] = new_arena;
+        }
+    }
 
     return new_arena;
 }
 
+/// Take a base sized page from the pool, returns NULL if the pool is empty
+static ArenaAllocator*
+_arena_pool_take() {
+    ArenaAllocator* page = _arena_pool_pop();
+    if (!page) return NULL;
+    page->current = 0;
+    page->eom = 0;
+    page->next = NULL;
+    return page;
+}
+
+/// Take a base sized page from the pool, or map a new one if the pool is empty
+static ArenaAllocator*
+_arena_take_page() {
+    ArenaAllocator* page = _arena_pool_take();
+    return page ? page : _arena_create(__arena_page_size);
+}
+
+/// Return a page into the pool zeroed, pages without a pool slot are unmapped
+static void
+_arena_release_page(ArenaAllocator* page) {
+    if (page->pool_index < 0) {
+        munmap(page, page->mapped_size);
+        return;
+    }
+
+    // Pooled pages must read back as zero like fresh mappings. The first OS page also holds the header,
+    // so its part of the region is cleared by hand and the rest is dropped.
+    size_t os_page = sysconf(_SC_PAGESIZE);
+    uintptr_t start = (uintptr_t)page->region;
+    uintptr_t used = start + page->current;
+    uintptr_t first = ARENA_ALIGN_UP(start, os_page);
+    memset(page->region, 0, (used < first ? used : first) - start);
+    if (used > first) madvise((void*)first, ARENA_ALIGN_UP(used, os_page) - first, MADV_DONTNEED);
+
+    _arena_pool_push(page);
+}
+
 ArenaRetCode
 arena_init(size_t size, int prealloc_count, ARENA_BOOL lock) {
+    return arena_init_flags(size, prealloc_count, lock, ARENA_FLAG_NONE);
+}
+
+/// Initialize the arena with page source flags, eg. to pre-fault or use transparent huge pages for large pools
+ArenaRetCode
+arena_init_flags(size_t size, int prealloc_count, ARENA_BOOL lock, int flags) {
+    __arena_flags = flags;
+    __arena_page_size = size;
+    __arena_owner = 1;
     __arena_root = _arena_create(size);
     if (!__arena_root) {
         perror("Arena allocator failed to allocate memory");
         exit(-1);
     }
+    __arena_current = __arena_root;
+    __arena_grow_size = size;
 
     // Pre-allocate pages if count is given
     if (prealloc_count > 0) {
@@ -96,54 +313,248 @@ arena_init(size_t size, int prealloc_count, ARENA_BOOL lock) {
     return ARENA_OK;
 }
 
-/// Free the arena allocator of all data. Returns operation result code.
+/// Free the arena allocator of all data. Called from the initializing thread this also unmaps the page pool,
+/// so other threads must have released their arenas before. Returns operation result code.
 ArenaRetCode
 arena_free() {
     if (!__arena_root) return ARENA_NULL;
+    if (!__arena_owner) return arena_thread_release();
     ArenaAllocator* cur = __arena_root;
 
     while (cur) {
         ArenaAllocator* next = cur->next;
-        free(cur);
+        munmap(cur, cur->mapped_size);
         cur = next;
     }
 
+    while ((cur = _arena_pool_pop())) {
+        munmap(cur, cur->mapped_size);
+    }
+
     __arena_root = NULL;
+    __arena_current = NULL;
+    __arena_owner = 0;
+    __arena_page_size = 0;
+    __atomic_store_n(&__arena_pool_registered, 0, __ATOMIC_RELAXED);
+    memset(__arena_tag_stats, 0, sizeof(__arena_tag_stats));
     return ARENA_OK;
 }
 
-/// Allocate data to arena, sets given pointer to the reserved data region. Returns operation result code.
-void*
-arena_alloc(size_t size) {
-    if (!__arena_root) return NULL;
-    if (size > __arena_root->size) return NULL;
+ArenaRetCode
+arena_thread_init() {
+    if (__arena_root) return ARENA_OK;
+    if (__arena_page_size == 0) return ARENA_NULL;
+
+    __arena_root = _arena_take_page();
+    if (!__arena_root) return ARENA_OOM;
+    __arena_current = __arena_root;
+    __arena_grow_size = __arena_page_size;
+    return ARENA_OK;
+}
+
+ArenaRetCode
+arena_thread_release() {
+    if (!__arena_root) return ARENA_NULL;
     ArenaAllocator* cur = __arena_root;
 
     while (cur) {
-        // Assign to current if there's enough space
-        if ((cur->current + size) <= cur->size) {
-            void* p = (void*)((char*)cur->region + cur->current);
-            cur->current += size;
-            DEBUG_PRINT("Reserving area %lu / %lu, size: %lu bytes\n", p, (cur->region + cur->current), size);
-            return p;
+        ArenaAllocator* next = cur->next;
+        _arena_release_page(cur);
+        cur = next;
+    }
+
+    __arena_root = NULL;
+    __arena_current = NULL;
+    memset(__arena_tag_stats, 0, sizeof(__arena_tag_stats));
+    return ARENA_OK;
+}
+
+int
+arena_pool_count() {
+    return __atomic_load_n(&__arena_pool_free, __ATOMIC_RELAXED);
+}
+
+/// Return memory of unused pages and the unused tail of the current page to the OS, they read back as zero
+/// if touched later. Returns the amount of bytes released.
+size_t
+arena_trim() {
+    if (!__arena_current) return 0;
+    size_t os_page = sysconf(_SC_PAGESIZE);
+    size_t released = 0;
+
+    uintptr_t tail = ARENA_ALIGN_UP((uintptr_t)__arena_current->region + __arena_current->current, os_page);
+    uintptr_t end = (uintptr_t)__arena_current + __arena_current->mapped_size;
+    if (tail < end && madvise((void*)tail, end - tail, MADV_DONTNEED) == 0) {
+        released += end - tail;
+    }
+
+    for (ArenaAllocator* page = __arena_current->next; page; page = page->next) {
+        uintptr_t start = ARENA_ALIGN_UP((uintptr_t)page->region, os_page);
+        end = (uintptr_t)page + page->mapped_size;
+        if (start < end && madvise((void*)start, end - start, MADV_DONTNEED) == 0) {
+            released += end - start;
         }
+    }
 
-        // Try to allocate a new arena region
-        if (!cur->next) {
-            if (cur->eom) return NULL;
-            cur->next = _arena_create(size);
-            if (!cur->next) {
-                perror("Arena allocator failed to create new region");
-                arena_free(__arena_root);
-                exit(-1);
-            };
-            DEBUG_PRINT("New arena region created at %lu\n", cur->next);
+    return released;
+}
+
+static inline void*
+_arena_bump(ArenaAllocator* page, size_t size, size_t align) {
+    uintptr_t base = (uintptr_t)page->region;
+    uintptr_t start = ARENA_ALIGN_UP(base + page->current, align);
+    if (start + size > base + page->size) return NULL;
+
+    page->current = (start - base) + size;
+    DEBUG_PRINT("Reserving area %lu / %lu, size: %lu bytes\n", start, base + page->current, size);
+    return (void*)start;
+}
+
+/// Allocate data from arena with given power-of-two alignment, returns a pointer to the reserved region or NULL if failed
+void*
+arena_alloc_aligned(size_t size, size_t align) {
+    if (!__arena_root && arena_thread_init() != ARENA_OK) return NULL;
+    // Anything up to the growth cap gets a page large enough for it, past that it is surely a bad size
+    if (size > ARENA_GROW_MAX) return NULL;
+
+    // Fast path, bump the current page
+    void* p = _arena_bump(__arena_current, size, align);
+    if (p) return p;
+
+    // Move on to pre-allocated pages, space left in passed pages is not revisited
+    while (__arena_current->next) {
+        __arena_current = __arena_current->next;
+        p = _arena_bump(__arena_current, size, align);
+        if (p) return p;
+    }
+
+    if (__arena_current->eom) return NULL;
+
+    // Prefer a page other threads gave back
+    if (size + align <= __arena_page_size) {
+        ArenaAllocator* page = _arena_pool_take();
+        if (page) {
+            __arena_current->next = page;
+            __arena_current = page;
+            return _arena_bump(__arena_current, size, align);
         }
+    }
+
+    // Grow geometrically up to a cap, a new page always fits the requested allocation
+    if (__arena_grow_size < ARENA_GROW_MAX) {
+        __arena_grow_size = __arena_grow_size * 2 < ARENA_GROW_MAX ? __arena_grow_size * 2 : ARENA_GROW_MAX;
+    }
+    size_t page_size = __arena_grow_size > size + align ? __arena_grow_size : size + align;
+
+    __arena_current->next = _arena_create(page_size);
+    if (!__arena_current->next) {
+        perror("Arena allocator failed to create new region");
+        arena_free(__arena_root);
+        exit(-1);
+    }
+    DEBUG_PRINT("New arena region created at %lu\n", __arena_current->next);
+
+    __arena_current = __arena_current->next;
+    return _arena_bump(__arena_current, size, align);
+}
 
-        cur = cur->next;
+/// Allocate data from arena on behalf of a subsystem, returns a pointer to the reserved region or NULL if failed
+void*
+arena_alloc_tagged(size_t size, ArenaTag tag) {
+    ArenaTagStats* stats = &__arena_tag_stats[tag < __ARENA_TAG_COUNT ? tag : ARENA_TAG_OTHER];
+    void* p = arena_alloc_aligned(size, ARENA_DEFAULT_ALIGN);
+    if (!p) {
+        stats->failed++;
+        return NULL;
     }
 
-    return NULL;
+    stats->count++;
+    stats->bytes += size;
+    return p;
+}
+
+/// Allocate data from arena with default alignment, returns a pointer to the reserved region or NULL if failed
+void*
+arena_alloc(size_t size) {
+    return arena_alloc_tagged(size, ARENA_TAG_OTHER);
+}
+
+ArenaTagStats
+arena_tag_stats(ArenaTag tag) {
+    if (tag >= __ARENA_TAG_COUNT) return (ArenaTagStats){0};
+    return __arena_tag_stats[tag];
+}
+
+const char*
+arena_tag_name(ArenaTag tag) {
+    if (tag >= __ARENA_TAG_COUNT) return "unknown";
+    return __arena_tag_names[tag];
+}
+
+size_t
+arena_page_stats(int* page_count) {
+    size_t total = 0;
+    int count = 0;
+    for (ArenaAllocator* page = __arena_root; page; page = page->next) {
+        total += page->size;
+        count++;
+    }
+    if (page_count) *page_count = count;
+    return total;
+}
+
+Arena*
+arena_child_new(size_t size) {
+    Arena* arena = arena_alloc_tagged(sizeof(Arena), ARENA_TAG_SCRATCH);
+    if (!arena) return NULL;
+
+    arena->page.region = arena_alloc_tagged(size, ARENA_TAG_SCRATCH);
+    if (!arena->page.region) return NULL;
+    arena->peak = 0;
+
+    // A child arena never grows, its memory stays bounded to the initial size
+    arena->page.size    = size;
+    arena->page.current = 0;
+    arena->page.eom     = 1;
+    arena->page.next    = NULL;
+    return arena;
+}
+
+void*
+arena_child_alloc_aligned(Arena* arena, size_t size, size_t align) {
+    if (!arena) return NULL;
+    void* p = _arena_bump(&arena->page, size, align);
+    if (arena->page.current > arena->peak) arena->peak = arena->page.current;
+    return p;
+}
+
+void*
+arena_child_alloc(Arena* arena, size_t size) {
+    return arena_child_alloc_aligned(arena, size, ARENA_DEFAULT_ALIGN);
+}
+
+ArenaMark
+arena_mark(Arena* arena) {
+    return (ArenaMark){ arena ? arena->page.current : 0 };
+}
+
+void
+arena_reset_to(Arena* arena, ArenaMark mark) {
+    if (!arena || mark.offset > arena->page.current) return;
+    arena->page.current = mark.offset;
+}
+
+void
+arena_reset(Arena* arena) {
+    if (!arena) return;
+    arena->page.current = 0;
+}
+
+size_t
+arena_child_peak(Arena* arena, size_t* capacity) {
+    if (!arena) return 0;
+    if (capacity) *capacity = arena->page.size;
+    return arena->peak;
 }
 
 #endif
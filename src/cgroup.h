@@ -0,0 +1,161 @@
+#ifndef DPATCH_CGROUP_H
+#define DPATCH_CGROUP_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+
+#define CGROUP_PATH_MAX 512
+#define CGROUP_VALUE_MAX 64
+#define CGROUP2_MAGIC 0x63677270
+
+typedef enum {
+    CGROUP_OK = 0,
+    CGROUP_NULL = -1,
+    CGROUP_UNSUPPORTED = -2,
+    CGROUP_NOT_WRITABLE = -3,
+    CGROUP_IO = -4,
+} CgroupRetCode;
+
+typedef struct CgroupStats_st {
+    uint64_t usage_usec;
+    uint64_t user_usec;
+    uint64_t system_usec;
+    uint64_t memory_peak;
+} CgroupStats;
+
+/// Check that given path is a writable cgroup v2 directory and enable the cpu, memory and pids controllers
+/// for its children. Returns operation result code.
+CgroupRetCode cgroup_init(char* root);
+/// Create a leaf cgroup with given id under root, returns operation result code
+CgroupRetCode cgroup_create(char* root, unsigned int id);
+/// Write a value into a controller file of a leaf cgroup, returns operation result code
+CgroupRetCode cgroup_set(char* root, unsigned int id, char* file, char* value);
+/// Open the process list of a leaf cgroup for writing, returns the file descriptor or -1 if failed
+int cgroup_open_procs(char* root, unsigned int id);
+/// Move the calling process into the cgroup of given process list descriptor, returns operation result code
+CgroupRetCode cgroup_join(int procs_fd);
+/// Read CPU and peak memory usage of a leaf cgroup, returns operation result code
+CgroupRetCode cgroup_read_stats(char* root, unsigned int id, CgroupStats* stats);
+/// Kill any processes left in a leaf cgroup and remove it, returns operation result code
+CgroupRetCode cgroup_remove(char* root, unsigned int id);
+
+#ifdef CGROUP_IMPL
+
+static inline int
+cgroup_path(char* buf, char* root, unsigned int id, char* file) {
+    if (file) return snprintf(buf, CGROUP_PATH_MAX, "%s/task-%u/%s", root, id, file);
+    return snprintf(buf, CGROUP_PATH_MAX, "%s/task-%u", root, id);
+}
+
+static CgroupRetCode
+cgroup_write_file(char* path, char* value) {
+    int fd = open(path, O_WRONLY | O_CLOEXEC);
+    if (fd < 0) return CGROUP_IO;
+
+    int len = strlen(value);
+    int written = write(fd, value, len);
+    close(fd);
+    return written == len ? CGROUP_OK : CGROUP_IO;
+}
+
+CgroupRetCode
+cgroup_init(char* root) {
+    if (!root) return CGROUP_NULL;
+
+    struct statfs fs;
+    if (statfs(root, &fs) != 0 || fs.f_type != CGROUP2_MAGIC) return CGROUP_UNSUPPORTED;
+    if (access(root, W_OK) != 0) return CGROUP_NOT_WRITABLE;
+
+    // Controllers are enabled one by one, so a missing one does not prevent using the others
+    char path[CGROUP_PATH_MAX];
+    snprintf(path, CGROUP_PATH_MAX, "%s/cgroup.subtree_control", root);
+    if (access(path, W_OK) != 0) return CGROUP_NOT_WRITABLE;
+
+    char* controllers[] = { "+cpu", "+memory", "+pids" };
+    for (int i = 0; i < 3; i++) {
+        cgroup_write_file(path, controllers[i]);
+    }
+    return CGROUP_OK;
+}
+
+CgroupRetCode
+cgroup_create(char* root, unsigned int id) {
+    char path[CGROUP_PATH_MAX];
+    cgroup_path(path, root, id, NULL);
+    if (mkdir(path, 0755) != 0 && errno != EEXIST) return CGROUP_IO;
+    return CGROUP_OK;
+}
+
+CgroupRetCode
+cgroup_set(char* root, unsigned int id, char* file, char* value) {
+    if (!value) return CGROUP_NULL;
+    char path[CGROUP_PATH_MAX];
+    cgroup_path(path, root, id, file);
+    return cgroup_write_file(path, value);
+}
+
+int
+cgroup_open_procs(char* root, unsigned int id) {
+    char path[CGROUP_PATH_MAX];
+    cgroup_path(path, root, id, "cgroup.procs");
+    return open(path, O_WRONLY | O_CLOEXEC);
+}
+
+CgroupRetCode
+cgroup_join(int procs_fd) {
+    if (procs_fd < 0) return CGROUP_NULL;
+    char buf[CGROUP_VALUE_MAX];
+    int len = snprintf(buf, CGROUP_VALUE_MAX, "%d", getpid());
+    return write(procs_fd, buf, len) == len ? CGROUP_OK : CGROUP_IO;
+}
+
+CgroupRetCode
+cgroup_read_stats(char* root, unsigned int id, CgroupStats* stats) {
+    if (!stats) return CGROUP_NULL;
+    memset(stats, 0, sizeof(CgroupStats));
+
+    char path[CGROUP_PATH_MAX];
+    cgroup_path(path, root, id, "cpu.stat");
+    FILE* fp = fopen(path, "r");
+    if (!fp) return CGROUP_IO;
+
+    char key[CGROUP_VALUE_MAX];
+    unsigned long long value = 0;
+    while (fscanf(fp, "%63s %llu", key, &value) == 2) {
+        if (strcmp(key, "usage_usec") == 0)       stats->usage_usec = value;
+        else if (strcmp(key, "user_usec") == 0)   stats->user_usec = value;
+        else if (strcmp(key, "system_usec") == 0) stats->system_usec = value;
+    }
+    fclose(fp);
+
+    // memory.peak only exists with the memory controller enabled on newer kernels
+    cgroup_path(path, root, id, "memory.peak");
+    fp = fopen(path, "r");
+    if (fp) {
+        if (fscanf(fp, "%llu", &value) == 1) stats->memory_peak = value;
+        fclose(fp);
+    }
+
+    return CGROUP_OK;
+}
+
+CgroupRetCode
+cgroup_remove(char* root, unsigned int id) {
+    char path[CGROUP_PATH_MAX];
+    cgroup_path(path, root, id, "cgroup.kill");
+    cgroup_write_file(path, "1");
+
+    cgroup_path(path, root, id, NULL);
+    if (rmdir(path) != 0 && errno != ENOENT) return CGROUP_IO;
+    return CGROUP_OK;
+}
+
+#endif
+
+#endif
@@ -6,10 +6,24 @@
 #include "config.h"
 #include "net.h"
 #include "protocol.h"
+#include "shm.h"
 
 #define CLIENT_PRINT(config, fd, fmt, ...) if (!config->args.quiet) fprintf(fd, fmt, ##__VA_ARGS__)
 #define INOTIFY_EVENT_BUF_SIZE ((sizeof(struct inotify_event) + 16) * 1024)
 
+// Progress of a response read a message at a time
+typedef struct ClientResponse_st {
+    long entries;
+    uint32_t seq;
+} ClientResponse;
+
+// Either transport to the agent, a shared memory channel if 'local' is set
+typedef struct ClientLink_st {
+    Connection conn;
+    ShmChannel channel;
+    unsigned char local;
+} ClientLink;
+
 static inline int
 is_cmd(char* cmd, char** cmd_set, int cmd_set_count) {
     for (int i = 0; i < cmd_set_count; i++) {
@@ -26,7 +40,7 @@ client_eval_cmds(char** argv,
     if (config->args.arg_count < 1) return -1;
 
     msg->type = -1;
-    for (int i = 0; i < 2; i++) {
+    for (int i = 0; i < 2 && i < config->args.arg_count; i++) {
         char* cmd = argv[config->args.arg_indices[i]];
         if (is_cmd(cmd, (char*[]){"run", "r"}, 2)) {
             msg->type = PROTOCOL_MSG_TASK_RUN;
@@ -36,18 +50,15 @@ client_eval_cmds(char** argv,
         }
         else if (is_cmd(cmd, (char*[]){"workspace", "ws", "w"}, 3)) {
             msg->type = PROTOCOL_MSG_WORKSPACE_INFO;
-            CLIENT_PRINT(config, stderr, "Workspace info command is not implemented yet\n");
-            return -1;
         }
         else if (is_cmd(cmd, (char*[]){"task", "t"}, 2)) {
             msg->type = PROTOCOL_MSG_TASK_INFO;
-            CLIENT_PRINT(config, stderr, "Task info command is not implemented yet\n");
-            return -1;
         }
         else if (is_cmd(cmd, (char*[]){"process", "proc", "p"}, 3)) {
             msg->type = PROTOCOL_MSG_PROC_INFO;
-            CLIENT_PRINT(config, stderr, "Process info command is not implemented yet\n");
-            return -1;
+        }
+        else if (is_cmd(cmd, (char*[]){"stats"}, 1)) {
+            msg->type = PROTOCOL_MSG_STATS;
         }
     }
     if (msg->type < 0) {
@@ -55,8 +66,6 @@ client_eval_cmds(char** argv,
         return -1;
     }
 
-    msg->length = config->args.arg_count - 1;
-
     for (int i = 1; i < config->args.arg_count; i++) {
         char* cmd = argv[config->args.arg_indices[i]];
         if(cmd == NULL) break;
@@ -95,6 +104,71 @@ send_cmd(Config* config, Connection* conn, char** argv, ProtocolTokenStream* tok
     return 0;
 }
 
+static void
+client_print_msg(Config* config, char* msg, int msg_len, ProtocolTokenStream* token_stream) {
+    if (protocol_read(msg, msg_len, token_stream) != 0) {
+        CLIENT_PRINT(config, stderr, "Received an invalid message from server.\n");
+        return;
+    }
+
+    FILE* fd;
+    char* fmt;
+    if (token_stream->type == PROTOCOL_MSG_ERR) {
+        fd = stderr;
+        fmt = "Error: %s\n";
+    }
+    else {
+        fd = stdout;
+        fmt = "Success: %s\n";
+    }
+    CLIENT_PRINT(config, fd, fmt, token_stream->tokens[0].value);
+
+    // Multi-line responses carry one line per token
+    for (int i = 1; i < token_stream->length; i++) {
+        CLIENT_PRINT(config, fd, "  %s\n", token_stream->tokens[i].value);
+    }
+}
+
+/// Print one message of a response, returns 1 once the response is complete, 0 if more frames follow and -1 if
+/// the message is invalid
+static int
+client_handle_msg(Config* config,
+                  ClientResponse* response,
+                  char* msg,
+                  ProtocolHeader* header,
+                  ProtocolTokenStream* token_stream)
+{
+    if (header->type != PROTOCOL_MSG_SNAPSHOT) {
+        client_print_msg(config, msg, header->size + header->length, token_stream);
+        return 1;
+    }
+
+    ProtocolSnapshotFrame frame;
+    ProtocolEntry entry;
+    char line[PROTOCOL_STR_MAX * 2 + 128];
+    int read = 0;
+    uint32_t frame_entries = 0;
+    if (protocol_snapshot_frame(msg, header->size + header->length, &frame) != 0 ||
+        frame.seq != response->seq++ || frame.kind >= __PROTOCOL_SNAPSHOT_COUNT)
+    {
+        return -1;
+    }
+
+    while ((read = protocol_snapshot_next(&frame, &entry)) > 0) {
+        if (response->entries++ == 0) CLIENT_PRINT(config, stdout, "Success: %s\n", protocol_snapshot_title(frame.kind, 0));
+        protocol_entry_format(line, sizeof(line), frame.kind, &entry);
+        CLIENT_PRINT(config, stdout, "  %s\n", line);
+        frame_entries++;
+    }
+    if (read < 0 || frame_entries != frame.count) return -1;
+
+    if (frame.flags & PROTOCOL_FLAG_LAST) {
+        if (response->entries == 0) CLIENT_PRINT(config, stdout, "Success: %s\n", protocol_snapshot_title(frame.kind, 1));
+        return 1;
+    }
+    return 0;
+}
+
 static int
 poll_response(Config* config, Connection* conn, ProtocolTokenStream* token_stream) {
     struct pollfd fd;
@@ -102,32 +176,108 @@ poll_response(Config* config, Connection* conn, ProtocolTokenStream* token_strea
     fd.events    = POLLIN;
     int poll_ret = poll(&fd, 1, config->settings.connection.client_timeout_ms);
 
-    if (poll_ret > 0) {
-        int value_read = read(conn->socket, conn->in_buf, config->settings.connection.buffer_size);
-        if (value_read > 0) {
-            if (protocol_read(conn->in_buf, config->settings.connection.buffer_size, token_stream) != 0) {
-                CLIENT_PRINT(config, stderr, "Received an invalid message from server.\n");
-            }
-            else {
-                FILE* fd;
-                char* fmt;
-                if (token_stream->type == PROTOCOL_MSG_ERR) {
-                    fd = stderr;
-                    fmt = "Error: %s\n";
-                }
-                else {
-                    fd = stdout;
-                    fmt = "Success: %s\n";
-                }
-                CLIENT_PRINT(config, fd, fmt, token_stream->tokens[0].value);
-            }
+    if (poll_ret < 1) {
+        CLIENT_PRINT(config, stderr, "Connection timeout after %ims\n", config->settings.connection.client_timeout_ms);
+        return -1;
+    }
+
+    // Snapshots arrive as a run of frames up to the one flagged last, every other response as a single message
+    ProtocolReader reader;
+    ClientResponse response = {0};
+    protocol_reader_init(&reader, conn->socket, conn->in_buf, config->settings.connection.buffer_size);
+    while (1) {
+        ProtocolHeader header;
+        char* msg = protocol_reader_next(&reader, &header);
+        if (!msg) {
+            CLIENT_PRINT(config, stderr, "Connection closed before a whole response was received.\n");
+            return -1;
+        }
+
+        int ret = client_handle_msg(config, &response, msg, &header, token_stream);
+        if (ret < 0) {
+            CLIENT_PRINT(config, stderr, "Received an invalid message from server.\n");
+            return -1;
         }
+        if (ret > 0) return 0;
     }
-    else {
-        CLIENT_PRINT(config, stderr, "Connection timeout after %ims\n", config->settings.connection.client_timeout_ms);
+}
+
+/// Connect to the agent over TCP, or over a shared memory channel if a local socket is given.
+/// Returns 1 if succesful.
+static int
+client_link_open(Config* config, ClientLink* link, Arena* scratch) {
+    link->local = config->args.local_path != NULL;
+    if (!link->local) {
+        return scratch ? connection_init_scratch(config, &link->conn, scratch) : connection_init(config, &link->conn);
+    }
+
+    link->conn = (Connection){0};
+    link->conn.in_buf  = scratch ? arena_child_alloc(scratch, config->settings.connection.buffer_size)
+                                 : MMALLOC_TAG(config->settings.connection.buffer_size, NET);
+    link->conn.out_buf = scratch ? arena_child_alloc(scratch, config->settings.connection.buffer_size)
+                                 : MMALLOC_TAG(config->settings.connection.buffer_size, NET);
+    if (!link->conn.in_buf || !link->conn.out_buf) {
+        CLIENT_PRINT(config, stderr, "Unable to allocate connection buffers\n");
+        return 0;
+    }
+    return shm_channel_connect(&link->channel, config->args.local_path) == 0;
+}
+
+static void
+client_link_close(ClientLink* link) {
+    if (link->local) shm_channel_close(&link->channel);
+    else connection_close(&link->conn);
+}
+
+/// Send a command through a shared memory channel and print its response
+static int
+channel_cmd(Config* config, ClientLink* link, ProtocolTokenStream* token_stream) {
+    ShmChannel* channel = &link->channel;
+    int timeout_ms = config->settings.connection.client_timeout_ms;
+    int len = protocol_tokenstream_to_buf(token_stream, link->conn.out_buf, config->settings.connection.buffer_size, 0);
+    if (len < 1 ||
+        shm_ring_wait(channel->requests, channel->ring_size, len, channel->client_fd, timeout_ms) != 0 ||
+        shm_ring_write(channel->requests, channel->ring_size, link->conn.out_buf, len) != 0)
+    {
+        CLIENT_PRINT(config, stderr, "Unable to send message through shared memory channel.\n");
         return -1;
     }
-    return 0;
+    shm_notify(&channel->requests->consumer_sleeping, channel->agent_fd);
+
+    ClientResponse response = {0};
+    while (1) {
+        if (shm_ring_wait(channel->responses, channel->ring_size, 0, channel->client_fd, timeout_ms) != 0) {
+            CLIENT_PRINT(config, stderr, "Connection timeout after %ims\n", timeout_ms);
+            return -1;
+        }
+
+        ProtocolHeader header;
+        len = shm_ring_read(channel->responses, channel->ring_size, link->conn.in_buf,
+                            config->settings.connection.buffer_size);
+        shm_notify(&channel->responses->producer_sleeping, channel->agent_fd);
+        int ret = -1;
+        if (len > 0 && protocol_header_get(link->conn.in_buf, len, &header) == 1 &&
+            header.size + header.length == (uint32_t)len)
+        {
+            ret = client_handle_msg(config, &response, link->conn.in_buf, &header, token_stream);
+        }
+        if (ret < 0) {
+            CLIENT_PRINT(config, stderr, "Received an invalid message from server.\n");
+            return -1;
+        }
+        if (ret > 0) return 0;
+    }
+}
+
+/// Send a command over a link and print its response
+static int
+client_request(Config* config, ClientLink* link, char** argv, ProtocolTokenStream* token_stream) {
+    if (link->local) {
+        CLIENT_PRINT(config, stdout, "Sending command to dpatch server at '%s'...\n", config->args.local_path);
+        return channel_cmd(config, link, token_stream);
+    }
+    if (send_cmd(config, &link->conn, argv, token_stream) != 0) return -1;
+    return poll_response(config, &link->conn, token_stream);
 }
 
 static int
@@ -135,6 +285,13 @@ poll_watch(Config* config, char** argv, ProtocolTokenStream* token_stream, int i
     char event_buf[INOTIFY_EVENT_BUF_SIZE];
     int running = 1;
 
+    // Every event gets its connection from a scratch arena that is reset afterwards
+    Arena* scratch = arena_child_new(config->settings.general.scratch_size);
+    if (!scratch) {
+        CLIENT_PRINT(config, stderr, "Unable to allocate scratch arena\n");
+        return -1;
+    }
+
     while (running) {
         struct pollfd fd;
         fd.fd        = inotify_fd;
@@ -152,11 +309,13 @@ poll_watch(Config* config, char** argv, ProtocolTokenStream* token_stream, int i
                 protocol_tokenstream_reset(token_stream);
                 if (client_eval_cmds(argv, config, token_stream) < 0) return -1;
 
-                Connection conn;
-                if (connection_init(config, &conn) < 1) return -1;
-                if (send_cmd(config, &conn, argv, token_stream) != 0) return -1;
-                if (poll_response(config, &conn, token_stream) != 0) return -1;
-                connection_close(&conn);
+                ArenaMark mark = arena_mark(scratch);
+                ClientLink link;
+                if (client_link_open(config, &link, scratch) < 1) return -1;
+                int ret = client_request(config, &link, argv, token_stream);
+                client_link_close(&link);
+                arena_reset_to(scratch, mark);
+                if (ret != 0) return -1;
             }
         }
     }
@@ -204,11 +363,11 @@ run_cmd(Config* config, char** argv) {
     else {
         if (client_eval_cmds(argv, config, token_stream) < 0) return -1;
 
-        Connection conn;
-        if (connection_init(config, &conn) < 1) return -1;
-        if (send_cmd(config, &conn, argv, token_stream) != 0) return -1;
-        if (poll_response(config, &conn, token_stream) != 0) return -1;
-        connection_close(&conn);
+        ClientLink link;
+        if (client_link_open(config, &link, NULL) < 1) return -1;
+        int ret = client_request(config, &link, argv, token_stream);
+        client_link_close(&link);
+        if (ret != 0) return -1;
     }
     return 0;
 }
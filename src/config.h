@@ -4,6 +4,7 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <limits.h>
 
 #ifdef ALLOC_FUNC
 #define MMALLOC(size) ALLOC_FUNC(size)
@@ -11,6 +12,12 @@
 #define MMALLOC(size) malloc(size)
 #endif
 
+#ifdef ALLOC_TAG_FUNC
+#define MMALLOC_TAG(size, tag) ALLOC_TAG_FUNC(size, ARENA_TAG_ ## tag)
+#else
+#define MMALLOC_TAG(size, tag) MMALLOC(size)
+#endif
+
 #define DEFAULT_ADDRESS "localhost"
 #define DEFAULT_PORT 9999
 
@@ -21,12 +28,31 @@
 #define ARG_HELP "-h"
 #define ARG_QUIET "-q"
 #define ARG_DETACHED "-d"
+#define ARG_TIMEOUT "-t"
+#define ARG_CGROUP "-c"
+#define ARG_PLACEMENT "-a"
+#define ARG_BACKLOG "-b"
+#define ARG_SPILL "-s"
+#define ARG_LOG_POLICY "-L"
+#define ARG_LOG_JSON "-j"
+#define ARG_LOG_ROTATE_SIZE "-r"
+#define ARG_LOG_ROTATE_TIME "-R"
+#define ARG_LOG_KEEP "-k"
+#define ARG_METRICS "-m"
+#define ARG_TRACE "-T"
+#define ARG_LOCAL_SOCKET "-u"
 
 typedef enum {
     RUNMODE_CMD,
     RUNMODE_SERVER
 } RunMode;
 
+typedef enum {
+    PLACEMENT_NONE,
+    PLACEMENT_CORE,
+    PLACEMENT_NODE
+} PlacementPolicy;
+
 typedef struct Args_st {
     char run_mode;
     char mode_detached;
@@ -35,6 +61,8 @@ typedef struct Args_st {
     char* watch_path;
     char* ws_file;
     char* log_file;
+    char* trace_file;
+    char* local_path;
     int port;
     int* arg_indices;
     int arg_count;
@@ -43,13 +71,22 @@ typedef struct Args_st {
 typedef struct Settings_st {
     struct {
         int process_store_count;
-        int task_store_count;
+        int task_queue_max;
+        char* task_spill_dir;
+        size_t task_spill_max;
         int protocol_token_count;
         int workspace_buf_size;
         char* cmd_bin_path;
-        int task_buf_size;
-        int task_var_max_count;
         int task_name_size;
+        int string_heap_size;
+        long task_timeout_ms;
+        long task_kill_grace_ms;
+        int timer_tick_ms;
+        int task_history_count;
+        char* cgroup_root;
+        int trace_capacity;
+        PlacementPolicy placement;
+        int scratch_size;
     } general;
     struct {
         int max_clients;
@@ -60,7 +97,19 @@ typedef struct Settings_st {
         int select_timeout_usec;
         int inotify_timeout_ms;
         int buffer_size;
+        int metrics_port;
+        int max_channels;
+        int channel_ring_size;
     } connection;
+    struct {
+        int ring_size;
+        int flush_ms;
+        char block_when_full;
+        char json;
+        size_t rotate_size;
+        long rotate_interval_ms;
+        int rotate_keep;
+    } log;
 } Settings;
 
 typedef struct Config_st {
@@ -69,6 +118,10 @@ typedef struct Config_st {
 } Config;
 
 void print_help();
+/// Parse a duration string with optional 'ms', 's', 'm' or 'h' unit (default seconds), returns milliseconds or -1 if invalid
+long config_parse_duration_ms(char* value);
+/// Parse a size string with optional 'K', 'M' or 'G' unit (default bytes), returns bytes or -1 if invalid
+long long config_parse_size(char* value);
 void config_collect_args(Config* config, int argc, char** argv);
 void config_default_settings(Config* config);
 Config* config_init(int argc, char** argv);
@@ -79,24 +132,69 @@ void
 print_help() {
     fprintf(stdout,
             "Usage:\n"
-            "  dpatch [-pfld] \n\tRun as agent\n"
-            "  dpatch [-pwq] <run|r> name [-e...]\n\tRun a task with given name through a dpatch agent\n"
-            "  dpatch [-pwq] <set|s> path/to/file.ini\n\tSet active workspace to given file path in a dpatch agent\n"
-            "  dpatch [-pwq] <task|t> <name>\n\tGet task info with given task name from a dpatch agent\n"
-            "  dpatch [-pwq] <workspace|ws|w>\n\tGet active workspace info from a dpatch agent\n"
-            "  dpatch [-pwq] <process|proc> <name>\n\tGet ongoing processes info with given task name from a dpatch agent\n"
+            "  dpatch [-pfldu] \n\tRun as agent\n"
+            "  dpatch [-pwqu] <run|r> name [-e...]\n\tRun a task with given name through a dpatch agent\n"
+            "  dpatch [-pwqu] <set|s> path/to/file.ini\n\tSet active workspace to given file path in a dpatch agent\n"
+            "  dpatch [-pwqu] <task|t> [name]\n\tGet resource usage of finished tasks, optionally by name, from a dpatch agent\n"
+            "  dpatch [-pwqu] <workspace|ws|w> [name]\n\tList tasks of the active workspace, optionally by name, from a dpatch agent\n"
+            "  dpatch [-pwqu] <process|proc> [name]\n\tGet ongoing processes info, optionally by task name, from a dpatch agent\n"
+            "  dpatch [-pwqu] stats [metrics]\n\tGet memory allocation statistics per subsystem, or agent metrics, from a dpatch agent\n"
+            "  dpatch [-pwqu] stats trace\n\tWrite the task lifecycle trace of a dpatch agent into its trace file\n"
             "\n"
             "Options:\n"
             "  -p PORT\t\tSet the port to serve/connect to (default: 9999)\n"
             "  -f /file/path\t\tSet a file to load as workspace in agent (default: none)\n"
             "  -l /file/path\t\tSet a file to write logs into (default: none)\n"
+            "  -L <drop|block>\tDrop log lines or block the agent when the log buffer is full (default: drop)\n"
+            "  -j \t\t\tWrite logs as JSON lines instead of text\n"
+            "  -r SIZE\t\tRotate the log file once it grows past given size, eg. 512K, 64M, 0 for never (default: 64M)\n"
+            "  -R DURATION\t\tRotate the log file once it is older than given duration, eg. 24h (default: never)\n"
+            "  -k COUNT\t\tSet how many rotated log files to keep (default: 5)\n"
             "  -w /dir/path\t\tRun given command when changes are noticed in given directory (ie. watch)\n"
             "  -q \t\t\tQuiet mode (no logging to terminal)\n"
             "  -d \t\t\tRun as a separate detached process\n"
+            "  -t DURATION\t\tSet default task timeout for agent, eg. 30s, 5m (default: none)\n"
+            "  -c /cgroup/path\tIsolate tasks in cgroup v2 leaves under given delegated directory (default: none)\n"
+            "  -a <core|node>\t\tRound-robin tasks without explicit placement across cores or NUMA nodes (default: none)\n"
+            "  -b BACKLOG\t\tSet the agent's pending connection backlog (default: 1024)\n"
+            "  -T /file/path\t\tTrace task lifecycles, written as Chrome trace-event JSON on shutdown or 'stats trace' (default: none)\n"
+            "  -u /sock/path\t\tServe (agent) or send commands (client) through shared memory rings handed over on a Unix socket (default: none)\n"
+            "  -m PORT\t\tServe agent metrics in Prometheus text format over HTTP on localhost (default: none)\n"
+            "  -s /dir/path\t\tSpill queued tasks over the in-memory limit into a file in given directory (default: /tmp)\n"
             "  -e KEY=VALUE\t\tSet an environment variable for a task\n"
             "  -h \t\t\tSee quick help");
 }
 
+long
+config_parse_duration_ms(char* value) {
+    if (!value) return -1;
+    char* end = NULL;
+    long amount = strtol(value, &end, 10);
+    if (end == value || amount < 0) return -1;
+
+    while (*end == ' ' || *end == '\t') end++;
+
+    if (*end == '\0' || strcmp(end, "s") == 0)   return amount * 1000;
+    else if (strcmp(end, "ms") == 0)            return amount;
+    else if (strcmp(end, "m") == 0)             return amount * 60 * 1000;
+    else if (strcmp(end, "h") == 0)             return amount * 60 * 60 * 1000;
+    return -1;
+}
+
+long long
+config_parse_size(char* value) {
+    if (!value) return -1;
+    char* end = NULL;
+    long long amount = strtoll(value, &end, 10);
+    if (end == value || amount < 0) return -1;
+
+    if (*end == '\0')                          return amount;
+    else if (strcmp(end, "K") == 0)           return amount * 1024;
+    else if (strcmp(end, "M") == 0)           return amount * 1024 * 1024;
+    else if (strcmp(end, "G") == 0)           return amount * 1024 * 1024 * 1024;
+    return -1;
+}
+
 void
 config_collect_args(Config* config, int argc, char** argv) {
     config->args = (Args) {
@@ -107,8 +205,10 @@ config_collect_args(Config* config, int argc, char** argv) {
         .watch_path = NULL,
         .ws_file = NULL,
         .log_file = NULL,
+        .trace_file = NULL,
+        .local_path = NULL,
         .port = 9999,
-        .arg_indices = (int*)MMALLOC(sizeof(int) * argc),
+        .arg_indices = (int*)MMALLOC_TAG(sizeof(int) * argc, CONFIG),
         .arg_count = 0,
     };
 
@@ -127,6 +227,9 @@ config_collect_args(Config* config, int argc, char** argv) {
         else if(strncmp(arg, ARG_QUIET, 2) == 0) {
             config->args.quiet = 1;
         }
+        else if(strncmp(arg, ARG_LOG_JSON, 2) == 0) {
+            config->settings.log.json = 1;
+        }
         else if(strncmp(arg, ARG_PORT, 2) == 0) {
             config->args.port = atoi(argv[i+1]);
             i++;
@@ -143,6 +246,88 @@ config_collect_args(Config* config, int argc, char** argv) {
             config->args.log_file = argv[i+1];
             i++;
         }
+        else if(strncmp(arg, ARG_TIMEOUT, 2) == 0) {
+            long timeout_ms = config_parse_duration_ms(argv[i+1]);
+            if (timeout_ms < 0) {
+                fprintf(stderr, "Invalid timeout value '%s'\n", argv[i+1]);
+                exit(EXIT_FAILURE);
+            }
+            config->settings.general.task_timeout_ms = timeout_ms;
+            i++;
+        }
+        else if(strncmp(arg, ARG_LOG_POLICY, 2) == 0) {
+            char* policy = argv[i+1] ? argv[i+1] : "";
+            if (strcmp(policy, "drop") == 0)       config->settings.log.block_when_full = 0;
+            else if (strcmp(policy, "block") == 0) config->settings.log.block_when_full = 1;
+            else {
+                fprintf(stderr, "Invalid log policy '%s'\n", policy);
+                exit(EXIT_FAILURE);
+            }
+            i++;
+        }
+        else if(strncmp(arg, ARG_LOG_ROTATE_SIZE, 2) == 0) {
+            long long size = config_parse_size(argv[i+1]);
+            if (size < 0) {
+                fprintf(stderr, "Invalid log rotation size '%s'\n", argv[i+1]);
+                exit(EXIT_FAILURE);
+            }
+            config->settings.log.rotate_size = size;
+            i++;
+        }
+        else if(strncmp(arg, ARG_LOG_ROTATE_TIME, 2) == 0) {
+            long interval_ms = config_parse_duration_ms(argv[i+1]);
+            if (interval_ms < 0) {
+                fprintf(stderr, "Invalid log rotation interval '%s'\n", argv[i+1]);
+                exit(EXIT_FAILURE);
+            }
+            config->settings.log.rotate_interval_ms = interval_ms;
+            i++;
+        }
+        else if(strncmp(arg, ARG_LOG_KEEP, 2) == 0) {
+            char* end = NULL;
+            long keep = argv[i+1] ? strtol(argv[i+1], &end, 10) : -1;
+            if (keep < 0 || keep > INT_MAX || end == argv[i+1] || *end != '\0') {
+                fprintf(stderr, "Invalid log rotation count '%s'\n", argv[i+1]);
+                exit(EXIT_FAILURE);
+            }
+            config->settings.log.rotate_keep = keep;
+            i++;
+        }
+        else if(strncmp(arg, ARG_SPILL, 2) == 0) {
+            config->settings.general.task_spill_dir = argv[i+1];
+            i++;
+        }
+        else if(strncmp(arg, ARG_CGROUP, 2) == 0) {
+            config->settings.general.cgroup_root = argv[i+1];
+            i++;
+        }
+        else if(strncmp(arg, ARG_PLACEMENT, 2) == 0) {
+            char* policy = argv[i+1] ? argv[i+1] : "";
+            if (strcmp(policy, "core") == 0)      config->settings.general.placement = PLACEMENT_CORE;
+            else if (strcmp(policy, "node") == 0) config->settings.general.placement = PLACEMENT_NODE;
+            else if (strcmp(policy, "none") == 0) config->settings.general.placement = PLACEMENT_NONE;
+            else {
+                fprintf(stderr, "Invalid placement policy '%s'\n", policy);
+                exit(EXIT_FAILURE);
+            }
+            i++;
+        }
+        else if(strncmp(arg, ARG_BACKLOG, 2) == 0) {
+            config->settings.connection.max_pending_conn = atoi(argv[i+1]);
+            i++;
+        }
+        else if(strncmp(arg, ARG_TRACE, 2) == 0) {
+            config->args.trace_file = argv[i+1];
+            i++;
+        }
+        else if(strncmp(arg, ARG_LOCAL_SOCKET, 2) == 0) {
+            config->args.local_path = argv[i+1];
+            i++;
+        }
+        else if(strncmp(arg, ARG_METRICS, 2) == 0) {
+            config->settings.connection.metrics_port = atoi(argv[i+1]);
+            i++;
+        }
         else if (strncmp(arg, ARG_HELP, 2) == 0) {
             config->args.help = 1;
         }
@@ -163,30 +348,51 @@ config_default_settings(Config* config) {
     config->settings = (Settings) {
         .general = {
             .process_store_count = 5,
-            .task_store_count = 5,
+            .task_queue_max = 100000,
+            .task_spill_dir = "/tmp",
+            .task_spill_max = (size_t)1024 * 1024 * 1024,
             .protocol_token_count = 30,
             .workspace_buf_size = 256,
             .cmd_bin_path = "/bin/sh",
-            .task_buf_size = 1024,
-            .task_var_max_count = 30,
             .task_name_size = 256,
+            .string_heap_size = 64 * 1024 * 1024,
+            .task_timeout_ms = 0,
+            .task_kill_grace_ms = 5000,
+            .timer_tick_ms = 10,
+            .task_history_count = 64,
+            .cgroup_root = NULL,
+            .trace_capacity = 64 * 1024,
+            .placement = PLACEMENT_NONE,
+            .scratch_size = 8192,
         },
         .connection = {
             .max_clients = 30,
-            .max_pending_conn = 3,
+            .max_pending_conn = 1024,
             .client_timeout_ms = 5000,
             .sock_timeout_sec = 5,
             .select_timeout_sec = 0,
             .select_timeout_usec = 66666,  // 15fps
             .inotify_timeout_ms = 1000,
             .buffer_size = 1024,
+            .metrics_port = 0,
+            .max_channels = 8,
+            .channel_ring_size = 64 * 1024,
+        },
+        .log = {
+            .ring_size = 256 * 1024,
+            .flush_ms = 50,
+            .block_when_full = 0,
+            .json = 0,
+            .rotate_size = 64 * 1024 * 1024,
+            .rotate_interval_ms = 0,
+            .rotate_keep = 5,
         },
     };
 }
 
 Config*
 config_init(int argc, char** argv) {
-    Config* config = (Config*)MMALLOC(sizeof(Config));
+    Config* config = (Config*)MMALLOC_TAG(sizeof(Config), CONFIG);
     if (!config) {
         fprintf(stderr, "Unable to allocate configuration data");
         exit(EXIT_FAILURE);
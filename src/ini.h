@@ -9,6 +9,12 @@
 #define MMALLOC(size) malloc(size)
 #endif
 
+#ifdef ALLOC_TAG_FUNC
+#define MMALLOC_TAG(size, tag) ALLOC_TAG_FUNC(size, ARENA_TAG_ ## tag)
+#else
+#define MMALLOC_TAG(size, tag) MMALLOC(size)
+#endif
+
 #ifndef INI_BUF_SIZE
 #define INI_BUF_SIZE 2048
 #endif
@@ -216,7 +222,7 @@ ini_parse(FILE* fp, IniHandler handler, void* data) {
 #ifndef INI_ALLOC_HEAP
     char buf[INI_BUF_SIZE];
 #else
-    char* buf = MMALLOC(sizeof(char) * INI_BUF_SIZE);
+    char* buf = MMALLOC_TAG(sizeof(char) * INI_BUF_SIZE, INI);
 #endif
 
     memset(buf, 0, INI_BUF_SIZE);
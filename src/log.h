@@ -2,9 +2,18 @@
 #define CUTIL_LOG_H
 
 #include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
 #include <time.h>
 #include <string.h>
 #include <stdarg.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 
 #ifndef LOG_LEVEL
 #define LOG_LEVEL 5
@@ -14,8 +23,19 @@
 #define LOG_PATH_MAX        512
 #define LOG_DATE_MAX        32
 #define LOG_TAG_MAX         32
+#define LOG_TASK_MAX        255
+#define LOG_PREFIX_MAX      (LOG_DATE_MAX + LOG_TAG_MAX + LOG_TASK_MAX + 32)
 #define LOG_OUT_MAX         (LOG_DATE_MAX + LOG_TAG_MAX + LOG_MSG_MAX)
 
+#define LOG_RING_SIZE       (256 * 1024)
+#define LOG_FLUSH_MS        50
+#define LOG_BATCH_MAX       64
+#define LOG_RECORD_ALIGN    32
+#define LOG_RECORD_SIZE(len) ((sizeof(LogRecord) + (len) + LOG_RECORD_ALIGN - 1) & ~(size_t)(LOG_RECORD_ALIGN - 1))
+// Every escaped byte takes at most 6 bytes (\u00XX), the rest is field names and numbers
+#define LOG_JSON_LINE_MAX(len) (256 + 6 * (size_t)(len))
+#define LOG_SCRATCH_SIZE    (LOG_JSON_LINE_MAX(LOG_MSG_MAX + LOG_TASK_MAX) * 2)
+
 #define LOG_CLR_NORMAL      "\x1B[0m"
 #define LOG_CLR_RED         "\x1B[31m"
 #define LOG_CLR_GREEN       "\x1B[32m"
@@ -28,80 +48,706 @@
 
 #define LOG_DATE_FMT "%Y/%m/%d %H:%M:%S"
 
+// Log calls take a context pointer before the format, see LOG_CTX
 #if LOG_LEVEL >= 1
-#define LOG_ERR(fmt, ...) log__print(LOG_CLR_RED, "ERROR", fmt, ##__VA_ARGS__)
+#define LOG_ERR(...) log__print(LOG_LVL_ERR, __VA_ARGS__)
 #else
-#define LOG_ERR(fmt, ...)
+#define LOG_ERR(...)
 #endif
 
 #if LOG_LEVEL >= 2
-#define LOG_WARN(fmt, ...) log__print(LOG_CLR_YELLOW, "WARN", fmt, ##__VA_ARGS__)
+#define LOG_WARN(...) log__print(LOG_LVL_WARN, __VA_ARGS__)
 #else
-#define LOG_WARN(fmt, ...)
+#define LOG_WARN(...)
 #endif
 
 #if LOG_LEVEL >= 3
-#define LOG_INFO(fmt, ...) log__print(LOG_CLR_GREEN, "INFO", fmt, ##__VA_ARGS__)
+#define LOG_INFO(...) log__print(LOG_LVL_INFO, __VA_ARGS__)
 #else
-#define LOG_INFO(fmt, ...)
+#define LOG_INFO(...)
 #endif
 
 #if LOG_LEVEL >= 4
-#define LOG_DEBUG(fmt, ...) log__print(LOG_CLR_CYAN, "DEBUG", fmt, ##__VA_ARGS__)
+#define LOG_DEBUG(...) log__print(LOG_LVL_DEBUG, __VA_ARGS__)
 #else
-#define LOG_DEBUG(fmt, ...)
+#define LOG_DEBUG(...)
 #endif
 
 #if LOG_LEVEL >= 5
-#define LOG_TRACE(fmt, ...) log__print(LOG_CLR_WHITE, "TRACE", fmt, ##__VA_ARGS__)
+#define LOG_TRACE(...) log__print(LOG_LVL_TRACE, __VA_ARGS__)
 #else
-#define LOG_TRACE(fmt, ...)
+#define LOG_TRACE(...)
 #endif
 
-FILE* __log_output_fd = NULL;
+/// Build the context argument of a log call
+#define LOG_CTX(component, task, pid, stream) (&(LogContext){ component, task, pid, stream })
+
+typedef enum {
+    LOG_LVL_ERR,
+    LOG_LVL_WARN,
+    LOG_LVL_INFO,
+    LOG_LVL_DEBUG,
+    LOG_LVL_TRACE,
+    LOG_LVL_PAD,
+} LogLevel;
+
+typedef enum {
+    LOG_COMP_SERVER,
+    LOG_COMP_TASK,
+    LOG_COMP_LOG,
+} LogComponent;
+
+typedef enum {
+    LOG_STREAM_NONE,
+    LOG_STREAM_STDOUT,
+    LOG_STREAM_STDERR,
+} LogStream;
+
+typedef enum {
+    LOG_FORMAT_TEXT,
+    LOG_FORMAT_JSON,
+} LogFormat;
+
+typedef enum {
+    LOG_POLICY_DROP,
+    LOG_POLICY_BLOCK,
+} LogFullPolicy;
+
+typedef struct LogOptions_st {
+    unsigned char async;
+    LogFullPolicy policy;
+    LogFormat format;
+    size_t ring_size;
+    int flush_ms;
+    size_t rotate_size;
+    long rotate_interval_ms;
+    int rotate_keep;
+} LogOptions;
+
+typedef struct LogContext_st {
+    LogComponent component;
+    const char* task;
+    int pid;
+    LogStream stream;
+} LogContext;
+
+// Records are written in place into the ring, 'seq' is set to the record position last to publish it.
+// The message is followed by the task name, neither is NUL-terminated.
+typedef struct LogRecord_st {
+    uint64_t seq;
+    uint64_t ts_ns;
+    uint32_t request_id;
+    int32_t pid;
+    uint16_t size;
+    uint16_t len;
+    uint8_t level;
+    uint8_t component;
+    uint8_t stream;
+    uint8_t task_len;
+    char msg[];
+} LogRecord;
+
+typedef struct LogFile_st {
+    int fd;
+    int reopen;
+    size_t size;
+    uint64_t opened_ms;
+    size_t rotate_size;
+    long rotate_interval_ms;
+    int rotate_keep;
+    unsigned char open_failed;
+    char path[LOG_PATH_MAX];
+} LogFile;
+
+typedef struct LogRing_st {
+    char* buf;
+    char* scratch;
+    size_t size;
+    uint64_t write_pos;
+    uint64_t read_pos;
+    uint64_t dropped;
+    LogFullPolicy policy;
+    int flush_ms;
+    unsigned char running;
+    pthread_t writer;
+    // Producers blocked on a full ring wake the writer through 'wake' and wait on 'space' for it to drain
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_cond_t space;
+    unsigned char wake_pending;
+    int waiters;
+} LogRing;
+
+static const char* __log_level_colors[] = { LOG_CLR_RED, LOG_CLR_YELLOW, LOG_CLR_GREEN, LOG_CLR_CYAN, LOG_CLR_WHITE };
+static const char* __log_level_tags[] = { "ERROR", "WARN", "INFO", "DEBUG", "TRACE" };
+static const char* __log_level_names[] = { "error", "warn", "info", "debug", "trace" };
+static const char* __log_component_names[] = { "server", "task", "log" };
+static const char* __log_stream_names[] = { NULL, "stdout", "stderr" };
+
+int __log_console_fd = STDOUT_FILENO;
+LogFile __log_file = { .fd = -1 };
+LogFormat __log_format = LOG_FORMAT_TEXT;
+LogRing __log_ring = {0};
+static signed char __log_console_color = -1;
+static __thread uint32_t __log_request_id = 0;
+
+/// Tag records logged from the calling thread with a request id until it is set back to 0
+void
+log_set_request(uint32_t request_id) {
+    __log_request_id = request_id;
+}
+
+/// Format the line prefix of a text record, returns its length
+static int
+log__prefix(char* buf, LogRecord* record, unsigned char color) {
+    // The writer formats lines in time order, so the date string only changes once a second
+    static __thread time_t last_sec = -1;
+    static __thread char date[LOG_DATE_MAX];
 
+    time_t sec = record->ts_ns / 1000000000ULL;
+    if (sec != last_sec) {
+        struct tm tm;
+        localtime_r(&sec, &tm);
+        strftime(date, LOG_DATE_MAX, LOG_DATE_FMT, &tm);
+        last_sec = sec;
+    }
+
+    // Task output is labeled with the task, everything else with the component it came from
+    const char* label = __log_component_names[record->component];
+    int label_len = strlen(label);
+    if (record->component == LOG_COMP_TASK && record->task_len > 0) {
+        label = record->msg + record->len;
+        label_len = record->task_len;
+    }
+
+    return snprintf(buf, LOG_PREFIX_MAX, "%s%s %s%s [%.*s] ",
+                    color ? __log_level_colors[record->level] : "",
+                    date,
+                    __log_level_tags[record->level],
+                    color ? LOG_CLR_NORMAL : "",
+                    label_len, label);
+}
+
+/// Get the length of the UTF-8 sequence starting at 'in', returns 0 if it is not a valid one
+static size_t
+log__utf8_len(const unsigned char* in, size_t left) {
+    uint32_t code, min;
+    size_t len;
+    if (in[0] >= 0xc2 && in[0] <= 0xdf)      { len = 2; code = in[0] & 0x1f; min = 0x80; }
+    else if ((in[0] & 0xf0) == 0xe0)         { len = 3; code = in[0] & 0x0f; min = 0x800; }
+    else if (in[0] >= 0xf0 && in[0] <= 0xf4) { len = 4; code = in[0] & 0x07; min = 0x10000; }
+    else return 0;
+    if (len > left) return 0;
+
+    for (size_t i = 1; i < len; i++) {
+        if ((in[i] & 0xc0) != 0x80) return 0;
+        code = (code << 6) | (in[i] & 0x3f);
+    }
+    // Overlong forms, surrogates and code points past Unicode are not valid either
+    if (code < min || code > 0x10ffff || (code >= 0xd800 && code <= 0xdfff)) return 0;
+    return len;
+}
+
+/// Copy a string into a JSON string body, returns the amount of bytes written. Bytes that are not valid UTF-8
+/// are replaced with U+FFFD, task output can be anything.
+static size_t
+log__json_escape(char* out, const char* in, size_t len) {
+    static const char hex[] = "0123456789abcdef";
+    char* start = out;
+    size_t run = 0;
+
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = in[i];
+        size_t utf8_len = 0;
+        if (c >= 0x80 && (utf8_len = log__utf8_len((const unsigned char*)in + i, len - i)) > 0) {
+            i += utf8_len - 1;
+            continue;
+        }
+        if (c >= 0x20 && c < 0x80 && c != '"' && c != '\\') continue;
+
+        // Copy the clean run before this byte in one go
+        memcpy(out, in + run, i - run);
+        out += i - run;
+        run = i + 1;
+
+        if (c >= 0x80) {
+            memcpy(out, "\xef\xbf\xbd", 3);
+            out += 3;
+            continue;
+        }
+
+        *out++ = '\\';
+        switch (c) {
+            case '"':  *out++ = '"'; break;
+            case '\\': *out++ = '\\'; break;
+            case '\n': *out++ = 'n'; break;
+            case '\r': *out++ = 'r'; break;
+            case '\t': *out++ = 't'; break;
+            default:
+                *out++ = 'u';
+                *out++ = '0';
+                *out++ = '0';
+                *out++ = hex[c >> 4];
+                *out++ = hex[c & 0xf];
+                break;
+        }
+    }
+
+    memcpy(out, in + run, len - run);
+    out += len - run;
+    return out - start;
+}
+
+/// Format a record as one JSON object and a newline, returns its length
+static size_t
+log__json_line(char* buf, LogRecord* record) {
+    char* out = buf;
+    out += sprintf(out, "{\"ts_ns\":%llu,\"level\":\"%s\",\"component\":\"%s\"",
+                   (unsigned long long)record->ts_ns,
+                   __log_level_names[record->level],
+                   __log_component_names[record->component]);
+
+    if (record->task_len > 0) {
+        memcpy(out, ",\"task\":\"", 9);
+        out += 9;
+        out += log__json_escape(out, record->msg + record->len, record->task_len);
+        *out++ = '"';
+    }
+    if (record->pid > 0) out += sprintf(out, ",\"pid\":%d", record->pid);
+    if (record->request_id > 0) out += sprintf(out, ",\"request_id\":%u", record->request_id);
+    if (record->stream != LOG_STREAM_NONE) out += sprintf(out, ",\"stream\":\"%s\"", __log_stream_names[record->stream]);
+
+    memcpy(out, ",\"msg\":\"", 8);
+    out += 8;
+    out += log__json_escape(out, record->msg, record->len);
+    memcpy(out, "\"}\n", 3);
+    out += 3;
+    return out - buf;
+}
+
+static size_t
+log__writev_all(int fd, struct iovec* iov, int count) {
+    size_t total = 0;
+    while (count > 0) {
+        ssize_t written = writev(fd, iov, count);
+        if (written < 0) return total;
+        total += written;
+
+        while (count > 0 && (size_t)written >= iov->iov_len) {
+            written -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char*)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+    return total;
+}
+
+static size_t
+log__write_all(int fd, char* buf, size_t len) {
+    struct iovec iov = { buf, len };
+    return log__writev_all(fd, &iov, 1);
+}
+
+/// Write records into given output, scratch has to fit the prefixes of a whole batch or the longest JSON line.
+/// Returns the amount of bytes written.
+static size_t
+log__write_records(int fd, unsigned char color, LogRecord** records, int count, char* scratch, size_t scratch_size) {
+    size_t written = 0;
+    if (__log_format == LOG_FORMAT_JSON) {
+        size_t used = 0;
+        for (int i = 0; i < count; i++) {
+            if (used + LOG_JSON_LINE_MAX(records[i]->len + records[i]->task_len) > scratch_size) {
+                written += log__write_all(fd, scratch, used);
+                used = 0;
+            }
+            used += log__json_line(scratch + used, records[i]);
+        }
+        if (used > 0) written += log__write_all(fd, scratch, used);
+        return written;
+    }
+
+    struct iovec iov[LOG_BATCH_MAX * 3];
+    int iov_count = 0;
+    for (int i = 0; i < count; i++) {
+        char* prefix = scratch + i * LOG_PREFIX_MAX;
+        iov[iov_count].iov_base = prefix;
+        iov[iov_count++].iov_len = log__prefix(prefix, records[i], color);
+        iov[iov_count].iov_base = records[i]->msg;
+        iov[iov_count++].iov_len = records[i]->len;
+        iov[iov_count].iov_base = "\n";
+        iov[iov_count++].iov_len = 1;
+    }
+    return log__writev_all(fd, iov, iov_count);
+}
+
+static uint64_t
+log__now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/// (Re)open the log file for appending, returns 0 on success and -1 if failed, in which case the old one is kept.
+/// The size and age limits then count from the failed attempt, so rotation is retried once they pass again
+/// instead of after every batch, and the error is only reported until an open succeeds.
+static int
+log__file_open(LogFile* file) {
+    int fd = open(file->path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        if (!file->open_failed) perror("Unable to open log file in append mode");
+        file->open_failed = 1;
+        file->size        = 0;
+        file->opened_ms   = log__now_ms();
+        return -1;
+    }
+
+    struct stat st;
+    if (file->fd >= 0) close(file->fd);
+    file->fd          = fd;
+    file->size        = fstat(fd, &st) == 0 ? (size_t)st.st_size : 0;
+    file->opened_ms   = log__now_ms();
+    file->open_failed = 0;
+    return 0;
+}
+
+/// Shift the retained files up by one, moving the current file to 'path.1' and the oldest out, then start a new one
+static void
+log__file_rotate(LogFile* file) {
+    char from[LOG_PATH_MAX + 16];
+    char to[LOG_PATH_MAX + 16];
+
+    if (file->rotate_keep > 0) {
+        snprintf(to, sizeof(to), "%s.%d", file->path, file->rotate_keep);
+        unlink(to);
+        for (int i = file->rotate_keep - 1; i > 0; i--) {
+            snprintf(from, sizeof(from), "%s.%d", file->path, i);
+            snprintf(to, sizeof(to), "%s.%d", file->path, i + 1);
+            rename(from, to);
+        }
+        snprintf(to, sizeof(to), "%s.1", file->path);
+        rename(file->path, to);
+    }
+    else {
+        unlink(file->path);
+    }
+    log__file_open(file);
+}
+
+/// Write records into the log file, reopening it first if asked to and rotating it after the batch if it is due
+static void
+log__file_write(LogFile* file, LogRecord** records, int count, char* scratch, size_t scratch_size) {
+    // Set from the SIGHUP handler, so an external logrotate can move the file away
+    if (__atomic_exchange_n(&file->reopen, 0, __ATOMIC_ACQ_REL)) {
+        log__file_open(file);
+    }
+    file->size += log__write_records(file->fd, 0, records, count, scratch, scratch_size);
+
+    if ((file->rotate_size > 0 && file->size >= file->rotate_size) ||
+        (file->rotate_interval_ms > 0 && log__now_ms() - file->opened_ms >= (uint64_t)file->rotate_interval_ms))
+    {
+        log__file_rotate(file);
+    }
+}
+
+static void
+log__write_outputs(LogRecord** records, int count, char* scratch, size_t scratch_size) {
+    // Colors only make sense on a terminal, log files and pipes get plain text
+    if (__log_console_color < 0) __log_console_color = isatty(__log_console_fd) ? 1 : 0;
+    if (__log_console_fd >= 0) log__write_records(__log_console_fd, __log_console_color, records, count, scratch, scratch_size);
+    if (__log_file.fd >= 0) log__file_write(&__log_file, records, count, scratch, scratch_size);
+}
+
+/// Get the monotonic time given milliseconds from now, for timed waits on the ring
+static void
+log__deadline(struct timespec* deadline, int ms) {
+    clock_gettime(CLOCK_MONOTONIC, deadline);
+    deadline->tv_sec  += ms / 1000;
+    deadline->tv_nsec += (ms % 1000) * 1000000L;
+    if (deadline->tv_nsec >= 1000000000L) {
+        deadline->tv_sec++;
+        deadline->tv_nsec -= 1000000000L;
+    }
+}
+
+static void
+log__ring_destroy(LogRing* ring) {
+    pthread_cond_destroy(&ring->space);
+    pthread_cond_destroy(&ring->wake);
+    pthread_mutex_destroy(&ring->lock);
+}
+
+/// Write out committed records in batches, returns the amount of records written
+static int
+log__drain(LogRing* ring) {
+    LogRecord* batch[LOG_BATCH_MAX];
+    int total = 0;
+
+    for (;;) {
+        uint64_t pos = ring->read_pos;
+        uint64_t end = __atomic_load_n(&ring->write_pos, __ATOMIC_ACQUIRE);
+        int count = 0;
+
+        while (pos < end && count < LOG_BATCH_MAX) {
+            LogRecord* record = (LogRecord*)(ring->buf + (pos & (ring->size - 1)));
+            // Reserved but not yet written by its producer
+            if (__atomic_load_n(&record->seq, __ATOMIC_ACQUIRE) != pos) break;
+
+            if (record->level != LOG_LVL_PAD) batch[count++] = record;
+            pos += record->size;
+        }
+
+        if (count > 0) log__write_outputs(batch, count, ring->scratch, LOG_SCRATCH_SIZE);
+        if (pos == ring->read_pos) break;
+
+        __atomic_store_n(&ring->read_pos, pos, __ATOMIC_RELEASE);
+        total += count;
+    }
+
+    return total;
+}
+
+static void*
+log__writer(void* data) {
+    LogRing* ring = (LogRing*)data;
+    uint64_t reported = 0;
+
+    for (;;) {
+        unsigned char running = __atomic_load_n(&ring->running, __ATOMIC_ACQUIRE);
+        uint64_t read_pos = ring->read_pos;
+        log__drain(ring);
+
+        uint64_t dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+        if (dropped != reported) {
+            union { LogRecord record; char bytes[sizeof(LogRecord) + 64]; } local;
+            LogRecord* record = &local.record;
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            memset(record, 0, sizeof(LogRecord));
+            record->ts_ns     = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+            record->level     = LOG_LVL_WARN;
+            record->component = LOG_COMP_LOG;
+            record->len       = snprintf(record->msg, 64, "Ring full, dropped %lu records",
+                                         (unsigned long)(dropped - reported));
+            log__write_outputs(&record, 1, ring->scratch, LOG_SCRATCH_SIZE);
+            reported = dropped;
+        }
+
+        pthread_mutex_lock(&ring->lock);
+        // Blocked producers retry once something was drained, and give up once the writer stops
+        if (ring->waiters > 0 && (ring->read_pos != read_pos || !running)) pthread_cond_broadcast(&ring->space);
+        if (running && !ring->wake_pending) {
+            struct timespec deadline;
+            log__deadline(&deadline, ring->flush_ms);
+            pthread_cond_timedwait(&ring->wake, &ring->lock, &deadline);
+        }
+        ring->wake_pending = 0;
+        pthread_mutex_unlock(&ring->lock);
+
+        if (!running) break;
+    }
+    return NULL;
+}
+
+/// Open the log output and start the background writer if asked to, returns 0 on success and -1 if failed.
+/// An existing log file is appended to, and rotated once it passes the size or age limit in given options.
 int
-log_init(char* output_file) {
+log_init(char* output_file, LogOptions* options) {
     if (output_file != NULL) {
-        __log_output_fd = fopen(output_file, "w");
-        if (!__log_output_fd) {
-            perror("Unable to open log file in write mode");
-            return -1;
-        }
+        snprintf(__log_file.path, LOG_PATH_MAX, "%s", output_file);
+        if (log__file_open(&__log_file) != 0) return -1;
+    }
+    if (!options) return 0;
+    __log_file.rotate_size        = options->rotate_size;
+    __log_file.rotate_interval_ms = options->rotate_interval_ms;
+    __log_file.rotate_keep        = options->rotate_keep;
+    __log_format = options->format;
+    if (!options->async) return 0;
+
+    // Positions are masked into the ring, so its size has to be a power of two
+    size_t size = 4096;
+    while (size < options->ring_size || size < LOG_RECORD_SIZE(LOG_MSG_MAX + LOG_TASK_MAX) * 2) size *= 2;
+
+    void* buf = mmap(NULL, size + LOG_SCRATCH_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buf == MAP_FAILED) {
+        perror("Unable to allocate log ring, logging synchronously");
+        return 0;
+    }
+
+    __log_ring.buf      = buf;
+    __log_ring.scratch  = (char*)buf + size;
+    __log_ring.size     = size;
+    __log_ring.policy   = options->policy;
+    __log_ring.flush_ms = options->flush_ms > 0 ? options->flush_ms : LOG_FLUSH_MS;
+    __log_ring.running  = 1;
+    __log_ring.waiters  = 0;
+    __log_ring.wake_pending = 0;
+
+    // Waits are timed against the monotonic clock, so wall clock jumps cannot stall the writer or producers
+    pthread_condattr_t cond_attr;
+    pthread_condattr_init(&cond_attr);
+    pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+    pthread_mutex_init(&__log_ring.lock, NULL);
+    pthread_cond_init(&__log_ring.wake, &cond_attr);
+    pthread_cond_init(&__log_ring.space, &cond_attr);
+    pthread_condattr_destroy(&cond_attr);
+
+    // The writer inherits a full signal mask, so shutdown handlers always run on a thread that can join it
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    int status = pthread_create(&__log_ring.writer, NULL, log__writer, &__log_ring);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    if (status != 0) {
+        perror("Unable to start log writer, logging synchronously");
+        __log_ring.running = 0;
+        log__ring_destroy(&__log_ring);
+        munmap(buf, size + LOG_SCRATCH_SIZE);
+        __log_ring.buf = NULL;
     }
     return 0;
 }
 
+/// Reopen the log file before the next write, safe to call from a signal handler
+void
+log_reopen() {
+    __atomic_store_n(&__log_file.reopen, 1, __ATOMIC_RELEASE);
+}
+
+/// Get the amount of records dropped because the ring was full
+uint64_t
+log_dropped() {
+    return __atomic_load_n(&__log_ring.dropped, __ATOMIC_RELAXED);
+}
+
 void
 log_close() {
-    if (__log_output_fd != NULL) {
-        fflush(__log_output_fd);
-        fclose(__log_output_fd);
-        __log_output_fd = NULL;
+    // Stop the writer after it has drained everything already queued
+    if (__atomic_exchange_n(&__log_ring.running, 0, __ATOMIC_ACQ_REL)) {
+        // Signaled without the lock, this may run in a signal handler. A missed signal only delays the writer
+        // by one flush interval.
+        pthread_cond_signal(&__log_ring.wake);
+        pthread_join(__log_ring.writer, NULL);
+        log__ring_destroy(&__log_ring);
+        munmap(__log_ring.buf, __log_ring.size + LOG_SCRATCH_SIZE);
+        __log_ring.buf = NULL;
+    }
+    if (__log_file.fd >= 0) {
+        close(__log_file.fd);
+        __log_file.fd = -1;
+    }
+}
+
+/// Block until the writer has drained the ring up to 'read_pos', or for at most one flush interval. The writer
+/// is woken right away instead of on its next flush.
+static void
+log__wait_space(LogRing* ring, uint64_t read_pos) {
+    pthread_mutex_lock(&ring->lock);
+    ring->waiters++;
+    ring->wake_pending = 1;
+    pthread_cond_signal(&ring->wake);
+    if (__atomic_load_n(&ring->read_pos, __ATOMIC_ACQUIRE) < read_pos &&
+        __atomic_load_n(&ring->running, __ATOMIC_ACQUIRE))
+    {
+        struct timespec deadline;
+        log__deadline(&deadline, ring->flush_ms);
+        pthread_cond_timedwait(&ring->space, &ring->lock, &deadline);
+    }
+    ring->waiters--;
+    pthread_mutex_unlock(&ring->lock);
+}
+
+/// Reserve space for a record at the position written into 'pos', returns a pointer to it or NULL if the ring
+/// is full and records are dropped
+static LogRecord*
+log__reserve(LogRing* ring, uint32_t len, uint64_t* pos_out) {
+    uint32_t size = LOG_RECORD_SIZE(len);
+
+    for (;;) {
+        uint64_t pos = __atomic_load_n(&ring->write_pos, __ATOMIC_RELAXED);
+        size_t offset = pos & (ring->size - 1);
+        // Records never wrap, the tail end of the ring is skipped over with a padding record instead.
+        // Everything is aligned to the header size, so a gap always has room for one.
+        uint32_t pad = ring->size - offset < size ? ring->size - offset : 0;
+
+        if (pos + pad + size - __atomic_load_n(&ring->read_pos, __ATOMIC_ACQUIRE) > ring->size) {
+            // Nothing drains a ring whose writer has stopped, so blocking gives up on it as well
+            if (ring->policy == LOG_POLICY_DROP || !__atomic_load_n(&ring->running, __ATOMIC_ACQUIRE)) {
+                __atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+                return NULL;
+            }
+            log__wait_space(ring, pos + pad + size - ring->size);
+            continue;
+        }
+
+        if (!__atomic_compare_exchange_n(&ring->write_pos, &pos, pos + pad + size, 0,
+                                         __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+        {
+            continue;
+        }
+
+        if (pad > 0) {
+            LogRecord* filler = (LogRecord*)(ring->buf + offset);
+            filler->size  = pad;
+            filler->level = LOG_LVL_PAD;
+            __atomic_store_n(&filler->seq, pos, __ATOMIC_RELEASE);
+        }
+
+        *pos_out = pos + pad;
+        return (LogRecord*)(ring->buf + ((pos + pad) & (ring->size - 1)));
     }
 }
 
 void
-log__print(char* color, char* tag, char* fmt, ...) {
-    time_t t = time(0);
-    char t_buf[LOG_DATE_MAX];
-    strftime(t_buf, LOG_DATE_MAX, LOG_DATE_FMT, localtime(&t));
+log__print(LogLevel level, const LogContext* ctx, char* fmt, ...) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+
+    // The record is built on the stack first, it is only copied into the ring once its length is known
+    union { LogRecord record; char bytes[sizeof(LogRecord) + LOG_MSG_MAX + LOG_TASK_MAX]; } local;
+    LogRecord* record = &local.record;
 
-    char in_buf[LOG_MSG_MAX];
     va_list args;
     va_start(args, fmt);
-    vsnprintf(in_buf, LOG_MSG_MAX, fmt, args);
+    int len = vsnprintf(record->msg, LOG_MSG_MAX, fmt, args);
     va_end(args);
+    if (len < 0) return;
+    if (len >= LOG_MSG_MAX) len = LOG_MSG_MAX - 1;
 
-    char out_buf[LOG_OUT_MAX];
-    snprintf(out_buf, LOG_OUT_MAX, "%s%s %s%s %s", color, t_buf, tag, LOG_CLR_NORMAL, in_buf);
+    size_t task_len = ctx && ctx->task ? strlen(ctx->task) : 0;
+    if (task_len > LOG_TASK_MAX) task_len = LOG_TASK_MAX;
+    if (task_len > 0) memcpy(record->msg + len, ctx->task, task_len);
 
-    fprintf(stdout, "%s\n", out_buf);
+    record->ts_ns      = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    record->request_id = __log_request_id;
+    record->pid        = ctx ? ctx->pid : 0;
+    record->size       = LOG_RECORD_SIZE(len + task_len);
+    record->len        = len;
+    record->level      = level;
+    record->component  = ctx ? ctx->component : LOG_COMP_SERVER;
+    record->stream     = ctx ? ctx->stream : LOG_STREAM_NONE;
+    record->task_len   = task_len;
 
-    if (__log_output_fd != NULL) {
-        fprintf(__log_output_fd, "%s\n", out_buf);
-        fflush(__log_output_fd);
+    // Without a writer thread the line is written out right away
+    if (!__atomic_load_n(&__log_ring.running, __ATOMIC_ACQUIRE)) {
+        char scratch[LOG_JSON_LINE_MAX(len + task_len) + LOG_PREFIX_MAX];
+        fflush(stdout);
+        log__write_outputs(&record, 1, scratch, sizeof(scratch));
+        return;
     }
+
+    uint64_t pos = 0;
+    LogRecord* slot = log__reserve(&__log_ring, len + task_len, &pos);
+    if (!slot) return;
+
+    // Everything but the sequence number goes in first, the writer may be polling it already
+    size_t skip = offsetof(LogRecord, ts_ns);
+    memcpy((char*)slot + skip, (char*)record + skip, sizeof(LogRecord) - skip + len + task_len);
+    __atomic_store_n(&slot->seq, pos, __ATOMIC_RELEASE);
 }
 
 #endif
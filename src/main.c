@@ -2,6 +2,9 @@
 #include <signal.h>
 #define ARENA_ALLOCATOR_IMPL
 #define ALLOC_FUNC arena_alloc
+#define ALLOC_TAG_FUNC arena_alloc_tagged
+// Global arena pages are fresh anonymous mappings, so allocations from it are already zeroed
+#define ALLOC_ZEROED
 #include "arena.h"
 #define CONFIG_IMPL
 #include "config.h"
@@ -17,11 +20,27 @@
 #define ALLOC_PAGE_COUNT 2
 #endif
 
+#ifndef ALLOC_PAGE_FLAGS
+#define ALLOC_PAGE_FLAGS ARENA_FLAG_NONE
+#endif
+
+static unsigned char __dump_alloc_stats = 0;
+
+/// Shut down and exit, only called from the main thread once the agent or the command has finished. The trace is
+/// dumped by the agent cleanup when its loop returns.
 void
-finish(int sig) {
+finish(int code) {
+    if (__dump_alloc_stats) server_log_alloc_stats();
     log_close();
     arena_free();
-    exit(sig);
+    exit(code);
+}
+
+/// Ask the agent loop to stop, shutdown happens once it returns. Only sets a flag, as the signal may land in the
+/// middle of logging or tracing.
+void
+stop_server(int sig) {
+    __server_stop = sig;
 }
 
 void
@@ -30,6 +49,11 @@ pipe_out(int sig) {
     fprintf(stderr, "Pipe broken, signal: %d\n", sig);
 }
 
+void
+reopen_log(int sig) {
+    log_reopen();
+}
+
 void
 daemonize() {
 
@@ -37,10 +61,21 @@ daemonize() {
 
 int
 main(int argc, char** argv, char** envp) {
-    arena_init(ALLOC_PAGE_SIZE, ALLOC_PAGE_COUNT, 1);
+    arena_init_flags(ALLOC_PAGE_SIZE, ALLOC_PAGE_COUNT, 1, ALLOC_PAGE_FLAGS);
 
     Config* config = config_init(argc, argv);
-    log_init(config->args.log_file);
+    // Only the agent gets a writer thread, a one-shot command logs straight to its output
+    LogOptions log_options = {
+        .async     = config->args.run_mode == RUNMODE_SERVER && !config->args.help,
+        .policy    = config->settings.log.block_when_full ? LOG_POLICY_BLOCK : LOG_POLICY_DROP,
+        .format    = config->settings.log.json ? LOG_FORMAT_JSON : LOG_FORMAT_TEXT,
+        .ring_size = config->settings.log.ring_size,
+        .flush_ms  = config->settings.log.flush_ms,
+        .rotate_size        = config->settings.log.rotate_size,
+        .rotate_interval_ms = config->settings.log.rotate_interval_ms,
+        .rotate_keep        = config->settings.log.rotate_keep,
+    };
+    log_init(config->args.log_file, &log_options);
 
     if (config->args.help) {
         print_help();
@@ -51,14 +86,18 @@ main(int argc, char** argv, char** envp) {
         daemonize();
     }
 
+    // A one-shot command keeps the default action of SIGINT and SIGTERM, it has nothing to shut down
     int ret_code = 0;
-    signal(SIGINT, finish);
-    signal(SIGTERM, finish);
     signal(SIGPIPE, pipe_out);
+    signal(SIGHUP, reopen_log);
 
     switch (config->args.run_mode) {
         case RUNMODE_SERVER:
+            __dump_alloc_stats = 1;
+            signal(SIGINT, stop_server);
+            signal(SIGTERM, stop_server);
             ret_code = run_as_server(config);
+            if (__server_stop) ret_code = __server_stop;
             break;
         case RUNMODE_CMD:
             ret_code = run_cmd(config, argv);
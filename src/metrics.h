@@ -0,0 +1,275 @@
+#ifndef DPATCH_METRICS_H
+#define DPATCH_METRICS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#define METRICS_SHARD_MAX 16
+
+// Histograms are log-linear: values below 2^SUB_BITS get a bucket each, every power of two above that is split
+// into 2^SUB_BITS linear buckets, so a value is off by at most 1/32 of itself. Values past 2^MAX_BITS are clamped.
+#define HISTOGRAM_SUB_BITS 5
+#define HISTOGRAM_MAX_BITS 32
+#define HISTOGRAM_BUCKETS ((HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS)
+
+typedef enum {
+    METRIC_TASKS_SUBMITTED,
+    METRIC_TASKS_LAUNCHED,
+    METRIC_TASKS_QUEUED,
+    METRIC_TASKS_REJECTED,
+    METRIC_TASKS_FAILED,
+    METRIC_CONNECTIONS_ACCEPTED,
+    METRIC_CONNECTIONS_REJECTED,
+    METRIC_OUTPUT_BYTES,
+    METRIC_LOOP_ITERATIONS,
+    METRIC_QUEUE_DEPTH,
+    METRIC_PROCESSES_RUNNING,
+    __METRIC_COUNT
+} MetricId;
+
+typedef enum {
+    HISTOGRAM_REQUEST,
+    HISTOGRAM_QUEUE_WAIT,
+    HISTOGRAM_SPAWN,
+    HISTOGRAM_REAP,
+    __HISTOGRAM_COUNT
+} HistogramId;
+
+typedef enum {
+    METRIC_COUNTER,
+    METRIC_GAUGE,
+    METRIC_HISTOGRAM,
+} MetricType;
+
+typedef struct MetricInfo_st {
+    const char* name;
+    const char* help;
+    MetricType type;
+} MetricInfo;
+
+// Counters of one thread, only ever written by that thread. Aligned so threads never share a cache line.
+typedef struct MetricsShard_st {
+    uint64_t values[__METRIC_COUNT];
+} __attribute__((aligned(64))) MetricsShard;
+
+// Fixed size, recorded from a single thread and read from any
+typedef struct Histogram_st {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t buckets[HISTOGRAM_BUCKETS];
+} Histogram;
+
+/// Add to a counter of the calling thread
+void metrics_add(MetricId id, uint64_t amount);
+/// Set the value of a gauge
+void metrics_set(MetricId id, int64_t value);
+/// Get the current value of a metric, counters are summed over every thread
+int64_t metrics_value(MetricId id);
+/// Get the name, help text and type of a metric
+const MetricInfo* metrics_info(MetricId id);
+/// Record a value into a histogram, only one thread may record into a histogram
+void histogram_record(HistogramId id, uint64_t value);
+/// Get the value at given quantile (0..1) of a histogram, as the upper bound of its bucket, or 0 if nothing is recorded
+uint64_t histogram_quantile(HistogramId id, double quantile);
+/// Get the histogram data and its name and help text
+const Histogram* histogram_get(HistogramId id);
+const MetricInfo* histogram_info(HistogramId id);
+/// Get a buffer size that every metric fits in whole in Prometheus text format
+size_t metrics_prometheus_size(void);
+/// Write every metric in Prometheus text format into given buffer, returns the amount of bytes written.
+/// Metrics that do not fit whole are left out.
+size_t metrics_render_prometheus(char* buf, size_t len);
+
+#define METRICS_INC(id) metrics_add(id, 1)
+
+#ifdef METRICS_IMPL
+
+static const MetricInfo __metrics_info[__METRIC_COUNT] = {
+    { "dpatch_tasks_submitted_total",       "Run requests for a task found in the workspace", METRIC_COUNTER },
+    { "dpatch_tasks_launched_total",        "Task processes started",                         METRIC_COUNTER },
+    { "dpatch_tasks_queued_total",          "Tasks put in the queue",                         METRIC_COUNTER },
+    { "dpatch_tasks_rejected_total",        "Tasks dropped because the queue was full",       METRIC_COUNTER },
+    { "dpatch_tasks_failed_total",          "Tasks that failed to launch or exited unsuccessfully", METRIC_COUNTER },
+    { "dpatch_connections_accepted_total",  "Client connections accepted",                    METRIC_COUNTER },
+    { "dpatch_connections_rejected_total",  "Client connections closed over the client limit", METRIC_COUNTER },
+    { "dpatch_output_bytes_total",          "Bytes read from task stdout and stderr",         METRIC_COUNTER },
+    { "dpatch_loop_iterations_total",       "Iterations of the agent event loop",             METRIC_COUNTER },
+    { "dpatch_queue_depth",                 "Tasks waiting in the queue, spilled ones included", METRIC_GAUGE },
+    { "dpatch_processes_running",           "Task processes currently running",               METRIC_GAUGE },
+};
+
+static const MetricInfo __histogram_info[__HISTOGRAM_COUNT] = {
+    { "dpatch_request_latency_us",  "Time from reading a client request to sending its response",  METRIC_HISTOGRAM },
+    { "dpatch_queue_wait_us",       "Time tasks spent queued before launch",                        METRIC_HISTOGRAM },
+    { "dpatch_spawn_latency_us",    "Time from fork to exec of task processes",                     METRIC_HISTOGRAM },
+    { "dpatch_reap_latency_us",     "Time from the agent noticing a task exit to reaping it",       METRIC_HISTOGRAM },
+};
+
+static Histogram __histograms[__HISTOGRAM_COUNT];
+static MetricsShard __metrics_shards[METRICS_SHARD_MAX];
+static int __metrics_shard_count = 0;
+static int64_t __metrics_gauges[__METRIC_COUNT];
+static __thread MetricsShard* __metrics_shard = NULL;
+static __thread unsigned char __metrics_shared = 0;
+
+static MetricsShard*
+metrics__claim() {
+    int idx = __atomic_fetch_add(&__metrics_shard_count, 1, __ATOMIC_RELAXED);
+    // Threads past the shard limit all add into the last one, which then needs atomic adds
+    if (idx >= METRICS_SHARD_MAX - 1) {
+        idx = METRICS_SHARD_MAX - 1;
+        __metrics_shared = 1;
+    }
+    __metrics_shard = &__metrics_shards[idx];
+    return __metrics_shard;
+}
+
+void
+metrics_add(MetricId id, uint64_t amount) {
+    MetricsShard* shard = __metrics_shard ? __metrics_shard : metrics__claim();
+    uint64_t* value = &shard->values[id];
+
+    // A single writer needs no read-modify-write, readers only have to see whole values
+    if (__metrics_shared) __atomic_add_fetch(value, amount, __ATOMIC_RELAXED);
+    else __atomic_store_n(value, *value + amount, __ATOMIC_RELAXED);
+}
+
+void
+metrics_set(MetricId id, int64_t value) {
+    __atomic_store_n(&__metrics_gauges[id], value, __ATOMIC_RELAXED);
+}
+
+int64_t
+metrics_value(MetricId id) {
+    if (id >= __METRIC_COUNT) return 0;
+    if (__metrics_info[id].type == METRIC_GAUGE) return __atomic_load_n(&__metrics_gauges[id], __ATOMIC_RELAXED);
+
+    uint64_t sum = 0;
+    for (int i = 0; i < METRICS_SHARD_MAX; i++) {
+        sum += __atomic_load_n(&__metrics_shards[i].values[id], __ATOMIC_RELAXED);
+    }
+    return (int64_t)sum;
+}
+
+const MetricInfo*
+metrics_info(MetricId id) {
+    if (id >= __METRIC_COUNT) return NULL;
+    return &__metrics_info[id];
+}
+
+static inline int
+histogram__index(uint64_t value) {
+    if (value >= (uint64_t)1 << HISTOGRAM_MAX_BITS) value = ((uint64_t)1 << HISTOGRAM_MAX_BITS) - 1;
+    if (value < (1 << HISTOGRAM_SUB_BITS)) return (int)value;
+
+    int shift = 63 - __builtin_clzll(value) - HISTOGRAM_SUB_BITS;
+    int sub = (int)(value >> shift) - (1 << HISTOGRAM_SUB_BITS);
+    return ((shift + 1) << HISTOGRAM_SUB_BITS) + sub;
+}
+
+static inline uint64_t
+histogram__upper(int idx) {
+    if (idx < (1 << HISTOGRAM_SUB_BITS)) return idx;
+
+    int shift = (idx >> HISTOGRAM_SUB_BITS) - 1;
+    uint64_t sub = idx & ((1 << HISTOGRAM_SUB_BITS) - 1);
+    return (((1 << HISTOGRAM_SUB_BITS) + sub + 1) << shift) - 1;
+}
+
+void
+histogram_record(HistogramId id, uint64_t value) {
+    Histogram* hist = &__histograms[id];
+    uint64_t* bucket = &hist->buckets[histogram__index(value)];
+    __atomic_store_n(bucket, *bucket + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&hist->sum, hist->sum + value, __ATOMIC_RELAXED);
+    if (value > hist->max) __atomic_store_n(&hist->max, value, __ATOMIC_RELAXED);
+    __atomic_store_n(&hist->count, hist->count + 1, __ATOMIC_RELAXED);
+}
+
+uint64_t
+histogram_quantile(HistogramId id, double quantile) {
+    Histogram* hist = &__histograms[id];
+    uint64_t count = __atomic_load_n(&hist->count, __ATOMIC_RELAXED);
+    if (count == 0) return 0;
+
+    uint64_t rank = (uint64_t)(quantile * count + 0.999999);
+    if (rank < 1) rank = 1;
+    uint64_t seen = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += __atomic_load_n(&hist->buckets[i], __ATOMIC_RELAXED);
+        if (seen >= rank) {
+            // The top bucket is wider than anything recorded into it
+            uint64_t upper = histogram__upper(i);
+            uint64_t max = __atomic_load_n(&hist->max, __ATOMIC_RELAXED);
+            return upper < max ? upper : max;
+        }
+    }
+    return __atomic_load_n(&hist->max, __ATOMIC_RELAXED);
+}
+
+const Histogram*
+histogram_get(HistogramId id) {
+    if (id >= __HISTOGRAM_COUNT) return NULL;
+    return &__histograms[id];
+}
+
+const MetricInfo*
+histogram_info(HistogramId id) {
+    if (id >= __HISTOGRAM_COUNT) return NULL;
+    return &__histogram_info[id];
+}
+
+size_t
+metrics_prometheus_size(void) {
+    // Names and help texts plus room for the widest number in every value, and the fixed text around them
+    size_t size = 1;
+    for (int i = 0; i < __METRIC_COUNT; i++) {
+        size += strlen(__metrics_info[i].name) * 3 + strlen(__metrics_info[i].help) + 20 + 32;
+    }
+    for (int i = 0; i < __HISTOGRAM_COUNT; i++) {
+        size += strlen(__histogram_info[i].name) * 7 + strlen(__histogram_info[i].help) + 20 * 5 + 128;
+    }
+    return size;
+}
+
+size_t
+metrics_render_prometheus(char* buf, size_t len) {
+    size_t loc = 0;
+    unsigned char full = 0;
+    for (int i = 0; !full && i < __METRIC_COUNT; i++) {
+        const MetricInfo* info = &__metrics_info[i];
+        int written = snprintf(buf + loc, len - loc, "# HELP %s %s\n# TYPE %s %s\n%s %lld\n",
+                               info->name, info->help,
+                               info->name, info->type == METRIC_COUNTER ? "counter" : "gauge",
+                               info->name, (long long)metrics_value(i));
+        if (written < 0 || (size_t)written >= len - loc) full = 1;
+        else loc += written;
+    }
+
+    // Histograms go out as summaries, a scraper only needs the quantiles and not every bucket
+    for (int i = 0; !full && i < __HISTOGRAM_COUNT; i++) {
+        const MetricInfo* info = &__histogram_info[i];
+        const Histogram* hist = &__histograms[i];
+        int written = snprintf(buf + loc, len - loc,
+                               "# HELP %s %s\n# TYPE %s summary\n"
+                               "%s{quantile=\"0.5\"} %llu\n%s{quantile=\"0.99\"} %llu\n%s{quantile=\"0.999\"} %llu\n"
+                               "%s_sum %llu\n%s_count %llu\n",
+                               info->name, info->help, info->name,
+                               info->name, (unsigned long long)histogram_quantile(i, 0.5),
+                               info->name, (unsigned long long)histogram_quantile(i, 0.99),
+                               info->name, (unsigned long long)histogram_quantile(i, 0.999),
+                               info->name, (unsigned long long)__atomic_load_n(&hist->sum, __ATOMIC_RELAXED),
+                               info->name, (unsigned long long)__atomic_load_n(&hist->count, __ATOMIC_RELAXED));
+        if (written < 0 || (size_t)written >= len - loc) full = 1;
+        else loc += written;
+    }
+
+    if (loc < len) buf[loc] = '\0';
+    return loc;
+}
+
+#endif
+
+#endif
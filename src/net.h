@@ -2,6 +2,7 @@
 #define DPATCH_NET_H
 
 #include <stdio.h>
+#include <errno.h>
 #include <stdint.h>
 #include <string.h>
 #include <stdlib.h>
@@ -11,6 +12,7 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <sys/time.h>
+#include <time.h>
 #include <fcntl.h>
 #include "config.h"
 #include "arena.h"
@@ -21,6 +23,12 @@
 #define MMALLOC(size) malloc(size)
 #endif
 
+#ifdef ALLOC_TAG_FUNC
+#define MMALLOC_TAG(size, tag) ALLOC_TAG_FUNC(size, ARENA_TAG_ ## tag)
+#else
+#define MMALLOC_TAG(size, tag) MMALLOC(size)
+#endif
+
 typedef struct Connection_st {
     int socket;
     struct sockaddr_in address;
@@ -39,13 +47,47 @@ socket_send(int socket, char* buf, int size) {
     int sent = 0;
     while (sent < size) {
         char* ptr = &buf[sent];
-        int s = send(socket, ptr, size - sent, 0);
+        // A client gone mid-response must not raise SIGPIPE, least of all in a program embedding the agent
+        int s = send(socket, ptr, size - sent, MSG_NOSIGNAL);
         if (s < 1) break;
         sent += s;
     }
     return sent;
 }
 
+/// Get current monotonic clock time in milliseconds, for deadlines of socket writes
+uint64_t
+socket_now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+/// Send a whole buffer on a non-blocking socket, waiting up to given time in total for the socket to take it.
+/// Returns the amount of bytes sent.
+int
+socket_send_wait(int socket, char* buf, int size, int flags, int timeout_ms) {
+    // One deadline for the whole buffer, a client reading a little at a time does not get the full wait each time
+    uint64_t deadline_ms = socket_now_ms() + timeout_ms;
+    int sent = 0;
+    while (sent < size) {
+        int s = send(socket, buf + sent, size - sent, flags | MSG_NOSIGNAL);
+        if (s > 0) {
+            sent += s;
+            continue;
+        }
+        if (s < 0 && errno == EINTR) continue;
+        if (s < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            uint64_t now_ms = socket_now_ms();
+            if (now_ms >= deadline_ms) break;
+            struct pollfd fd = { .fd = socket, .events = POLLOUT };
+            if (poll(&fd, 1, deadline_ms - now_ms) > 0) continue;
+        }
+        break;
+    }
+    return sent;
+}
+
 int
 socket_read(int socket, char* buf, int size) {
     int readc = 0;
@@ -75,29 +117,53 @@ socket_set_timeout(int sock, int timeout_flag, int timeout_secs) {
     return setsockopt(sock, SOL_SOCKET, timeout_flag, &tv, sizeof(struct timeval));
 }
 
+/// Open a non-blocking listening socket on the loopback interface, returns the socket or -1 if failed
 int
-connection_init(Config* config, Connection* conn_ptr) {
+socket_listen_local(int port, int backlog) {
+    int opt = 1;
+    struct sockaddr_in address = {
+        .sin_family = AF_INET,
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+        .sin_port = htons(port),
+    };
+
+    int sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sock < 0) {
+        perror("Unable to create socket");
+        return -1;
+    }
+
+    if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0 ||
+        bind(sock, (struct sockaddr*)&address, sizeof(address)) < 0 ||
+        listen(sock, backlog) < 0)
+    {
+        perror("Unable to listen to local socket");
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+/// Initialize a connection using given buffers of config buffer size, returns 1 if succesful
+int
+connection_init_buffers(Config* config, Connection* conn_ptr, char* in_buf, char* out_buf) {
     int opt = 1;
     *conn_ptr = (Connection){
-        .socket = socket(AF_INET, SOCK_STREAM, 0),
+        .socket = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0),
         .address = {
             .sin_family = AF_INET,
             .sin_addr.s_addr = INADDR_ANY,
             .sin_port = htons(config->args.port),
         },
-        .in_buf = 0,
-        .out_buf = 0,
+        .in_buf = in_buf,
+        .out_buf = out_buf,
     };
 
     if (conn_ptr->socket < 0) {
         perror("Unable to create socket");
         return conn_ptr->socket;
     }
-
-    conn_ptr->in_buf = MMALLOC(sizeof(char) * config->settings.connection.buffer_size);
-    if (!conn_ptr->in_buf) return -1;
-    conn_ptr->out_buf = MMALLOC(sizeof(char) * config->settings.connection.buffer_size);
-    if (!conn_ptr->in_buf) return -1;
+    if (!conn_ptr->in_buf || !conn_ptr->out_buf) return -1;
 
     // Set socket to reuse address
     if (setsockopt(conn_ptr->socket, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
@@ -127,6 +193,12 @@ connection_init(Config* config, Connection* conn_ptr) {
             return -1;
         }
 
+        // Incoming connections are drained until the accept queue is empty
+        if (socket_set_nonblock(conn_ptr->socket) != 0) {
+            perror("Unable to set listening socket as non-blocking");
+            return -1;
+        }
+
 #ifdef NETWORK_DEBUG
         printf("Socket listening on port %i\n", config->args.port);
 #endif
@@ -144,6 +216,22 @@ connection_init(Config* config, Connection* conn_ptr) {
     return 1;
 }
 
+/// Initialize a connection with buffers allocated for its lifetime, returns 1 if succesful
+int
+connection_init(Config* config, Connection* conn_ptr) {
+    char* in_buf = MMALLOC_TAG(sizeof(char) * config->settings.connection.buffer_size, NET);
+    char* out_buf = MMALLOC_TAG(sizeof(char) * config->settings.connection.buffer_size, NET);
+    return connection_init_buffers(config, conn_ptr, in_buf, out_buf);
+}
+
+/// Initialize a short-lived connection with buffers from a scratch arena, returns 1 if succesful
+int
+connection_init_scratch(Config* config, Connection* conn_ptr, Arena* scratch) {
+    char* in_buf = arena_child_alloc(scratch, sizeof(char) * config->settings.connection.buffer_size);
+    char* out_buf = arena_child_alloc(scratch, sizeof(char) * config->settings.connection.buffer_size);
+    return connection_init_buffers(config, conn_ptr, in_buf, out_buf);
+}
+
 int
 connection_close(Connection* conn) {
     if (conn->socket > 0) {
@@ -159,9 +247,11 @@ connection_init_set(Connection* conn, Config* config) {
     FD_ZERO(&conn->read_flags);
     FD_ZERO(&conn->write_flags);
 
-    // Add connection socket to descriptor read set
-    FD_SET(conn->socket, &conn->read_flags);
-    FD_SET(conn->socket, &conn->write_flags);
+    // Add connection socket to both descriptor sets, an embedded agent may run without one
+    if (conn->socket >= 0) {
+        FD_SET(conn->socket, &conn->read_flags);
+        FD_SET(conn->socket, &conn->write_flags);
+    }
 
     memset(conn->in_buf, 0, config->settings.connection.buffer_size);
     memset(conn->out_buf, 0, config->settings.connection.buffer_size);
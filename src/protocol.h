@@ -1,6 +1,7 @@
 #ifndef DPATCH_PROTOCOL_H
 #define DPATCH_PROTOCOL_H
 
+#include <sys/wait.h>
 #include "net.h"
 
 #ifdef ALLOC_FUNC
@@ -9,6 +10,12 @@
 #define MMALLOC(size) malloc(size)
 #endif
 
+#ifdef ALLOC_TAG_FUNC
+#define MMALLOC_TAG(size, tag) ALLOC_TAG_FUNC(size, ARENA_TAG_ ## tag)
+#else
+#define MMALLOC_TAG(size, tag) MMALLOC(size)
+#endif
+
 typedef enum {
     PROTOCOL_MSG_NONE,
     PROTOCOL_MSG_PING,
@@ -19,35 +26,153 @@ typedef enum {
     PROTOCOL_MSG_PROC_INFO,
     PROTOCOL_MSG_SUCCESS,
     PROTOCOL_MSG_ERR,
+    PROTOCOL_MSG_STATS,
+    PROTOCOL_MSG_SNAPSHOT,
     __PROTOCOL_MSG_COUNT
 } ProtocolMsgType;
 
+// Messages start with the magic byte, the version with its top bit set and the flags, followed by the message type
+// and body length as varints. The header is the same in every version, so a side can always tell which version a
+// message it does not understand is in. Legacy messages start with their length as a native int instead, which
+// never has the top bit of its second byte set below 32KB.
+#define PROTOCOL_MAGIC 0xDA
+#define PROTOCOL_VERSION 1
+#define PROTOCOL_VERSION_LEGACY 0
+#define PROTOCOL_VERSION_BIT 0x80
+#define PROTOCOL_VARINT_MAX 10
+#define PROTOCOL_HEADER_MAX (3 + PROTOCOL_VARINT_MAX * 2)
+#define PROTOCOL_LEGACY_HEADER (sizeof(int) * 2)
+
+// Message flags
+#define PROTOCOL_FLAG_LAST 0x01
+
+// Snapshot bodies start with the snapshot kind, frame sequence number and entry count
+#define PROTOCOL_SNAPSHOT_PREFIX (1 + PROTOCOL_VARINT_MAX * 2)
+#define PROTOCOL_ENTRY_FIELDS 16
+#define PROTOCOL_ENTRY_STRS 2
+#define PROTOCOL_STR_MAX 255
+
+typedef enum {
+    PROTOCOL_SNAPSHOT_TASKS,
+    PROTOCOL_SNAPSHOT_PROCS,
+    PROTOCOL_SNAPSHOT_WORKSPACE,
+    __PROTOCOL_SNAPSHOT_COUNT
+} ProtocolSnapshotKind;
+
+// Numeric fields of snapshot entries per kind. Fields are only ever appended, readers zero the ones they did not get.
+typedef enum {
+    PROTOCOL_TASK_PID,
+    PROTOCOL_TASK_STATUS,
+    PROTOCOL_TASK_WALL_MS,
+    PROTOCOL_TASK_UTIME_US,
+    PROTOCOL_TASK_STIME_US,
+    PROTOCOL_TASK_MAXRSS_KB,
+    PROTOCOL_TASK_NVCSW,
+    PROTOCOL_TASK_NIVCSW,
+    PROTOCOL_TASK_INBLOCK,
+    PROTOCOL_TASK_OUBLOCK,
+    PROTOCOL_TASK_CG_CPU_USEC,
+    PROTOCOL_TASK_CG_MEM_PEAK,
+    __PROTOCOL_TASK_FIELD_COUNT
+} ProtocolTaskField;
+
+typedef enum {
+    PROTOCOL_PROC_PID,
+    PROTOCOL_PROC_RUNNING_MS,
+    PROTOCOL_PROC_TRACE_ID,
+    __PROTOCOL_PROC_FIELD_COUNT
+} ProtocolProcField;
+
 typedef enum {
     PROTOCOL_TOKEN_NONE,
     PROTOCOL_TOKEN_ARG,
     PROTOCOL_TOKEN_VAR
 } ProtocolTokenType;
 
+typedef struct ProtocolHeader_st {
+    unsigned char version;
+    unsigned char flags;
+    uint32_t type;
+    uint32_t length;
+    uint32_t size;
+} ProtocolHeader;
+
 typedef struct ProtocolToken_st {
     unsigned char type;
     char* value;
 } ProtocolToken;
 
+// Written in 'version', which reading a message sets to the version it was in, so a reply goes out in the
+// version of its request
 typedef struct ProtocolTokenStream_st {
     ProtocolMsgType type;
     int length;
+    int capacity;
+    unsigned char version;
     ProtocolToken* tokens;
 } ProtocolTokenStream;
 
+// One snapshot entry: varint numbers followed by length-prefixed strings, which point into the read buffer
+typedef struct ProtocolEntry_st {
+    uint64_t fields[PROTOCOL_ENTRY_FIELDS];
+    int field_count;
+    const char* strs[PROTOCOL_ENTRY_STRS];
+    uint32_t str_lens[PROTOCOL_ENTRY_STRS];
+    int str_count;
+} ProtocolEntry;
+
+// Sends one whole frame elsewhere than the snapshot socket without waiting on the reader, returns the amount of
+// bytes taken. The flags have MSG_MORE set while more frames of the snapshot follow.
+typedef int (*ProtocolWriteFunc)(void* ctx, char* buf, int len, int flags);
+
+// Writer of a snapshot streamed as frames of one buffer each. Legacy clients get a single message of text lines
+// instead, cut short at 'token_max' lines if set. Frames go through 'write' instead of the socket if set.
+typedef struct ProtocolSnapshot_st {
+    int socket;
+    uint64_t deadline_ms;
+    char* buf;
+    int buf_len;
+    int loc;
+    int token_max;
+    uint32_t count;
+    uint32_t seq;
+    unsigned char kind;
+    unsigned char version;
+    unsigned char failed;
+    long sent;
+    ProtocolWriteFunc write;
+    void* write_ctx;
+} ProtocolSnapshot;
+
+// A received snapshot frame, entries are read from 'data' until 'end'
+typedef struct ProtocolSnapshotFrame_st {
+    unsigned char kind;
+    unsigned char flags;
+    uint32_t count;
+    uint32_t seq;
+    const char* data;
+    const char* end;
+} ProtocolSnapshotFrame;
+
+// Buffered reader of whole messages from a stream socket, messages may arrive split or back to back
+typedef struct ProtocolReader_st {
+    int socket;
+    char* buf;
+    int buf_len;
+    int start;
+    int end;
+} ProtocolReader;
+
 /// Allocate a new token stream object.
 ProtocolTokenStream* protocol_tokenstream_alloc(int token_length);
 /// Reset a token stream
 void protocol_tokenstream_reset(ProtocolTokenStream* token_stream);
 /// Add a new token into token stream
 void protocol_tokenstream_add_token(ProtocolTokenStream* token_stream, ProtocolTokenType type, char* value);
-/// Deserialize a byte buffer into a token stream.
+/// Deserialize a whole message from a byte buffer into a token stream, returns 0 if succesful.
 int protocol_buf_to_tokenstream(char* in_buf, int in_buf_len, int in_buf_loc, ProtocolTokenStream* token_stream);
-/// Serialize token stream into a byte buffer.
+/// Serialize token stream into a byte buffer as a whole message in the version of the stream.
+/// Returns the position after the message, or -1 if it does not fit.
 int protocol_tokenstream_to_buf(ProtocolTokenStream* token_stream, char* out_buf, int out_buf_len, int out_buf_loc);
 /// Output token stream into comprised parts.
 int protocol_parse_token_stream(ProtocolTokenStream* token_stream, unsigned char* type, char** args, char** vars);
@@ -55,18 +180,58 @@ int protocol_parse_token_stream(ProtocolTokenStream* token_stream, unsigned char
 int protocol_send(int socket, char* data_buf, int buf_len, ProtocolTokenStream* token_stream);
 /// Read a network message into a protocol token stream, returns 0 if succesful
 int protocol_read(char* data_buf, int buf_len, ProtocolTokenStream* token_stream);
+/// Write a message header into a buffer of at least PROTOCOL_HEADER_MAX bytes, returns the header size
+int protocol_header_put(char* buf, ProtocolHeader* header);
+/// Read a message header of any version from a buffer. Returns 1 if read, 0 if more bytes are needed and -1 if
+/// the header is malformed.
+int protocol_header_get(const char* buf, int len, ProtocolHeader* header);
+/// Start reading messages from a socket into given buffer, which limits the message size
+void protocol_reader_init(ProtocolReader* reader, int socket, char* buf, int buf_len);
+/// Read the next whole message, returns a pointer to it valid until the next call, or NULL if the connection
+/// closed or the message is invalid
+char* protocol_reader_next(ProtocolReader* reader, ProtocolHeader* header);
+/// Write a varint into a buffer of at least PROTOCOL_VARINT_MAX bytes, returns the amount of bytes written
+int protocol_varint_put(char* buf, uint64_t value);
+/// Read a varint from a buffer, returns the amount of bytes read or 0 if it is cut short
+int protocol_varint_get(const char* buf, const char* end, uint64_t* value);
+/// Encode a snapshot entry into a buffer, returns the amount of bytes written or 0 if it does not fit.
+/// Strings past PROTOCOL_STR_MAX are cut short.
+int protocol_entry_put(char* buf, int buf_len, ProtocolEntry* entry);
+/// Decode a snapshot entry from a buffer, returns the amount of bytes read or 0 if the entry is malformed
+int protocol_entry_get(const char* buf, const char* end, ProtocolEntry* entry);
+/// Format a snapshot entry of given kind as a line of text, returns the line length as snprintf does
+int protocol_entry_format(char* buf, size_t len, unsigned char kind, ProtocolEntry* entry);
+/// Get the heading of a snapshot of given kind, or the line shown instead when it has no entries
+const char* protocol_snapshot_title(unsigned char kind, int empty);
+/// Start a snapshot of given kind streamed into a socket in given protocol version, using given buffer for each frame.
+/// Sending every frame of the snapshot may take up to 'timeout_ms' in total.
+void protocol_snapshot_begin(ProtocolSnapshot* snap, int socket, char* buf, int buf_len,
+                             unsigned char kind, unsigned char version, int timeout_ms);
+/// Add an entry into a snapshot, sending the current frame first if the entry does not fit into it.
+/// Entries too large for an empty frame are left out. Returns 0 on success and -1 if sending failed.
+int protocol_snapshot_add(ProtocolSnapshot* snap, ProtocolEntry* entry);
+/// Send the last frame of a snapshot, returns the amount of bytes sent for the whole snapshot or -1 if failed
+long protocol_snapshot_end(ProtocolSnapshot* snap);
+/// Read the header of a snapshot frame from a whole message, returns 0 if succesful
+int protocol_snapshot_frame(char* data_buf, int buf_len, ProtocolSnapshotFrame* frame);
+/// Read the next entry of a snapshot frame, returns 1 if read, 0 at the end of the frame and -1 if malformed
+int protocol_snapshot_next(ProtocolSnapshotFrame* frame, ProtocolEntry* entry);
 
 #ifdef PROTOCOL_IMPL
 
 ProtocolTokenStream*
 protocol_tokenstream_alloc(int token_length) {
-    ProtocolTokenStream* token_stream = (ProtocolTokenStream*)MMALLOC(
-            sizeof(ProtocolTokenStream) + (sizeof(ProtocolToken) * token_length));
+    ProtocolTokenStream* token_stream = (ProtocolTokenStream*)MMALLOC_TAG(
+            sizeof(ProtocolTokenStream) + (sizeof(ProtocolToken) * token_length), PROTOCOL);
     if (!token_stream) return NULL;
 
-    token_stream->length = 0;
-    token_stream->tokens = (ProtocolToken*)((char*)token_stream + sizeof(ProtocolTokenStream));
+    token_stream->length   = 0;
+    token_stream->capacity = token_length;
+    token_stream->version  = PROTOCOL_VERSION;
+    token_stream->tokens   = (ProtocolToken*)((char*)token_stream + sizeof(ProtocolTokenStream));
+#ifndef ALLOC_ZEROED
     memset(token_stream->tokens, 0, sizeof(ProtocolToken) * token_length);
+#endif
 
     return token_stream;
 }
@@ -86,6 +251,76 @@ protocol_tokenstream_add_token(ProtocolTokenStream* token_stream, ProtocolTokenT
     token_stream->length++;
 }
 
+static inline int
+protocol__varint_size(uint64_t value) {
+    int len = 1;
+    while (value >= 0x80) {
+        value >>= 7;
+        len++;
+    }
+    return len;
+}
+
+int
+protocol_header_put(char* buf, ProtocolHeader* header) {
+    int len = 0;
+    buf[len++] = (char)PROTOCOL_MAGIC;
+    buf[len++] = (char)(PROTOCOL_VERSION_BIT | header->version);
+    buf[len++] = (char)header->flags;
+    len += protocol_varint_put(buf + len, header->type);
+    len += protocol_varint_put(buf + len, header->length);
+    header->size = len;
+    return len;
+}
+
+/// Read a header varint, telling a value cut short by the end of the buffer apart from a malformed one
+static inline int
+protocol__header_varint(const char* buf, const char* end, uint32_t* value) {
+    uint64_t result = 0;
+    int len = protocol_varint_get(buf, end, &result);
+    if (len == 0) return end - buf < PROTOCOL_VARINT_MAX ? 0 : -1;
+    if (result > INT32_MAX) return -1;
+    *value = (uint32_t)result;
+    return len;
+}
+
+int
+protocol_header_get(const char* buf, int len, ProtocolHeader* header) {
+    if (len < 2) return 0;
+
+    if ((unsigned char)buf[0] == PROTOCOL_MAGIC && (buf[1] & PROTOCOL_VERSION_BIT)) {
+        if (len < 3) return 0;
+        const char* end = buf + len;
+        int loc = 3;
+        int read = protocol__header_varint(buf + loc, end, &header->type);
+        if (read < 1) return read;
+        loc += read;
+        read = protocol__header_varint(buf + loc, end, &header->length);
+        if (read < 1) return read;
+        loc += read;
+
+        header->version = buf[1] & ~PROTOCOL_VERSION_BIT;
+        header->flags   = buf[2];
+        header->size    = loc;
+        return 1;
+    }
+
+    // Legacy messages carry their whole length, type and token count as native ints
+    if (len < (int)PROTOCOL_LEGACY_HEADER) return 0;
+    int msg_len = 0;
+    int type = 0;
+    memcpy(&msg_len, buf, sizeof(int));
+    memcpy(&type, buf + sizeof(int), sizeof(int));
+    if (msg_len < (int)(PROTOCOL_LEGACY_HEADER + sizeof(int)) || type < 0) return -1;
+
+    header->version = PROTOCOL_VERSION_LEGACY;
+    header->flags   = 0;
+    header->type    = type;
+    header->size    = PROTOCOL_LEGACY_HEADER;
+    header->length  = msg_len - PROTOCOL_LEGACY_HEADER;
+    return 1;
+}
+
 int
 protocol_buf_to_tokenstream(char* in_buf,
                             int in_buf_len,
@@ -94,27 +329,44 @@ protocol_buf_to_tokenstream(char* in_buf,
 {
     if (!in_buf || !token_stream) return -1;
 
-    int stream_type = *(int*)(in_buf + start_loc);
-    int token_len = *(int*)(in_buf + start_loc + sizeof(int));
-    if (token_len < 1) return -1;
+    ProtocolHeader header;
+    if (protocol_header_get(in_buf + start_loc, in_buf_len - start_loc, &header) != 1) return -1;
+    if (header.size + header.length > (uint32_t)(in_buf_len - start_loc)) return -1;
+
+    // Replies go out in the version of the request, a newer one than known is answered in the current version
+    token_stream->version = header.version < PROTOCOL_VERSION ? header.version : PROTOCOL_VERSION;
+    if (header.version > PROTOCOL_VERSION) return -1;
+
+    char* cur = in_buf + start_loc + header.size;
+    char* end = cur + header.length;
+    uint64_t token_len = 0;
+    if (header.version == PROTOCOL_VERSION_LEGACY) {
+        int legacy_len = 0;
+        memcpy(&legacy_len, cur, sizeof(int));
+        if (legacy_len < 0) return -1;
+        token_len = legacy_len;
+        cur += sizeof(int);
+    }
+    else {
+        int read = protocol_varint_get(cur, end, &token_len);
+        if (read == 0) return -1;
+        cur += read;
+    }
+    if (token_len > (uint64_t)token_stream->capacity) return -1;
 
-    token_stream->type = stream_type;
+    token_stream->type = header.type;
     token_stream->length = token_len;
     memset(token_stream->tokens, 0, sizeof(ProtocolToken) * token_len);
 
-    int cur = start_loc + (sizeof(int) * 2);
-
     for (int i = 0; i < token_stream->length; i++) {
-        token_stream->tokens[i].type = *(unsigned char*)(in_buf + cur);
+        if (cur >= end) return -1;
+        token_stream->tokens[i].type = *(unsigned char*)cur;
         cur += sizeof(unsigned char);
 
-        int c = 0;
-        while (in_buf[cur + c] != '\0') {
-            c++;
-        }
-        token_stream->tokens[i].value = in_buf + cur;
-
-        cur += c + 1;
+        char* value_end = memchr(cur, '\0', end - cur);
+        if (!value_end) return -1;
+        token_stream->tokens[i].value = cur;
+        cur = value_end + 1;
     }
 
     return 0;
@@ -128,9 +380,35 @@ protocol_tokenstream_to_buf(ProtocolTokenStream* token_stream,
 {
     if (!out_buf || !token_stream) return -1;
 
-    *(int*)(out_buf + start_loc) = token_stream->type;
-    *(int*)(out_buf + start_loc + sizeof(int)) = token_stream->length;
-    int cur = start_loc + (sizeof(int) * 2);
+    int token_len = 0;
+    int tokens_size = 0;
+    for (int i = 0; i < token_stream->length; i++) {
+        ProtocolToken token = token_stream->tokens[i];
+        if (token.type == PROTOCOL_TOKEN_NONE || !token.value) continue;
+        tokens_size += sizeof(unsigned char) + strlen(token.value) + 1;
+        token_len++;
+    }
+
+    int cur = start_loc;
+    if (token_stream->version == PROTOCOL_VERSION_LEGACY) {
+        int msg_len = PROTOCOL_LEGACY_HEADER + sizeof(int) + tokens_size;
+        if (start_loc + msg_len > out_buf_len) return -1;
+        int type = token_stream->type;
+        memcpy(out_buf + cur, &msg_len, sizeof(int));
+        memcpy(out_buf + cur + sizeof(int), &type, sizeof(int));
+        memcpy(out_buf + cur + sizeof(int) * 2, &token_len, sizeof(int));
+        cur += sizeof(int) * 3;
+    }
+    else {
+        ProtocolHeader header = {
+            .version = token_stream->version,
+            .type    = token_stream->type,
+            .length  = protocol__varint_size(token_len) + tokens_size,
+        };
+        if (start_loc + PROTOCOL_HEADER_MAX + (int)header.length > out_buf_len) return -1;
+        cur += protocol_header_put(out_buf + cur, &header);
+        cur += protocol_varint_put(out_buf + cur, token_len);
+    }
 
     for (int i = 0; i < token_stream->length; i++) {
         ProtocolToken token = token_stream->tokens[i];
@@ -175,26 +453,18 @@ int protocol_parse_token_stream(ProtocolTokenStream* token_stream, unsigned char
 
 int
 protocol_send(int socket, char* data_buf, int buf_len, ProtocolTokenStream* token_stream) {
-    int length = protocol_tokenstream_to_buf(token_stream, data_buf, buf_len, sizeof(int));
+    int length = protocol_tokenstream_to_buf(token_stream, data_buf, buf_len, 0);
     if (length < 1) {
         fprintf(stderr, "Failed to serialize protocol token stream into a buffer\n");
         return -1;
     }
 
-    length += sizeof(int);
-    *((int*)data_buf) = length;
-
     return socket_send(socket, data_buf, length);
 }
 
 int
 protocol_read(char* data_buf, int buf_len, ProtocolTokenStream* token_stream) {
-    int msg_len = *((int*)data_buf);
-    if (protocol_buf_to_tokenstream(data_buf,
-                                    msg_len - sizeof(int),
-                                    sizeof(int),
-                                    token_stream) != 0)
-    {
+    if (protocol_buf_to_tokenstream(data_buf, buf_len, 0, token_stream) != 0) {
         fprintf(stderr, "Failed to deserialize buffer into a protocol token stream\n");
         return -1;
     }
@@ -202,6 +472,371 @@ protocol_read(char* data_buf, int buf_len, ProtocolTokenStream* token_stream) {
     return 0;
 }
 
+void
+protocol_reader_init(ProtocolReader* reader, int socket, char* buf, int buf_len) {
+    *reader = (ProtocolReader){
+        .socket = socket,
+        .buf = buf,
+        .buf_len = buf_len,
+    };
+}
+
+char*
+protocol_reader_next(ProtocolReader* reader, ProtocolHeader* header) {
+    while (1) {
+        int available = reader->end - reader->start;
+        int status = protocol_header_get(reader->buf + reader->start, available, header);
+        if (status < 0) return NULL;
+        if (status > 0) {
+            uint32_t msg_len = header->size + header->length;
+            if (msg_len > (uint32_t)reader->buf_len) return NULL;
+            if (msg_len <= (uint32_t)available) {
+                char* msg = reader->buf + reader->start;
+                reader->start += msg_len;
+                return msg;
+            }
+        }
+
+        // Move the partial message to the front to make room for the rest of it
+        if (reader->start > 0) {
+            memmove(reader->buf, reader->buf + reader->start, available);
+            reader->start = 0;
+            reader->end = available;
+        }
+        if (reader->end >= reader->buf_len) return NULL;
+
+        int value_read = read(reader->socket, reader->buf + reader->end, reader->buf_len - reader->end);
+        if (value_read < 0 && errno == EINTR) continue;
+        if (value_read < 1) return NULL;
+        reader->end += value_read;
+    }
+}
+
+/*****************************************************
+ * SNAPSHOTS
+ ****************************************************/
+
+int
+protocol_varint_put(char* buf, uint64_t value) {
+    int len = 0;
+    while (value >= 0x80) {
+        buf[len++] = (char)(value | 0x80);
+        value >>= 7;
+    }
+    buf[len++] = (char)value;
+    return len;
+}
+
+int
+protocol_varint_get(const char* buf, const char* end, uint64_t* value) {
+    uint64_t result = 0;
+    for (int i = 0; i < PROTOCOL_VARINT_MAX && buf + i < end; i++) {
+        unsigned char byte = (unsigned char)buf[i];
+        result |= (uint64_t)(byte & 0x7f) << (7 * i);
+        if (!(byte & 0x80)) {
+            *value = result;
+            return i + 1;
+        }
+    }
+    return 0;
+}
+
+int
+protocol_entry_put(char* buf, int buf_len, ProtocolEntry* entry) {
+    int field_count = entry->field_count < PROTOCOL_ENTRY_FIELDS ? entry->field_count : PROTOCOL_ENTRY_FIELDS;
+    int str_count = entry->str_count < PROTOCOL_ENTRY_STRS ? entry->str_count : PROTOCOL_ENTRY_STRS;
+
+    // Checked against the widest varint, so small values never have to be measured first
+    int loc = 0;
+    if (buf_len < PROTOCOL_VARINT_MAX * (field_count + 1)) return 0;
+    loc += protocol_varint_put(buf + loc, field_count);
+    for (int i = 0; i < field_count; i++) {
+        loc += protocol_varint_put(buf + loc, entry->fields[i]);
+    }
+
+    if (buf_len - loc < PROTOCOL_VARINT_MAX) return 0;
+    loc += protocol_varint_put(buf + loc, str_count);
+    for (int i = 0; i < str_count; i++) {
+        uint32_t len = entry->str_lens[i] < PROTOCOL_STR_MAX ? entry->str_lens[i] : PROTOCOL_STR_MAX;
+        if (buf_len - loc < (int)(PROTOCOL_VARINT_MAX + len)) return 0;
+        loc += protocol_varint_put(buf + loc, len);
+        if (len > 0) memcpy(buf + loc, entry->strs[i], len);
+        loc += len;
+    }
+    return loc;
+}
+
+int
+protocol_entry_get(const char* buf, const char* end, ProtocolEntry* entry) {
+    const char* cur = buf;
+    uint64_t count = 0;
+    int len = protocol_varint_get(cur, end, &count);
+    if (len == 0) return 0;
+    cur += len;
+
+    // Fields and strings from newer writers are skipped over
+    memset(entry->fields, 0, sizeof(entry->fields));
+    entry->field_count = count < PROTOCOL_ENTRY_FIELDS ? (int)count : PROTOCOL_ENTRY_FIELDS;
+    for (uint64_t i = 0; i < count; i++) {
+        uint64_t value = 0;
+        len = protocol_varint_get(cur, end, &value);
+        if (len == 0) return 0;
+        if (i < PROTOCOL_ENTRY_FIELDS) entry->fields[i] = value;
+        cur += len;
+    }
+
+    len = protocol_varint_get(cur, end, &count);
+    if (len == 0) return 0;
+    cur += len;
+    entry->str_count = count < PROTOCOL_ENTRY_STRS ? (int)count : PROTOCOL_ENTRY_STRS;
+    for (int i = 0; i < PROTOCOL_ENTRY_STRS; i++) {
+        entry->strs[i] = "";
+        entry->str_lens[i] = 0;
+    }
+    for (uint64_t i = 0; i < count; i++) {
+        uint64_t str_len = 0;
+        len = protocol_varint_get(cur, end, &str_len);
+        if (len == 0 || str_len > (uint64_t)(end - cur - len)) return 0;
+        cur += len;
+        if (i < PROTOCOL_ENTRY_STRS) {
+            entry->strs[i] = cur;
+            entry->str_lens[i] = (uint32_t)str_len;
+        }
+        cur += str_len;
+    }
+    return cur - buf;
+}
+
+static const char* __protocol_snapshot_titles[__PROTOCOL_SNAPSHOT_COUNT][2] = {
+    { "Finished tasks",            "No finished tasks in history" },
+    { "Running processes",         "No running processes" },
+    { "Tasks in active workspace", "No tasks in active workspace" },
+};
+
+const char*
+protocol_snapshot_title(unsigned char kind, int empty) {
+    if (kind >= __PROTOCOL_SNAPSHOT_COUNT) return "";
+    return __protocol_snapshot_titles[kind][empty ? 1 : 0];
+}
+
+int
+protocol_entry_format(char* buf, size_t len, unsigned char kind, ProtocolEntry* entry) {
+    uint64_t* f = entry->fields;
+    int name_len = entry->str_lens[0];
+    const char* name = entry->strs[0];
+
+    switch (kind) {
+        case PROTOCOL_SNAPSHOT_TASKS: {
+            int status = (int)f[PROTOCOL_TASK_STATUS];
+            char status_buf[20];
+            if (WIFSIGNALED(status)) snprintf(status_buf, sizeof(status_buf), "signal %d", WTERMSIG(status));
+            else snprintf(status_buf, sizeof(status_buf), "exit %d", WEXITSTATUS(status));
+
+            int written = snprintf(buf, len,
+                            "%.*s pid=%d %s wall=%.3fs user=%.3fs sys=%.3fs maxrss=%lluKB csw=%llu/%llu io=%llu/%llu",
+                            name_len, name,
+                            (int)f[PROTOCOL_TASK_PID],
+                            status_buf,
+                            f[PROTOCOL_TASK_WALL_MS] / 1000.0,
+                            f[PROTOCOL_TASK_UTIME_US] / 1000000.0,
+                            f[PROTOCOL_TASK_STIME_US] / 1000000.0,
+                            (unsigned long long)f[PROTOCOL_TASK_MAXRSS_KB],
+                            (unsigned long long)f[PROTOCOL_TASK_NVCSW],
+                            (unsigned long long)f[PROTOCOL_TASK_NIVCSW],
+                            (unsigned long long)f[PROTOCOL_TASK_INBLOCK],
+                            (unsigned long long)f[PROTOCOL_TASK_OUBLOCK]);
+
+            // Cgroup accounting also covers descendants that outlived the task's main process
+            if (f[PROTOCOL_TASK_CG_CPU_USEC] > 0 && written > 0 && (size_t)written < len) {
+                written += snprintf(buf + written, len - written,
+                                    " cg_cpu=%.3fs cg_mem_peak=%lluKB",
+                                    f[PROTOCOL_TASK_CG_CPU_USEC] / 1000000.0,
+                                    (unsigned long long)(f[PROTOCOL_TASK_CG_MEM_PEAK] / 1024));
+            }
+            return written;
+        }
+
+        case PROTOCOL_SNAPSHOT_PROCS:
+            return snprintf(buf, len, "%.*s pid=%d running=%.3fs",
+                            name_len, name, (int)f[PROTOCOL_PROC_PID], f[PROTOCOL_PROC_RUNNING_MS] / 1000.0);
+
+        case PROTOCOL_SNAPSHOT_WORKSPACE: {
+            // Only the first line of a multi-line command, the rest is elided
+            const char* cmd = entry->strs[1];
+            const char* cmd_end = memchr(cmd, '\n', entry->str_lens[1]);
+            int cmd_len = cmd_end ? cmd_end - cmd : (int)entry->str_lens[1];
+            return snprintf(buf, len, "%.*s: %.*s%s", name_len, name, cmd_len, cmd, cmd_end ? " ..." : "");
+        }
+    }
+    return snprintf(buf, len, "%.*s", name_len, name);
+}
+
+/// Append a text line token into a legacy snapshot message, returns 0 if it fit
+static int
+protocol__snapshot_line(ProtocolSnapshot* snap, const char* line, int line_len) {
+    if (line_len < 0 || snap->loc + line_len + 2 > snap->buf_len) return -1;
+    snap->buf[snap->loc] = PROTOCOL_TOKEN_ARG;
+    memcpy(snap->buf + snap->loc + 1, line, line_len);
+    snap->buf[snap->loc + 1 + line_len] = '\0';
+    snap->loc += line_len + 2;
+    return 0;
+}
+
+void
+protocol_snapshot_begin(ProtocolSnapshot* snap, int socket, char* buf, int buf_len,
+                        unsigned char kind, unsigned char version, int timeout_ms)
+{
+    *snap = (ProtocolSnapshot){
+        .socket = socket,
+        .deadline_ms = socket_now_ms() + timeout_ms,
+        .buf = buf,
+        .buf_len = buf_len,
+        .loc = PROTOCOL_HEADER_MAX + PROTOCOL_SNAPSHOT_PREFIX,
+        .kind = kind,
+        .version = version,
+    };
+
+    // Legacy clients get the heading and one line per entry as a single message
+    if (version == PROTOCOL_VERSION_LEGACY) {
+        const char* title = protocol_snapshot_title(kind, 0);
+        snap->loc = PROTOCOL_LEGACY_HEADER + sizeof(int);
+        protocol__snapshot_line(snap, title, strlen(title));
+    }
+}
+
+static int
+protocol__snapshot_flush(ProtocolSnapshot* snap, unsigned char flags) {
+    int start = 0;
+    if (snap->version == PROTOCOL_VERSION_LEGACY) {
+        int type = PROTOCOL_MSG_SUCCESS;
+        int token_len = snap->count + 1;
+        memcpy(snap->buf, &snap->loc, sizeof(int));
+        memcpy(snap->buf + sizeof(int), &type, sizeof(int));
+        memcpy(snap->buf + sizeof(int) * 2, &token_len, sizeof(int));
+    }
+    else {
+        char head[PROTOCOL_HEADER_MAX + PROTOCOL_SNAPSHOT_PREFIX];
+        char prefix[PROTOCOL_SNAPSHOT_PREFIX];
+        int prefix_len = 0;
+        int data = PROTOCOL_HEADER_MAX + PROTOCOL_SNAPSHOT_PREFIX;
+        prefix[prefix_len++] = snap->kind;
+        prefix_len += protocol_varint_put(prefix + prefix_len, snap->seq);
+        prefix_len += protocol_varint_put(prefix + prefix_len, snap->count);
+
+        // The header size depends on the frame length, so it is put right before the entries once they are in
+        ProtocolHeader header = {
+            .version = snap->version,
+            .flags   = flags,
+            .type    = PROTOCOL_MSG_SNAPSHOT,
+            .length  = prefix_len + snap->loc - data,
+        };
+        int head_len = protocol_header_put(head, &header);
+        memcpy(head + head_len, prefix, prefix_len);
+        head_len += prefix_len;
+        start = data - head_len;
+        memcpy(snap->buf + start, head, head_len);
+    }
+
+    // More frames follow right away, so let the kernel pack them into full segments. The whole snapshot shares
+    // one deadline, each frame only gets what is left of it.
+    int frame_len = snap->loc - start;
+    int send_flags = flags & PROTOCOL_FLAG_LAST ? 0 : MSG_MORE;
+    int sent;
+    if (snap->write) {
+        sent = snap->write(snap->write_ctx, snap->buf + start, frame_len, send_flags);
+    }
+    else {
+        uint64_t now_ms = socket_now_ms();
+        int timeout_ms = now_ms < snap->deadline_ms ? (int)(snap->deadline_ms - now_ms) : 0;
+        sent = socket_send_wait(snap->socket, snap->buf + start, frame_len, send_flags, timeout_ms);
+    }
+    if (sent != frame_len) {
+        snap->failed = 1;
+        return -1;
+    }
+
+    snap->sent += sent;
+    snap->seq++;
+    snap->count = 0;
+    snap->loc = PROTOCOL_HEADER_MAX + PROTOCOL_SNAPSHOT_PREFIX;
+    return 0;
+}
+
+int
+protocol_snapshot_add(ProtocolSnapshot* snap, ProtocolEntry* entry) {
+    if (snap->failed) return -1;
+
+    // Lines past what fits into one legacy message are left out, as they always were
+    if (snap->version == PROTOCOL_VERSION_LEGACY) {
+        if (snap->token_max > 0 && (int)snap->count + 1 >= snap->token_max) return 0;
+        char line[PROTOCOL_STR_MAX * 2 + 128];
+        int line_len = protocol_entry_format(line, sizeof(line), snap->kind, entry);
+        if (line_len >= (int)sizeof(line)) line_len = sizeof(line) - 1;
+        if (protocol__snapshot_line(snap, line, line_len) == 0) snap->count++;
+        return 0;
+    }
+
+    int len = protocol_entry_put(snap->buf + snap->loc, snap->buf_len - snap->loc, entry);
+    if (len == 0) {
+        if (snap->count == 0) return 0;
+        if (protocol__snapshot_flush(snap, 0) != 0) return -1;
+        len = protocol_entry_put(snap->buf + snap->loc, snap->buf_len - snap->loc, entry);
+        if (len == 0) return 0;
+    }
+    snap->loc += len;
+    snap->count++;
+    return 0;
+}
+
+long
+protocol_snapshot_end(ProtocolSnapshot* snap) {
+    if (snap->failed) return -1;
+    if (snap->version == PROTOCOL_VERSION_LEGACY && snap->count == 0) {
+        const char* empty = protocol_snapshot_title(snap->kind, 1);
+        snap->loc = PROTOCOL_LEGACY_HEADER + sizeof(int);
+        protocol__snapshot_line(snap, empty, strlen(empty));
+    }
+    if (protocol__snapshot_flush(snap, PROTOCOL_FLAG_LAST) != 0) return -1;
+    return snap->sent;
+}
+
+int
+protocol_snapshot_frame(char* data_buf, int buf_len, ProtocolSnapshotFrame* frame) {
+    ProtocolHeader header;
+    if (protocol_header_get(data_buf, buf_len, &header) != 1) return -1;
+    if (header.type != PROTOCOL_MSG_SNAPSHOT || header.version == PROTOCOL_VERSION_LEGACY) return -1;
+    if (header.size + header.length > (uint32_t)buf_len || header.length < 1) return -1;
+
+    const char* cur = data_buf + header.size;
+    const char* end = cur + header.length;
+    uint64_t seq = 0;
+    uint64_t count = 0;
+    frame->kind  = *(unsigned char*)cur++;
+    frame->flags = header.flags;
+
+    int read = protocol_varint_get(cur, end, &seq);
+    if (read == 0) return -1;
+    cur += read;
+    read = protocol_varint_get(cur, end, &count);
+    if (read == 0) return -1;
+    cur += read;
+
+    frame->seq   = (uint32_t)seq;
+    frame->count = (uint32_t)count;
+    frame->data  = cur;
+    frame->end   = end;
+    return 0;
+}
+
+int
+protocol_snapshot_next(ProtocolSnapshotFrame* frame, ProtocolEntry* entry) {
+    if (frame->data >= frame->end) return 0;
+    int len = protocol_entry_get(frame->data, frame->end, entry);
+    if (len == 0) return -1;
+    frame->data += len;
+    return 1;
+}
+
 #endif
 
 #endif
@@ -2,9 +2,12 @@
 #define DPATCH_SERVER_H
 
 #include <errno.h>
+#include <signal.h>
 #include <unistd.h>
 #include <wait.h>
 #include <time.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
 #include "arena.h"
 #include "net.h"
 #define STORE_IMPL
@@ -15,73 +18,337 @@
 #include "ini.h"
 #define PROTOCOL_IMPL
 #include "protocol.h"
+#define TIMER_IMPL
+#include "timer.h"
+#define CGROUP_IMPL
+#include "cgroup.h"
+#define AFFINITY_IMPL
+#include "affinity.h"
+#define STRHEAP_IMPL
+#include "strheap.h"
+#define SPILL_IMPL
+#include "spill.h"
+#define METRICS_IMPL
+#include "metrics.h"
+#define TRACE_IMPL
+#include "trace.h"
+#define SHM_IMPL
+#include "shm.h"
 #include "log.h"
 
-#define FMT_SERVER(fmt, ...) "[server] " fmt, ##__VA_ARGS__
-#define FMT_TARGET(target, fmt, ...) "[%s] " fmt, target, ##__VA_ARGS__
+#define FMT_SERVER(fmt, ...) LOG_CTX(LOG_COMP_SERVER, NULL, 0, LOG_STREAM_NONE), fmt, ##__VA_ARGS__
+#define FMT_TARGET(target, fmt, ...) LOG_CTX(LOG_COMP_TASK, target, 0, LOG_STREAM_NONE), fmt, ##__VA_ARGS__
+#define FMT_TASK(name, fmt, ...) LOG_CTX(LOG_COMP_SERVER, name, 0, LOG_STREAM_NONE), fmt, ##__VA_ARGS__
+#define FMT_PROCESS(process, fmt, ...) \
+    LOG_CTX(LOG_COMP_SERVER, (process)->task_name, (process)->pid, LOG_STREAM_NONE), fmt, ##__VA_ARGS__
+#define FMT_OUTPUT(process, stream, fmt, ...) \
+    LOG_CTX(LOG_COMP_TASK, (process)->task_name, (process)->pid, stream), fmt, ##__VA_ARGS__
+
+// Requests taken from one channel per loop iteration, so a busy client can not starve the rest of the loop
+#define SERVER_CHANNEL_BATCH 64
+// Metrics scrapes waiting for their request at once, matches the listen backlog of the metrics socket
+#define SERVER_SCRAPE_MAX 16
+// Snapshots a socket client could not take at once, and the bytes each of them may hold back
+#define SERVER_OUTBOX_MAX 16
+#define SERVER_OUTBOX_SIZE (4 * 1024 * 1024)
+// Wait on a client for a snapshot when every outbox is taken, far below the socket timeout
+#define SERVER_SNAPSHOT_WAIT_MS 50
 
 #define SERVER_RESPOND_FMT(server, config, packet, type, fmt, ...) {\
-    char buf[config->settings.connection.buffer_size];\
-    snprintf(buf, config->settings.connection.buffer_size, fmt, ##__VA_ARGS__);\
-    server_respond(server, config, packet, type, buf);\
+    char* buf = arena_child_alloc((server)->scratch, config->settings.connection.buffer_size);\
+    if (buf) snprintf(buf, config->settings.connection.buffer_size, fmt, ##__VA_ARGS__);\
+    server_respond(server, config, packet, buf ? type : PROTOCOL_MSG_ERR, buf ? buf : "Internal error");\
 }
 
-typedef struct Task_st {
-    int buf_loc;
-    int var_count;
-    char* cmd;
-    char* dir;
-    char* wait;
-    char* name;
+// A string inside a task record, offset 0 means the field is not set
+typedef struct TaskField_st {
+    uint32_t offset;
+    uint32_t length;
+} TaskField;
+
+// Queued task as one variable-length block: this header, the env var fields and then the strings
+typedef struct TaskRecord_st {
+    struct TaskRecord_st* next;
+    uint32_t size;
+    uint32_t var_count;
+    uint32_t trace_id;
+    uint64_t queued_us;
+    long timeout_ms;
+    int numa_node;
+    TaskField name;
+    TaskField cmd;
+    TaskField dir;
+    TaskField wait;
+    TaskField cpu_weight;
+    TaskField memory_max;
+    TaskField pids_max;
+    TaskField cpus;
+    TaskField vars[];
+} TaskRecord;
+
+#define TASK_STR(task, field) ((task)->field.offset ? (char*)(task) + (task)->field.offset : NULL)
+
+// Growable scratch space a task is parsed into before it is packed into a record of its exact size
+typedef struct TaskBuilder_st {
+    TaskRecord task;
+    unsigned char failed;
+    uint32_t buf_len;
+    uint32_t buf_cap;
+    uint32_t vars_cap;
     char* buf;
-    char** vars;
-} Task;
-
+    TaskField* vars;
+} TaskBuilder;
+
+typedef enum {
+    KILLSTAGE_NONE,
+    KILLSTAGE_TERM,
+    KILLSTAGE_KILL,
+} KillStage;
+
+// Kept as one record per process rather than split into arrays per field: every loop iteration reads the
+// descriptors, pid and timestamps of each process together, so a split would touch as many cache lines. Only
+// the name and unfinished output lines, which scans never need, live outside the record in the string heap.
 typedef struct TaskProcess_st {
-    time_t start_time;
+    uint64_t start_ms;
+    uint64_t spawn_us;
+    uint64_t exit_us;
     pid_t pid;
-    char* task_name;
     int out_fd_r;
     int err_fd_r;
+    int exec_fd_r;
+    int pid_fd;
+    int timer_id;
+    unsigned int cgroup_id;
+    uint32_t trace_id;
+    unsigned char kill_stage;
+    unsigned char output_seen;
+    char* task_name;
+    // Output after the last line break of each stream, stdout first and stderr after it, allocated once needed
+    char* line_buf;
+    uint16_t line_len[2];
 } TaskProcess;
 
+DEFINE_STORE(proc_store, TaskProcess)
+DEFINE_STACK(socket_stack, int)
+
+typedef struct TaskUsage_st {
+    pid_t pid;
+    int status;
+    uint64_t wall_ms;
+    uint64_t utime_us;
+    uint64_t stime_us;
+    long maxrss_kb;
+    long nvcsw;
+    long nivcsw;
+    long inblock;
+    long oublock;
+    uint64_t cg_cpu_usec;
+    uint64_t cg_mem_peak;
+    char* task_name;
+} TaskUsage;
+
+typedef struct TaskHistory_st {
+    int capacity;
+    int head;
+    int count;
+    size_t item_size;
+    size_t name_size;
+    char* data;
+} TaskHistory;
+
+// A request from a socket client, or from a shared memory channel if 'channel' is set
 typedef struct ClientPacket_st {
     int socket;
     int client;
     int len;
     char* data;
+    ShmChannel* channel;
 } ClientPacket;
 
+// Lets a program embedding the agent see task output and exits, which the agent itself only logs
+typedef struct ServerHooks_st {
+    void (*output)(void* ctx, TaskProcess* process, LogStream stream, const char* line, int len);
+    void (*exit)(void* ctx, TaskProcess* process, int status);
+    void* ctx;
+} ServerHooks;
+
+typedef enum {
+    SUBMIT_STARTED,
+    SUBMIT_QUEUED,
+    SUBMIT_NOT_FOUND,
+    SUBMIT_REJECTED,
+    SUBMIT_FAILED,
+} SubmitStatus;
+
+// The rest of a snapshot a socket client has not read yet, sent from the loop as its socket becomes writable.
+// The buffer is mapped on first use, so only slow clients take up memory.
+typedef struct ServerOutbox_st {
+    int socket;
+    char* buf;
+    uint32_t len;
+    uint32_t sent;
+    uint64_t deadline_ms;
+} ServerOutbox;
+
 typedef struct Server_st {
     unsigned char running;
     Connection conn;
     char* workspace;
     ProtocolTokenStream* token_stream;
-    Stack* client_stack;
-    Stack* process_stack;
-    Stack* task_stack;
-    Store* process_store;
-    Store* task_store;
+    Arena* scratch;
+    socket_stack* client_stack;
+    proc_store* process_store;
+    TaskRecord* queue_head;
+    TaskRecord* queue_tail;
+    int queue_count;
+    int queue_max;
+    Spill* spill;
+    int metrics_socket;
+    int scrape_count;
+    int scrape_sockets[SERVER_SCRAPE_MAX];
+    uint64_t scrape_deadline_ms[SERVER_SCRAPE_MAX];
+    int outbox_count;
+    ServerOutbox outboxes[SERVER_OUTBOX_MAX];
+    int local_socket;
+    char* local_path;
+    ShmChannel* channels;
+    int channel_count;
+    uint32_t request_count;
+    uint32_t task_seq;
+    StrHeap* strings;
+    TaskBuilder builder;
+    TimerWheel* timers;
+    TaskHistory* history;
+    long kill_grace_ms;
+    char* cgroup_root;
+    unsigned int cgroup_seq;
+    PlacementPolicy placement;
+    unsigned int placement_next;
+    int node_count;
+    cpu_set_t agent_cpus;
+    ServerHooks hooks;
 } Server;
 
+// Set by the signal handlers of the agent to the signal asking it to stop, the loop finishes its iteration and
+// leaves, so shutdown never runs inside a handler
+volatile sig_atomic_t __server_stop = 0;
+
 /*****************************************************
  * NETWORK & IO
  ****************************************************/
 
+/// Write a whole message into the response ring of a channel. If the ring is full the message is parked until the
+/// client makes room, the agent never waits on a client. While MSG_MORE is set the client is only woken up once a
+/// frame had to be parked. Returns the amount of bytes written or -1 if failed.
+static int
+server_channel_write(void* ctx, char* buf, int len, int flags) {
+    ShmChannel* channel = ctx;
+    if (shm_channel_reply(channel, buf, len) != 0) return -1;
+
+    if ((flags & MSG_MORE) && channel->parked_len == 0) return len;
+    shm_notify(&channel->responses->consumer_sleeping, channel->client_fd);
+    return len;
+}
+
+/// Send a snapshot frame to a socket client without waiting on it. What the socket does not take right away is
+/// kept in the outbox of the client, and later frames queue behind it. Returns the amount of bytes taken or -1.
+static int
+server_socket_write(void* ctx, char* buf, int len, int flags) {
+    ServerOutbox* outbox = ctx;
+    int sent = 0;
+    if (outbox->len == 0) {
+        sent = send(outbox->socket, buf, len, flags | MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (sent == len) return len;
+        if (sent < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) return -1;
+            sent = 0;
+        }
+    }
+
+    if (!outbox->buf) {
+        char* buf = mmap(NULL, SERVER_OUTBOX_SIZE, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (buf == MAP_FAILED) return -1;
+        outbox->buf = buf;
+    }
+    if (outbox->len + (len - sent) > SERVER_OUTBOX_SIZE) return -1;
+    memcpy(outbox->buf + outbox->len, buf + sent, len - sent);
+    outbox->len += len - sent;
+    return len;
+}
+
+static inline void
+server_outbox_clear(ServerOutbox* outbox) {
+    if (outbox->buf) munmap(outbox->buf, SERVER_OUTBOX_SIZE);
+    outbox->buf  = NULL;
+    outbox->len  = 0;
+    outbox->sent = 0;
+}
+
+/// Send what the outboxes hold to the clients that are writable. An outbox closes its socket once sent, or when
+/// the client has not read it all within the socket timeout.
+static void
+server_handle_outboxes(Server* server) {
+    uint64_t now_ms = timer_now_ms();
+    for (int i = server->outbox_count - 1; i >= 0; i--) {
+        ServerOutbox* outbox = &server->outboxes[i];
+        if (FD_ISSET(outbox->socket, &server->conn.write_flags)) {
+            int sent = send(outbox->socket, outbox->buf + outbox->sent, outbox->len - outbox->sent,
+                            MSG_DONTWAIT | MSG_NOSIGNAL);
+            if (sent > 0) outbox->sent += sent;
+            else if (sent < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) outbox->deadline_ms = 0;
+        }
+        if (outbox->sent < outbox->len && now_ms < outbox->deadline_ms) continue;
+
+        if (outbox->sent < outbox->len) {
+            LOG_WARN(FMT_SERVER("Dropped snapshot to socket '%d' with %u bytes unsent",
+                                outbox->socket, outbox->len - outbox->sent));
+        }
+        close(outbox->socket);
+        server_outbox_clear(outbox);
+        server->outbox_count--;
+        if (i != server->outbox_count) {
+            *outbox = server->outboxes[server->outbox_count];
+            server->outboxes[server->outbox_count].buf = NULL;
+        }
+    }
+}
+
+/// Send the token stream of the server to the client of a packet, through its socket or its channel
+static int
+server_packet_send(Server* server, Config* config, ClientPacket* packet) {
+    if (!packet->channel) {
+        return protocol_send(packet->socket,
+                             server->conn.out_buf,
+                             config->settings.connection.buffer_size,
+                             server->token_stream);
+    }
+
+    int len = protocol_tokenstream_to_buf(server->token_stream, server->conn.out_buf,
+                                          config->settings.connection.buffer_size, 0);
+    if (len < 1) return -1;
+    return server_channel_write(packet->channel, server->conn.out_buf, len, 0);
+}
+
+/// Finish with the client of a packet. Socket clients get a connection per request, channels stay open.
+static void
+server_packet_done(Server* server, ClientPacket* packet) {
+    if (packet->channel) return;
+    close(packet->socket);
+    socket_stack_remove_at_fast(server->client_stack, packet->client);
+}
+
 static int
 server_send(Server* server,
             Config* config,
-            int client_sock,
+            ClientPacket* packet,
             ProtocolMsgType type,
             char* buf)
 {
     server->token_stream->type = type;
     protocol_tokenstream_reset(server->token_stream);
     protocol_tokenstream_add_token(server->token_stream, PROTOCOL_TOKEN_ARG, buf);
-    return protocol_send(client_sock,
-                         server->conn.out_buf,
-                         config->settings.connection.buffer_size,
-                         server->token_stream);
+    return server_packet_send(server, config, packet);
 }
 
 static int
@@ -91,9 +358,8 @@ server_respond(Server* server,
                ProtocolMsgType msg_type,
                char* msg)
 {
-    int sent = server_send(server, config, packet->socket, msg_type, msg);
-    close(packet->socket);
-    stack_remove_at_fast(server->client_stack, packet->client);
+    int sent = server_send(server, config, packet, msg_type, msg);
+    server_packet_done(server, packet);
     if (sent < 1) {
         LOG_WARN(FMT_SERVER("Failed to send response to socket '%d'", packet->socket));
         return -1;
@@ -101,41 +367,176 @@ server_respond(Server* server,
     return sent;
 }
 
+/*****************************************************
+ * ACCOUNTING
+ ****************************************************/
+
+#define HISTORY_ITEM(history, idx) ((TaskUsage*)((history)->data + ((idx) * (history)->item_size)))
+#define TIMEVAL_US(tv) ((uint64_t)(tv).tv_sec * 1000000 + (uint64_t)(tv).tv_usec)
+
+static TaskHistory*
+task_history_new(int capacity, size_t name_size) {
+    size_t item_size = sizeof(TaskUsage) + sizeof(char) * name_size;
+    TaskHistory* history = MMALLOC_TAG(sizeof(TaskHistory) + item_size * capacity, SERVER);
+    if (!history) return NULL;
+
+    history->capacity  = capacity;
+    history->head      = 0;
+    history->count     = 0;
+    history->item_size = item_size;
+    history->name_size = name_size;
+    history->data      = (char*)(history + 1);
+    return history;
+}
+
+/// Record a new entry into history, overwriting the oldest one when full
+static TaskUsage*
+task_history_push(TaskHistory* history, char* task_name) {
+    if (!history || history->capacity < 1) return NULL;
+
+    TaskUsage* usage = HISTORY_ITEM(history, history->head);
+    memset(usage, 0, history->item_size);
+    usage->task_name = (char*)(usage + 1);
+    strncpy(usage->task_name, task_name, history->name_size - 1);
+
+    history->head = (history->head + 1) % history->capacity;
+    if (history->count < history->capacity) history->count++;
+    return usage;
+}
+
+/// Get an entry from history, where index 0 is the most recent one
+static TaskUsage*
+task_history_get(TaskHistory* history, int idx) {
+    if (!history || idx < 0 || idx >= history->count) return NULL;
+    int loc = (history->head - 1 - idx + history->capacity) % history->capacity;
+    return HISTORY_ITEM(history, loc);
+}
+
+static void
+task_usage_record(TaskUsage* usage, TaskProcess* process, int status, struct rusage* ru, uint64_t now_ms) {
+    usage->pid       = process->pid;
+    usage->status    = status;
+    usage->wall_ms   = now_ms - process->start_ms;
+    usage->utime_us  = TIMEVAL_US(ru->ru_utime);
+    usage->stime_us  = TIMEVAL_US(ru->ru_stime);
+    usage->maxrss_kb = ru->ru_maxrss;
+    usage->nvcsw     = ru->ru_nvcsw;
+    usage->nivcsw    = ru->ru_nivcsw;
+    usage->inblock   = ru->ru_inblock;
+    usage->oublock   = ru->ru_oublock;
+}
+
+static int
+task_status_format(char* buf, size_t len, int status) {
+    if (WIFSIGNALED(status)) return snprintf(buf, len, "signal %d", WTERMSIG(status));
+    return snprintf(buf, len, "exit %d", WEXITSTATUS(status));
+}
+
 /*****************************************************
  * TASKS & WORKSPACES
  ****************************************************/
 
-static char*
-task_write(Task* task, char* value, char end_char) {
-    int len = strlen(value);
-    char* ptr = task->buf + task->buf_loc;
-    memcpy(ptr, value, len);
+/// Grow a builder buffer from the string heap to fit at least given amount of items, returns 0 on success
+static int
+task_builder_grow(StrHeap* heap, void** buf, uint32_t* cap, uint32_t need, size_t item_size) {
+    if (need <= *cap) return 0;
+    uint32_t new_cap = *cap > 0 ? *cap : 16;
+    while (new_cap < need) new_cap *= 2;
+
+    void* new_buf = strheap_alloc(heap, new_cap * item_size);
+    if (!new_buf) return -1;
+    if (*buf) {
+        memcpy(new_buf, *buf, *cap * item_size);
+        strheap_free(heap, *buf);
+    }
+    *buf = new_buf;
+    *cap = new_cap;
+    return 0;
+}
+
+/// Append a string into the builder, returns its field or an unset field if the builder could not grow
+static TaskField
+task_write(StrHeap* heap, TaskBuilder* builder, char* value, char end_char) {
+    uint32_t len = strlen(value);
+    if (task_builder_grow(heap, (void**)&builder->buf, &builder->buf_cap, builder->buf_len + len + 1, 1) != 0) {
+        builder->failed = 1;
+        return (TaskField){0};
+    }
 
+    char* ptr = builder->buf + builder->buf_len;
+    memcpy(ptr, value, len);
     ptr[len] = end_char;
-    task->buf_loc += len + 1;
-    return ptr;
+
+    // Builder offsets are kept one past the buffer position, so a set field never has offset 0
+    TaskField field = { builder->buf_len + 1, len };
+    builder->buf_len += len + 1;
+    return field;
 }
 
 static void
-workspace_task_get(void* data, char* section, char* name, char* value) {
-    Task* task = (Task*)data;
-    if (strcmp(section, task->name) == 0) {
+task_add_var(StrHeap* heap, TaskBuilder* builder, char* name, char* value) {
+    if (task_builder_grow(heap, (void**)&builder->vars, &builder->vars_cap,
+                          builder->task.var_count + 1, sizeof(TaskField)) != 0)
+    {
+        builder->failed = 1;
+        return;
+    }
 
-        if (strcmp(name, "cmd") == 0) {
-            task->cmd = task->buf + task->buf_loc;
-        }
-        else if (strcmp(name, "dir") == 0) {
-            task->dir = task->buf + task->buf_loc;
-        }
-        else if (strcmp(name, "wait") == 0) {
-            task->wait = task->buf + task->buf_loc;
+    TaskField field = value ? task_write(heap, builder, name, '=') : task_write(heap, builder, name, '\0');
+    if (value) field.length += task_write(heap, builder, value, '\0').length + 1;
+    builder->vars[builder->task.var_count++] = field;
+}
+
+typedef struct TaskParse_st {
+    Server* server;
+    char* name;
+} TaskParse;
+
+static void
+workspace_task_get(void* data, char* section, char* name, char* value) {
+    TaskParse* parse = (TaskParse*)data;
+    StrHeap* heap = parse->server->strings;
+    TaskBuilder* builder = &parse->server->builder;
+    TaskRecord* task = &builder->task;
+    if (strcmp(section, parse->name) != 0) return;
+
+    if (strcmp(name, "cmd") == 0) {
+        task->cmd = task_write(heap, builder, value, '\0');
+    }
+    else if (strcmp(name, "dir") == 0) {
+        task->dir = task_write(heap, builder, value, '\0');
+    }
+    else if (strcmp(name, "wait") == 0) {
+        task->wait = task_write(heap, builder, value, '\0');
+    }
+    else if (strcmp(name, "cpu_weight") == 0) {
+        task->cpu_weight = task_write(heap, builder, value, '\0');
+    }
+    else if (strcmp(name, "memory_max") == 0) {
+        task->memory_max = task_write(heap, builder, value, '\0');
+    }
+    else if (strcmp(name, "pids_max") == 0) {
+        task->pids_max = task_write(heap, builder, value, '\0');
+    }
+    else if (strcmp(name, "cpus") == 0) {
+        task->cpus = task_write(heap, builder, value, '\0');
+    }
+    else if (strcmp(name, "numa_node") == 0) {
+        char* end = NULL;
+        task->numa_node = strtol(value, &end, 10);
+        if (end == value || *end != '\0' || task->numa_node < 0 || task->numa_node >= AFFINITY_NODE_MAX) {
+            LOG_WARN(FMT_TARGET(parse->name, "Invalid NUMA node '%s', ignoring", value));
+            task->numa_node = -1;
         }
-        else {
-            task->vars[task->var_count] = task_write(task, name, '=');
-            task->var_count++;
+    }
+    else if (strcmp(name, "timeout") == 0) {
+        task->timeout_ms = config_parse_duration_ms(value);
+        if (task->timeout_ms < 0) {
+            LOG_WARN(FMT_TARGET(parse->name, "Invalid timeout value '%s', ignoring", value));
         }
-
-        task_write(task, value, '\0');
+    }
+    else {
+        task_add_var(heap, builder, name, value);
     }
 }
 
@@ -155,53 +556,265 @@ get_from_ws(Server* server, IniHandler handler, void* data) {
     return status;
 }
 
-static inline KeyValue
-get_task(Server* server, Config* config, char* task_name, char** envs) {
-    if (!task_name) return KEYVALUE_NONE;
-
-    // Allocate new Task into task stack
-    KeyValue res = store_push_empty(server->task_store);
-    if (!res.value) {
-        LOG_WARN(FMT_SERVER("Task store capacity reached"));
-        return KEYVALUE_NONE;
+#define TASK_FIELD_REBASE(field, base) ((field).offset ? (TaskField){ (field).offset - 1 + (base), (field).length } : (field))
+
+/// Pack a parsed task into a record of its exact size, returns the record or NULL if the heap is exhausted
+static TaskRecord*
+task_builder_commit(StrHeap* heap, TaskBuilder* builder) {
+    uint32_t base = sizeof(TaskRecord) + sizeof(TaskField) * builder->task.var_count;
+    TaskRecord* task = strheap_alloc(heap, base + builder->buf_len);
+    if (!task) return NULL;
+
+    *task = builder->task;
+    task->next       = NULL;
+    task->size       = base + builder->buf_len;
+    task->name       = TASK_FIELD_REBASE(task->name, base);
+    task->cmd        = TASK_FIELD_REBASE(task->cmd, base);
+    task->dir        = TASK_FIELD_REBASE(task->dir, base);
+    task->wait       = TASK_FIELD_REBASE(task->wait, base);
+    task->cpu_weight = TASK_FIELD_REBASE(task->cpu_weight, base);
+    task->memory_max = TASK_FIELD_REBASE(task->memory_max, base);
+    task->pids_max   = TASK_FIELD_REBASE(task->pids_max, base);
+    task->cpus       = TASK_FIELD_REBASE(task->cpus, base);
+    for (uint32_t i = 0; i < task->var_count; i++) {
+        task->vars[i] = TASK_FIELD_REBASE(builder->vars[i], base);
     }
-    Task* new_task = res.value;
+    memcpy((char*)task + base, builder->buf, builder->buf_len);
+    return task;
+}
 
-    new_task->buf_loc = 0;
-    new_task->buf     = (char*)new_task + sizeof(Task);
-    new_task->vars    = (char**)(new_task->buf + config->settings.general.task_buf_size);
-    new_task->name    = task_write(new_task, task_name, '\0');
+static inline void
+task_free(Server* server, TaskRecord* task) {
+    strheap_free(server->strings, task);
+}
 
-    // Try parse Task data from active workspace INI file, remove from task stack if parse fails
-    if (get_from_ws(server, workspace_task_get, new_task) != 0) {
+/// Parse a task from the active workspace into a new record, returns the record or NULL if failed
+static TaskRecord*
+get_task(Server* server, Config* config, char* task_name, char** envs) {
+    if (!task_name) return NULL;
+
+    TaskBuilder* builder = &server->builder;
+    builder->task       = (TaskRecord){0};
+    builder->task.timeout_ms = -1;
+    builder->task.numa_node  = -1;
+    builder->failed     = 0;
+    builder->buf_len    = 0;
+    builder->task.name  = task_write(server->strings, builder, task_name, '\0');
+
+    // Try parse Task data from active workspace INI file
+    TaskParse parse = { server, task_name };
+    if (get_from_ws(server, workspace_task_get, &parse) != 0) {
         LOG_WARN(FMT_SERVER("Task '%s' does not exist", task_name));
-        store_remove_at(server->task_store, res.key);
-        return KEYVALUE_NONE;
+        return NULL;
     }
 
     // If task has no cmd, it cannot be executed
-    if (!new_task->cmd) {
+    if (!builder->task.cmd.offset) {
         LOG_WARN(FMT_SERVER("Task '%s' is invalid: missing 'cmd' value", task_name));
-        store_remove_at(server->task_store, res.key);
-        return KEYVALUE_NONE;
+        return NULL;
+    }
+
+    // Fall back to the agent-wide default if the task did not declare a valid timeout
+    if (builder->task.timeout_ms < 0) {
+        builder->task.timeout_ms = config->settings.general.task_timeout_ms;
     }
 
     // Apply environment variables to existing Task variables
     if (envs != NULL) {
-        int e = 0;
-        char* env = envs[e];
-        while (env != NULL) {
-            new_task->vars[e + new_task->var_count] = task_write(new_task, env, '\0');
-            e++;
-            env = envs[e];
+        for (int e = 0; envs[e] != NULL; e++) {
+            task_add_var(server->strings, builder, envs[e], NULL);
         }
     }
 
-    return res;
+    TaskRecord* task = builder->failed ? NULL : task_builder_commit(server->strings, builder);
+    if (!task) {
+        LOG_WARN(FMT_SERVER("String heap exhausted, unable to store task '%s'", task_name));
+    }
+    return task;
 }
 
+static inline void
+task_queue_link(Server* server, TaskRecord* task) {
+    task->next = NULL;
+    if (server->queue_tail) server->queue_tail->next = task;
+    else server->queue_head = task;
+    server->queue_tail = task;
+    server->queue_count++;
+}
+
+/// Append a task to the end of the queue, spilling it to disk once the in-memory queue is full.
+/// Takes ownership of the task on success, returns 0 on success and -1 if the task could not be queued.
 static int
-server_task_launch(Server* server, Config* config, Task* new_task) {
+task_queue_push(Server* server, TaskRecord* task) {
+    task->queued_us = timer_now_us();
+
+    // Anything spilled is older than the new task, so it has to follow them to disk to keep the order
+    if (server->queue_count < server->queue_max && (!server->spill || server->spill->count == 0)) {
+        task_queue_link(server, task);
+        return 0;
+    }
+
+    if (spill_push(server->spill, task, task->size) != 0) return -1;
+    task_free(server, task);
+    return 0;
+}
+
+/// Page spilled tasks back into the in-memory queue while it has room
+static void
+task_queue_refill(Server* server) {
+    while (server->spill && server->spill->count > 0 && server->queue_count < server->queue_max) {
+        uint32_t size = spill_peek(server->spill);
+        TaskRecord* task = strheap_alloc(server->strings, size);
+        if (!task) break;
+
+        // Records only hold offsets relative to themselves, so a copy is valid wherever it lands
+        spill_pop(server->spill, task, size);
+        task_queue_link(server, task);
+    }
+
+    if (spill_trim(server->spill) != 0) {
+        LOG_WARN(FMT_SERVER("Failed to truncate the drained task spill segment: %s", strerror(errno)));
+    }
+}
+
+static void
+task_queue_unlink(Server* server, TaskRecord* prev, TaskRecord* task) {
+    if (prev) prev->next = task->next;
+    else server->queue_head = task->next;
+    if (server->queue_tail == task) server->queue_tail = prev;
+    server->queue_count--;
+}
+
+static inline void
+close_pipe(int* fds) {
+    close(fds[0]);
+    close(fds[1]);
+}
+
+static inline void
+close_inherited_fds(int from) {
+#ifdef SYS_close_range
+    if (syscall(SYS_close_range, from, ~0U, 0) == 0) return;
+#endif
+    long max_fd = sysconf(_SC_OPEN_MAX);
+    for (long fd = from; fd < max_fd; fd++) {
+        close(fd);
+    }
+}
+
+static void
+server_task_timeout(void* data, int key) {
+    Server* server = (Server*)data;
+    TaskProcess* process = proc_store_get(server->process_store, key);
+    if (!process) return;
+    process->timer_id = TIMER_NONE;
+
+    // Signal the whole process group, the task may have spawned children of its own
+    if (process->kill_stage == KILLSTAGE_NONE) {
+        LOG_WARN(FMT_PROCESS(process, "Task '%s' timed out, sending SIGTERM to process group %d",
+                            process->task_name,
+                            process->pid));
+        kill(-process->pid, SIGTERM);
+        process->kill_stage = KILLSTAGE_TERM;
+        process->timer_id = timer_add(server->timers,
+                                      timer_now_ms() + server->kill_grace_ms,
+                                      server_task_timeout,
+                                      server,
+                                      key);
+    }
+    else {
+        LOG_WARN(FMT_PROCESS(process, "Task '%s' did not exit after SIGTERM, sending SIGKILL to process group %d",
+                            process->task_name,
+                            process->pid));
+        kill(-process->pid, SIGKILL);
+        process->kill_stage = KILLSTAGE_KILL;
+    }
+}
+
+static void
+server_cgroup_cleanup(void* data, int key) {
+    Server* server = (Server*)data;
+    if (cgroup_remove(server->cgroup_root, (unsigned int)key) != CGROUP_OK) {
+        LOG_WARN(FMT_SERVER("Unable to remove cgroup 'task-%u': %s", (unsigned int)key, strerror(errno)));
+    }
+}
+
+/// Create a leaf cgroup with the task's limits applied, returns the cgroup id or 0 if the task runs without one
+static unsigned int
+server_task_cgroup(Server* server, TaskRecord* task, int* procs_fd) {
+    unsigned int id = ++server->cgroup_seq;
+    if (cgroup_create(server->cgroup_root, id) != CGROUP_OK) {
+        LOG_WARN(FMT_SERVER("Unable to create cgroup for task '%s': %s", TASK_STR(task, name), strerror(errno)));
+        return 0;
+    }
+
+    char* files[]  = { "cpu.weight", "memory.max", "pids.max" };
+    char* values[] = { TASK_STR(task, cpu_weight), TASK_STR(task, memory_max), TASK_STR(task, pids_max) };
+    for (int i = 0; i < 3; i++) {
+        if (!values[i]) continue;
+        if (cgroup_set(server->cgroup_root, id, files[i], values[i]) != CGROUP_OK) {
+            LOG_WARN(FMT_TARGET(TASK_STR(task, name), "Unable to set cgroup '%s' to '%s': %s", files[i], values[i], strerror(errno)));
+        }
+    }
+
+    *procs_fd = cgroup_open_procs(server->cgroup_root, id);
+    if (*procs_fd < 0) {
+        LOG_WARN(FMT_SERVER("Unable to open cgroup for task '%s': %s", TASK_STR(task, name), strerror(errno)));
+        cgroup_remove(server->cgroup_root, id);
+        return 0;
+    }
+    return id;
+}
+
+/// Resolve CPU and NUMA placement of a task, explicit workspace keys take precedence over the agent policy
+static void
+server_task_placement(Server* server, TaskRecord* task, Placement* placement) {
+    placement->has_cpus  = 0;
+    placement->numa_node = task->numa_node;
+
+    char* cpus = TASK_STR(task, cpus);
+    if (cpus) {
+        if (affinity_parse_cpulist(cpus, &placement->cpus) > 0) placement->has_cpus = 1;
+        else LOG_WARN(FMT_TARGET(TASK_STR(task, name), "Invalid CPU list '%s', ignoring", cpus));
+    }
+
+    if (placement->numa_node >= 0) {
+        if (!placement->has_cpus && affinity_node_cpus(placement->numa_node, &placement->cpus) > 0) {
+            placement->has_cpus = 1;
+        }
+        return;
+    }
+    if (placement->has_cpus) return;
+
+    // Round-robin tasks without explicit placement across the agent's cores or nodes
+    if (server->placement == PLACEMENT_CORE) {
+        int cpu = affinity_nth_cpu(&server->agent_cpus, server->placement_next++);
+        if (cpu >= 0) {
+            CPU_ZERO(&placement->cpus);
+            CPU_SET(cpu, &placement->cpus);
+            placement->has_cpus = 1;
+        }
+    }
+    else if (server->placement == PLACEMENT_NODE) {
+        int node = server->placement_next++ % server->node_count;
+        placement->numa_node = node;
+        if (affinity_node_cpus(node, &placement->cpus) > 0) placement->has_cpus = 1;
+    }
+}
+
+/// Open a close-on-exec descriptor that turns readable when given child exits, returns -1 if the kernel has no
+/// pidfd support
+static inline int
+server_pidfd_open(pid_t pid) {
+#ifdef SYS_pidfd_open
+    return syscall(SYS_pidfd_open, pid, 0);
+#else
+    return -1;
+#endif
+}
+
+static int
+server_task_launch(Server* server, Config* config, TaskRecord* new_task) {
     if (!new_task) {
         return -1;
     }
@@ -211,80 +824,176 @@ server_task_launch(Server* server, Config* config, Task* new_task) {
         return -1;
     }
 
-    // Create pipes for child -> server communication
+    // The process keeps its own copy of the name, the task itself is released once launched
+    char* task_name = strheap_dup(server->strings, TASK_STR(new_task, name));
+    if (!task_name) {
+        LOG_WARN(FMT_SERVER("String heap exhausted, unable to launch task '%s'", TASK_STR(new_task, name)));
+        return -1;
+    }
+
+    // Create pipes for child -> server communication, no other child may inherit them
     int out_fd[2] = {0};
-    if (pipe(out_fd) < 0 || socket_set_nonblock(out_fd[0]) != 0) {
+    if (pipe2(out_fd, O_CLOEXEC) < 0 || socket_set_nonblock(out_fd[0]) != 0) {
         perror("Unable to create STDOUT pipe descriptors for child process");
+        strheap_free(server->strings, task_name);
         return -1;
     }
 
     int err_fd[2] = {0};
-    if (pipe(err_fd) < 0 || socket_set_nonblock(err_fd[0]) != 0) {
+    if (pipe2(err_fd, O_CLOEXEC) < 0 || socket_set_nonblock(err_fd[0]) != 0) {
         perror("Unable to create STDERR pipe descriptors for child process");
+        close_pipe(out_fd);
+        strheap_free(server->strings, task_name);
         return -1;
     }
 
+    // Closed by the exec in the child, so EOF on it marks the end of the fork to exec stretch
+    int exec_fd[2] = {0};
+    if (pipe2(exec_fd, O_CLOEXEC) < 0 || socket_set_nonblock(exec_fd[0]) != 0) {
+        perror("Unable to create exec pipe descriptors for child process");
+        close_pipe(out_fd);
+        close_pipe(err_fd);
+        strheap_free(server->strings, task_name);
+        return -1;
+    }
+
+    Placement placement;
+    server_task_placement(server, new_task, &placement);
+
+    // Place the task into its own cgroup when resource isolation is enabled
+    int procs_fd = -1;
+    unsigned int cgroup_id = 0;
+    if (server->cgroup_root) {
+        cgroup_id = server_task_cgroup(server, new_task, &procs_fd);
+    }
+
     // Fork process
+    uint64_t spawn_us = timer_now_us();
     pid_t child_pid = fork();
 
     // Error
     if (child_pid < 0) {
         perror("Unable to fork child process");
+        close_pipe(out_fd);
+        close_pipe(err_fd);
+        close_pipe(exec_fd);
+        strheap_free(server->strings, task_name);
+        if (cgroup_id) {
+            close(procs_fd);
+            cgroup_remove(server->cgroup_root, cgroup_id);
+        }
         return -1;
     }
     // Child process
     else if (child_pid == 0) {
+        // Lead a new process group so timeouts can reclaim the whole process tree
+        setpgid(0, 0);
+
         // Set child process STDOUT & STDERR into pipes
-        if (dup2(out_fd[1], STDOUT_FILENO) < 0) { perror("Failed to redirect STDOUT to pipe"); exit(errno); }
-        if (dup2(err_fd[1], STDERR_FILENO) < 0) { perror("Failed to redirect STDERR to pipe"); exit(errno); }
+        if (dup2(out_fd[1], STDOUT_FILENO) < 0) { perror("Failed to redirect STDOUT to pipe"); _exit(errno); }
+        if (dup2(err_fd[1], STDERR_FILENO) < 0) { perror("Failed to redirect STDERR to pipe"); _exit(errno); }
+
+        // Join the task cgroup before exec, so every descendant is accounted and limited
+        if (procs_fd >= 0 && cgroup_join(procs_fd) != CGROUP_OK) {
+            perror("Failed to join task cgroup");
+        }
+
+        if (affinity_apply(&placement) != 0) {
+            perror("Failed to apply task CPU or NUMA placement");
+        }
+
+        // Don't leak agent sockets or other tasks' pipes into the task, only the exec pipe is kept until exec
+        int exec_fd_w = STDERR_FILENO + 1;
+        if (exec_fd[1] != exec_fd_w && dup3(exec_fd[1], exec_fd_w, O_CLOEXEC) < 0) exec_fd_w = -1;
+        close_inherited_fds(STDERR_FILENO + 2);
+
+        char* envs[new_task->var_count + 1];
+        for (uint32_t i = 0; i < new_task->var_count; i++) {
+            envs[i] = (char*)new_task + new_task->vars[i].offset;
+        }
+        envs[new_task->var_count] = NULL;
 
-        char* args[] = { config->settings.general.cmd_bin_path, "-c", new_task->cmd, NULL };
-        if (new_task->dir != NULL) {
-            if (chdir(new_task->dir) != 0) {
+        char* args[] = { config->settings.general.cmd_bin_path, "-c", TASK_STR(new_task, cmd), NULL };
+        char* dir = TASK_STR(new_task, dir);
+        if (dir != NULL) {
+            if (chdir(dir) != 0) {
                 perror("Failed to change working directory");
-                exit(errno);
+                _exit(errno);
             }
         }
 
-        if (execve(config->settings.general.cmd_bin_path, args, new_task->vars) != 0) {
+        if (execve(config->settings.general.cmd_bin_path, args, envs) != 0) {
             perror("Failed to execute command");
         }
 
-        close(out_fd[1]);
-        close(err_fd[1]);
-        exit(errno);
+        // Anything written tells the agent exec failed, so the attempt is left out of the spawn latency. The child
+        // leaves without running exit handlers, which belong to the agent or to a program embedding it.
+        int exec_errno = errno;
+        if (exec_fd_w >= 0 && write(exec_fd_w, &exec_errno, sizeof(int)) < 0) exec_errno = errno;
+        _exit(exec_errno);
     }
     // Parent
     else {
-        LOG_DEBUG("Parent pid: %d, child pid: %d", getpid(), child_pid);
+        LOG_DEBUG(FMT_SERVER("Parent pid: %d, child pid: %d", getpid(), child_pid));
+        if (procs_fd >= 0) close(procs_fd);
+
+        // Only the child writes into the pipes, holding the write ends would prevent EOF
+        close(out_fd[1]);
+        close(err_fd[1]);
+        close(exec_fd[1]);
+
+        // Also set the group from parent side, so it exists before any timeout can fire
+        setpgid(child_pid, child_pid);
 
         // Push a new task process to store
-        KeyValue res = store_push_empty(server->process_store);
-        if (!res.value) {
+        int key = -1;
+        TaskProcess* process = proc_store_push_empty(server->process_store, &key);
+        if (!process) {
             LOG_WARN(FMT_SERVER("Failed to push new process to the process store"));
+            close(exec_fd[0]);
+            strheap_free(server->strings, task_name);
             return -1;
         }
 
-        TaskProcess* process = res.value;
-        process->start_time  = time(0);
+        process->start_ms    = timer_now_ms();
+        process->spawn_us    = spawn_us;
+        process->exit_us     = 0;
         process->out_fd_r    = out_fd[0];
         process->err_fd_r    = err_fd[0];
+        process->exec_fd_r   = exec_fd[0];
+        process->pid_fd      = server_pidfd_open(child_pid);
         process->pid         = child_pid;
-        process->task_name   = ((char*)process) + sizeof(TaskProcess);
-        memcpy(process->task_name, new_task->name, strlen(new_task->name));
+        process->task_name   = task_name;
+        process->timer_id    = TIMER_NONE;
+        process->kill_stage  = KILLSTAGE_NONE;
+        process->cgroup_id   = cgroup_id;
+        process->trace_id    = new_task->trace_id;
+        process->output_seen = 0;
+        TRACE(TRACE_LAUNCHED, new_task->trace_id, child_pid, task_name, new_task->queued_us != 0);
+
+        if (new_task->timeout_ms > 0) {
+            process->timer_id = timer_add(server->timers,
+                                          timer_now_ms() + new_task->timeout_ms,
+                                          server_task_timeout,
+                                          server,
+                                          key);
+            if (process->timer_id == TIMER_NONE) {
+                LOG_WARN(FMT_SERVER("Timer capacity reached, task '%s' will run without timeout", task_name));
+            }
+        }
+        METRICS_INC(METRIC_TASKS_LAUNCHED);
         return 0;
     }
 }
 
 static unsigned char
-server_task_wait_match(Server* server, Task* task) {
-    if (task->wait) {
-        for (int i = server->process_store->capacity-1; i >= 0; i--) {
-            KeyValue res = store_get(server->process_store, i);
-            if (!res.value) continue;
-            TaskProcess* process = res.value;
-
-            if (strcmp(process->task_name, task->wait) == 0) {
+server_task_wait_match(Server* server, TaskRecord* task) {
+    char* wait = TASK_STR(task, wait);
+    if (wait) {
+        store_foreach(server->process_store, i) {
+            TaskProcess* process = proc_store_get(server->process_store, i);
+
+            if (strcmp(process->task_name, wait) == 0) {
                 return 1;
             }
         }
@@ -292,47 +1001,484 @@ server_task_wait_match(Server* server, Task* task) {
     return 0;
 }
 
+/// Launch queued tasks that no longer wait on a running task, oldest first, while process slots are free.
+/// Returns the amount of tasks launched or -1 if a launch failed.
 static int
-server_check_task_queue(Server* server, Config* config, char* completed_task_name, int name_len) {
-    if (server->process_store->open_cnt < 1) {
+server_check_task_queue(Server* server, Config* config) {
+    int launched = 0;
+    task_queue_refill(server);
+    TaskRecord* prev = NULL;
+    TaskRecord* task = server->queue_head;
+
+    while (server->process_store->open_cnt > 0) {
+        // Launches made room at the end of the scan, so continue it with tasks paged back from disk
+        if (!task) {
+            int queued = server->queue_count;
+            task_queue_refill(server);
+            if (server->queue_count == queued) break;
+            task = prev ? prev->next : server->queue_head;
+        }
+
+        TaskRecord* next = task->next;
+        LOG_DEBUG(FMT_TASK(TASK_STR(task, name), "Task wait: %s", TASK_STR(task, wait)));
+
+        if (server_task_wait_match(server, task)) {
+            prev = task;
+            task = next;
+            continue;
+        }
+
+        // The client was told the task is queued, and a failed fork, cgroup or affinity setup may well pass,
+        // so the task stays queued for the next scan and its run stays open in the trace
+        if (server_task_launch(server, config, task) != 0) {
+            METRICS_INC(METRIC_TASKS_FAILED);
+            TRACE(TRACE_LAUNCH_RETRY, task->trace_id, 0, TASK_STR(task, name), 0);
+            LOG_WARN(FMT_SERVER("Failed to launch task '%s'", TASK_STR(task, name)));
+            return -1;
+        }
+        histogram_record(HISTOGRAM_QUEUE_WAIT, timer_now_us() - task->queued_us);
+        LOG_INFO(FMT_TASK(TASK_STR(task, name), "Launching task '%s'", TASK_STR(task, name)));
+        task_queue_unlink(server, prev, task);
+        task_free(server, task);
+        launched++;
+        task = next;
+    }
+
+    return launched;
+}
+
+/// Respond with one line per token, packing as many lines as fit into a single message
+static int
+server_respond_lines(Server* server,
+                     Config* config,
+                     ClientPacket* packet,
+                     char* lines,
+                     int lines_len)
+{
+    protocol_tokenstream_reset(server->token_stream);
+    server->token_stream->type = PROTOCOL_MSG_SUCCESS;
+
+    int loc = 0;
+    while (loc < lines_len && lines[loc] != '\0' &&
+           server->token_stream->length < config->settings.general.protocol_token_count)
+    {
+        protocol_tokenstream_add_token(server->token_stream, PROTOCOL_TOKEN_ARG, lines + loc);
+        loc += strlen(lines + loc) + 1;
+    }
+
+    int sent = server_packet_send(server, config, packet);
+    server_packet_done(server, packet);
+    if (sent < 1) {
+        LOG_WARN(FMT_SERVER("Failed to send response to socket '%d'", packet->socket));
         return -1;
     }
+    return sent;
+}
 
-    for (int i = server->task_store->capacity-1; i >= 0; i--) {
-        KeyValue res = store_get(server->task_store, i);
-        if (!res.value) continue;
-        Task* task = res.value;
+/// Write a line into a line buffer if it fits, accounting for the serialized token overhead
+static inline int
+lines_append(char* lines, int loc, int lines_len, char* line) {
+    int len = strlen(line);
+    if (loc + len + 2 > lines_len) return loc;
+    memcpy(lines + loc, line, len + 1);
+    return loc + len + 1;
+}
 
-        LOG_DEBUG("Task name: %s, task wait: %s", task->name, task->wait);
+/// Start streaming a snapshot response. Nothing runs on the event loop until it ends, so every frame is of the
+/// same agent state. Frames a socket client does not take at once wait in an outbox, the loop never waits on it.
+static inline void
+server_snapshot_begin(Server* server, Config* config, ClientPacket* packet, ProtocolSnapshot* snap, unsigned char kind) {
+    ServerOutbox* outbox = NULL;
+    if (!packet->channel && server->outbox_count < SERVER_OUTBOX_MAX) {
+        outbox = &server->outboxes[server->outbox_count];
+        outbox->socket      = packet->socket;
+        outbox->deadline_ms = timer_now_ms() + config->settings.connection.sock_timeout_sec * 1000;
+    }
+    protocol_snapshot_begin(snap, packet->socket, server->conn.out_buf, config->settings.connection.buffer_size,
+                            kind, server->token_stream->version, SERVER_SNAPSHOT_WAIT_MS);
+    snap->token_max = config->settings.general.protocol_token_count;
+    if (packet->channel) {
+        snap->write     = server_channel_write;
+        snap->write_ctx = packet->channel;
+    }
+    else if (outbox) {
+        snap->write     = server_socket_write;
+        snap->write_ctx = outbox;
+    }
+}
 
-        if (task->wait == NULL || strncmp(task->wait, completed_task_name, name_len) == 0) {
-            int status = server_task_launch(server, config, task);
-            if (status != 0) {
-                LOG_WARN(FMT_SERVER("Failed to launch task '%s'", task->name));
-                return -1;
+static int
+server_snapshot_end(Server* server, ClientPacket* packet, ProtocolSnapshot* snap) {
+    long sent = protocol_snapshot_end(snap);
+    ServerOutbox* outbox = snap->write == server_socket_write ? snap->write_ctx : NULL;
+    if (outbox && sent > 0 && outbox->len > 0) {
+        // The outbox owns the socket from here, and closes it once the rest is sent
+        server->outbox_count++;
+        socket_stack_remove_at_fast(server->client_stack, packet->client);
+    }
+    else {
+        if (outbox) server_outbox_clear(outbox);
+        server_packet_done(server, packet);
+    }
+    if (sent < 1) {
+        LOG_WARN(FMT_SERVER("Failed to send snapshot to socket '%d'", packet->socket));
+        return -1;
+    }
+    return sent;
+}
+
+static void
+server_task_info(Server* server, Config* config, ClientPacket* packet, char* task_name) {
+    ProtocolSnapshot snap;
+    ProtocolEntry entry;
+    server_snapshot_begin(server, config, packet, &snap, PROTOCOL_SNAPSHOT_TASKS);
+    entry.field_count = __PROTOCOL_TASK_FIELD_COUNT;
+    entry.str_count   = 1;
+
+    for (int i = 0; i < server->history->count; i++) {
+        TaskUsage* usage = task_history_get(server->history, i);
+        if (task_name && strcmp(usage->task_name, task_name) != 0) continue;
+
+        entry.fields[PROTOCOL_TASK_PID]         = usage->pid;
+        entry.fields[PROTOCOL_TASK_STATUS]      = usage->status;
+        entry.fields[PROTOCOL_TASK_WALL_MS]     = usage->wall_ms;
+        entry.fields[PROTOCOL_TASK_UTIME_US]    = usage->utime_us;
+        entry.fields[PROTOCOL_TASK_STIME_US]    = usage->stime_us;
+        entry.fields[PROTOCOL_TASK_MAXRSS_KB]   = usage->maxrss_kb;
+        entry.fields[PROTOCOL_TASK_NVCSW]       = usage->nvcsw;
+        entry.fields[PROTOCOL_TASK_NIVCSW]      = usage->nivcsw;
+        entry.fields[PROTOCOL_TASK_INBLOCK]     = usage->inblock;
+        entry.fields[PROTOCOL_TASK_OUBLOCK]     = usage->oublock;
+        entry.fields[PROTOCOL_TASK_CG_CPU_USEC] = usage->cg_cpu_usec;
+        entry.fields[PROTOCOL_TASK_CG_MEM_PEAK] = usage->cg_mem_peak;
+        entry.strs[0]     = usage->task_name;
+        entry.str_lens[0] = strlen(usage->task_name);
+        if (protocol_snapshot_add(&snap, &entry) != 0) break;
+    }
+    server_snapshot_end(server, packet, &snap);
+}
+
+static void
+server_proc_info(Server* server, Config* config, ClientPacket* packet, char* task_name) {
+    ProtocolSnapshot snap;
+    ProtocolEntry entry;
+    uint64_t now_ms = timer_now_ms();
+    server_snapshot_begin(server, config, packet, &snap, PROTOCOL_SNAPSHOT_PROCS);
+    entry.field_count = __PROTOCOL_PROC_FIELD_COUNT;
+    entry.str_count   = 1;
+
+    store_foreach(server->process_store, i) {
+        TaskProcess* process = proc_store_get(server->process_store, i);
+        if (task_name && strcmp(process->task_name, task_name) != 0) continue;
+
+        entry.fields[PROTOCOL_PROC_PID]        = process->pid;
+        entry.fields[PROTOCOL_PROC_RUNNING_MS] = now_ms - process->start_ms;
+        entry.fields[PROTOCOL_PROC_TRACE_ID]   = process->trace_id;
+        entry.strs[0]     = process->task_name;
+        entry.str_lens[0] = strlen(process->task_name);
+        if (protocol_snapshot_add(&snap, &entry) != 0) break;
+    }
+    server_snapshot_end(server, packet, &snap);
+}
+
+typedef struct WorkspaceSnapshot_st {
+    ProtocolSnapshot* snap;
+    char* name;
+} WorkspaceSnapshot;
+
+/// List every task of the workspace as it is parsed, a section is a task once it has a command
+static void
+workspace_task_list(void* data, char* section, char* name, char* value) {
+    WorkspaceSnapshot* ws = (WorkspaceSnapshot*)data;
+    if (strcmp(name, "cmd") != 0) return;
+    if (ws->name && strcmp(section, ws->name) != 0) return;
+
+    ProtocolEntry entry;
+    entry.field_count = 0;
+    entry.str_count   = 2;
+    entry.strs[0]     = section;
+    entry.str_lens[0] = strlen(section);
+    entry.strs[1]     = value;
+    entry.str_lens[1] = strlen(value);
+    protocol_snapshot_add(ws->snap, &entry);
+}
+
+static void
+server_workspace_info(Server* server, Config* config, ClientPacket* packet, char* task_name) {
+    if (server->workspace[0] == '\0') {
+        server_respond(server, config, packet, PROTOCOL_MSG_ERR, "No active workspace");
+        return;
+    }
+
+    ProtocolSnapshot snap;
+    WorkspaceSnapshot ws = { &snap, task_name };
+    server_snapshot_begin(server, config, packet, &snap, PROTOCOL_SNAPSHOT_WORKSPACE);
+    if (get_from_ws(server, workspace_task_list, &ws) != 0) {
+        LOG_WARN(FMT_SERVER("Failed to read workspace '%s'", server->workspace));
+    }
+    server_snapshot_end(server, packet, &snap);
+}
+
+/// Log allocation statistics of every subsystem tag, failed allocations are logged as warnings
+void
+server_log_alloc_stats() {
+    int page_count = 0;
+    size_t page_bytes = arena_page_stats(&page_count);
+    LOG_INFO(FMT_SERVER("Arena: %d pages, %zu bytes", page_count, page_bytes));
+
+    for (int i = 0; i < __ARENA_TAG_COUNT; i++) {
+        ArenaTagStats stats = arena_tag_stats(i);
+        if (stats.count == 0 && stats.failed == 0) continue;
+        LOG_INFO(FMT_SERVER("Arena '%s': bytes=%zu allocs=%zu failed=%zu",
+                             arena_tag_name(i), stats.bytes, stats.count, stats.failed));
+        if (stats.failed > 0) {
+            LOG_WARN(FMT_SERVER("Arena '%s' failed %zu allocations", arena_tag_name(i), stats.failed));
+        }
+    }
+}
+
+static void
+server_stats_info(Server* server, Config* config, ClientPacket* packet) {
+    int lines_len = config->settings.connection.buffer_size - (sizeof(int) * 3);
+    char* lines = arena_child_alloc(server->scratch, lines_len);
+    char* line = arena_child_alloc(server->scratch, lines_len);
+    int loc = 0;
+    if (!lines || !line) {
+        server_respond(server, config, packet, PROTOCOL_MSG_ERR, "Internal error");
+        return;
+    }
+    memset(lines, 0, lines_len);
+
+    int page_count = 0;
+    size_t page_bytes = arena_page_stats(&page_count);
+    snprintf(line, lines_len, "arena pages=%d bytes=%zu", page_count, page_bytes);
+    loc = lines_append(lines, loc, lines_len, line);
+
+    for (int i = 0; i < __ARENA_TAG_COUNT; i++) {
+        ArenaTagStats stats = arena_tag_stats(i);
+        if (stats.count == 0 && stats.failed == 0) continue;
+        snprintf(line, lines_len, "%s bytes=%zu allocs=%zu failed=%zu",
+                 arena_tag_name(i), stats.bytes, stats.count, stats.failed);
+        loc = lines_append(lines, loc, lines_len, line);
+    }
+
+    size_t capacity = 0;
+    size_t peak = arena_child_peak(server->scratch, &capacity);
+    snprintf(line, lines_len, "scratch peak=%zu capacity=%zu", peak, capacity);
+    loc = lines_append(lines, loc, lines_len, line);
+
+    snprintf(line, lines_len, "strings used=%zu peak=%zu reserved=%zu capacity=%zu",
+             server->strings->used, server->strings->peak, server->strings->reserved, server->strings->capacity);
+    loc = lines_append(lines, loc, lines_len, line);
+
+    snprintf(line, lines_len, "queue tasks=%d max=%d spilled=%d spill_bytes=%zu",
+             server->queue_count, server->queue_max,
+             server->spill ? server->spill->count : 0,
+             server->spill ? server->spill->tail - server->spill->head : 0);
+    loc = lines_append(lines, loc, lines_len, line);
+
+    snprintf(line, lines_len, "log dropped=%lu", (unsigned long)log_dropped());
+    loc = lines_append(lines, loc, lines_len, line);
+
+    server_respond_lines(server, config, packet, lines, loc);
+}
+
+/// Update gauges from server state, they are only read when metrics are requested
+static void
+server_metrics_refresh(Server* server) {
+    metrics_set(METRIC_QUEUE_DEPTH, server->queue_count + (server->spill ? server->spill->count : 0));
+    metrics_set(METRIC_PROCESSES_RUNNING, server->process_store->capacity - server->process_store->open_cnt);
+}
+
+static void
+server_metrics_info(Server* server, Config* config, ClientPacket* packet) {
+    int lines_len = config->settings.connection.buffer_size - (sizeof(int) * 3);
+    char* lines = arena_child_alloc(server->scratch, lines_len);
+    char* line = arena_child_alloc(server->scratch, lines_len);
+    int loc = 0;
+    if (!lines || !line) {
+        server_respond(server, config, packet, PROTOCOL_MSG_ERR, "Internal error");
+        return;
+    }
+    memset(lines, 0, lines_len);
+
+    server_metrics_refresh(server);
+    for (int i = 0; i < __METRIC_COUNT; i++) {
+        snprintf(line, lines_len, "%s %lld", metrics_info(i)->name, (long long)metrics_value(i));
+        loc = lines_append(lines, loc, lines_len, line);
+    }
+
+    for (int i = 0; i < __HISTOGRAM_COUNT; i++) {
+        const Histogram* hist = histogram_get(i);
+        snprintf(line, lines_len, "%s count=%llu p50=%llu p99=%llu p999=%llu max=%llu",
+                 histogram_info(i)->name,
+                 (unsigned long long)hist->count,
+                 (unsigned long long)histogram_quantile(i, 0.5),
+                 (unsigned long long)histogram_quantile(i, 0.99),
+                 (unsigned long long)histogram_quantile(i, 0.999),
+                 (unsigned long long)hist->max);
+        loc = lines_append(lines, loc, lines_len, line);
+    }
+
+    server_respond_lines(server, config, packet, lines, loc);
+}
+
+/// Answer a metrics scrape with a single HTTP/1.0 response, whatever the path
+static void
+server_metrics_respond(Server* server, Config* config, int sock) {
+    size_t body_len = metrics_prometheus_size();
+    size_t head_len = 128;
+    int timeout_ms = config->settings.connection.sock_timeout_sec * 1000;
+
+    ArenaMark mark = arena_mark(server->scratch);
+    char* head = arena_child_alloc(server->scratch, head_len);
+    char* body = arena_child_alloc(server->scratch, body_len);
+    if (head && body) {
+        server_metrics_refresh(server);
+        int body_written = metrics_render_prometheus(body, body_len);
+        int head_written = snprintf(head, head_len,
+                                    "HTTP/1.0 200 OK\r\n"
+                                    "Content-Type: text/plain; version=0.0.4\r\n"
+                                    "Content-Length: %d\r\n\r\n",
+                                    body_written);
+        if (socket_send_wait(sock, head, head_written, 0, timeout_ms) == head_written) {
+            socket_send_wait(sock, body, body_written, 0, timeout_ms);
+        }
+    }
+    else {
+        LOG_WARN(FMT_SERVER("Unable to allocate a metrics response"));
+    }
+    arena_reset_to(server->scratch, mark);
+}
+
+/// Accept new metrics scrapes and answer those whose request has arrived. A scrape stays in the select set
+/// until then, and is dropped if it sends nothing within the socket timeout.
+static void
+server_handle_metrics(Server* server, Config* config) {
+    if (FD_ISSET(server->metrics_socket, &server->conn.read_flags)) {
+        while (1) {
+            int sock = accept4(server->metrics_socket, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (sock < 0) {
+                if (errno == EINTR || errno == ECONNABORTED) continue;
+                if (errno != EAGAIN && errno != EWOULDBLOCK) perror("Error accepting metrics connection");
+                break;
             }
-            else {
-                LOG_INFO(FMT_SERVER("Launching task '%s'", task->name));
-                store_remove_at(server->task_store, res.key);
+            if (server->scrape_count >= SERVER_SCRAPE_MAX) {
+                close(sock);
+                continue;
             }
-            return 0;
+            server->scrape_sockets[server->scrape_count] = sock;
+            server->scrape_deadline_ms[server->scrape_count++] = timer_now_ms() +
+                config->settings.connection.sock_timeout_sec * 1000;
         }
     }
 
-    return -1;
+    uint64_t now_ms = timer_now_ms();
+    for (int i = server->scrape_count - 1; i >= 0; i--) {
+        int sock = server->scrape_sockets[i];
+        // The request is read only to be discarded, so any bytes at all mean it has arrived
+        int value_read = recv(sock, server->conn.in_buf, config->settings.connection.buffer_size, MSG_DONTWAIT);
+        if (value_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) &&
+            now_ms < server->scrape_deadline_ms[i])
+        {
+            continue;
+        }
+
+        if (value_read > 0) server_metrics_respond(server, config, sock);
+        close(sock);
+        server->scrape_count--;
+        server->scrape_sockets[i] = server->scrape_sockets[server->scrape_count];
+        server->scrape_deadline_ms[i] = server->scrape_deadline_ms[server->scrape_count];
+    }
+}
+
+static void
+server_trace_dump(Server* server, Config* config, ClientPacket* packet) {
+    if (!__trace.events) {
+        server_respond(server, config, packet, PROTOCOL_MSG_ERR, "Tracing is not enabled");
+        return;
+    }
+
+    long written = trace_dump();
+    if (written < 0) {
+        SERVER_RESPOND_FMT(server, config, packet, PROTOCOL_MSG_ERR, "Failed to write trace into '%s'", __trace.path);
+        return;
+    }
+    SERVER_RESPOND_FMT(server, config, packet, PROTOCOL_MSG_SUCCESS, "Wrote %ld trace events into '%s'",
+                       written, __trace.path);
+}
+
+/// Parse a task from the active workspace and start it, or queue it if it has to wait. The run id given to the
+/// task is written to 'run_id', it is the same id the trace and process listings show.
+static SubmitStatus
+server_task_submit(Server* server, Config* config, char* task_name, char** vars, uint32_t* run_id) {
+    TaskRecord* new_task = get_task(server, config, task_name, vars);
+    if (!new_task) {
+        LOG_WARN(FMT_SERVER("Failed to find requested task '%s'", task_name));
+        return SUBMIT_NOT_FOUND;
+    }
+    METRICS_INC(METRIC_TASKS_SUBMITTED);
+    uint32_t trace_id = new_task->trace_id = ++server->task_seq;
+    if (run_id) *run_id = trace_id;
+    TRACE(TRACE_SUBMITTED, trace_id, 0, task_name, 0);
+
+    // Tasks waiting on a running task, or on a free process slot, go to the queue
+    if (server_task_wait_match(server, new_task) || server->process_store->open_cnt < 1) {
+        if (task_queue_push(server, new_task) != 0) {
+            METRICS_INC(METRIC_TASKS_REJECTED);
+            TRACE(TRACE_FAILED, trace_id, 0, task_name, 0);
+            task_free(server, new_task);
+            LOG_WARN(FMT_SERVER("Task queue is full, dropping task '%s'", task_name));
+            return SUBMIT_REJECTED;
+        }
+        METRICS_INC(METRIC_TASKS_QUEUED);
+        TRACE(TRACE_QUEUED, trace_id, 0, task_name, 0);
+        LOG_INFO(FMT_TASK(task_name, "Queuing task '%s'", task_name));
+        return SUBMIT_QUEUED;
+    }
+
+    int launch_status = server_task_launch(server, config, new_task);
+    task_free(server, new_task);
+    if (launch_status != 0) {
+        METRICS_INC(METRIC_TASKS_FAILED);
+        TRACE(TRACE_FAILED, trace_id, 0, task_name, 0);
+        LOG_WARN(FMT_SERVER("Failed to start task '%s'", task_name));
+        return SUBMIT_FAILED;
+    }
+    LOG_INFO(FMT_TASK(task_name, "Starting task '%s'", task_name));
+    return SUBMIT_STARTED;
+}
+
+/// Make the workspace file at 'path' the active one, returns 0 on success and -1 if it cannot be read
+static int
+server_workspace_set(Server* server, Config* config, const char* path) {
+    if (!path || access(path, R_OK) != 0 || strlen(path) >= (size_t)config->settings.general.workspace_buf_size) {
+        LOG_WARN(FMT_SERVER("Failed to set active workspace as '%s'", path ? path : ""));
+        return -1;
+    }
+
+    strcpy(server->workspace, path);
+    LOG_INFO(FMT_SERVER("Using workspace '%s'", path));
+    return 0;
 }
 
 static int
 server_eval_packet(Config* config, Server* server, ClientPacket* packet) {
-    if (protocol_read(packet->data, config->settings.connection.buffer_size, server->token_stream) != 0) {
+    if (protocol_read(packet->data, packet->len, server->token_stream) != 0) {
         server_respond(server, config, packet, PROTOCOL_MSG_ERR, "Invalid command");
         LOG_WARN(FMT_SERVER("Received an invalid message from client"));
         return -1;
     }
 
     unsigned char type = 0;
-    char* args[server->token_stream->length];
-    char* vars[server->token_stream->length];
+    char** args = arena_child_alloc(server->scratch, sizeof(char*) * (server->token_stream->length + 1));
+    char** vars = arena_child_alloc(server->scratch, sizeof(char*) * (server->token_stream->length + 1));
+    if (!args || !vars) {
+        server_respond(server, config, packet, PROTOCOL_MSG_ERR, "Internal error");
+        LOG_WARN(FMT_SERVER("Scratch arena exhausted while handling client message"));
+        return -1;
+    }
+
     if (protocol_parse_token_stream(server->token_stream, &type, args, vars) != 0) {
         server_respond(server, config, packet, PROTOCOL_MSG_ERR, "Invalid command");
         LOG_WARN(FMT_SERVER("Failed to parse tokens from client message"));
@@ -341,63 +1487,57 @@ server_eval_packet(Config* config, Server* server, ClientPacket* packet) {
 
     switch (server->token_stream->type) {
         case PROTOCOL_MSG_TASK_RUN: {
-            KeyValue res = get_task(server, config, args[0], vars);
-            if (!res.value) {
-                SERVER_RESPOND_FMT(server, config, packet, PROTOCOL_MSG_ERR, "Task '%s' not found", args[0]);
-                LOG_WARN(FMT_SERVER("Failed to find requested task '%s'", args[0]));
-                return -1;
-            }
-
-            Task* new_task = res.value;
-            if (server_task_wait_match(server, new_task)) {
-                SERVER_RESPOND_FMT(server, config, packet, PROTOCOL_MSG_SUCCESS, "Task '%s' put in queue", args[0]);
-                LOG_INFO(FMT_SERVER("Queuing task '%s'", args[0]));
-            }
-            else {
-                int launch_status = server_task_launch(server, config, new_task);
-
-                if (launch_status != 0) {
+            uint32_t run_id = 0;
+            switch (server_task_submit(server, config, args[0], vars, &run_id)) {
+                case SUBMIT_STARTED:
+                    SERVER_RESPOND_FMT(server, config, packet, PROTOCOL_MSG_SUCCESS, "Task '%s' started succesfully", args[0]);
+                    break;
+                case SUBMIT_QUEUED:
+                    SERVER_RESPOND_FMT(server, config, packet, PROTOCOL_MSG_SUCCESS, "Task '%s' put in queue", args[0]);
+                    break;
+                case SUBMIT_NOT_FOUND:
+                    SERVER_RESPOND_FMT(server, config, packet, PROTOCOL_MSG_ERR, "Task '%s' not found", args[0]);
+                    return -1;
+                case SUBMIT_REJECTED:
+                    SERVER_RESPOND_FMT(server, config, packet, PROTOCOL_MSG_ERR, "Task queue is full, '%s' was not queued", args[0]);
+                    return -1;
+                case SUBMIT_FAILED:
                     SERVER_RESPOND_FMT(server, config, packet, PROTOCOL_MSG_ERR, "Failed to run task '%s'", args[0]);
-                    LOG_WARN(FMT_SERVER("Failed to start task '%s'", args[0]));
                     return -1;
-                }
-                else {
-                    SERVER_RESPOND_FMT(server, config, packet, PROTOCOL_MSG_SUCCESS, "Task '%s' started succesfully", args[0]);
-                    LOG_INFO(FMT_SERVER("Starting task '%s'", args[0]));
-                    store_remove_at(server->task_store, res.key);
-                }
             }
-
             break;
         }
 
         case PROTOCOL_MSG_WORKSPACE_SET: {
-            if (access(args[0], R_OK) != 0) {
+            if (server_workspace_set(server, config, args[0]) != 0) {
                 server_respond(server, config, packet, PROTOCOL_MSG_ERR, "Workspace not found");
-                LOG_WARN(FMT_SERVER("Failed to set active workspace as '%s'", args[0]));
                 return -1;
             }
-
-            strcpy(server->workspace, args[0]);
             SERVER_RESPOND_FMT(server, config, packet, PROTOCOL_MSG_SUCCESS, "Workspace '%s' set as active", args[0]);
-            LOG_INFO(FMT_SERVER("Using workspace '%s'", args[0]));
             break;
         }
 
-        // TODO: Get task info
-        /* case PROTOCOL_MSG_TASK_INFO: { */
-            /* break; */
-        /* } */
+        case PROTOCOL_MSG_TASK_INFO: {
+            server_task_info(server, config, packet, args[0]);
+            break;
+        }
 
-        // TODO: Get workspace info
-        /* case PROTOCOL_MSG_WORKSPACE_INFO: { */
-            /* break; */
-        /* } */
+        case PROTOCOL_MSG_WORKSPACE_INFO: {
+            server_workspace_info(server, config, packet, args[0]);
+            break;
+        }
 
-        // TODO: Get process info
-        /* case PROTOCOL_MSG_PROC_INFO: { */
-            /* break; */
-        /* } */
+        case PROTOCOL_MSG_PROC_INFO: {
+            server_proc_info(server, config, packet, args[0]);
+            break;
+        }
+
+        case PROTOCOL_MSG_STATS: {
+            if (args[0] && strcmp(args[0], "metrics") == 0) server_metrics_info(server, config, packet);
+            else if (args[0] && strcmp(args[0], "trace") == 0) server_trace_dump(server, config, packet);
+            else server_stats_info(server, config, packet);
+            break;
+        }
 
         default:
             server_respond(server, config, packet, PROTOCOL_MSG_ERR, "Invalid command");
@@ -406,6 +1546,18 @@ server_eval_packet(Config* config, Server* server, ClientPacket* packet) {
     return 0;
 }
 
+/// Evaluate one client request, everything allocated while handling it is released right after
+static void
+server_handle_packet(Server* server, Config* config, ClientPacket* packet) {
+    uint64_t received_us = timer_now_us();
+    ArenaMark mark = arena_mark(server->scratch);
+    log_set_request(++server->request_count);
+    server_eval_packet(config, server, packet);
+    histogram_record(HISTOGRAM_REQUEST, timer_now_us() - received_us);
+    log_set_request(0);
+    arena_reset_to(server->scratch, mark);
+}
+
 static inline void
 set_sock_desc(int sock_desc, int* max_sock_desc, fd_set* read_flags) {
     if (sock_desc > 0) FD_SET(sock_desc, read_flags);
@@ -415,89 +1567,324 @@ set_sock_desc(int sock_desc, int* max_sock_desc, fd_set* read_flags) {
 static inline void
 server_cleanup(Server* server) {
     for (int i = server->client_stack->count-1; i >= 0; i--) {
-        int sock = *(int*)stack_pop(server->client_stack);
+        int sock = *socket_stack_pop(server->client_stack);
         close(sock);
     }
+    spill_close(server->spill);
+    if (server->metrics_socket >= 0) close(server->metrics_socket);
+    for (int i = 0; i < server->scrape_count; i++) {
+        close(server->scrape_sockets[i]);
+    }
+    for (int i = 0; i < server->outbox_count; i++) {
+        close(server->outboxes[i].socket);
+        server_outbox_clear(&server->outboxes[i]);
+    }
+    for (int i = 0; i < server->channel_count; i++) {
+        shm_channel_close(&server->channels[i]);
+    }
+    if (server->local_socket >= 0) {
+        close(server->local_socket);
+        unlink(server->local_path);
+    }
+    if (server->conn.socket >= 0) close(server->conn.socket);
+    if (__trace.events) trace_dump();
+    trace_close();
 }
 
 static int
-server_check_activity(Server* server, Config* config) {
+server_check_activity(Server* server, Config* config, long timeout_us) {
     int max_sock_desc = server->conn.socket;
 
     // Add client sockets to descriptor set
     for (int i = server->client_stack->count-1; i >= 0; i--) {
-        int sock = *(int*)stack_get(server->client_stack, i);
+        int sock = *socket_stack_get(server->client_stack, i);
         set_sock_desc(sock, &max_sock_desc, &server->conn.read_flags);
     }
 
+    // Wait for slow clients to take more of their snapshot
+    for (int i = 0; i < server->outbox_count; i++) {
+        set_sock_desc(server->outboxes[i].socket, &max_sock_desc, &server->conn.write_flags);
+    }
+
     // Add process pipes to descriptor set
-    for (int i = server->process_store->capacity-1; i >= 0; i--) {
-        KeyValue res = store_get(server->process_store, i);
-        if (!res.value) continue;
-        TaskProcess* process = res.value;
+    store_foreach(server->process_store, i) {
+        TaskProcess* process = proc_store_get(server->process_store, i);
 
         set_sock_desc(process->out_fd_r, &max_sock_desc, &server->conn.read_flags);
         set_sock_desc(process->err_fd_r, &max_sock_desc, &server->conn.read_flags);
+        set_sock_desc(process->exec_fd_r, &max_sock_desc, &server->conn.read_flags);
+        // Wakes the loop as soon as the task exits, instead of noticing it on the next select timeout
+        set_sock_desc(process->pid_fd, &max_sock_desc, &server->conn.read_flags);
+    }
+
+    if (server->metrics_socket >= 0) set_sock_desc(server->metrics_socket, &max_sock_desc, &server->conn.read_flags);
+    for (int i = 0; i < server->scrape_count; i++) {
+        set_sock_desc(server->scrape_sockets[i], &max_sock_desc, &server->conn.read_flags);
+    }
+    if (server->local_socket >= 0) set_sock_desc(server->local_socket, &max_sock_desc, &server->conn.read_flags);
+
+    // The agent announces it is going to sleep before checking the request rings one last time, a client
+    // writing after that rings the doorbell
+    unsigned char pending = 0;
+    for (int i = 0; i < server->channel_count; i++) {
+        ShmChannel* channel = &server->channels[i];
+        __atomic_store_n(&channel->requests->consumer_sleeping, 1, __ATOMIC_SEQ_CST);
+        // Requests of a channel with parked replies wait, the client reading replies rings the doorbell instead
+        if (channel->parked_len > 0) {
+            __atomic_store_n(&channel->responses->producer_sleeping, 1, __ATOMIC_SEQ_CST);
+            if (shm_channel_unpark_ready(channel)) pending = 1;
+        }
+        else if (shm_ring_pending(channel->requests)) pending = 1;
+        set_sock_desc(channel->sock, &max_sock_desc, &server->conn.read_flags);
+        set_sock_desc(channel->agent_fd, &max_sock_desc, &server->conn.read_flags);
     }
 
     // Poll for file descriptor changes
-    struct timeval waitd = {config->settings.connection.select_timeout_sec,
-                            config->settings.connection.select_timeout_usec}; // 15fps
-    return select(max_sock_desc + 1, &server->conn.read_flags, NULL, NULL, &waitd);
+    struct timeval waitd = {timeout_us / 1000000, timeout_us % 1000000};
+    if (pending) waitd = (struct timeval){0, 0};
+    return select(max_sock_desc + 1, &server->conn.read_flags, &server->conn.write_flags, NULL, &waitd);
 }
 
 static int
-server_handle_incoming(Connection* conn, Config* config, Stack* client_stack) {
-    if (FD_ISSET(conn->socket, &conn->read_flags)) {
-        // Try accepting a new connection from main socket
-        socklen_t addr_len = 0;
-        int new_socket = accept(conn->socket, (struct sockaddr*)&conn->address, &addr_len);
-        if (new_socket < 1) {
+server_handle_incoming(Connection* conn, Config* config, socket_stack* client_stack) {
+    if (conn->socket < 0 || !FD_ISSET(conn->socket, &conn->read_flags)) return 0;
+
+    // Drain every pending connection, so a burst is handled in one loop iteration
+    int accepted = 0;
+    while (1) {
+        socklen_t addr_len = sizeof(conn->address);
+        int new_socket = accept4(conn->socket,
+                                 (struct sockaddr*)&conn->address,
+                                 &addr_len,
+                                 SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (new_socket < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            if (errno == EINTR || errno == ECONNABORTED) continue;
             perror("Error accepting new connection");
             return -1;
         }
 
         // If over the max client limit, instantly close the connection
         if (client_stack->count >= config->settings.connection.max_clients) {
+            METRICS_INC(METRIC_CONNECTIONS_REJECTED);
+            LOG_DEBUG(FMT_SERVER("Rejected connection %d, client limit reached", new_socket));
             close(new_socket);
-            return 0;
-        }
-
-        if (socket_set_nonblock(new_socket) != 0) {
-            perror("Failed to set connection socket as non-blocking");
-            return -1;
+            continue;
         }
 
         if (socket_set_timeout(new_socket, SO_RCVTIMEO, config->settings.connection.sock_timeout_sec) != 0 ||
             socket_set_timeout(new_socket, SO_SNDTIMEO, config->settings.connection.sock_timeout_sec) != 0)
         {
             perror("Failed to set socket timeout options");
+            close(new_socket);
+            continue;
+        }
+
+        socket_stack_push(client_stack, new_socket);
+        METRICS_INC(METRIC_CONNECTIONS_ACCEPTED);
+        LOG_DEBUG(FMT_SERVER("New connection %d", new_socket));
+        accepted++;
+    }
+    return accepted;
+}
+
+/// Accept clients of the local socket and hand each of them a new shared memory channel
+static int
+server_handle_local(Server* server, Config* config) {
+    if (server->local_socket < 0 || !FD_ISSET(server->local_socket, &server->conn.read_flags)) return 0;
+
+    // Rings always fit a few whole messages
+    int ring_size = config->settings.connection.channel_ring_size;
+    if (ring_size < config->settings.connection.buffer_size * 4) ring_size = config->settings.connection.buffer_size * 4;
+
+    int accepted = 0;
+    while (1) {
+        int new_socket = accept4(server->local_socket, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (new_socket < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            perror("Error accepting new local connection");
             return -1;
         }
 
-        stack_push(client_stack, &new_socket);
-        LOG_DEBUG("New connection %d", new_socket);
-        return 1;
+        if (server->channel_count >= config->settings.connection.max_channels) {
+            METRICS_INC(METRIC_CONNECTIONS_REJECTED);
+            LOG_DEBUG(FMT_SERVER("Rejected local connection %d, channel limit reached", new_socket));
+            close(new_socket);
+            continue;
+        }
+
+        ShmChannel* channel = &server->channels[server->channel_count];
+        if (shm_channel_create(channel, ring_size) != 0 || shm_channel_send(channel, new_socket) != 0) {
+            LOG_WARN(FMT_SERVER("Unable to hand a shared memory channel over to local connection %d", new_socket));
+            shm_channel_close(channel);
+            close(new_socket);
+            continue;
+        }
+
+        // The socket only tells when the client is gone from now on
+        channel->sock = new_socket;
+        server->channel_count++;
+        METRICS_INC(METRIC_CONNECTIONS_ACCEPTED);
+        LOG_DEBUG(FMT_SERVER("New shared memory channel %d", new_socket));
+        accepted++;
     }
-    return 0;
+    return accepted;
 }
 
 static void
-server_process_print(Server* server, Config* config, TaskProcess* process) {
-    memset(server->conn.in_buf, 0, config->settings.connection.buffer_size);
-    if (FD_ISSET(process->out_fd_r, &server->conn.read_flags)) {
-        int value_read = read(process->out_fd_r, server->conn.in_buf, config->settings.connection.buffer_size);
-        if (value_read > 0) {
-            LOG_INFO(FMT_TARGET(process->task_name, "%s", server->conn.in_buf));
-            memset(server->conn.in_buf, 0, value_read);
+server_channel_remove(Server* server, int idx) {
+    LOG_DEBUG(FMT_SERVER("Shared memory channel closed - socket %i", server->channels[idx].sock));
+    shm_channel_close(&server->channels[idx]);
+    server->channel_count--;
+    if (idx != server->channel_count) server->channels[idx] = server->channels[server->channel_count];
+}
+
+/// Evaluate requests waiting in the channel rings, dropping channels whose client is gone or does not read
+/// its replies
+static void
+server_handle_channels(Server* server, Config* config) {
+    for (int i = server->channel_count - 1; i >= 0; i--) {
+        ShmChannel* channel = &server->channels[i];
+        __atomic_store_n(&channel->requests->consumer_sleeping, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&channel->responses->producer_sleeping, 0, __ATOMIC_RELAXED);
+        if (FD_ISSET(channel->agent_fd, &server->conn.read_flags)) shm_drain(channel->agent_fd);
+
+        // Parked replies go out before any further request is evaluated
+        uint32_t parked = channel->parked_len;
+        if (parked > 0 && shm_channel_unpark(channel) < parked) {
+            shm_notify(&channel->responses->consumer_sleeping, channel->client_fd);
+        }
+
+        int len = 0;
+        for (int handled = 0; handled < SERVER_CHANNEL_BATCH && channel->parked_len == 0; handled++) {
+            len = shm_ring_read(channel->requests, channel->ring_size, server->conn.in_buf,
+                                config->settings.connection.buffer_size);
+            if (len < 1) break;
+            shm_notify(&channel->requests->producer_sleeping, channel->client_fd);
+
+            ClientPacket packet = {
+                .client  = i,
+                .socket  = channel->sock,
+                .len     = len,
+                .data    = server->conn.in_buf,
+                .channel = channel,
+            };
+            server_handle_packet(server, config, &packet);
+        }
+        if (len < 0) {
+            LOG_WARN(FMT_SERVER("Received a malformed frame from shared memory channel '%d'", channel->sock));
+            server_channel_remove(server, i);
+            continue;
+        }
+        if (channel->broken) {
+            LOG_WARN(FMT_SERVER("Shared memory channel '%d' is not reading its replies", channel->sock));
+            server_channel_remove(server, i);
+            continue;
+        }
+
+        if (FD_ISSET(channel->sock, &server->conn.read_flags)) {
+            char byte;
+            ssize_t value_read = read(channel->sock, &byte, 1);
+            if (value_read == 0 || (value_read < 0 && errno != EAGAIN && errno != EINTR)) {
+                server_channel_remove(server, i);
+            }
         }
     }
+}
 
-    if (FD_ISSET(process->err_fd_r, &server->conn.read_flags)) {
-        int value_read = read(process->err_fd_r, server->conn.in_buf, config->settings.connection.buffer_size);
-        if (value_read > 0) {
-            LOG_WARN(FMT_TARGET(process->task_name, "%s", server->conn.in_buf));
+/// Pass one line of task output on to the hooks, or to the log
+static void
+process_line(Server* server, TaskProcess* process, unsigned char is_err, const char* line, int len) {
+    if (server->hooks.output) {
+        server->hooks.output(server->hooks.ctx, process, is_err ? LOG_STREAM_STDERR : LOG_STREAM_STDOUT, line, len);
+    }
+    else if (is_err) LOG_WARN(FMT_OUTPUT(process, LOG_STREAM_STDERR, "%.*s", len, line));
+    else LOG_INFO(FMT_OUTPUT(process, LOG_STREAM_STDOUT, "%.*s", len, line));
+}
+
+/// Pass on the unfinished line of a stream, once the stream ends or the line no longer fits
+static void
+process_line_flush(Server* server, TaskProcess* process, unsigned char is_err, int line_max) {
+    if (!process->line_buf || process->line_len[is_err] == 0) return;
+    process_line(server, process, is_err, process->line_buf + is_err * line_max, process->line_len[is_err]);
+    process->line_len[is_err] = 0;
+}
+
+static inline int
+process_read(Server* server, Config* config, TaskProcess* process, int* fd, unsigned char is_err) {
+    int line_max = config->settings.connection.buffer_size;
+    int value_read = read(*fd, server->conn.in_buf, line_max);
+    if (value_read > 0) {
+        metrics_add(METRIC_OUTPUT_BYTES, value_read);
+        if (!process->output_seen) {
+            process->output_seen = 1;
+            TRACE(TRACE_FIRST_OUTPUT, process->trace_id, process->pid, process->task_name, is_err);
         }
+
+        // One record per line, so structured output never carries a multi-line message. A line split across
+        // reads is put together in the line buffer first, one longer than the buffer is passed on in parts.
+        char* line = server->conn.in_buf;
+        char* end = line + value_read;
+        while (line < end) {
+            char* line_end = memchr(line, '\n', end - line);
+            int len = (line_end ? line_end : end) - line;
+            uint16_t* carried = &process->line_len[is_err];
+
+            if (!line_end && !process->line_buf) {
+                process->line_buf = strheap_alloc(server->strings, line_max * 2);
+            }
+            if ((*carried > 0 || !line_end) && process->line_buf) {
+                char* buf = process->line_buf + is_err * line_max;
+                int take = len < line_max - *carried ? len : line_max - *carried;
+                memcpy(buf + *carried, line, take);
+                *carried += take;
+                line += take;
+                if (line_end || *carried == line_max) process_line_flush(server, process, is_err, line_max);
+                if (line == line_end) line++;
+                continue;
+            }
+
+            process_line(server, process, is_err, line, len);
+            line += line_end ? len + 1 : len;
+        }
+    }
+    // Write end closed, stop polling the pipe
+    else if (value_read == 0) {
+        process_line_flush(server, process, is_err, line_max);
+        close(*fd);
+        *fd = -1;
+    }
+    return value_read;
+}
+
+/// Record the spawn latency of a process once its exec pipe closes, given the time the loop woke up to it
+static void
+server_process_exec_check(TaskProcess* process, uint64_t woke_us) {
+    int exec_errno = 0;
+    ssize_t value_read = read(process->exec_fd_r, &exec_errno, sizeof(int));
+    if (value_read < 0 && (errno == EAGAIN || errno == EINTR)) return;
+
+    if (value_read == 0) histogram_record(HISTOGRAM_SPAWN, woke_us - process->spawn_us);
+    close(process->exec_fd_r);
+    process->exec_fd_r = -1;
+}
+
+/// Read all output left in the pipes of a finished process
+static void
+server_process_drain(Server* server, Config* config, TaskProcess* process) {
+    while (process->out_fd_r >= 0 && process_read(server, config, process, &process->out_fd_r, 0) > 0);
+    while (process->err_fd_r >= 0 && process_read(server, config, process, &process->err_fd_r, 1) > 0);
+}
+
+static void
+server_process_print(Server* server, Config* config, TaskProcess* process) {
+    if (process->out_fd_r >= 0 && FD_ISSET(process->out_fd_r, &server->conn.read_flags)) {
+        process_read(server, config, process, &process->out_fd_r, 0);
+    }
+
+    if (process->err_fd_r >= 0 && FD_ISSET(process->err_fd_r, &server->conn.read_flags)) {
+        process_read(server, config, process, &process->err_fd_r, 1);
     }
 }
 
@@ -505,131 +1892,322 @@ server_process_print(Server* server, Config* config, TaskProcess* process) {
  * RUN LOOP
  ****************************************************/
 
+/// Set up everything the agent needs before its first loop iteration. A port of 0 or less runs the agent
+/// without a TCP listener, for a program driving it in-process. Returns 0 on success and -1 if failed.
 int
-run_as_server(Config* config) {
-    Server server = {0};
-    server.conn = (Connection){0};
-    if (connection_init(config, &server.conn) < 1) {
-        LOG_ERR(FMT_SERVER("Unable to initialize connection"));
-        /* fprintf(stderr, "[FATAL] Unable to initialize connection\n"); */
-        return -1;
+server_init(Server* server, Config* config) {
+    server->conn = (Connection){0};
+    if (config->args.port > 0) {
+        if (connection_init(config, &server->conn) < 1) {
+            LOG_ERR(FMT_SERVER("Unable to initialize connection"));
+            /* fprintf(stderr, "[FATAL] Unable to initialize connection\n"); */
+            return -1;
+        }
+    }
+    else {
+        server->conn.socket  = -1;
+        server->conn.in_buf  = MMALLOC_TAG(sizeof(char) * config->settings.connection.buffer_size, NET);
+        server->conn.out_buf = MMALLOC_TAG(sizeof(char) * config->settings.connection.buffer_size, NET);
+        if (!server->conn.in_buf || !server->conn.out_buf) {
+            LOG_ERR(FMT_SERVER("Failed to allocate server data"));
+            return -1;
+        }
     }
 
-    server.workspace     = arena_alloc(sizeof(char) * config->settings.general.workspace_buf_size);
-    server.token_stream  = protocol_tokenstream_alloc(config->settings.general.protocol_token_count);
-    server.client_stack  = stack_new(config->settings.connection.max_clients, sizeof(int));
-    server.process_store = store_new(config->settings.general.process_store_count,
-                                     sizeof(TaskProcess) +
-                                     sizeof(char) * config->settings.general.task_name_size);
-    server.task_store    = store_new(config->settings.general.task_store_count,
-                                     sizeof(Task) +
-                                     (sizeof(char) * config->settings.general.task_buf_size) +
-                                     (sizeof(char*) * config->settings.general.task_var_max_count));
-    if (!server.workspace     ||
-        !server.token_stream  ||
-        !server.client_stack  ||
-        !server.process_store ||
-        !server.task_store)
+    server->workspace     = arena_alloc_tagged(sizeof(char) * config->settings.general.workspace_buf_size, ARENA_TAG_SERVER);
+    server->token_stream  = protocol_tokenstream_alloc(config->settings.general.protocol_token_count);
+    server->scratch       = arena_child_new(config->settings.general.scratch_size);
+    server->client_stack  = socket_stack_new(config->settings.connection.max_clients);
+    server->process_store = proc_store_new(config->settings.general.process_store_count);
+    server->queue_max     = config->settings.general.task_queue_max;
+    server->strings       = strheap_new(config->settings.general.string_heap_size);
+    server->spill         = spill_new(config->settings.general.task_spill_dir,
+                                     config->settings.general.task_spill_max);
+    server->timers        = timer_wheel_new(config->settings.general.process_store_count * 2,
+                                           config->settings.general.timer_tick_ms,
+                                           timer_now_ms());
+    server->history       = task_history_new(config->settings.general.task_history_count,
+                                            config->settings.general.task_name_size);
+    server->kill_grace_ms = config->settings.general.task_kill_grace_ms;
+    server->channels      = MMALLOC_TAG(sizeof(ShmChannel) * config->settings.connection.max_channels, SERVER);
+    server->metrics_socket = -1;
+    server->scrape_count   = 0;
+    server->outbox_count   = 0;
+    memset(server->outboxes, 0, sizeof(server->outboxes));
+    server->local_socket   = -1;
+    if (!server->workspace     ||
+        !server->channels      ||
+        !server->token_stream  ||
+        !server->scratch       ||
+        !server->client_stack  ||
+        !server->process_store ||
+        !server->strings       ||
+        !server->timers        ||
+        !server->history)
     {
         LOG_ERR(FMT_SERVER("Failed to allocate server data"));
+        server_log_alloc_stats();
         return -1;
     }
 
-    LOG_INFO(FMT_SERVER("dpatch server started at port %d", config->args.port));
-    server.running = 1;
-    while(server.running) {
-        // Check for any activity in sockets
-        connection_init_set(&server.conn, config);
-        int activity = server_check_activity(&server, config);
-        if ((activity < 0) && (errno != EINTR)) {
-            LOG_ERR(FMT_SERVER("Unknown error during select()"));
-        }
-
-        // Check for incoming connections
-        int incoming = server_handle_incoming(&server.conn, config, server.client_stack);
-        if (incoming < 0) {
-            LOG_WARN(FMT_SERVER("Error receiving an incoming connection"));
-        }
-
-        // Read from client sockets
-        for (int i = server.client_stack->count-1; i >= 0; i--) {
-            int sock_desc = *(int*)stack_get(server.client_stack, i);
-            if (sock_desc == 0) {
-                stack_remove_at_fast(server.client_stack, i);
-                continue;
-            }
+    // All long-lived server data is allocated, give untouched arena memory back to the OS
+    arena_trim();
 
-            if (FD_ISSET(sock_desc, &server.conn.read_flags)) {
-                int value_read = read(sock_desc, server.conn.in_buf, config->settings.connection.buffer_size);
-
-                if (value_read > 0) {
-                    ClientPacket packet = {
-                        .client = i,
-                        .socket = sock_desc,
-                        .len    = value_read,
-                        .data   = server.conn.in_buf,
-                    };
-                    server_eval_packet(config, &server, &packet);
-                }
-                // Connection closed
-                else if (value_read == 0) {
-                    LOG_DEBUG("Connection closed - socket %i", sock_desc);
-                    stack_remove_at_fast(server.client_stack, i);
-                    close(sock_desc);
-                }
-                // Error
-                else {
-                    LOG_WARN(FMT_SERVER("Error reading data from client socket '%d'", sock_desc));
-                }
-            }
+    server->placement  = config->settings.general.placement;
+    server->node_count = affinity_node_count();
+    if (sched_getaffinity(0, sizeof(cpu_set_t), &server->agent_cpus) != 0) {
+        LOG_WARN(FMT_SERVER("Unable to read agent CPU affinity, disabling task placement"));
+        server->placement = PLACEMENT_NONE;
+    }
+
+    // Fall back to running tasks without isolation if the delegated subtree cannot be used
+    if (config->settings.general.cgroup_root) {
+        CgroupRetCode cg_status = cgroup_init(config->settings.general.cgroup_root);
+        if (cg_status == CGROUP_OK) {
+            server->cgroup_root = config->settings.general.cgroup_root;
+            LOG_INFO(FMT_SERVER("Isolating tasks in cgroups under '%s'", server->cgroup_root));
+        }
+        else {
+            LOG_WARN(FMT_SERVER("'%s' is not a writable cgroup v2 directory (%d), running tasks without isolation",
+                                config->settings.general.cgroup_root,
+                                cg_status));
         }
+    }
 
-        // Check running task processes
-        for (int i = server.process_store->capacity-1; i >= 0; i--) {
-            KeyValue res = store_get(server.process_store, i);
-            if (!res.value) continue;
-            TaskProcess* process = res.value;
+    if (config->args.trace_file) {
+        if (trace_init(config->args.trace_file, config->settings.general.trace_capacity) == 0) {
+            LOG_INFO(FMT_SERVER("Tracing task lifecycles into '%s'", config->args.trace_file));
+        }
+        else {
+            LOG_WARN(FMT_SERVER("Unable to trace task lifecycles, running without tracing"));
+        }
+    }
 
-            // Check process status
-            int status = 0;
-            pid_t w_pid = waitpid(process->pid, &status, WNOHANG | WUNTRACED);
+    if (config->settings.connection.metrics_port > 0) {
+        server->metrics_socket = socket_listen_local(config->settings.connection.metrics_port, 16);
+        if (server->metrics_socket >= 0) {
+            LOG_INFO(FMT_SERVER("Serving metrics at http://127.0.0.1:%d/metrics", config->settings.connection.metrics_port));
+        }
+        else {
+            LOG_WARN(FMT_SERVER("Unable to serve metrics at port %d", config->settings.connection.metrics_port));
+        }
+    }
 
-            // If we have an exit status, log it and remove the process from store
-            if (w_pid != 0) {
-                LOG_DEBUG("Completed process name: %s, pid: %d", process->task_name, process->pid);
+    if (config->args.local_path) {
+        server->local_socket = shm_listen(config->args.local_path, config->settings.connection.max_pending_conn);
+        if (server->local_socket >= 0) {
+            server->local_path = config->args.local_path;
+            LOG_INFO(FMT_SERVER("Serving local clients through shared memory at '%s'", config->args.local_path));
+        }
+        else {
+            LOG_WARN(FMT_SERVER("Unable to serve local clients at '%s'", config->args.local_path));
+        }
+    }
 
-                int name_len = strlen(process->task_name);
-                char name_buf[name_len+1];
-                memset(name_buf, 0, name_len+1);
-                memcpy(name_buf, process->task_name, name_len);
+    server->running = 1;
+    return 0;
+}
+
+/// Run one iteration of the agent loop, waiting at most 'timeout_us' for activity. Returns the amount of task
+/// processes reaped during the iteration.
+int
+server_step(Server* server, Config* config, long timeout_us) {
+    int reaped = 0;
+    METRICS_INC(METRIC_LOOP_ITERATIONS);
+    // Check for any activity in sockets
+    connection_init_set(&server->conn, config);
+    int activity = server_check_activity(server, config, timeout_us);
+    if ((activity < 0) && (errno != EINTR)) {
+        LOG_ERR(FMT_SERVER("Unknown error during select()"));
+    }
+    // The descriptor sets are left as they were on error, nothing in them is actually readable
+    if (activity < 0) {
+        FD_ZERO(&server->conn.read_flags);
+        FD_ZERO(&server->conn.write_flags);
+    }
+    uint64_t woke_us = timer_now_us();
 
-                // Error
-                if (w_pid < 0) {
-                    perror("Error waiting for task process");
+    // Fire expired task deadlines
+    timer_wheel_advance(server->timers, timer_now_ms());
+
+    // Check for incoming connections
+    int incoming = server_handle_incoming(&server->conn, config, server->client_stack);
+    if (incoming < 0) {
+        LOG_WARN(FMT_SERVER("Error receiving an incoming connection"));
+    }
+
+    // Answer metrics scrapes
+    if (server->metrics_socket >= 0) server_handle_metrics(server, config);
+
+    // Send the rest of snapshots to slow socket clients
+    if (server->outbox_count > 0) server_handle_outboxes(server);
+
+    // Hand channels over to new local clients
+    if (server_handle_local(server, config) < 0) {
+        LOG_WARN(FMT_SERVER("Error receiving an incoming local connection"));
+    }
+
+    // Read from client sockets
+    for (int i = server->client_stack->count-1; i >= 0; i--) {
+        int sock_desc = *socket_stack_get(server->client_stack, i);
+        if (sock_desc == 0) {
+            socket_stack_remove_at_fast(server->client_stack, i);
+            continue;
+        }
+
+        if (FD_ISSET(sock_desc, &server->conn.read_flags)) {
+            int value_read = read(sock_desc, server->conn.in_buf, config->settings.connection.buffer_size);
+
+            if (value_read > 0) {
+                ClientPacket packet = {
+                    .client = i,
+                    .socket = sock_desc,
+                    .len    = value_read,
+                    .data   = server->conn.in_buf,
+                };
+                server_handle_packet(server, config, &packet);
+            }
+            // Connection closed
+            else if (value_read == 0) {
+                LOG_DEBUG(FMT_SERVER("Connection closed - socket %i", sock_desc));
+                socket_stack_remove_at_fast(server->client_stack, i);
+                close(sock_desc);
+            }
+            // Error
+            else {
+                LOG_WARN(FMT_SERVER("Error reading data from client socket '%d'", sock_desc));
+            }
+        }
+    }
+
+    // Take requests from shared memory channels
+    server_handle_channels(server, config);
+
+    // Check running task processes
+    store_foreach(server->process_store, i) {
+        TaskProcess* process = proc_store_get(server->process_store, i);
+
+        // Descriptors of a process launched after the wakeup may reuse numbers still flagged in the set
+        if (process->spawn_us < woke_us) {
+            if (process->exec_fd_r >= 0 && FD_ISSET(process->exec_fd_r, &server->conn.read_flags)) {
+                server_process_exec_check(process, woke_us);
+            }
+            if (process->pid_fd >= 0 && process->exit_us == 0 &&
+                FD_ISSET(process->pid_fd, &server->conn.read_flags))
+            {
+                process->exit_us = woke_us;
+            }
+        }
+
+        // Check process status, collecting resource usage of the reaped child
+        int status = 0;
+        struct rusage ru = {0};
+        pid_t w_pid = wait4(process->pid, &status, WNOHANG, &ru);
+
+        // If we have an exit status, log it and remove the process from store
+        if (w_pid != 0) {
+            LOG_DEBUG(FMT_PROCESS(process, "Completed process"));
+
+            int name_len = strlen(process->task_name);
+            char name_buf[name_len+1];
+            memset(name_buf, 0, name_len+1);
+            memcpy(name_buf, process->task_name, name_len);
+            reaped++;
+
+            // Error
+            if (w_pid < 0) {
+                perror("Error waiting for task process");
+                status = -1;
+            }
+            // PID returned with status
+            else if (w_pid > 0) {
+                if (process->exit_us) histogram_record(HISTOGRAM_REAP, timer_now_us() - process->exit_us);
+                TRACE_AT(TRACE_EXITED, process->trace_id, process->pid, process->task_name,
+                         WIFEXITED(status) ? WEXITSTATUS(status) : -WTERMSIG(status),
+                         process->exit_us ? process->exit_us * 1000 : trace_now_ns());
+                TRACE(TRACE_REAPED, process->trace_id, process->pid, process->task_name, 0);
+
+                // With history disabled the usage is still recorded for the log line, just not kept
+                TaskUsage untracked = {0};
+                TaskUsage* usage = task_history_push(server->history, name_buf);
+                if (!usage) {
+                    untracked.task_name = name_buf;
+                    usage = &untracked;
                 }
-                // PID returned with status
-                else if (w_pid > 0) {
-                    time_t t = time(0);
-                    time_t diff = t - process->start_time;
-                    char diff_buf[20];
-                    strftime(diff_buf, 20, "%H:%M:%S", localtime(&diff));
-                    LOG_INFO(FMT_SERVER("Task '%s' finished in %s with status code '%d'",
-                                        name_buf,
-                                        diff_buf,
-                                        WEXITSTATUS(status)));
+                task_usage_record(usage, process, status, &ru, timer_now_ms());
+
+                CgroupStats cg_stats;
+                if (process->cgroup_id &&
+                    cgroup_read_stats(server->cgroup_root, process->cgroup_id, &cg_stats) == CGROUP_OK)
+                {
+                    usage->cg_cpu_usec = cg_stats.usage_usec;
+                    usage->cg_mem_peak = cg_stats.memory_peak;
                 }
 
-                close(process->out_fd_r);
-                close(process->err_fd_r);
-                store_remove_at(server.process_store, i);
-                server_check_task_queue(&server, config, name_buf, name_len);
+                if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) METRICS_INC(METRIC_TASKS_FAILED);
+
+                char status_buf[20];
+                task_status_format(status_buf, sizeof(status_buf), status);
+                LOG_INFO(FMT_PROCESS(process, "Task '%s' finished in %.3fs with %s (user %.3fs, sys %.3fs, max rss %ldKB)",
+                                    name_buf,
+                                    usage->wall_ms / 1000.0,
+                                    status_buf,
+                                    usage->utime_us / 1000000.0,
+                                    usage->stime_us / 1000000.0,
+                                    usage->maxrss_kb));
             }
-            // Print STDOUT & STDERR messages from running child process
-            else {
-                server_process_print(&server, config, process);
+
+            // Reclaim any descendants left behind by a timed out task
+            timer_cancel(server->timers, process->timer_id);
+            if (process->kill_stage != KILLSTAGE_NONE) {
+                kill(-process->pid, SIGKILL);
+            }
+
+            // Leftover processes may still be exiting, so retry removing a busy cgroup a bit later
+            if (process->cgroup_id &&
+                cgroup_remove(server->cgroup_root, process->cgroup_id) != CGROUP_OK)
+            {
+                timer_add(server->timers,
+                          timer_now_ms() + 250,
+                          server_cgroup_cleanup,
+                          server,
+                          process->cgroup_id);
             }
+
+            server_process_drain(server, config, process);
+            if (process->out_fd_r >= 0) close(process->out_fd_r);
+            if (process->err_fd_r >= 0) close(process->err_fd_r);
+            if (process->exec_fd_r >= 0) close(process->exec_fd_r);
+            if (process->pid_fd >= 0) close(process->pid_fd);
+            // A descendant may still hold the pipes open, whatever it wrote without a line break goes out now
+            process_line_flush(server, process, 0, config->settings.connection.buffer_size);
+            process_line_flush(server, process, 1, config->settings.connection.buffer_size);
+            strheap_free(server->strings, process->line_buf);
+            // Reported once all output is read, a task submitted from the hook launches as soon as the slot is free
+            if (server->hooks.exit) server->hooks.exit(server->hooks.ctx, process, status);
+            strheap_free(server->strings, process->task_name);
+            proc_store_remove_at(server->process_store, i);
+            server_check_task_queue(server, config);
+        }
+        // Print STDOUT & STDERR messages from running child process
+        else {
+            server_process_print(server, config, process);
         }
+    }
 
+    return reaped;
+}
+
+int
+run_as_server(Config* config) {
+    Server server = {0};
+    if (server_init(&server, config) != 0) return -1;
+
+    LOG_INFO(FMT_SERVER("dpatch server started at port %d", config->args.port));
+    long timeout_us = config->settings.connection.select_timeout_sec * 1000000L +
+                      config->settings.connection.select_timeout_usec; // 15fps
+    while (server.running && !__server_stop) {
+        server_step(&server, config, timeout_us);
     }
 
     server_cleanup(&server);
@@ -0,0 +1,452 @@
+#ifndef DPATCH_SHM_H
+#define DPATCH_SHM_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+
+#define SHM_FRAME_HEADER sizeof(uint32_t)
+// Polls of a ring before going to sleep on the doorbell, a reply from a busy agent usually lands within these.
+// Only spun with more than one CPU online, otherwise the other side can not run meanwhile.
+#define SHM_SPIN_COUNT 2000
+// Reply bytes parked for a client at most, a whole snapshot has to fit while the client is still reading its start.
+// Mapped without reserving, so only what is parked takes memory.
+#define SHM_PARK_MAX (4 * 1024 * 1024)
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SHM_CPU_RELAX() __builtin_ia32_pause()
+#else
+#define SHM_CPU_RELAX() __asm__ __volatile__("" ::: "memory")
+#endif
+
+// One direction of a channel, written by a single producer and read by a single consumer. Positions only ever
+// grow and are taken modulo the capacity, which is a power of two. The data follows the header.
+// A side sets its sleeping flag right before it sleeps on its doorbell, so the other side only makes a syscall to
+// wake a sleeper.
+typedef struct ShmRing_st {
+    uint64_t head __attribute__((aligned(64)));
+    uint32_t producer_sleeping;
+    uint64_t tail __attribute__((aligned(64)));
+    uint32_t consumer_sleeping;
+} ShmRing;
+
+// A pair of rings in one shared mapping. The agent creates it and hands the memfd and doorbells over to the client
+// through a Unix socket, the socket then only tells either side when the other one is gone.
+typedef struct ShmChannel_st {
+    int sock;
+    int memfd;
+    int agent_fd;
+    int client_fd;
+    uint32_t ring_size;
+    size_t map_size;
+    void* map;
+    ShmRing* requests;
+    ShmRing* responses;
+    // Replies of the agent that did not fit into the response ring yet, in the order written, up to SHM_PARK_MAX.
+    // They start at 'parked_head', so moving some into the ring does not shift the rest.
+    char* parked;
+    uint32_t parked_head;
+    uint32_t parked_len;
+    // Set once a reply fit neither, the client has then lost part of a response and the channel is of no use
+    unsigned char broken;
+} ShmChannel;
+
+/// Create a channel with rings of given size (rounded up to a power of two), returns 0 on success and -1 if failed
+int shm_channel_create(ShmChannel* channel, uint32_t ring_size);
+/// Hand a channel over to the client at the other end of a Unix socket, returns 0 on success
+int shm_channel_send(ShmChannel* channel, int sock);
+/// Take over a channel handed over through a Unix socket, returns 0 on success
+int shm_channel_recv(ShmChannel* channel, int sock);
+/// Connect to an agent at given Unix socket path and take over the channel it hands over, returns 0 on success
+int shm_channel_connect(ShmChannel* channel, const char* path);
+/// Unmap a channel and close its descriptors
+void shm_channel_close(ShmChannel* channel);
+/// Write a reply frame into the response ring of a channel, or park it behind earlier parked frames if the ring has
+/// no room. Never waits for the client. Returns 0 on success and -1 if it does not fit either, marking the
+/// channel broken.
+int shm_channel_reply(ShmChannel* channel, const char* buf, uint32_t len);
+/// Move parked reply frames into the response ring as far as they fit, returns the amount of bytes still parked
+uint32_t shm_channel_unpark(ShmChannel* channel);
+/// Tell whether the next parked reply frame of a channel fits into its response ring
+int shm_channel_unpark_ready(ShmChannel* channel);
+/// Open a non-blocking Unix socket listening at given path, replacing a stale socket file. Anything else already
+/// at the path is left alone. Returns the socket or -1 if failed.
+int shm_listen(const char* path, int backlog);
+/// Write a frame into a ring, returns 0 on success, -1 if there is no room right now and -2 if it never fits
+int shm_ring_write(ShmRing* ring, uint32_t ring_size, const char* buf, uint32_t len);
+/// Read the next frame from a ring, returns its length, 0 if the ring is empty or -1 if the frame is malformed
+/// or larger than the buffer
+int shm_ring_read(ShmRing* ring, uint32_t ring_size, char* buf, uint32_t buf_len);
+/// Tell whether a ring has a frame to read
+int shm_ring_pending(ShmRing* ring);
+/// Wait as the consumer until a ring has a frame to read, or as the producer until there is room for a frame of
+/// 'space' bytes if given, sleeping on the doorbell of the waiting side in between. Returns 0 when ready and -1 on
+/// timeout.
+int shm_ring_wait(ShmRing* ring, uint32_t ring_size, uint32_t space, int efd, int timeout_ms);
+/// Ring the doorbell of the other side if it sleeps on given flag, called after writing or reading frames
+void shm_notify(uint32_t* sleeping, int efd);
+/// Clear a doorbell after waking up to it
+void shm_drain(int efd);
+
+#ifdef SHM_IMPL
+
+static size_t
+shm__ring_bytes(uint32_t ring_size) {
+    return sizeof(ShmRing) + ring_size;
+}
+
+/// Point the channel at its rings inside the mapping
+static void
+shm__channel_layout(ShmChannel* channel) {
+    channel->requests  = (ShmRing*)channel->map;
+    channel->responses = (ShmRing*)((char*)channel->map + shm__ring_bytes(channel->ring_size));
+}
+
+int
+shm_channel_create(ShmChannel* channel, uint32_t ring_size) {
+    uint32_t size = 4096;
+    while (size < ring_size) size <<= 1;
+
+    *channel = (ShmChannel){ .sock = -1, .memfd = -1, .agent_fd = -1, .client_fd = -1 };
+    channel->ring_size = size;
+    channel->map_size  = shm__ring_bytes(size) * 2;
+    channel->memfd     = memfd_create("dpatch-channel", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (channel->memfd < 0) {
+        perror("Unable to create shared memory channel");
+        return -1;
+    }
+
+    // Sealed to its size, so the client can not shrink it under the agent's mapping
+    if (ftruncate(channel->memfd, channel->map_size) != 0 ||
+        fcntl(channel->memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) != 0)
+    {
+        perror("Unable to size shared memory channel");
+        shm_channel_close(channel);
+        return -1;
+    }
+
+    channel->map = mmap(NULL, channel->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, channel->memfd, 0);
+    channel->agent_fd  = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    channel->client_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (channel->map == MAP_FAILED || channel->agent_fd < 0 || channel->client_fd < 0) {
+        if (channel->map == MAP_FAILED) channel->map = NULL;
+        perror("Unable to map shared memory channel");
+        shm_channel_close(channel);
+        return -1;
+    }
+    shm__channel_layout(channel);
+    return 0;
+}
+
+int
+shm_channel_send(ShmChannel* channel, int sock) {
+    int fds[3] = { channel->memfd, channel->agent_fd, channel->client_fd };
+    char control[CMSG_SPACE(sizeof(fds))];
+    struct iovec iov = { .iov_base = &channel->ring_size, .iov_len = sizeof(uint32_t) };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control,
+        .msg_controllen = sizeof(control),
+    };
+    memset(control, 0, sizeof(control));
+
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type  = SCM_RIGHTS;
+    cmsg->cmsg_len   = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+    return sendmsg(sock, &msg, MSG_NOSIGNAL) == sizeof(uint32_t) ? 0 : -1;
+}
+
+int
+shm_channel_recv(ShmChannel* channel, int sock) {
+    int fds[3] = { -1, -1, -1 };
+    char control[CMSG_SPACE(sizeof(fds))];
+    uint32_t ring_size = 0;
+    struct iovec iov = { .iov_base = &ring_size, .iov_len = sizeof(uint32_t) };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control,
+        .msg_controllen = sizeof(control),
+    };
+
+    *channel = (ShmChannel){ .sock = sock, .memfd = -1, .agent_fd = -1, .client_fd = -1 };
+    if (recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) != sizeof(uint32_t)) return -1;
+
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    if (!cmsg || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(sizeof(fds))) return -1;
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+    channel->memfd     = fds[0];
+    channel->agent_fd  = fds[1];
+    channel->client_fd = fds[2];
+    channel->ring_size = ring_size;
+    channel->map_size  = shm__ring_bytes(ring_size) * 2;
+
+    struct stat st;
+    if ((ring_size & (ring_size - 1)) != 0 || fstat(channel->memfd, &st) != 0 || (size_t)st.st_size < channel->map_size) {
+        return -1;
+    }
+    channel->map = mmap(NULL, channel->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, channel->memfd, 0);
+    if (channel->map == MAP_FAILED) {
+        channel->map = NULL;
+        return -1;
+    }
+    shm__channel_layout(channel);
+    return 0;
+}
+
+int
+shm_channel_connect(ShmChannel* channel, const char* path) {
+    struct sockaddr_un address = { .sun_family = AF_UNIX };
+    snprintf(address.sun_path, sizeof(address.sun_path), "%s", path);
+
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0) {
+        perror("Unable to create socket");
+        return -1;
+    }
+    if (connect(sock, (struct sockaddr*)&address, sizeof(address)) != 0) {
+        perror("Unable to connect to agent");
+        close(sock);
+        return -1;
+    }
+    if (shm_channel_recv(channel, sock) != 0) {
+        fprintf(stderr, "Agent did not hand over a shared memory channel\n");
+        shm_channel_close(channel);
+        return -1;
+    }
+    return 0;
+}
+
+void
+shm_channel_close(ShmChannel* channel) {
+    if (channel->map) munmap(channel->map, channel->map_size);
+    if (channel->memfd >= 0) close(channel->memfd);
+    if (channel->agent_fd >= 0) close(channel->agent_fd);
+    if (channel->client_fd >= 0) close(channel->client_fd);
+    if (channel->sock >= 0) close(channel->sock);
+    if (channel->parked) munmap(channel->parked, SHM_PARK_MAX);
+    *channel = (ShmChannel){ .sock = -1, .memfd = -1, .agent_fd = -1, .client_fd = -1 };
+}
+
+int
+shm_listen(const char* path, int backlog) {
+    struct sockaddr_un address = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Unix socket path '%s' is too long\n", path);
+        return -1;
+    }
+    snprintf(address.sun_path, sizeof(address.sun_path), "%s", path);
+
+    // Only a socket left behind by an earlier agent is removed, never a file that happens to share the path
+    struct stat st;
+    if (lstat(path, &st) == 0) {
+        if (!S_ISSOCK(st.st_mode)) {
+            fprintf(stderr, "Unix socket path '%s' exists and is not a socket\n", path);
+            return -1;
+        }
+        unlink(path);
+    }
+
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sock < 0) {
+        perror("Unable to create socket");
+        return -1;
+    }
+
+    if (bind(sock, (struct sockaddr*)&address, sizeof(address)) != 0 || listen(sock, backlog) != 0) {
+        perror("Unable to listen to Unix socket");
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+/// Copy into a ring at given position, wrapping around its end
+static inline void
+shm__copy_in(ShmRing* ring, uint32_t ring_size, uint64_t pos, const void* src, uint32_t len) {
+    char* data = (char*)(ring + 1);
+    uint32_t offset = pos & (ring_size - 1);
+    uint32_t first = ring_size - offset < len ? ring_size - offset : len;
+    memcpy(data + offset, src, first);
+    memcpy(data, (const char*)src + first, len - first);
+}
+
+static inline void
+shm__copy_out(ShmRing* ring, uint32_t ring_size, uint64_t pos, void* dst, uint32_t len) {
+    char* data = (char*)(ring + 1);
+    uint32_t offset = pos & (ring_size - 1);
+    uint32_t first = ring_size - offset < len ? ring_size - offset : len;
+    memcpy(dst, data + offset, first);
+    memcpy((char*)dst + first, data, len - first);
+}
+
+int
+shm_ring_write(ShmRing* ring, uint32_t ring_size, const char* buf, uint32_t len) {
+    if (len + SHM_FRAME_HEADER > ring_size) return -2;
+
+    uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    if (head - tail > ring_size || ring_size - (head - tail) < len + SHM_FRAME_HEADER) return -1;
+
+    shm__copy_in(ring, ring_size, head, &len, SHM_FRAME_HEADER);
+    shm__copy_in(ring, ring_size, head + SHM_FRAME_HEADER, buf, len);
+    __atomic_store_n(&ring->head, head + SHM_FRAME_HEADER + len, __ATOMIC_RELEASE);
+    return 0;
+}
+
+int
+shm_ring_read(ShmRing* ring, uint32_t ring_size, char* buf, uint32_t buf_len) {
+    uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+    uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    if (head == tail) return 0;
+
+    // Positions come from the other process, so they are checked before anything is copied out
+    uint32_t len = 0;
+    if (head - tail < SHM_FRAME_HEADER || head - tail > ring_size) return -1;
+    shm__copy_out(ring, ring_size, tail, &len, SHM_FRAME_HEADER);
+    if (len > buf_len || len > head - tail - SHM_FRAME_HEADER) return -1;
+
+    shm__copy_out(ring, ring_size, tail + SHM_FRAME_HEADER, buf, len);
+    __atomic_store_n(&ring->tail, tail + SHM_FRAME_HEADER + len, __ATOMIC_RELEASE);
+    return len;
+}
+
+int
+shm_ring_pending(ShmRing* ring) {
+    return __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) != __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+}
+
+static inline int
+shm__ring_ready(ShmRing* ring, uint32_t ring_size, uint32_t space) {
+    if (!space) return shm_ring_pending(ring);
+    uint64_t used = __atomic_load_n(&ring->head, __ATOMIC_RELAXED) - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    return used <= ring_size && ring_size - used >= space + SHM_FRAME_HEADER;
+}
+
+static inline uint64_t
+shm__now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+int
+shm_ring_wait(ShmRing* ring, uint32_t ring_size, uint32_t space, int efd, int timeout_ms) {
+    static int spin_count = -1;
+    if (spin_count < 0) spin_count = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? SHM_SPIN_COUNT : 0;
+
+    uint32_t* sleeping = space ? &ring->producer_sleeping : &ring->consumer_sleeping;
+    for (int i = 0; i < spin_count; i++) {
+        if (shm__ring_ready(ring, ring_size, space)) return 0;
+        SHM_CPU_RELAX();
+    }
+
+    uint64_t deadline = shm__now_ms() + timeout_ms;
+    while (1) {
+        // Announced before the last check, so a producer either sees the flag or the check sees its frame
+        __atomic_store_n(sleeping, 1, __ATOMIC_SEQ_CST);
+        int ready = shm__ring_ready(ring, ring_size, space);
+        uint64_t now = shm__now_ms();
+        if (!ready && now < deadline) {
+            struct pollfd fd = { .fd = efd, .events = POLLIN };
+            poll(&fd, 1, deadline - now);
+            shm_drain(efd);
+            ready = shm__ring_ready(ring, ring_size, space);
+        }
+        __atomic_store_n(sleeping, 0, __ATOMIC_RELAXED);
+        if (ready) return 0;
+        if (shm__now_ms() >= deadline) return -1;
+    }
+}
+
+int
+shm_channel_reply(ShmChannel* channel, const char* buf, uint32_t len) {
+    // Nothing may pass frames already parked, the client reads them in order
+    if (channel->parked_len == 0) {
+        int written = shm_ring_write(channel->responses, channel->ring_size, buf, len);
+        if (written == 0) return 0;
+        if (written == -2) {
+            channel->broken = 1;
+            return -1;
+        }
+    }
+
+    // Parked frames carry the same header as in the ring, so they move over as they are
+    if (len + SHM_FRAME_HEADER > SHM_PARK_MAX - channel->parked_len) {
+        channel->broken = 1;
+        return -1;
+    }
+    if (!channel->parked) {
+        void* parked = mmap(NULL, SHM_PARK_MAX, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (parked == MAP_FAILED) {
+            perror("Unable to park shared memory reply");
+            channel->broken = 1;
+            return -1;
+        }
+        channel->parked = parked;
+    }
+    // Frames already moved into the ring leave room at the start, taken back only once the end is reached
+    if (channel->parked_head + channel->parked_len + len + SHM_FRAME_HEADER > SHM_PARK_MAX) {
+        memmove(channel->parked, channel->parked + channel->parked_head, channel->parked_len);
+        channel->parked_head = 0;
+    }
+    char* end = channel->parked + channel->parked_head + channel->parked_len;
+    memcpy(end, &len, SHM_FRAME_HEADER);
+    memcpy(end + SHM_FRAME_HEADER, buf, len);
+    channel->parked_len += SHM_FRAME_HEADER + len;
+    return 0;
+}
+
+uint32_t
+shm_channel_unpark(ShmChannel* channel) {
+    while (channel->parked_len > 0) {
+        uint32_t len;
+        char* head = channel->parked + channel->parked_head;
+        memcpy(&len, head, SHM_FRAME_HEADER);
+        if (shm_ring_write(channel->responses, channel->ring_size, head + SHM_FRAME_HEADER, len) != 0) break;
+        channel->parked_head += SHM_FRAME_HEADER + len;
+        channel->parked_len  -= SHM_FRAME_HEADER + len;
+    }
+    if (channel->parked_len == 0) channel->parked_head = 0;
+    return channel->parked_len;
+}
+
+int
+shm_channel_unpark_ready(ShmChannel* channel) {
+    if (channel->parked_len == 0) return 0;
+    uint32_t len;
+    memcpy(&len, channel->parked + channel->parked_head, SHM_FRAME_HEADER);
+    return shm__ring_ready(channel->responses, channel->ring_size, len);
+}
+
+void
+shm_notify(uint32_t* sleeping, int efd) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (!__atomic_load_n(sleeping, __ATOMIC_RELAXED)) return;
+    uint64_t one = 1;
+    if (write(efd, &one, sizeof(one)) < 0 && errno != EAGAIN) perror("Unable to wake shared memory channel");
+}
+
+void
+shm_drain(int efd) {
+    uint64_t count;
+    while (read(efd, &count, sizeof(count)) > 0) {}
+}
+
+#endif
+
+#endif
@@ -0,0 +1,183 @@
+#ifndef DPATCH_SPILL_H
+#define DPATCH_SPILL_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#ifdef ALLOC_FUNC
+#define MMALLOC(size) ALLOC_FUNC(size)
+#else
+#define MMALLOC(size) malloc(size)
+#endif
+
+#ifdef ALLOC_TAG_FUNC
+#define MMALLOC_TAG(size, tag) ALLOC_TAG_FUNC(size, ARENA_TAG_ ## tag)
+#else
+#define MMALLOC_TAG(size, tag) MMALLOC(size)
+#endif
+
+#define SPILL_PATH_MAX 256
+#define SPILL_GROW_MIN (1024 * 1024)
+#define SPILL_RECORD_ALIGN 8
+#define SPILL_RECORD_SIZE(size) ((sizeof(uint32_t) + (size) + SPILL_RECORD_ALIGN - 1) & ~(size_t)(SPILL_RECORD_ALIGN - 1))
+
+typedef struct Spill_st {
+    int fd;
+    int count;
+    char* map;
+    size_t mapped;
+    size_t limit;
+    size_t head;
+    size_t tail;
+    char dir[SPILL_PATH_MAX];
+} Spill;
+
+/// Create a spill queue keeping its segment file in given directory, up to given size in bytes.
+/// The file is created on first push. Returns a pointer to the queue or NULL if failed.
+Spill* spill_new(char* dir, size_t limit);
+/// Append a record to the end of the segment, returns 0 on success and -1 if it could not be stored.
+/// Space of popped records is reused once they fill half of the segment, so it only grows with live records.
+int spill_push(Spill* spill, void* data, uint32_t size);
+/// Get the size of the oldest record, returns 0 if the queue is empty
+uint32_t spill_peek(Spill* spill);
+/// Copy the oldest record into given buffer and drop it, returns its size or 0 if empty or the buffer is too small
+uint32_t spill_pop(Spill* spill, void* out, uint32_t out_size);
+/// Give the segment of a drained queue back, so an idle agent holds no disk or page cache for it.
+/// Returns 0 on success or if there is nothing to give back, and -1 if the file could not be truncated.
+int spill_trim(Spill* spill);
+/// Unmap and close the segment file
+void spill_close(Spill* spill);
+
+#ifdef SPILL_IMPL
+
+Spill*
+spill_new(char* dir, size_t limit) {
+    if (!dir) return NULL;
+    Spill* spill = MMALLOC_TAG(sizeof(Spill), SPILL);
+    if (!spill) return NULL;
+
+    memset(spill, 0, sizeof(Spill));
+    spill->fd    = -1;
+    spill->limit = limit;
+    snprintf(spill->dir, SPILL_PATH_MAX, "%s", dir);
+    return spill;
+}
+
+static int
+spill_create(Spill* spill) {
+    char path[SPILL_PATH_MAX + 32];
+    snprintf(path, sizeof(path), "%s/dpatch-spill-XXXXXX", spill->dir);
+    spill->fd = mkostemp(path, O_CLOEXEC);
+    if (spill->fd < 0) return -1;
+
+    // Nothing reads the segment after the agent exits, so it only needs to live as long as the descriptor
+    unlink(path);
+    return 0;
+}
+
+static int
+spill_grow(Spill* spill, size_t need) {
+    size_t size = spill->mapped > 0 ? spill->mapped : SPILL_GROW_MIN;
+    while (size < need) size *= 2;
+    if (size > spill->limit) size = spill->limit;
+    if (size < need) return -1;
+
+    // Reserve the blocks up front, writing into a sparse mapping on a full disk would raise SIGBUS
+    if (posix_fallocate(spill->fd, 0, size) != 0) return -1;
+
+    char* map = spill->map ?
+        mremap(spill->map, spill->mapped, size, MREMAP_MAYMOVE) :
+        mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, spill->fd, 0);
+    if (map == MAP_FAILED) return -1;
+
+    spill->map    = map;
+    spill->mapped = size;
+    return 0;
+}
+
+int
+spill_push(Spill* spill, void* data, uint32_t size) {
+    if (!spill || !data) return -1;
+    if (spill->fd < 0 && spill_create(spill) != 0) return -1;
+
+    size_t record_size = SPILL_RECORD_SIZE(size);
+
+    // Move the live records to the start once more than half of the segment is popped, so a sustained backlog
+    // reuses its space instead of growing the file. Never more is moved than was popped since the last time.
+    if (spill->tail + record_size > spill->mapped && spill->head > 0 && spill->head >= spill->mapped / 2) {
+        memmove(spill->map, spill->map + spill->head, spill->tail - spill->head);
+        spill->tail -= spill->head;
+        spill->head  = 0;
+    }
+
+    if (spill->tail + record_size > spill->mapped &&
+        spill_grow(spill, spill->tail + record_size) != 0)
+    {
+        return -1;
+    }
+
+    char* record = spill->map + spill->tail;
+    memcpy(record, &size, sizeof(uint32_t));
+    memcpy(record + sizeof(uint32_t), data, size);
+    spill->tail += record_size;
+    spill->count++;
+    return 0;
+}
+
+uint32_t
+spill_peek(Spill* spill) {
+    if (!spill || spill->count < 1) return 0;
+    uint32_t size;
+    memcpy(&size, spill->map + spill->head, sizeof(uint32_t));
+    return size;
+}
+
+uint32_t
+spill_pop(Spill* spill, void* out, uint32_t out_size) {
+    uint32_t size = spill_peek(spill);
+    if (size == 0 || size > out_size) return 0;
+
+    memcpy(out, spill->map + spill->head + sizeof(uint32_t), size);
+    spill->head += SPILL_RECORD_SIZE(size);
+    spill->count--;
+    if (spill->count == 0) {
+        spill->head = 0;
+        spill->tail = 0;
+    }
+    return size;
+}
+
+int
+spill_trim(Spill* spill) {
+    if (!spill || spill->count > 0 || !spill->map) return 0;
+
+    // Unmapped either way, a file left at its size is just allocated again from the start on the next push
+    munmap(spill->map, spill->mapped);
+    spill->map    = NULL;
+    spill->mapped = 0;
+    spill->head   = 0;
+    spill->tail   = 0;
+    return ftruncate(spill->fd, 0) == 0 ? 0 : -1;
+}
+
+void
+spill_close(Spill* spill) {
+    if (!spill) return;
+    if (spill->map) munmap(spill->map, spill->mapped);
+    if (spill->fd >= 0) close(spill->fd);
+    spill->map    = NULL;
+    spill->mapped = 0;
+    spill->fd     = -1;
+    spill->count  = 0;
+    spill->head   = 0;
+    spill->tail   = 0;
+}
+
+#endif
+
+#endif
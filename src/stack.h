@@ -2,6 +2,7 @@
 #define DPATCH_STACK_H
 
 #include <stdlib.h>
+#include <stddef.h>
 
 #ifdef ALLOC_FUNC
 #define MMALLOC(size) ALLOC_FUNC(size)
@@ -9,6 +10,12 @@
 #define MMALLOC(size) malloc(size)
 #endif
 
+#ifdef ALLOC_TAG_FUNC
+#define MMALLOC_TAG(size, tag) ALLOC_TAG_FUNC(size, ARENA_TAG_ ## tag)
+#else
+#define MMALLOC_TAG(size, tag) MMALLOC(size)
+#endif
+
 typedef struct Stack_st {
     size_t count;
     size_t capacity;
@@ -34,13 +41,69 @@ unsigned char stack_remove_at_fast(Stack* s, int i);
 /// Reset the stack back to empty, returns 1 if succesful or 0 if failed
 unsigned char stack_reset(Stack* s);
 
+/// Define a stack type 'name' holding items of type T, with typed functions name_new, name_push, name_pop,
+/// name_get, name_remove_at_fast and name_reset. The type shares its layout with Stack, so the generic
+/// functions work on it through a cast, but the typed ones copy items with a compile-time size.
+/// name_push returns the index of the new item, or -1 if the stack is full.
+#define DEFINE_STACK(name, T)\
+typedef struct name ## _st {\
+    size_t count;\
+    size_t capacity;\
+    size_t item_size;\
+    T* data;\
+} name;\
+\
+_Static_assert(sizeof(name) == sizeof(Stack) &&\
+               offsetof(name, count) == offsetof(Stack, count) &&\
+               offsetof(name, capacity) == offsetof(Stack, capacity) &&\
+               offsetof(name, item_size) == offsetof(Stack, item_size) &&\
+               offsetof(name, data) == offsetof(Stack, data),\
+               #name " must share its layout with Stack");\
+\
+static inline name* \
+name ## _new(size_t capacity) {\
+    return (name*)stack_new(capacity, sizeof(T));\
+}\
+\
+static inline int \
+name ## _push(name* s, T item) {\
+    if (s->count >= s->capacity) return -1;\
+    s->data[s->count] = item;\
+    return (int)s->count++;\
+}\
+\
+static inline T* \
+name ## _pop(name* s) {\
+    if (s->count < 1) return NULL;\
+    return &s->data[--s->count];\
+}\
+\
+static inline T* \
+name ## _get(name* s, int i) {\
+    if (i < 0 || i >= s->count) return NULL;\
+    return &s->data[i];\
+}\
+\
+static inline unsigned char \
+name ## _remove_at_fast(name* s, int i) {\
+    if (i < 0 || i >= s->count) return 0;\
+    s->data[i] = s->data[s->count - 1];\
+    s->count--;\
+    return 1;\
+}\
+\
+static inline void \
+name ## _reset(name* s) {\
+    s->count = 0;\
+}
+
 #ifdef STACK_IMPL
 
 #define STACK_ITEM(s, i) ((char*)((s)->data) + ((i) * (s)->item_size))
 
 Stack*
 stack_new(size_t capacity, size_t item_size) {
-    Stack* s = (Stack*)MMALLOC(sizeof(Stack) + (item_size * capacity));
+    Stack* s = (Stack*)MMALLOC_TAG(sizeof(Stack) + (item_size * capacity), STACK);
     if (!s) {
         fprintf(stderr, "Stack allocation failed");
         return NULL;
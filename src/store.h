@@ -2,6 +2,9 @@
 #define CUTIL_STORE_H
 
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stddef.h>
 
 #ifdef ALLOC_FUNC
 #define MMALLOC(size) ALLOC_FUNC(size)
@@ -9,14 +12,30 @@
 #define MMALLOC(size) malloc(size)
 #endif
 
+#ifdef ALLOC_TAG_FUNC
+#define MMALLOC_TAG(size, tag) ALLOC_TAG_FUNC(size, ARENA_TAG_ ## tag)
+#else
+#define MMALLOC_TAG(size, tag) MMALLOC(size)
+#endif
+
 #ifdef FREE_FUNC
 #define MFREE(ptr) ALLOC_FUNC(ptr)
 #else
 #define MFREE(ptr) free(ptr)
 #endif
 
+#ifndef STORE_ITEM_ALIGN
+#define STORE_ITEM_ALIGN 64
+#endif
+
+#define STORE_STRIDE(item_size) (((item_size) + STORE_ITEM_ALIGN - 1) & ~(size_t)(STORE_ITEM_ALIGN - 1))
+
 #define KEYVALUE_NONE (KeyValue){ -1, NULL }
 
+/// Iterate used indices of a store in ascending order, removing the current index while iterating is allowed
+#define store_foreach(store, idx) \
+    for (int idx = store_next_used((Store*)(store), 0); idx >= 0; idx = store_next_used((Store*)(store), idx + 1))
+
 typedef struct KeyValue_st {
     size_t key;
     void* value;
@@ -25,8 +44,10 @@ typedef struct KeyValue_st {
 typedef struct Store_st {
     int capacity;
     size_t item_size;
+    size_t stride;
     int open_cnt;
     int* open;
+    uint64_t* used;
     char* data;
 } Store;
 
@@ -46,18 +67,87 @@ unsigned char store_is_used(Store* store, int idx);
 unsigned char store_replace(Store* store, int idx, void* data);
 /// Remove data from given store index, returns 1 on success and 0 on failure
 unsigned char store_remove_at(Store* store, int idx);
+/// Find the first used index at or after given index, returns the index or -1 if there are none
+int store_next_used(Store* store, int idx);
 /// Get amount of items in the store (ie. length)
 int store_length(Store* store);
 /// Reset store back to zeroed state (retains capacity and item size)
 void store_reset(Store* store);
 
+/// Define a store type 'name' holding items of type T, with typed functions name_new, name_push,
+/// name_push_empty, name_get and name_remove_at. The type shares its layout with Store, so the generic
+/// functions and store_foreach work on it, but the typed ones address and copy items with compile-time sizes.
+/// name_push returns the index of the new item, or -1 if the store is full.
+#define DEFINE_STORE(name, T)\
+typedef struct name ## _st {\
+    int capacity;\
+    size_t item_size;\
+    size_t stride;\
+    int open_cnt;\
+    int* open;\
+    uint64_t* used;\
+    char* data;\
+} name;\
+\
+_Static_assert(sizeof(name) == sizeof(Store) &&\
+               offsetof(name, capacity) == offsetof(Store, capacity) &&\
+               offsetof(name, item_size) == offsetof(Store, item_size) &&\
+               offsetof(name, stride) == offsetof(Store, stride) &&\
+               offsetof(name, open_cnt) == offsetof(Store, open_cnt) &&\
+               offsetof(name, open) == offsetof(Store, open) &&\
+               offsetof(name, used) == offsetof(Store, used) &&\
+               offsetof(name, data) == offsetof(Store, data),\
+               #name " must share its layout with Store");\
+\
+static inline name* \
+name ## _new(int capacity) {\
+    return (name*)store_new(capacity, sizeof(T));\
+}\
+\
+static inline T* \
+name ## _get(name* s, int idx) {\
+    if (idx < 0 || idx >= s->capacity) return NULL;\
+    if (!((s->used[idx >> 6] >> (idx & 63)) & 1)) return NULL;\
+    return (T*)(s->data + (size_t)idx * STORE_STRIDE(sizeof(T)));\
+}\
+\
+static inline T* \
+name ## _push_empty(name* s, int* idx) {\
+    if (s->open_cnt < 1) return NULL;\
+    int i = s->open[--s->open_cnt];\
+    s->used[i >> 6] |= (uint64_t)1 << (i & 63);\
+    T* item = (T*)(s->data + (size_t)i * STORE_STRIDE(sizeof(T)));\
+    *item = (T){0};\
+    if (idx) *idx = i;\
+    return item;\
+}\
+\
+static inline int \
+name ## _push(name* s, const T* value) {\
+    int idx = -1;\
+    T* item = name ## _push_empty(s, &idx);\
+    if (!item) return -1;\
+    *item = *value;\
+    return idx;\
+}\
+\
+static inline unsigned char \
+name ## _remove_at(name* s, int idx) {\
+    if (!name ## _get(s, idx)) return 0;\
+    s->used[idx >> 6] &= ~((uint64_t)1 << (idx & 63));\
+    s->open[s->open_cnt++] = idx;\
+    return 1;\
+}
+
 #ifdef STORE_IMPL
 
-#define ITEM_IDX(store, idx) ((char*)store->data + (idx * (store->item_size + 1)))
-#define ITEM_USED(ptr) (*ptr)
-#define ITEM_VALUE(ptr) (ptr + 1)
+#define STORE_WORDS(capacity) (((capacity) + 63) / 64)
+#define ITEM_IDX(store, idx) ((char*)store->data + ((size_t)(idx) * store->stride))
+#define ITEM_USED(store, idx) ((store->used[(idx) >> 6] >> ((idx) & 63)) & 1)
+#define ITEM_SET_USED(store, idx) (store->used[(idx) >> 6] |= (uint64_t)1 << ((idx) & 63))
+#define ITEM_SET_OPEN(store, idx) (store->used[(idx) >> 6] &= ~((uint64_t)1 << ((idx) & 63)))
 
-#define KEYVALUE(store, idx) (KeyValue){ idx, (void*)ITEM_VALUE(ITEM_IDX(store, idx)) }
+#define KEYVALUE(store, idx) (KeyValue){ idx, (void*)ITEM_IDX(store, idx) }
 
 static inline int
 get_push_index(Store* store) {
@@ -77,17 +167,28 @@ reset_open(Store* store) {
 
 Store*
 store_new(int capacity, size_t item_size) {
-    Store* store = MMALLOC(sizeof(Store) +
-                           sizeof(int) * capacity +
-                           sizeof(char) * (item_size + 1) * capacity);
+    // Items start at cache line boundaries, so one item never straddles lines it does not need
+    size_t stride = STORE_STRIDE(item_size);
+    Store* store = MMALLOC_TAG(sizeof(Store) +
+                               sizeof(int) * capacity +
+                               sizeof(uint64_t) * STORE_WORDS(capacity) +
+                               STORE_ITEM_ALIGN +
+                               sizeof(char) * stride * capacity,
+                               STORE);
     if (!store) return NULL;
 
-    store->capacity     = capacity;
-    store->item_size    = item_size;
-    store->open_cnt = capacity;
-    store->open     = (int*)((char*)store + sizeof(Store));
-    store->data         = (char*)store->open + (sizeof(int) * capacity);
-    memset(store->data, 0, (item_size + 1) * capacity);
+    store->capacity  = capacity;
+    store->item_size = item_size;
+    store->stride    = stride;
+    store->open_cnt  = capacity;
+    store->used      = (uint64_t*)((char*)store + sizeof(Store));
+    store->open      = (int*)(store->used + STORE_WORDS(capacity));
+    store->data      = (char*)(((uintptr_t)(store->open + capacity) + STORE_ITEM_ALIGN - 1) &
+                               ~(uintptr_t)(STORE_ITEM_ALIGN - 1));
+#ifndef ALLOC_ZEROED
+    memset(store->used, 0, sizeof(uint64_t) * STORE_WORDS(capacity));
+    memset(store->data, 0, stride * capacity);
+#endif
     reset_open(store);
 
     return store;
@@ -107,10 +208,8 @@ store_push(Store* store, void* data) {
     int idx = get_push_index(store);
     if (idx < 0) return KEYVALUE_NONE;
 
-    char* ptr = ITEM_IDX(store, idx);
-    ITEM_USED(ptr) = 1;
-
-    memcpy(ITEM_VALUE(ptr), data, store->item_size);
+    ITEM_SET_USED(store, idx);
+    memcpy(ITEM_IDX(store, idx), data, store->item_size);
     return KEYVALUE(store, idx);
 }
 
@@ -121,53 +220,63 @@ store_push_empty(Store* store) {
     int idx = get_push_index(store);
     if (idx < 0) return KEYVALUE_NONE;
 
-    char* ptr = ITEM_IDX(store, idx);
-    ITEM_USED(ptr) = 1;
-
-    memset(ITEM_VALUE(ptr), 0, store->item_size);
+    ITEM_SET_USED(store, idx);
+    memset(ITEM_IDX(store, idx), 0, store->item_size);
     return KEYVALUE(store, idx);
 }
 
 KeyValue
 store_get(Store* store, int idx) {
-    if (!store) return KEYVALUE_NONE;
-    char* ptr = ITEM_IDX(store, idx);
-    if (!ITEM_USED(ptr)) return KEYVALUE_NONE;
+    if (!store || idx < 0 || idx >= store->capacity) return KEYVALUE_NONE;
+    if (!ITEM_USED(store, idx)) return KEYVALUE_NONE;
     return KEYVALUE(store, idx);
 }
 
 unsigned char
 store_is_used(Store* store, int idx) {
-    return ITEM_USED(ITEM_IDX(store, idx));
+    if (!store || idx < 0 || idx >= store->capacity) return 0;
+    return ITEM_USED(store, idx);
 }
 
 unsigned char
 store_replace(Store* store, int idx, void* data) {
     if (!store) return 0;
-    if (idx >= store->capacity) return 0;
+    if (idx < 0 || idx >= store->capacity) return 0;
 
-    char* ptr = ITEM_IDX(store, idx);
-    if (!ITEM_USED(ptr)) return 0;
+    if (!ITEM_USED(store, idx)) return 0;
 
-    memcpy(ITEM_VALUE(ptr), data, store->item_size);
-    ITEM_USED(ptr) = 1;
+    memcpy(ITEM_IDX(store, idx), data, store->item_size);
     return 1;
 }
 
 unsigned char
 store_remove_at(Store* store, int idx) {
     if (!store) return 0;
-    if (idx >= store->capacity) return 0;
+    if (idx < 0 || idx >= store->capacity) return 0;
 
-    char* ptr = ITEM_IDX(store, idx);
-    if (!ITEM_USED(ptr)) return 0;
+    if (!ITEM_USED(store, idx)) return 0;
 
-    ITEM_USED(ptr) = 0;
+    ITEM_SET_OPEN(store, idx);
     store->open[store->open_cnt] = idx;
     store->open_cnt++;
     return 1;
 }
 
+int
+store_next_used(Store* store, int idx) {
+    if (!store || idx < 0 || idx >= store->capacity) return -1;
+
+    // Mask off bits below the start index, then skip empty words and count trailing zeros of the first hit
+    int word = idx >> 6;
+    uint64_t bits = store->used[word] & (~(uint64_t)0 << (idx & 63));
+    int words = STORE_WORDS(store->capacity);
+    while (!bits) {
+        if (++word >= words) return -1;
+        bits = store->used[word];
+    }
+    return (word << 6) + __builtin_ctzll(bits);
+}
+
 int
 store_length(Store* store) {
     if (!store) return -1;
@@ -177,7 +286,8 @@ store_length(Store* store) {
 void
 store_reset(Store* store) {
     if (!store) return;
-    memset(store->data, 0, sizeof(char) * (store->item_size + 1) * store->capacity);
+    memset(store->used, 0, sizeof(uint64_t) * STORE_WORDS(store->capacity));
+    memset(store->data, 0, store->stride * store->capacity);
     reset_open(store);
 }
 
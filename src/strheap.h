@@ -0,0 +1,200 @@
+#ifndef DPATCH_STRHEAP_H
+#define DPATCH_STRHEAP_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#ifdef ALLOC_FUNC
+#define MMALLOC(size) ALLOC_FUNC(size)
+#else
+#define MMALLOC(size) malloc(size)
+#endif
+
+#ifdef ALLOC_TAG_FUNC
+#define MMALLOC_TAG(size, tag) ALLOC_TAG_FUNC(size, ARENA_TAG_ ## tag)
+#else
+#define MMALLOC_TAG(size, tag) MMALLOC(size)
+#endif
+
+// Size classes go 32, 48, 64, 96, 128 ... 4096, so a block wastes at most a third of its size
+#define STRHEAP_CLASS_MIN_SHIFT 5
+#define STRHEAP_CLASS_COUNT 15
+#define STRHEAP_CLASS_MAX ((size_t)1 << (STRHEAP_CLASS_MIN_SHIFT + STRHEAP_CLASS_COUNT / 2))
+#define STRHEAP_SLAB_SIZE (16 * 1024)
+#define STRHEAP_LARGE STRHEAP_CLASS_COUNT
+
+typedef struct StrHeapBlock_st {
+    uint32_t size_class;
+    uint32_t used;
+    size_t size;
+} StrHeapBlock;
+
+typedef struct StrHeap_st {
+    size_t capacity;
+    size_t reserved;
+    size_t used;
+    size_t peak;
+    char* slab;
+    size_t slab_left;
+    void** slabs;
+    size_t slab_count;
+    StrHeapBlock* free[STRHEAP_CLASS_COUNT];
+} StrHeap;
+
+/// Create a new string heap growing on demand up to given capacity in bytes, returns a pointer to the heap or NULL
+StrHeap* strheap_new(size_t capacity);
+/// Allocate a block from the heap, returns a pointer to it or NULL if the heap capacity would be exceeded
+void* strheap_alloc(StrHeap* heap, size_t size);
+/// Copy a string into the heap, returns a pointer to the copy or NULL if failed
+char* strheap_dup(StrHeap* heap, const char* str);
+/// Give a block back to the heap, NULL is ignored
+void strheap_free(StrHeap* heap, void* ptr);
+/// Get the usable size of an allocated block
+size_t strheap_block_size(void* ptr);
+/// Give every slab back to the OS, blocks allocated from them become invalid. Large blocks are still given back
+/// one by one as they are freed.
+void strheap_release(StrHeap* heap);
+
+#ifdef STRHEAP_IMPL
+
+#define STRHEAP_BLOCK(ptr) ((StrHeapBlock*)((char*)(ptr) - sizeof(StrHeapBlock)))
+#define STRHEAP_CLASS_SIZE(cls) ((size_t)((cls) & 1 ? 3 : 2) << (STRHEAP_CLASS_MIN_SHIFT - 1 + (cls) / 2))
+
+StrHeap*
+strheap_new(size_t capacity) {
+    StrHeap* heap = MMALLOC_TAG(sizeof(StrHeap), HEAP);
+    if (!heap) return NULL;
+
+    memset(heap, 0, sizeof(StrHeap));
+    heap->capacity = capacity;
+    return heap;
+}
+
+static inline int
+strheap_class(size_t need) {
+    int cls = 0;
+    while (cls < STRHEAP_CLASS_COUNT && STRHEAP_CLASS_SIZE(cls) < need) cls++;
+    return cls;
+}
+
+void*
+strheap_alloc(StrHeap* heap, size_t size) {
+    if (!heap) return NULL;
+    size_t need = sizeof(StrHeapBlock) + size;
+    int cls = strheap_class(need);
+
+    // Blocks over the largest class get a mapping of their own, so they can be returned to the OS when freed
+    if (cls == STRHEAP_LARGE) {
+        size_t mapped = (need + 4095) & ~(size_t)4095;
+        if (heap->reserved + mapped > heap->capacity) return NULL;
+
+        void* mem = mmap(NULL, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED) return NULL;
+
+        StrHeapBlock* block = (StrHeapBlock*)mem;
+        block->size_class = STRHEAP_LARGE;
+        block->used = 1;
+        block->size = mapped;
+        heap->reserved += mapped;
+        heap->used += mapped;
+        if (heap->used > heap->peak) heap->peak = heap->used;
+        return (void*)(block + 1);
+    }
+
+    size_t class_size = STRHEAP_CLASS_SIZE(cls);
+    // Freed blocks keep their header, the free list link lives in the payload
+    StrHeapBlock* block = heap->free[cls];
+    if (block) {
+        heap->free[cls] = *(StrHeapBlock**)(block + 1);
+    }
+    else {
+        // Carve from the current slab, starting a new one when it runs out. Slabs are mapped outside the
+        // arena so the heap can grow past its fixed budget, and they are never given back, their blocks are
+        // recycled through the class free lists instead.
+        if (heap->slab_left < class_size) {
+            if (heap->reserved + STRHEAP_SLAB_SIZE > heap->capacity) return NULL;
+
+            // The slab table is sized for the whole capacity up front, only the part in use is ever touched
+            if (!heap->slabs) {
+                void* table = mmap(NULL, (heap->capacity / STRHEAP_SLAB_SIZE) * sizeof(void*),
+                                   PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+                if (table == MAP_FAILED) return NULL;
+                heap->slabs = table;
+            }
+
+            void* slab = mmap(NULL, STRHEAP_SLAB_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (slab == MAP_FAILED) return NULL;
+            heap->slabs[heap->slab_count++] = slab;
+            heap->slab = slab;
+            heap->slab_left = STRHEAP_SLAB_SIZE;
+            heap->reserved += STRHEAP_SLAB_SIZE;
+        }
+        block = (StrHeapBlock*)heap->slab;
+        heap->slab += class_size;
+        heap->slab_left -= class_size;
+    }
+
+    block->size_class = cls;
+    block->used = 1;
+    block->size = class_size;
+    heap->used += class_size;
+    if (heap->used > heap->peak) heap->peak = heap->used;
+    return (void*)(block + 1);
+}
+
+char*
+strheap_dup(StrHeap* heap, const char* str) {
+    if (!str) return NULL;
+    size_t len = strlen(str);
+    char* copy = strheap_alloc(heap, len + 1);
+    if (copy) memcpy(copy, str, len + 1);
+    return copy;
+}
+
+void
+strheap_free(StrHeap* heap, void* ptr) {
+    if (!heap || !ptr) return;
+    StrHeapBlock* block = STRHEAP_BLOCK(ptr);
+    if (!block->used) return;
+
+    block->used = 0;
+    heap->used -= block->size;
+    if (block->size_class == STRHEAP_LARGE) {
+        heap->reserved -= block->size;
+        munmap(block, block->size);
+        return;
+    }
+
+    *(StrHeapBlock**)(block + 1) = heap->free[block->size_class];
+    heap->free[block->size_class] = block;
+}
+
+size_t
+strheap_block_size(void* ptr) {
+    if (!ptr) return 0;
+    return STRHEAP_BLOCK(ptr)->size - sizeof(StrHeapBlock);
+}
+
+void
+strheap_release(StrHeap* heap) {
+    if (!heap || !heap->slabs) return;
+    for (size_t i = 0; i < heap->slab_count; i++) {
+        munmap(heap->slabs[i], STRHEAP_SLAB_SIZE);
+    }
+    munmap(heap->slabs, (heap->capacity / STRHEAP_SLAB_SIZE) * sizeof(void*));
+
+    // Only large blocks are left, each of them is in use for its whole mapping
+    heap->reserved -= heap->slab_count * STRHEAP_SLAB_SIZE;
+    heap->used       = heap->reserved;
+    heap->slabs      = NULL;
+    heap->slab_count = 0;
+    heap->slab       = NULL;
+    heap->slab_left  = 0;
+    memset(heap->free, 0, sizeof(heap->free));
+}
+
+#endif
+
+#endif
@@ -0,0 +1,253 @@
+#ifndef DPATCH_TIMER_H
+#define DPATCH_TIMER_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef ALLOC_FUNC
+#define MMALLOC(size) ALLOC_FUNC(size)
+#else
+#define MMALLOC(size) malloc(size)
+#endif
+
+#ifdef ALLOC_TAG_FUNC
+#define MMALLOC_TAG(size, tag) ALLOC_TAG_FUNC(size, ARENA_TAG_ ## tag)
+#else
+#define MMALLOC_TAG(size, tag) MMALLOC(size)
+#endif
+
+#define TIMER_WHEEL_BITS    6
+#define TIMER_WHEEL_SLOTS   (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MASK    (TIMER_WHEEL_SLOTS - 1)
+#define TIMER_WHEEL_LEVELS  4
+#define TIMER_WHEEL_SPAN    ((uint64_t)1 << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS))
+#define TIMER_NONE          -1
+
+typedef void(*TimerCallback)(void*, int);
+
+typedef struct Timer_st {
+    uint64_t expire;
+    int prev;
+    int next;
+    int slot;
+    int key;
+    void* data;
+    TimerCallback callback;
+} Timer;
+
+typedef struct TimerWheel_st {
+    uint64_t start_ms;
+    uint64_t tick;
+    unsigned int tick_ms;
+    int capacity;
+    int active;
+    int free_head;
+    int slots[TIMER_WHEEL_LEVELS * TIMER_WHEEL_SLOTS];
+    Timer* timers;
+} TimerWheel;
+
+/// Get current monotonic clock time in milliseconds
+uint64_t timer_now_ms();
+/// Get current monotonic clock time in microseconds
+uint64_t timer_now_us();
+/// Create a new timer wheel with given timer capacity and tick resolution, returns a pointer to the wheel or NULL if failed
+TimerWheel* timer_wheel_new(int capacity, unsigned int tick_ms, uint64_t now_ms);
+/// Add a timer firing at given absolute time, returns the timer id or TIMER_NONE if wheel capacity is full
+int timer_add(TimerWheel* wheel, uint64_t expire_ms, TimerCallback callback, void* data, int key);
+/// Cancel a pending timer, returns 1 on success and 0 if timer was not active
+unsigned char timer_cancel(TimerWheel* wheel, int id);
+/// Advance the wheel up to given time and fire expired timers, returns the amount of timers fired
+int timer_wheel_advance(TimerWheel* wheel, uint64_t now_ms);
+
+#ifdef TIMER_IMPL
+
+uint64_t
+timer_now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+uint64_t
+timer_now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+TimerWheel*
+timer_wheel_new(int capacity, unsigned int tick_ms, uint64_t now_ms) {
+    TimerWheel* wheel = MMALLOC_TAG(sizeof(TimerWheel) + sizeof(Timer) * capacity, TIMER);
+    if (!wheel) return NULL;
+
+    wheel->start_ms  = now_ms;
+    wheel->tick      = 0;
+    wheel->tick_ms   = tick_ms > 0 ? tick_ms : 1;
+    wheel->capacity  = capacity;
+    wheel->active    = 0;
+    wheel->free_head = capacity > 0 ? 0 : TIMER_NONE;
+    wheel->timers    = (Timer*)(wheel + 1);
+
+    for (int i = 0; i < TIMER_WHEEL_LEVELS * TIMER_WHEEL_SLOTS; i++) {
+        wheel->slots[i] = TIMER_NONE;
+    }
+
+    // Unused timers are chained into a free list through 'next'
+    for (int i = 0; i < capacity; i++) {
+        wheel->timers[i] = (Timer){0};
+        wheel->timers[i].slot = TIMER_NONE;
+        wheel->timers[i].next = (i + 1 < capacity) ? i + 1 : TIMER_NONE;
+    }
+
+    return wheel;
+}
+
+static inline void
+timer_link_slot(TimerWheel* wheel, int id, int slot) {
+    Timer* timer = &wheel->timers[id];
+    timer->slot = slot;
+    timer->prev = TIMER_NONE;
+    timer->next = wheel->slots[slot];
+    if (timer->next != TIMER_NONE) wheel->timers[timer->next].prev = id;
+    wheel->slots[slot] = id;
+}
+
+static inline void
+timer_link(TimerWheel* wheel, int id) {
+    Timer* timer = &wheel->timers[id];
+    uint64_t expire = timer->expire;
+    if (expire <= wheel->tick) expire = wheel->tick + 1;
+
+    uint64_t delta = expire - wheel->tick;
+    if (delta >= TIMER_WHEEL_SPAN) {
+        // Clamp far deadlines to the last level, they get re-linked when cascaded
+        delta = TIMER_WHEEL_SPAN - 1;
+        expire = wheel->tick + delta;
+    }
+
+    int level = 0;
+    while (level < TIMER_WHEEL_LEVELS - 1 &&
+           delta >= ((uint64_t)1 << (TIMER_WHEEL_BITS * (level + 1))))
+    {
+        level++;
+    }
+
+    int slot = level * TIMER_WHEEL_SLOTS +
+               (int)((expire >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK);
+    timer_link_slot(wheel, id, slot);
+}
+
+static inline void
+timer_unlink(TimerWheel* wheel, int id) {
+    Timer* timer = &wheel->timers[id];
+    if (timer->prev != TIMER_NONE) wheel->timers[timer->prev].next = timer->next;
+    else wheel->slots[timer->slot] = timer->next;
+    if (timer->next != TIMER_NONE) wheel->timers[timer->next].prev = timer->prev;
+    timer->slot = TIMER_NONE;
+}
+
+static inline void
+timer_release(TimerWheel* wheel, int id) {
+    wheel->timers[id].next = wheel->free_head;
+    wheel->free_head = id;
+    wheel->active--;
+}
+
+int
+timer_add(TimerWheel* wheel, uint64_t expire_ms, TimerCallback callback, void* data, int key) {
+    if (!wheel || wheel->free_head == TIMER_NONE) return TIMER_NONE;
+
+    int id = wheel->free_head;
+    Timer* timer = &wheel->timers[id];
+    wheel->free_head = timer->next;
+    wheel->active++;
+
+    uint64_t rel_ms = expire_ms > wheel->start_ms ? expire_ms - wheel->start_ms : 0;
+    timer->expire   = (rel_ms + wheel->tick_ms - 1) / wheel->tick_ms;
+    timer->key      = key;
+    timer->data     = data;
+    timer->callback = callback;
+    timer_link(wheel, id);
+    return id;
+}
+
+unsigned char
+timer_cancel(TimerWheel* wheel, int id) {
+    if (!wheel || id < 0 || id >= wheel->capacity) return 0;
+    if (wheel->timers[id].slot == TIMER_NONE) return 0;
+
+    timer_unlink(wheel, id);
+    timer_release(wheel, id);
+    return 1;
+}
+
+static inline void
+timer_cascade(TimerWheel* wheel, int level) {
+    int slot = level * TIMER_WHEEL_SLOTS +
+               (int)((wheel->tick >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK);
+    int id = wheel->slots[slot];
+    wheel->slots[slot] = TIMER_NONE;
+
+    while (id != TIMER_NONE) {
+        int next = wheel->timers[id].next;
+        // Due on this very tick, its slot is fired right after the cascade
+        if (wheel->timers[id].expire <= wheel->tick) {
+            timer_link_slot(wheel, id, (int)(wheel->tick & TIMER_WHEEL_MASK));
+        }
+        else {
+            timer_link(wheel, id);
+        }
+        id = next;
+    }
+}
+
+int
+timer_wheel_advance(TimerWheel* wheel, uint64_t now_ms) {
+    if (!wheel || now_ms < wheel->start_ms) return 0;
+    uint64_t target = (now_ms - wheel->start_ms) / wheel->tick_ms;
+    int fired = 0;
+
+    while (wheel->tick < target) {
+        // Nothing pending, jump straight to the target tick
+        if (wheel->active == 0) {
+            wheel->tick = target;
+            break;
+        }
+
+        wheel->tick++;
+
+        // Pull down coarser levels whenever the finer level wraps around
+        for (int level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+            if ((wheel->tick & (((uint64_t)1 << (TIMER_WHEEL_BITS * level)) - 1)) != 0) break;
+            timer_cascade(wheel, level);
+        }
+
+        int slot = (int)(wheel->tick & TIMER_WHEEL_MASK);
+        int id = wheel->slots[slot];
+        wheel->slots[slot] = TIMER_NONE;
+
+        while (id != TIMER_NONE) {
+            Timer* timer = &wheel->timers[id];
+            int next = timer->next;
+
+            // Release before calling back, so the callback can re-arm into the same timer
+            TimerCallback callback = timer->callback;
+            void* data = timer->data;
+            int key = timer->key;
+            timer->slot = TIMER_NONE;
+            timer_release(wheel, id);
+
+            if (callback) callback(data, key);
+            fired++;
+            id = next;
+        }
+    }
+
+    return fired;
+}
+
+#endif
+
+#endif
@@ -0,0 +1,222 @@
+#ifndef DPATCH_TRACE_H
+#define DPATCH_TRACE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "log.h"
+
+#define TRACE_NAME_MAX 39
+#define TRACE_PATH_MAX 512
+#define TRACE_WRITE_BUF (16 * 1024)
+#define TRACE_LINE_MAX (256 + 6 * TRACE_NAME_MAX)
+
+// Only checks whether tracing is on, so a disabled tracer costs a single branch
+#define TRACE(kind, id, pid, name, arg) do {\
+    if (__trace.events) trace_record(kind, id, pid, name, arg, trace_now_ns());\
+} while (0)
+#define TRACE_AT(kind, id, pid, name, arg, ts_ns) do {\
+    if (__trace.events) trace_record(kind, id, pid, name, arg, ts_ns);\
+} while (0)
+
+typedef enum {
+    TRACE_SUBMITTED,
+    TRACE_QUEUED,
+    TRACE_LAUNCHED,
+    TRACE_FAILED,
+    TRACE_LAUNCH_RETRY,
+    TRACE_FIRST_OUTPUT,
+    TRACE_EXITED,
+    TRACE_REAPED,
+    __TRACE_KIND_COUNT
+} TraceKind;
+
+// One lifecycle step of a task run, 'id' tells runs of the same task apart. Task names past the inline
+// buffer are cut short.
+typedef struct TraceEvent_st {
+    uint64_t ts_ns;
+    int64_t arg;
+    uint32_t id;
+    int32_t pid;
+    uint8_t kind;
+    char name[TRACE_NAME_MAX];
+} TraceEvent;
+
+// Fixed ring of events, once full the oldest ones are overwritten
+typedef struct TraceBuffer_st {
+    TraceEvent* events;
+    size_t capacity;
+    uint64_t head;
+    char path[TRACE_PATH_MAX];
+} TraceBuffer;
+
+extern TraceBuffer __trace;
+
+/// Get current monotonic clock time in nanoseconds
+uint64_t trace_now_ns();
+/// Start tracing into a preallocated buffer of given amount of events, dumped into given file.
+/// Returns 0 on success and -1 if failed.
+int trace_init(char* path, size_t capacity);
+/// Record an event, use the TRACE macro instead to skip it when tracing is off
+void trace_record(TraceKind kind, uint32_t id, int32_t pid, const char* name, int64_t arg, uint64_t ts_ns);
+/// Write buffered events into the trace file as Chrome trace-event JSON, returns the amount of events written
+/// or -1 if failed
+long trace_dump();
+/// Release the trace buffer
+void trace_close();
+
+#ifdef TRACE_IMPL
+
+TraceBuffer __trace = {0};
+
+uint64_t
+trace_now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int
+trace_init(char* path, size_t capacity) {
+    if (!path || capacity < 1) return -1;
+
+    // Mapped outside the arena, the buffer is sized for a long run and the arena for long-lived agent data
+    void* events = mmap(NULL, sizeof(TraceEvent) * capacity, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (events == MAP_FAILED) {
+        perror("Unable to allocate trace buffer");
+        return -1;
+    }
+
+    __trace.events   = events;
+    __trace.capacity = capacity;
+    __trace.head     = 0;
+    snprintf(__trace.path, TRACE_PATH_MAX, "%s", path);
+    return 0;
+}
+
+void
+trace_record(TraceKind kind, uint32_t id, int32_t pid, const char* name, int64_t arg, uint64_t ts_ns) {
+    TraceEvent* event = &__trace.events[__trace.head % __trace.capacity];
+    event->ts_ns = ts_ns;
+    event->arg   = arg;
+    event->id    = id;
+    event->pid   = pid;
+    event->kind  = kind;
+
+    size_t len = name ? strnlen(name, TRACE_NAME_MAX - 1) : 0;
+    if (len > 0) memcpy(event->name, name, len);
+    event->name[len] = '\0';
+    __trace.head++;
+}
+
+/// Format one Chrome async event, every run of a task is a track with its spans nested in the run
+static int
+trace__event_json(char* buf, TraceEvent* event, char* ph, char* name, int escape, char* args) {
+    int len = snprintf(buf, TRACE_LINE_MAX, ",\n{\"cat\":\"task\",\"ph\":\"%s\",\"id\":%u,\"ts\":%llu.%03u,\"pid\":%d,"
+                       "\"tid\":0,\"name\":\"",
+                       ph, event->id,
+                       (unsigned long long)(event->ts_ns / 1000), (unsigned)(event->ts_ns % 1000),
+                       getpid());
+    size_t name_len = strlen(name);
+    if (escape) {
+        len += log__json_escape(buf + len, name, name_len);
+    }
+    else {
+        memcpy(buf + len, name, name_len);
+        len += name_len;
+    }
+    len += snprintf(buf + len, TRACE_LINE_MAX - len, "\"%s%s}", args ? ",\"args\":" : "", args ? args : "");
+    return len;
+}
+
+static int
+trace__event_lines(char* buf, TraceEvent* event) {
+    char args[64];
+    int len = 0;
+    switch (event->kind) {
+        case TRACE_SUBMITTED:
+            len += trace__event_json(buf + len, event, "b", event->name, 1, NULL);
+            break;
+        case TRACE_QUEUED:
+            len += trace__event_json(buf + len, event, "b", "queued", 0, NULL);
+            break;
+        case TRACE_LAUNCHED:
+            // 'arg' tells whether the run went through the queue
+            if (event->arg) len += trace__event_json(buf + len, event, "e", "queued", 0, NULL);
+            snprintf(args, sizeof(args), "{\"pid\":%d}", event->pid);
+            len += trace__event_json(buf + len, event, "b", "running", 0, args);
+            break;
+        case TRACE_FAILED:
+            len += trace__event_json(buf + len, event, "e", event->name, 1, "{\"failed\":1}");
+            break;
+        case TRACE_LAUNCH_RETRY:
+            // The run stays queued and is launched again later
+            len += trace__event_json(buf + len, event, "n", "launch failed", 0, NULL);
+            break;
+        case TRACE_FIRST_OUTPUT:
+            len += trace__event_json(buf + len, event, "n", "first output", 0, NULL);
+            break;
+        case TRACE_EXITED:
+            snprintf(args, sizeof(args), "{\"status\":%lld}", (long long)event->arg);
+            len += trace__event_json(buf + len, event, "e", "running", 0, args);
+            break;
+        case TRACE_REAPED:
+            len += trace__event_json(buf + len, event, "e", event->name, 1, NULL);
+            break;
+    }
+    return len;
+}
+
+long
+trace_dump() {
+    if (!__trace.events) return -1;
+
+    // Written next to the target and moved over it, so a reader never sees a half written trace
+    char tmp_path[TRACE_PATH_MAX + 8];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", __trace.path);
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        perror("Unable to open trace file");
+        return -1;
+    }
+
+    char buf[TRACE_WRITE_BUF];
+    size_t used = snprintf(buf, sizeof(buf),
+                           "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n"
+                           "{\"ph\":\"M\",\"name\":\"process_name\",\"pid\":%d,\"tid\":0,\"args\":{\"name\":\"dpatch\"}}",
+                           getpid());
+
+    uint64_t start = __trace.head > __trace.capacity ? __trace.head - __trace.capacity : 0;
+    for (uint64_t i = start; i < __trace.head; i++) {
+        if (used + TRACE_LINE_MAX * 3 > sizeof(buf)) {
+            log__write_all(fd, buf, used);
+            used = 0;
+        }
+        used += trace__event_lines(buf + used, &__trace.events[i % __trace.capacity]);
+    }
+    used += snprintf(buf + used, sizeof(buf) - used, "\n]}\n");
+    log__write_all(fd, buf, used);
+
+    if (close(fd) != 0 || rename(tmp_path, __trace.path) != 0) {
+        perror("Unable to write trace file");
+        unlink(tmp_path);
+        return -1;
+    }
+    return (long)(__trace.head - start);
+}
+
+void
+trace_close() {
+    if (!__trace.events) return;
+    munmap(__trace.events, sizeof(TraceEvent) * __trace.capacity);
+    __trace.events = NULL;
+}
+
+#endif
+
+#endif
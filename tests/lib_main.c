@@ -0,0 +1,127 @@
+#include <signal.h>
+#include <sys/wait.h>
+#include "dpatch.h"
+#include "testutil.h"
+
+// Linked against the static library like an embedding program would, so only the public API is in reach
+
+#define TEST_LIB_WORKSPACE "tests/libdpatch_test.ini"
+
+typedef struct TestLibCapture_st {
+    int lines;
+    int exits;
+    size_t longest;
+    int with_nul;
+    long last_run;
+    char out[64];
+    char err[64];
+} TestLibCapture;
+
+static void
+test_lib_output(void* ctx, long run_id, const char* task_name, DpStream stream, const char* line, size_t len) {
+    TestLibCapture* capture = ctx;
+    char* dest = stream == DP_STDERR ? capture->err : capture->out;
+    snprintf(dest, sizeof(capture->out), "%s:%.*s", task_name, (int)len, line);
+    capture->lines++;
+    if (len > capture->longest) capture->longest = len;
+    if (memchr(line, '\0', len)) capture->with_nul++;
+}
+
+static void
+test_lib_exit(void* ctx, long run_id, const char* task_name, pid_t pid, int status) {
+    TestLibCapture* capture = ctx;
+    capture->exits++;
+    capture->last_run = run_id;
+}
+
+TEST_SUITE(libdpatch,
+    TestLibCapture capture;
+    memset(&capture, 0, sizeof(capture));
+    DpOptions options;
+    memset(&options, 0, sizeof(options));
+    options.max_processes = 2;
+    options.output = test_lib_output;
+    options.exit   = test_lib_exit;
+    options.ctx    = &capture;
+    DpRunner* runner = NULL;
+
+    TEST_CASE("runner should be created once per process",
+        runner = dp_runner_new(&options);
+        TEST_ASSERT_NOT(runner, NULL);
+        TEST_ASSERT_EQ(dp_runner_new(&options), NULL);
+        TEST_ASSERT_EQ(dp_workspace_load(runner, "tests/missing.ini"), DP_ERR_NOT_FOUND);
+        TEST_ASSERT_EQ(dp_workspace_load(runner, TEST_LIB_WORKSPACE), DP_OK);
+    );
+
+    TEST_CASE("runner should hand task output and exit status to the caller",
+        const char* env[2];
+        env[0] = "WHO=lib";
+        env[1] = NULL;
+        long run_id = dp_submit(runner, "echo", env);
+        TEST_ASSERT(run_id > 0);
+
+        int status = -1;
+        TEST_ASSERT_EQ(dp_wait(runner, run_id, 5000, &status), DP_OK);
+        TEST_ASSERT(WIFEXITED(status));
+        TEST_ASSERT_EQ(WEXITSTATUS(status), 0);
+        TEST_ASSERT_EQ(strcmp(capture.out, "echo:out lib"), 0);
+        TEST_ASSERT_EQ(strcmp(capture.err, "echo:err lib"), 0);
+        TEST_ASSERT_EQ(capture.lines, 2);
+        TEST_ASSERT_EQ(capture.exits, 1);
+        TEST_ASSERT_EQ(capture.last_run, run_id);
+
+        run_id = dp_submit(runner, "fail", NULL);
+        TEST_ASSERT_EQ(dp_wait(runner, run_id, 5000, &status), DP_OK);
+        TEST_ASSERT(WIFEXITED(status));
+        TEST_ASSERT_EQ(WEXITSTATUS(status), 3);
+    );
+
+    TEST_CASE("runner should hand over whole lines however the task writes them",
+        int lines = capture.lines;
+        long run_id = dp_submit(runner, "split", NULL);
+        TEST_ASSERT_EQ(dp_wait(runner, run_id, 5000, NULL), DP_OK);
+        TEST_ASSERT_EQ(capture.lines - lines, 2);
+        TEST_ASSERT_EQ(strcmp(capture.out, "split:tail"), 0);
+    );
+
+    TEST_CASE("runner should pass on NUL bytes and split lines longer than its buffer",
+        int lines = capture.lines;
+        capture.longest = 0;
+        long run_id = dp_submit(runner, "binary", NULL);
+        TEST_ASSERT_EQ(dp_wait(runner, run_id, 5000, NULL), DP_OK);
+        TEST_ASSERT_EQ(capture.with_nul, 1);
+        TEST_ASSERT_EQ(capture.lines - lines, 3);
+        TEST_ASSERT_EQ(capture.longest, 1024);
+    );
+
+    TEST_CASE("runner should report unknown tasks and runs",
+        TEST_ASSERT_EQ(dp_submit(runner, "missing", NULL), DP_ERR_NOT_FOUND);
+        TEST_ASSERT_EQ(dp_submit(runner, NULL, NULL), DP_ERR_ARG);
+        TEST_ASSERT_EQ(dp_wait(runner, 1000, 0, NULL), DP_ERR_NOT_FOUND);
+        TEST_ASSERT_EQ(dp_pending(runner), 0);
+    );
+
+    TEST_CASE("runner should queue tasks over its process limit",
+        long first = dp_submit(runner, "sleepy", NULL);
+        long second = dp_submit(runner, "sleepy", NULL);
+        long third = dp_submit(runner, "sleepy", NULL);
+        TEST_ASSERT(first > 0 && second > first && third > second);
+        TEST_ASSERT_EQ(dp_pending(runner), 3);
+        TEST_ASSERT_EQ(dp_poll(runner, 50), 0);
+        TEST_ASSERT_EQ(dp_wait(runner, third, 50, NULL), DP_ERR_TIMEOUT);
+    );
+
+    TEST_CASE("runner should kill its tasks when freed",
+        dp_runner_free(runner);
+        TEST_ASSERT_EQ(waitpid(-1, NULL, WNOHANG), -1);
+
+        runner = dp_runner_new(NULL);
+        TEST_ASSERT_NOT(runner, NULL);
+        TEST_ASSERT_EQ(dp_pending(runner), 0);
+        dp_runner_free(runner);
+    );
+)
+
+int main(int argc, char** arv) {
+    return RUN_TEST(libdpatch);
+}
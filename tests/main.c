@@ -1,8 +1,18 @@
 #include "testutil.h"
+#define ARENA_ALLOCATOR_IMPL
 #include "test_protocol.c"
 #include "test_arena.c"
 #include "test_ini.c"
 #include "test_store.c"
+#include "test_stack.c"
+#include "test_timer.c"
+#include "test_affinity.c"
+#include "test_strheap.c"
+#include "test_spill.c"
+#include "test_log.c"
+#include "test_metrics.c"
+#include "test_trace.c"
+#include "test_shm.c"
 
 int main(int argc, char** arv) {
     int err = 0;
@@ -10,5 +20,14 @@ int main(int argc, char** arv) {
     err += RUN_TEST(arena);
     /* err += RUN_TEST(ini); */
     err += RUN_TEST(store);
+    err += RUN_TEST(stack);
+    err += RUN_TEST(timer);
+    err += RUN_TEST(affinity);
+    err += RUN_TEST(strheap);
+    err += RUN_TEST(spill);
+    err += RUN_TEST(log);
+    err += RUN_TEST(metrics);
+    err += RUN_TEST(trace);
+    err += RUN_TEST(shm);
     return err;
 }
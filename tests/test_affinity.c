@@ -0,0 +1,32 @@
+#define AFFINITY_IMPL
+#include "affinity.h"
+#include "testutil.h"
+
+TEST_SUITE(affinity,
+    cpu_set_t set;
+
+    TEST_CASE("cpu list should parse single cpus and ranges",
+        TEST_ASSERT_EQ(affinity_parse_cpulist("0-3,8,10-11", &set), 7);
+        TEST_ASSERT(CPU_ISSET(0, &set));
+        TEST_ASSERT(CPU_ISSET(3, &set));
+        TEST_ASSERT(!CPU_ISSET(4, &set));
+        TEST_ASSERT(CPU_ISSET(8, &set));
+        TEST_ASSERT(CPU_ISSET(11, &set));
+        TEST_ASSERT_EQ(affinity_parse_cpulist("5\n", &set), 1);
+    );
+
+    TEST_CASE("cpu list should reject invalid input",
+        TEST_ASSERT_EQ(affinity_parse_cpulist("", &set), -1);
+        TEST_ASSERT_EQ(affinity_parse_cpulist("3-1", &set), -1);
+        TEST_ASSERT_EQ(affinity_parse_cpulist("a-b", &set), -1);
+        TEST_ASSERT_EQ(affinity_parse_cpulist("1;2", &set), -1);
+        TEST_ASSERT_EQ(affinity_parse_cpulist("0-99999", &set), -1);
+    );
+
+    TEST_CASE("nth cpu should wrap around the set",
+        affinity_parse_cpulist("2,4,6", &set);
+        TEST_ASSERT_EQ(affinity_nth_cpu(&set, 0), 2);
+        TEST_ASSERT_EQ(affinity_nth_cpu(&set, 2), 6);
+        TEST_ASSERT_EQ(affinity_nth_cpu(&set, 4), 4);
+    );
+)
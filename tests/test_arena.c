@@ -1,7 +1,40 @@
+#include <pthread.h>
 #include "testutil.h"
 #define ARENA_ALLOCATOR_IMPL
 #include "arena.h"
 
+#define ARENA_STRESS_THREADS 8
+#define ARENA_STRESS_ROUNDS 16
+#define ARENA_STRESS_ALLOCS 512
+
+/// Allocate, fill and verify blocks on a thread's own arena, returns the amount of corrupted or failed blocks
+static void*
+arena_stress_thread(void* arg) {
+    uintptr_t id = (uintptr_t)arg;
+    uintptr_t errors = 0;
+    unsigned char* blocks[ARENA_STRESS_ALLOCS];
+
+    for (int round = 0; round < ARENA_STRESS_ROUNDS; round++) {
+        for (int i = 0; i < ARENA_STRESS_ALLOCS; i++) {
+            size_t size = 16 + ((i * 37 + id) % 200);
+            blocks[i] = arena_alloc(size);
+            if (!blocks[i]) {
+                errors++;
+                continue;
+            }
+            if (blocks[i][0] != 0 || blocks[i][size - 1] != 0) errors++;
+            memset(blocks[i], (int)(id + 1), size);
+        }
+        for (int i = 0; i < ARENA_STRESS_ALLOCS; i++) {
+            size_t size = 16 + ((i * 37 + id) % 200);
+            if (blocks[i] && (blocks[i][0] != id + 1 || blocks[i][size - 1] != id + 1)) errors++;
+        }
+        arena_thread_release();
+    }
+
+    return (void*)errors;
+}
+
 TEST_SUITE(arena,
     TEST_CASE("arena should not allocate over pre-allocated and locked capacity",
         TEST_ASSERT(arena_init(32, 1, 1) == ARENA_OK);
@@ -14,7 +47,6 @@ TEST_SUITE(arena,
 
     TEST_CASE("arena should allow allocation over capacity without preallocation and lock",
         TEST_ASSERT(arena_init(1024, 0, 0) == ARENA_OK);
-        TEST_ASSERT(arena_alloc(1025) == NULL);
         TEST_ASSERT(arena_alloc(512) != NULL);
         TEST_ASSERT(arena_alloc(512) != NULL);
         TEST_ASSERT(__arena_root->next == NULL);
@@ -23,4 +55,123 @@ TEST_SUITE(arena,
         TEST_ASSERT(arena_free() == ARENA_OK);
         TEST_ASSERT(__arena_root == NULL);
     );
+
+    TEST_CASE("arena should grow to fit allocations larger than its root page",
+        TEST_ASSERT(arena_init(1024, 0, 0) == ARENA_OK);
+        char* p = arena_alloc(4000);
+        TEST_ASSERT(p != NULL);
+        TEST_ASSERT(__arena_root->next != NULL);
+        TEST_ASSERT(__arena_current->size >= 4000);
+        memset(p, 0xff, 4000);
+        TEST_ASSERT(arena_alloc(ARENA_GROW_MAX + 1) == NULL);
+        TEST_ASSERT(arena_free() == ARENA_OK);
+    );
+
+    TEST_CASE("arena allocations should honour alignment",
+        TEST_ASSERT(arena_init(1024, 0, 0) == ARENA_OK);
+        TEST_ASSERT(arena_alloc(3) != NULL);
+        void* p = arena_alloc(8);
+        TEST_ASSERT(((uintptr_t)p % ARENA_DEFAULT_ALIGN) == 0);
+        TEST_ASSERT(arena_alloc(1) != NULL);
+        p = arena_alloc_aligned(64, 64);
+        TEST_ASSERT(p != NULL);
+        TEST_ASSERT(((uintptr_t)p % 64) == 0);
+        TEST_ASSERT(arena_free() == ARENA_OK);
+    );
+
+    TEST_CASE("arena should grow geometrically and bump from the current page",
+        TEST_ASSERT(arena_init(1024, 0, 0) == ARENA_OK);
+        TEST_ASSERT(arena_alloc(1024) != NULL);
+        TEST_ASSERT(arena_alloc(1024) != NULL);
+        TEST_ASSERT(__arena_root->next != NULL);
+        TEST_ASSERT(__arena_root->next->size == 2048);
+        TEST_ASSERT(__arena_current == __arena_root->next);
+        TEST_ASSERT(arena_alloc(1024) != NULL);
+        TEST_ASSERT(__arena_current->next == NULL);
+        TEST_ASSERT(arena_alloc(1024) != NULL);
+        TEST_ASSERT(__arena_current->size == 4096);
+        TEST_ASSERT(arena_free() == ARENA_OK);
+    );
+
+    TEST_CASE("child arena should be bounded and reusable through marks",
+        TEST_ASSERT(arena_init(4096, 1, 1) == ARENA_OK);
+        Arena* scratch = arena_child_new(256);
+        TEST_ASSERT(scratch != NULL);
+        TEST_ASSERT(arena_child_alloc(scratch, 64) != NULL);
+
+        ArenaMark mark = arena_mark(scratch);
+        void* p = arena_child_alloc(scratch, 128);
+        TEST_ASSERT(p != NULL);
+        TEST_ASSERT(arena_child_alloc(scratch, 128) == NULL);
+
+        arena_reset_to(scratch, mark);
+        TEST_ASSERT(arena_child_alloc(scratch, 128) == p);
+
+        arena_reset(scratch);
+        TEST_ASSERT(arena_child_alloc(scratch, 256) != NULL);
+        TEST_ASSERT(arena_free() == ARENA_OK);
+    );
+
+    TEST_CASE("arena pages should come zeroed and trimmed memory should read back as zero",
+        TEST_ASSERT(arena_init(65536, 2, 1) == ARENA_OK);
+        char* p = arena_alloc(128);
+        int zeroed = 1;
+        for (int i = 0; i < 128; i++) if (p[i] != 0) zeroed = 0;
+        TEST_ASSERT(zeroed);
+        TEST_ASSERT(arena_trim() > 0);
+        char* q = arena_alloc(65536);
+        q[65535] = 1;
+        TEST_ASSERT(q[0] == 0);
+        TEST_ASSERT(arena_free() == ARENA_OK);
+    );
+
+    TEST_CASE("arena should track bytes, allocations and failed allocations per tag",
+        TEST_ASSERT(arena_init(4096, 1, 1) == ARENA_OK);
+        TEST_ASSERT(arena_alloc_tagged(100, ARENA_TAG_NET) != NULL);
+        TEST_ASSERT(arena_alloc_tagged(200, ARENA_TAG_NET) != NULL);
+        TEST_ASSERT(arena_alloc_tagged(8192, ARENA_TAG_STORE) == NULL);
+
+        ArenaTagStats net = arena_tag_stats(ARENA_TAG_NET);
+        TEST_ASSERT(net.bytes == 300 && net.count == 2 && net.failed == 0);
+        ArenaTagStats store = arena_tag_stats(ARENA_TAG_STORE);
+        TEST_ASSERT(store.count == 0 && store.failed == 1);
+
+        Arena* scratch = arena_child_new(256);
+        size_t capacity = 0;
+        TEST_ASSERT(arena_tag_stats(ARENA_TAG_SCRATCH).bytes >= 256);
+        TEST_ASSERT(arena_child_alloc(scratch, 64) != NULL);
+        arena_reset(scratch);
+        TEST_ASSERT(arena_child_peak(scratch, &capacity) == 64 && capacity == 256);
+
+        TEST_ASSERT(strcmp(arena_tag_name(ARENA_TAG_PROTOCOL), "protocol") == 0);
+        TEST_ASSERT(arena_free() == ARENA_OK);
+        TEST_ASSERT(arena_tag_stats(ARENA_TAG_NET).count == 0);
+    );
+
+    TEST_CASE("thread arenas should allocate concurrently and recycle pages through the pool",
+        TEST_ASSERT(arena_init(8192, 1, 1) == ARENA_OK);
+        TEST_ASSERT(arena_pool_count() == 0);
+
+        pthread_t threads[ARENA_STRESS_THREADS];
+        for (uintptr_t i = 0; i < ARENA_STRESS_THREADS; i++) {
+            pthread_create(&threads[i], NULL, arena_stress_thread, (void*)i);
+        }
+        uintptr_t errors = 0;
+        for (int i = 0; i < ARENA_STRESS_THREADS; i++) {
+            void* res = NULL;
+            pthread_join(threads[i], &res);
+            errors += (uintptr_t)res;
+        }
+        TEST_ASSERT(errors == 0);
+
+        // Released pages went back to the pool and were reused, instead of mapping new ones every round
+        TEST_ASSERT(arena_pool_count() > 0);
+        TEST_ASSERT(__arena_pool_registered <= ARENA_STRESS_THREADS + 1);
+
+        // The locked main arena is unaffected by the other threads
+        TEST_ASSERT(arena_alloc(4096) != NULL);
+        TEST_ASSERT(arena_alloc(8192) == NULL);
+        TEST_ASSERT(arena_free() == ARENA_OK);
+        TEST_ASSERT(arena_pool_count() == 0);
+    );
 )
@@ -0,0 +1,190 @@
+#include "log.h"
+#include "testutil.h"
+
+#define TEST_LOG_FILE "/tmp/dpatch-test.log"
+#define TEST_LOG_DIR "/tmp/dpatch-test-logs"
+#define TEST_LOG_PRODUCERS 4
+#define TEST_LOG_LINES 5000
+
+static void*
+test_log_producer(void* data) {
+    long producer = (long)data;
+    for (int i = 0; i < TEST_LOG_LINES; i++) {
+        log__print(LOG_LVL_INFO, LOG_CTX(LOG_COMP_SERVER, NULL, 0, LOG_STREAM_NONE), "p%ld %d", producer, i);
+    }
+    return NULL;
+}
+
+/// Log from several threads at once through the writer ring, then count the lines that made it into the file.
+/// Returns the amount of lines, or -1 if a producer's lines came out of order.
+static int
+test_log_producers(LogFullPolicy policy) {
+    LogOptions options;
+    memset(&options, 0, sizeof(LogOptions));
+    options.async    = 1;
+    options.policy   = policy;
+    // A writer this slow leaves it to the producers to wake it, the ring fills many times over
+    options.flush_ms = 1000;
+    unlink(TEST_LOG_FILE);
+    if (log_init(TEST_LOG_FILE, &options) != 0) return -1;
+
+    pthread_t threads[TEST_LOG_PRODUCERS];
+    for (long i = 0; i < TEST_LOG_PRODUCERS; i++) {
+        pthread_create(&threads[i], NULL, test_log_producer, (void*)i);
+    }
+    for (int i = 0; i < TEST_LOG_PRODUCERS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    log_close();
+
+    FILE* fp = fopen(TEST_LOG_FILE, "r");
+    if (!fp) return -1;
+    int next[TEST_LOG_PRODUCERS] = {0};
+    int lines = 0;
+    unsigned char ordered = 1;
+    char line[256];
+    while (fgets(line, sizeof(line), fp)) {
+        char* msg = strstr(line, "] p");
+        long producer;
+        int seq;
+        if (!msg || sscanf(msg, "] p%ld %d", &producer, &seq) != 2) continue;
+        if (producer < 0 || producer >= TEST_LOG_PRODUCERS || seq < next[producer]) ordered = 0;
+        else next[producer] = seq + 1;
+        lines++;
+    }
+    fclose(fp);
+    unlink(TEST_LOG_FILE);
+    return ordered ? lines : -1;
+}
+
+TEST_SUITE(log,
+    char out[512];
+    union { LogRecord record; char bytes[sizeof(LogRecord) + 64]; } local;
+    LogRecord* record = &local.record;
+
+    TEST_CASE("json escaper should escape quotes, backslashes and control bytes",
+        char in[] = "a\"b\\c\nd\te\x01";
+        size_t len = log__json_escape(out, in, strlen(in));
+        out[len] = '\0';
+        TEST_ASSERT_EQ(strcmp(out, "a\\\"b\\\\c\\nd\\te\\u0001"), 0);
+    );
+
+    TEST_CASE("json escaper should copy clean strings as is",
+        size_t len = log__json_escape(out, "plain text", 10);
+        TEST_ASSERT_EQ(len, 10);
+        TEST_ASSERT_EQ(memcmp(out, "plain text", 10), 0);
+    );
+
+    TEST_CASE("json escaper should keep UTF-8 and replace invalid bytes",
+        // A euro sign, a stray continuation byte, a truncated sequence, an overlong slash and a surrogate
+        char in[] = "\xe2\x82\xac" "a\x80" "b\xe2\x82" "c\xc0\xaf" "d\xed\xa0\x80";
+        size_t len = log__json_escape(out, in, strlen(in));
+        out[len] = '\0';
+        TEST_ASSERT_EQ(strcmp(out, "\xe2\x82\xac" "a\xef\xbf\xbd" "b\xef\xbf\xbd\xef\xbf\xbd"
+                                   "c\xef\xbf\xbd\xef\xbf\xbd" "d\xef\xbf\xbd\xef\xbf\xbd\xef\xbf\xbd"), 0);
+    );
+
+    TEST_CASE("json line should only carry the fields that are set",
+        memset(record, 0, sizeof(LogRecord));
+        record->ts_ns = 42;
+        record->level = LOG_LVL_WARN;
+        record->component = LOG_COMP_SERVER;
+        record->len = 2;
+        memcpy(record->msg, "hi", 2);
+        size_t len = log__json_line(out, record);
+        out[len] = '\0';
+        TEST_ASSERT_EQ(strcmp(out, "{\"ts_ns\":42,\"level\":\"warn\",\"component\":\"server\",\"msg\":\"hi\"}\n"), 0);
+    );
+
+    TEST_CASE("json line should carry task output fields",
+        record->component = LOG_COMP_TASK;
+        record->pid = 7;
+        record->request_id = 3;
+        record->stream = LOG_STREAM_STDERR;
+        record->task_len = 4;
+        memcpy(record->msg + record->len, "ta\"k", 4);
+        size_t len = log__json_line(out, record);
+        out[len] = '\0';
+        TEST_ASSERT_EQ(strcmp(out, "{\"ts_ns\":42,\"level\":\"warn\",\"component\":\"task\",\"task\":\"ta\\\"k\",\"pid\":7,"
+                                   "\"request_id\":3,\"stream\":\"stderr\",\"msg\":\"hi\"}\n"), 0);
+    );
+
+    TEST_CASE("log ring should keep every line of every producer in order when blocking",
+        __log_console_fd = -1;
+        uint64_t started_ms = timer_now_ms();
+        TEST_ASSERT_EQ(test_log_producers(LOG_POLICY_BLOCK), TEST_LOG_PRODUCERS * TEST_LOG_LINES);
+        TEST_ASSERT_EQ(log_dropped(), 0);
+        // Blocked producers wake the writer, they never wait out its flush interval for every ring's worth
+        TEST_ASSERT(timer_now_ms() - started_ms < 10000);
+    );
+
+    TEST_CASE("log ring should count every line it drops when full",
+        int lines = test_log_producers(LOG_POLICY_DROP);
+        TEST_ASSERT(lines > 0);
+        TEST_ASSERT(log_dropped() > 0);
+        TEST_ASSERT_EQ(lines + log_dropped(), TEST_LOG_PRODUCERS * TEST_LOG_LINES);
+        __log_console_fd = STDOUT_FILENO;
+    );
+
+    TEST_CASE("log file should rotate past its size and keep the retained count",
+        LogOptions options;
+        memset(&options, 0, sizeof(LogOptions));
+        options.rotate_size = 256;
+        options.rotate_keep = 2;
+        __log_console_fd = open("/dev/null", O_WRONLY);
+        TEST_ASSERT_EQ(log_init(TEST_LOG_FILE, &options), 0);
+
+        for (int i = 0; i < 40; i++) {
+            log__print(LOG_LVL_INFO, LOG_CTX(LOG_COMP_SERVER, NULL, 0, LOG_STREAM_NONE), "rotated line %d", i);
+        }
+        TEST_ASSERT_EQ(access(TEST_LOG_FILE ".1", F_OK), 0);
+        TEST_ASSERT_EQ(access(TEST_LOG_FILE ".2", F_OK), 0);
+        TEST_ASSERT_NOT(access(TEST_LOG_FILE ".3", F_OK), 0);
+        TEST_ASSERT(__log_file.size < 256);
+    );
+
+    TEST_CASE("log file should be recreated when reopened after a move",
+        rename(TEST_LOG_FILE, TEST_LOG_FILE ".moved");
+        log_reopen();
+        log__print(LOG_LVL_INFO, LOG_CTX(LOG_COMP_SERVER, NULL, 0, LOG_STREAM_NONE), "after reopen");
+        TEST_ASSERT_EQ(access(TEST_LOG_FILE, F_OK), 0);
+
+        log_close();
+        close(__log_console_fd);
+        __log_console_fd = STDOUT_FILENO;
+        unlink(TEST_LOG_FILE);
+        unlink(TEST_LOG_FILE ".1");
+        unlink(TEST_LOG_FILE ".2");
+        unlink(TEST_LOG_FILE ".moved");
+    );
+
+    TEST_CASE("log file should count its limits again when reopening it fails",
+        LogOptions options;
+        memset(&options, 0, sizeof(LogOptions));
+        options.rotate_size = 256;
+        __log_console_fd = open("/dev/null", O_WRONLY);
+        mkdir(TEST_LOG_DIR, 0755);
+        TEST_ASSERT_EQ(log_init(TEST_LOG_DIR "/test.log", &options), 0);
+
+        unlink(TEST_LOG_DIR "/test.log");
+        rmdir(TEST_LOG_DIR);
+        for (int i = 0; i < 20; i++) {
+            log__print(LOG_LVL_INFO, LOG_CTX(LOG_COMP_SERVER, NULL, 0, LOG_STREAM_NONE), "orphaned line %d", i);
+        }
+        TEST_ASSERT_EQ(__log_file.open_failed, 1);
+        TEST_ASSERT(__log_file.size < 256);
+
+        mkdir(TEST_LOG_DIR, 0755);
+        for (int i = 0; i < 20; i++) {
+            log__print(LOG_LVL_INFO, LOG_CTX(LOG_COMP_SERVER, NULL, 0, LOG_STREAM_NONE), "recovered line %d", i);
+        }
+        TEST_ASSERT_EQ(__log_file.open_failed, 0);
+        TEST_ASSERT_EQ(access(TEST_LOG_DIR "/test.log", F_OK), 0);
+
+        log_close();
+        close(__log_console_fd);
+        __log_console_fd = STDOUT_FILENO;
+        unlink(TEST_LOG_DIR "/test.log");
+        rmdir(TEST_LOG_DIR);
+    );
+)
@@ -0,0 +1,95 @@
+#define METRICS_IMPL
+#include "metrics.h"
+#include "testutil.h"
+#include <pthread.h>
+
+#define TEST_METRICS_ADDS 10000
+
+static const uint64_t test_histogram_values[] = { 0, 1, 31, 32, 33, 63, 64, 65, 1000, 123456, 4000000000ULL };
+
+static void*
+test_metrics_adder(void* data) {
+    for (int i = 0; i < TEST_METRICS_ADDS; i++) metrics_add(METRIC_OUTPUT_BYTES, 2);
+    return NULL;
+}
+
+TEST_SUITE(metrics,
+    char out[4096];
+
+    TEST_CASE("metrics counters should add up within a thread",
+        METRICS_INC(METRIC_TASKS_SUBMITTED);
+        METRICS_INC(METRIC_TASKS_SUBMITTED);
+        metrics_add(METRIC_OUTPUT_BYTES, 100);
+        TEST_ASSERT_EQ(metrics_value(METRIC_TASKS_SUBMITTED), 2);
+        TEST_ASSERT_EQ(metrics_value(METRIC_OUTPUT_BYTES), 100);
+        TEST_ASSERT_EQ(metrics_value(METRIC_TASKS_FAILED), 0);
+    );
+
+    TEST_CASE("metrics counters should be summed over every thread",
+        pthread_t threads[4];
+        for (int i = 0; i < 4; i++) pthread_create(&threads[i], NULL, test_metrics_adder, NULL);
+        for (int i = 0; i < 4; i++) pthread_join(threads[i], NULL);
+        TEST_ASSERT_EQ(metrics_value(METRIC_OUTPUT_BYTES), 100 + 4 * TEST_METRICS_ADDS * 2);
+    );
+
+    TEST_CASE("metrics gauges should hold the last value set",
+        metrics_set(METRIC_QUEUE_DEPTH, 12);
+        metrics_set(METRIC_QUEUE_DEPTH, 5);
+        TEST_ASSERT_EQ(metrics_value(METRIC_QUEUE_DEPTH), 5);
+    );
+
+    TEST_CASE("metrics should render in Prometheus text format",
+        size_t len = metrics_render_prometheus(out, sizeof(out));
+        TEST_ASSERT(len > 0);
+        TEST_ASSERT_EQ(strlen(out), len);
+        TEST_ASSERT_NOT(strstr(out, "# TYPE dpatch_tasks_submitted_total counter\ndpatch_tasks_submitted_total 2\n"), NULL);
+        TEST_ASSERT_NOT(strstr(out, "# TYPE dpatch_queue_depth gauge\ndpatch_queue_depth 5\n"), NULL);
+    );
+
+    TEST_CASE("metrics should leave out what does not fit whole",
+        size_t len = metrics_render_prometheus(out, 200);
+        TEST_ASSERT(len < 200);
+        TEST_ASSERT_EQ(out[len - 1], '\n');
+        TEST_ASSERT_EQ(strstr(out, "dpatch_processes_running"), NULL);
+    );
+
+    TEST_CASE("metrics should fit whole in the size given for them",
+        size_t size = metrics_prometheus_size();
+        char* full = malloc(size);
+        TEST_ASSERT_NOT(full, NULL);
+        size_t len = metrics_render_prometheus(full, size);
+        TEST_ASSERT(len < size);
+        TEST_ASSERT_NOT(strstr(full, "dpatch_reap_latency_us_count"), NULL);
+        free(full);
+    );
+
+    TEST_CASE("histogram buckets should bound values within 1/32 of them",
+        int bounded = 0;
+        int count = sizeof(test_histogram_values) / sizeof(test_histogram_values[0]);
+        for (int i = 0; i < count; i++) {
+            uint64_t value = test_histogram_values[i];
+            uint64_t upper = histogram__upper(histogram__index(value));
+            if (upper >= value && upper - value <= value / 32) bounded++;
+        }
+        TEST_ASSERT_EQ(bounded, count);
+        TEST_ASSERT_EQ(histogram__index((uint64_t)1 << 40), HISTOGRAM_BUCKETS - 1);
+    );
+
+    TEST_CASE("histogram quantiles should follow the recorded distribution",
+        TEST_ASSERT_EQ(histogram_quantile(HISTOGRAM_SPAWN, 0.5), 0);
+        for (uint64_t i = 1; i <= 1000; i++) histogram_record(HISTOGRAM_SPAWN, i);
+        uint64_t p50 = histogram_quantile(HISTOGRAM_SPAWN, 0.5);
+        uint64_t p99 = histogram_quantile(HISTOGRAM_SPAWN, 0.99);
+        TEST_ASSERT(p50 >= 500 && p50 <= 500 + 500 / 32);
+        TEST_ASSERT(p99 >= 990 && p99 <= 1000);
+        TEST_ASSERT_EQ(histogram_quantile(HISTOGRAM_SPAWN, 1.0), 1000);
+        TEST_ASSERT_EQ(histogram_get(HISTOGRAM_SPAWN)->count, 1000);
+        TEST_ASSERT_EQ(histogram_get(HISTOGRAM_SPAWN)->sum, 500500);
+    );
+
+    TEST_CASE("histograms should render as Prometheus summaries",
+        metrics_render_prometheus(out, sizeof(out));
+        TEST_ASSERT_NOT(strstr(out, "# TYPE dpatch_spawn_latency_us summary\n"), NULL);
+        TEST_ASSERT_NOT(strstr(out, "dpatch_spawn_latency_us_count 1000\n"), NULL);
+    );
+)
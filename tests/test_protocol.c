@@ -2,6 +2,22 @@
 #include "testutil.h"
 #include "protocol.h"
 #include <stdlib.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <pthread.h>
+
+#define TEST_SNAPSHOT_ENTRIES 300
+
+/// Read a socket a little at a time until it closes, like a client that always lets the next write through
+static void*
+test_slow_reader(void* data) {
+    int sock = (int)(long)data;
+    char buf[256];
+    while (read(sock, buf, sizeof(buf)) > 0) usleep(2000);
+    return NULL;
+}
+
+static uint64_t test_varint_values[] = { 0, 1, 127, 128, 300, 16384, 0xffffffffULL, UINT64_MAX };
 
 TEST_SUITE(protocol,
 
@@ -44,4 +60,228 @@ TEST_SUITE(protocol,
         TEST_ASSERT_EQ(res_stream->tokens[2].type, test_stream->tokens[2].type);
         TEST_ASSERT_EQ(strcmp(res_stream->tokens[2].value, test_stream->tokens[2].value), 0);
     );
+
+    TEST_CASE("varints should round trip at every width",
+        char buf[PROTOCOL_VARINT_MAX];
+        for (int i = 0; i < (int)(sizeof(test_varint_values) / sizeof(uint64_t)); i++) {
+            uint64_t value = 0;
+            int len = protocol_varint_put(buf, test_varint_values[i]);
+            TEST_ASSERT_EQ(protocol_varint_get(buf, buf + len, &value), len);
+            TEST_ASSERT_EQ(value, test_varint_values[i]);
+            TEST_ASSERT_EQ(protocol_varint_get(buf, buf + len - 1, &value), 0);
+        }
+        TEST_ASSERT_EQ(protocol_varint_put(buf, 127), 1);
+        TEST_ASSERT_EQ(protocol_varint_put(buf, UINT64_MAX), PROTOCOL_VARINT_MAX);
+    );
+
+    TEST_CASE("snapshot entry should round trip and skip fields it does not know",
+        char buf[128];
+        ProtocolEntry entry;
+        ProtocolEntry res;
+        entry.field_count = PROTOCOL_ENTRY_FIELDS + 2;
+        for (int i = 0; i < entry.field_count && i < PROTOCOL_ENTRY_FIELDS; i++) entry.fields[i] = i * 1000;
+        entry.str_count   = 2;
+        entry.strs[0]     = "task";
+        entry.str_lens[0] = 4;
+        entry.strs[1]     = "echo hi";
+        entry.str_lens[1] = 7;
+
+        // Written by hand past the field limit, as a newer writer with more fields would
+        int len = protocol_varint_put(buf, PROTOCOL_ENTRY_FIELDS + 2);
+        for (int i = 0; i < PROTOCOL_ENTRY_FIELDS + 2; i++) len += protocol_varint_put(buf + len, i * 1000);
+        len += protocol_varint_put(buf + len, 2);
+        len += protocol_varint_put(buf + len, 4);
+        memcpy(buf + len, "task", 4);
+        len += 4;
+        len += protocol_varint_put(buf + len, 7);
+        memcpy(buf + len, "echo hi", 7);
+        len += 7;
+
+        TEST_ASSERT_EQ(protocol_entry_get(buf, buf + len, &res), len);
+        TEST_ASSERT_EQ(res.field_count, PROTOCOL_ENTRY_FIELDS);
+        TEST_ASSERT_EQ(res.fields[PROTOCOL_ENTRY_FIELDS - 1], (PROTOCOL_ENTRY_FIELDS - 1) * 1000);
+        TEST_ASSERT_EQ(res.str_lens[1], 7);
+        TEST_ASSERT_EQ(memcmp(res.strs[1], "echo hi", 7), 0);
+        TEST_ASSERT_EQ(protocol_entry_get(buf, buf + len - 1, &res), 0);
+
+        entry.field_count = 2;
+        entry.str_count   = 1;
+        len = protocol_entry_put(buf, sizeof(buf), &entry);
+        TEST_ASSERT(len > 0);
+        TEST_ASSERT_EQ(protocol_entry_get(buf, buf + len, &res), len);
+        TEST_ASSERT_EQ(res.fields[1], 1000);
+        TEST_ASSERT_EQ(res.fields[2], 0);
+        TEST_ASSERT_EQ(res.str_count, 1);
+        TEST_ASSERT_EQ(res.str_lens[1], 0);
+        TEST_ASSERT_EQ(protocol_entry_put(buf, 8, &entry), 0);
+    );
+
+    TEST_CASE("snapshot should stream in frames of the buffer size and end with the last one",
+        int fds[2];
+        char out_buf[128];
+        char in_buf[128];
+        char name[16];
+        ProtocolSnapshot snap;
+        ProtocolSnapshotFrame frame;
+        ProtocolEntry entry;
+        TEST_ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+        socket_set_nonblock(fds[0]);
+
+        // Read in a separate process, the snapshot is larger than the socket buffer
+        pid_t pid = fork();
+        if (pid == 0) {
+            close(fds[0]);
+            long entries = 0;
+            uint32_t seq = 0;
+            unsigned char last = 0;
+            ProtocolReader reader;
+            ProtocolHeader header;
+            protocol_reader_init(&reader, fds[1], in_buf, sizeof(in_buf));
+            while (!last) {
+                char* msg = protocol_reader_next(&reader, &header);
+                if (!msg) _exit(1);
+                if (protocol_snapshot_frame(msg, header.size + header.length, &frame) != 0 || frame.seq != seq++) _exit(3);
+                if (frame.kind != PROTOCOL_SNAPSHOT_PROCS) _exit(4);
+                while (protocol_snapshot_next(&frame, &entry) > 0) {
+                    if (entry.fields[PROTOCOL_PROC_PID] != (uint64_t)entries++) _exit(5);
+                }
+                last = frame.flags & PROTOCOL_FLAG_LAST;
+            }
+            _exit(entries == TEST_SNAPSHOT_ENTRIES && seq > 1 ? 0 : 6);
+        }
+        close(fds[1]);
+
+        protocol_snapshot_begin(&snap, fds[0], out_buf, sizeof(out_buf), PROTOCOL_SNAPSHOT_PROCS, PROTOCOL_VERSION, 1000);
+        entry.field_count = __PROTOCOL_PROC_FIELD_COUNT;
+        entry.str_count   = 1;
+        entry.strs[0]     = name;
+        for (int i = 0; i < TEST_SNAPSHOT_ENTRIES; i++) {
+            entry.fields[PROTOCOL_PROC_PID]        = i;
+            entry.fields[PROTOCOL_PROC_RUNNING_MS] = i * 10;
+            entry.fields[PROTOCOL_PROC_TRACE_ID]   = i;
+            entry.str_lens[0] = snprintf(name, sizeof(name), "task%d", i);
+            TEST_ASSERT_EQ(protocol_snapshot_add(&snap, &entry), 0);
+        }
+        TEST_ASSERT(protocol_snapshot_end(&snap) > (long)sizeof(out_buf));
+        TEST_ASSERT(snap.seq > 1);
+
+        int status = 0;
+        waitpid(pid, &status, 0);
+        TEST_ASSERT(WIFEXITED(status));
+        TEST_ASSERT_EQ(WEXITSTATUS(status), 0);
+        close(fds[0]);
+    );
+
+    TEST_CASE("versioned messages should be smaller than legacy ones and both should round trip",
+        char buf[64];
+        char legacy_buf[64];
+        ProtocolTokenStream* res_stream = protocol_tokenstream_alloc(test_stream->length);
+        int written = protocol_tokenstream_to_buf(test_stream, buf, sizeof(buf), 0);
+        test_stream->version = PROTOCOL_VERSION_LEGACY;
+        int legacy_written = protocol_tokenstream_to_buf(test_stream, legacy_buf, sizeof(legacy_buf), 0);
+        test_stream->version = PROTOCOL_VERSION;
+        TEST_ASSERT(written > 0);
+        TEST_ASSERT(written < legacy_written);
+        TEST_ASSERT_EQ((unsigned char)buf[0], PROTOCOL_MAGIC);
+
+        TEST_ASSERT_EQ(protocol_buf_to_tokenstream(legacy_buf, legacy_written, 0, res_stream), 0);
+        TEST_ASSERT_EQ(res_stream->version, PROTOCOL_VERSION_LEGACY);
+        TEST_ASSERT_EQ(res_stream->length, 3);
+        TEST_ASSERT_EQ(strcmp(res_stream->tokens[2].value, "var2=fgh"), 0);
+
+        TEST_ASSERT_EQ(protocol_buf_to_tokenstream(buf, written, 0, res_stream), 0);
+        TEST_ASSERT_EQ(res_stream->version, PROTOCOL_VERSION);
+        TEST_ASSERT_EQ(res_stream->type, PROTOCOL_MSG_PING);
+        TEST_ASSERT_EQ(strcmp(res_stream->tokens[2].value, "var2=fgh"), 0);
+        TEST_ASSERT_NOT(protocol_buf_to_tokenstream(buf, written - 1, 0, res_stream), 0);
+        TEST_ASSERT_EQ(protocol_tokenstream_to_buf(test_stream, buf, 8, 0), -1);
+
+        // Over the reader's token capacity
+        res_stream->capacity = 2;
+        TEST_ASSERT_NOT(protocol_buf_to_tokenstream(buf, written, 0, res_stream), 0);
+    );
+
+    TEST_CASE("headers should ask for more bytes until whole and reject newer versions",
+        char buf[PROTOCOL_HEADER_MAX];
+        ProtocolHeader header;
+        ProtocolHeader res;
+        ProtocolTokenStream* res_stream = protocol_tokenstream_alloc(1);
+        header.version = PROTOCOL_VERSION;
+        header.flags   = PROTOCOL_FLAG_LAST;
+        header.type    = PROTOCOL_MSG_SNAPSHOT;
+        header.length  = 300;
+        int len = protocol_header_put(buf, &header);
+        TEST_ASSERT_EQ(len, 3 + 1 + 2);
+        for (int i = 0; i < len; i++) TEST_ASSERT_EQ(protocol_header_get(buf, i, &res), 0);
+        TEST_ASSERT_EQ(protocol_header_get(buf, len, &res), 1);
+        TEST_ASSERT_EQ(res.flags, PROTOCOL_FLAG_LAST);
+        TEST_ASSERT_EQ(res.length, 300);
+        TEST_ASSERT_EQ(res.size, len);
+
+        // A newer client is answered in the newest version this side knows
+        header.version = PROTOCOL_VERSION + 1;
+        header.type    = PROTOCOL_MSG_PING;
+        header.length  = 0;
+        len = protocol_header_put(buf, &header);
+        TEST_ASSERT_NOT(protocol_buf_to_tokenstream(buf, len, 0, res_stream), 0);
+        TEST_ASSERT_EQ(res_stream->version, PROTOCOL_VERSION);
+    );
+
+    TEST_CASE("legacy snapshot should be a single message of text lines",
+        int fds[2];
+        char out_buf[128];
+        char in_buf[128];
+        ProtocolSnapshot snap;
+        ProtocolEntry entry;
+        ProtocolTokenStream* res_stream = protocol_tokenstream_alloc(4);
+        TEST_ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+
+        protocol_snapshot_begin(&snap, fds[0], out_buf, sizeof(out_buf), PROTOCOL_SNAPSHOT_PROCS,
+                                PROTOCOL_VERSION_LEGACY, 1000);
+        snap.token_max = 3;
+        entry.field_count = __PROTOCOL_PROC_FIELD_COUNT;
+        entry.str_count   = 1;
+        entry.strs[0]     = "build";
+        entry.str_lens[0] = 5;
+        entry.fields[PROTOCOL_PROC_RUNNING_MS] = 1500;
+        for (int i = 0; i < 5; i++) {
+            entry.fields[PROTOCOL_PROC_PID] = 100 + i;
+            TEST_ASSERT_EQ(protocol_snapshot_add(&snap, &entry), 0);
+        }
+        long sent = protocol_snapshot_end(&snap);
+        TEST_ASSERT(sent > 0);
+        TEST_ASSERT_EQ(read(fds[1], in_buf, sizeof(in_buf)), sent);
+
+        TEST_ASSERT_EQ(protocol_read(in_buf, sent, res_stream), 0);
+        TEST_ASSERT_EQ(res_stream->type, PROTOCOL_MSG_SUCCESS);
+        TEST_ASSERT_EQ(res_stream->length, 3);
+        TEST_ASSERT_EQ(strcmp(res_stream->tokens[0].value, "Running processes"), 0);
+        TEST_ASSERT_EQ(strcmp(res_stream->tokens[2].value, "build pid=101 running=1.500s"), 0);
+        close(fds[0]);
+        close(fds[1]);
+    );
+
+    TEST_CASE("sending should give up at one deadline however slowly the reader drains",
+        int fds[2];
+        TEST_ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+        socket_set_nonblock(fds[0]);
+        int buf_size = 4096;
+        setsockopt(fds[0], SOL_SOCKET, SO_SNDBUF, &buf_size, sizeof(buf_size));
+        pthread_t reader;
+        pthread_create(&reader, NULL, test_slow_reader, (void*)(long)fds[1]);
+
+        int size = 4 * 1024 * 1024;
+        char* big = calloc(1, size);
+        uint64_t start_ms = socket_now_ms();
+        int sent = socket_send_wait(fds[0], big, size, 0, 200);
+        uint64_t took_ms = socket_now_ms() - start_ms;
+        TEST_ASSERT(sent < size);
+        TEST_ASSERT(took_ms < 1000);
+
+        shutdown(fds[0], SHUT_RDWR);
+        pthread_join(reader, NULL);
+        free(big);
+        close(fds[0]);
+        close(fds[1]);
+    );
 )
@@ -0,0 +1,136 @@
+#define SHM_IMPL
+#include "shm.h"
+#include "testutil.h"
+
+#define TEST_SHM_FRAME 1000
+
+static char test_shm_in[TEST_SHM_FRAME];
+static char test_shm_out[TEST_SHM_FRAME];
+
+TEST_SUITE(shm,
+    ShmChannel test_channel;
+    ShmChannel test_client;
+
+    TEST_CASE("shm channel should round rings up to a power of two",
+        TEST_ASSERT_EQ(shm_channel_create(&test_channel, 5000), 0);
+        TEST_ASSERT_EQ(test_channel.ring_size, 8192);
+        TEST_ASSERT_EQ(shm_ring_pending(test_channel.requests), 0);
+        TEST_ASSERT_EQ(shm_ring_read(test_channel.requests, test_channel.ring_size, test_shm_out, TEST_SHM_FRAME), 0);
+    );
+
+    TEST_CASE("shm ring should keep frames whole across its end",
+        int ok = 1;
+        // Frames of this size start at a different offset every time around the ring, so both the length and
+        // the data get split at its end at some point
+        for (int i = 0; i < 100 && ok; i++) {
+            memset(test_shm_in, 'a' + i % 26, TEST_SHM_FRAME);
+            int len = TEST_SHM_FRAME - i;
+            if (shm_ring_write(test_channel.requests, test_channel.ring_size, test_shm_in, len) != 0) ok = 0;
+            if (shm_ring_read(test_channel.requests, test_channel.ring_size, test_shm_out, TEST_SHM_FRAME) != len) ok = 0;
+            if (memcmp(test_shm_in, test_shm_out, len) != 0) ok = 0;
+        }
+        TEST_ASSERT(ok);
+        TEST_ASSERT_EQ(shm_ring_pending(test_channel.requests), 0);
+    );
+
+    TEST_CASE("shm ring should refuse frames once full or too large",
+        int written = 0;
+        while (shm_ring_write(test_channel.responses, test_channel.ring_size, test_shm_in, TEST_SHM_FRAME) == 0) {
+            written++;
+        }
+        TEST_ASSERT_EQ(written, 8192 / (TEST_SHM_FRAME + SHM_FRAME_HEADER));
+        TEST_ASSERT_EQ(shm_ring_write(test_channel.responses, test_channel.ring_size, test_shm_in, 8192), -2);
+        TEST_ASSERT_EQ(shm_ring_wait(test_channel.responses, test_channel.ring_size, TEST_SHM_FRAME,
+                                     test_channel.agent_fd, 10), -1);
+
+        // A frame larger than the read buffer is malformed as far as the reader is concerned
+        TEST_ASSERT_EQ(shm_ring_read(test_channel.responses, test_channel.ring_size, test_shm_out, 10), -1);
+        TEST_ASSERT_EQ(shm_ring_read(test_channel.responses, test_channel.ring_size, test_shm_out, TEST_SHM_FRAME),
+                       TEST_SHM_FRAME);
+        TEST_ASSERT_EQ(shm_ring_wait(test_channel.responses, test_channel.ring_size, TEST_SHM_FRAME,
+                                     test_channel.agent_fd, 10), 0);
+    );
+
+    TEST_CASE("shm channel should park replies past a full ring and keep their order",
+        ShmChannel parking;
+        TEST_ASSERT_EQ(shm_channel_create(&parking, 4096), 0);
+        int ok = 1;
+        int frames = 0;
+        // Two rings' worth of replies, the second half has to wait aside
+        for (; frames < 2 * 4096 / (TEST_SHM_FRAME + SHM_FRAME_HEADER); frames++) {
+            memset(test_shm_in, 'a' + frames, TEST_SHM_FRAME);
+            if (shm_channel_reply(&parking, test_shm_in, TEST_SHM_FRAME) != 0) ok = 0;
+        }
+        TEST_ASSERT(ok);
+        TEST_ASSERT(parking.parked_len > 0);
+        TEST_ASSERT_EQ(shm_channel_unpark_ready(&parking), 0);
+
+        // The client reading makes room, and every reply comes out in the order written
+        for (int i = 0; i < frames && ok; i++) {
+            int len = shm_ring_read(parking.responses, parking.ring_size, test_shm_out, TEST_SHM_FRAME);
+            if (len == 0) {
+                shm_channel_unpark(&parking);
+                len = shm_ring_read(parking.responses, parking.ring_size, test_shm_out, TEST_SHM_FRAME);
+            }
+            if (len != TEST_SHM_FRAME || test_shm_out[0] != 'a' + i) ok = 0;
+        }
+        TEST_ASSERT(ok);
+        TEST_ASSERT_EQ(parking.parked_len, 0);
+        TEST_ASSERT_EQ(parking.broken, 0);
+
+        // A client that reads nothing gets its channel marked broken once the parked replies fill up too, which
+        // takes far more than a ring so that a whole snapshot can wait for a client still reading its start
+        while (shm_channel_reply(&parking, test_shm_in, TEST_SHM_FRAME) == 0) {}
+        TEST_ASSERT_EQ(parking.broken, 1);
+        TEST_ASSERT(parking.parked_len > SHM_PARK_MAX - TEST_SHM_FRAME - 2 * SHM_FRAME_HEADER);
+        shm_channel_close(&parking);
+        TEST_ASSERT_EQ(parking.parked, NULL);
+    );
+
+    TEST_CASE("shm channel should be handed over through a Unix socket",
+        int socks[2];
+        TEST_ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, socks), 0);
+        TEST_ASSERT_EQ(shm_channel_send(&test_channel, socks[0]), 0);
+        TEST_ASSERT_EQ(shm_channel_recv(&test_client, socks[1]), 0);
+        TEST_ASSERT_EQ(test_client.ring_size, test_channel.ring_size);
+
+        // Both mappings are the same memory, and the doorbell only rings for a side that sleeps
+        TEST_ASSERT_EQ(shm_ring_write(test_client.requests, test_client.ring_size, "ping", 5), 0);
+        shm_notify(&test_client.requests->consumer_sleeping, test_client.agent_fd);
+        uint64_t count = 0;
+        TEST_ASSERT_EQ(read(test_channel.agent_fd, &count, sizeof(count)), -1);
+        test_channel.requests->consumer_sleeping = 1;
+        shm_notify(&test_client.requests->consumer_sleeping, test_client.agent_fd);
+        TEST_ASSERT_EQ(read(test_channel.agent_fd, &count, sizeof(count)), sizeof(count));
+        TEST_ASSERT_EQ(shm_ring_wait(test_channel.requests, test_channel.ring_size, 0, test_channel.agent_fd, 10), 0);
+        TEST_ASSERT_EQ(shm_ring_read(test_channel.requests, test_channel.ring_size, test_shm_out, TEST_SHM_FRAME), 5);
+        TEST_ASSERT_EQ(strcmp(test_shm_out, "ping"), 0);
+
+        close(socks[0]);
+        shm_channel_close(&test_client);
+        shm_channel_close(&test_channel);
+        TEST_ASSERT_EQ(test_client.sock, -1);
+    );
+
+    TEST_CASE("shm listen should replace a stale socket but leave other files alone",
+        char path[] = "/tmp/dpatch_test_shm.sock";
+        unlink(path);
+        int sock = shm_listen(path, 1);
+        TEST_ASSERT(sock >= 0);
+        close(sock);
+        sock = shm_listen(path, 1);
+        TEST_ASSERT(sock >= 0);
+        close(sock);
+        unlink(path);
+
+        FILE* file = fopen(path, "w");
+        TEST_ASSERT(file != NULL);
+        fputs("keep", file);
+        fclose(file);
+        TEST_ASSERT_EQ(shm_listen(path, 1), -1);
+        struct stat st;
+        TEST_ASSERT_EQ(stat(path, &st), 0);
+        TEST_ASSERT_EQ(st.st_size, 4);
+        unlink(path);
+    );
+)
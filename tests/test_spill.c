@@ -0,0 +1,91 @@
+#define SPILL_IMPL
+#include "spill.h"
+#include "testutil.h"
+
+TEST_SUITE(spill,
+    Spill* spill;
+    char out[1024];
+
+    TEST_CASE("spill should not touch disk before first push",
+        spill = spill_new("/tmp", SPILL_GROW_MIN * 4);
+        TEST_ASSERT_NOT(spill, NULL);
+        TEST_ASSERT_EQ(spill->fd, -1);
+        TEST_ASSERT_EQ(spill_peek(spill), 0);
+        TEST_ASSERT_EQ(spill_pop(spill, out, sizeof(out)), 0);
+    );
+
+    TEST_CASE("spill should return records in push order",
+        TEST_ASSERT_EQ(spill_push(spill, "first", 6), 0);
+        TEST_ASSERT_EQ(spill_push(spill, "second record", 14), 0);
+        TEST_ASSERT_EQ(spill->count, 2);
+        TEST_ASSERT_EQ(spill->tail, SPILL_RECORD_SIZE(6) + SPILL_RECORD_SIZE(14));
+
+        TEST_ASSERT_EQ(spill_peek(spill), 6);
+        TEST_ASSERT_EQ(spill_pop(spill, out, 4), 0);
+        TEST_ASSERT_EQ(spill_pop(spill, out, sizeof(out)), 6);
+        TEST_ASSERT_EQ(strcmp(out, "first"), 0);
+        TEST_ASSERT_EQ(spill_pop(spill, out, sizeof(out)), 14);
+        TEST_ASSERT_EQ(strcmp(out, "second record"), 0);
+    );
+
+    TEST_CASE("spill should release the segment once drained",
+        TEST_ASSERT_EQ(spill->count, 0);
+        TEST_ASSERT_NOT(spill->map, NULL);
+        TEST_ASSERT_EQ(spill_trim(spill), 0);
+        TEST_ASSERT_EQ(spill->map, NULL);
+        TEST_ASSERT_EQ(spill->mapped, 0);
+        TEST_ASSERT_EQ(spill->tail, 0);
+    );
+
+    TEST_CASE("spill should grow the segment and keep order across growth",
+        int pushed = 0;
+        for (int i = 0; i < 3000; i++) {
+            memset(out, 0, sizeof(out));
+            memcpy(out, &i, sizeof(int));
+            if (spill_push(spill, out, 1000) == 0) pushed++;
+        }
+        TEST_ASSERT_EQ(pushed, 3000);
+        TEST_ASSERT(spill->mapped > SPILL_GROW_MIN);
+
+        int in_order = 0;
+        for (int i = 0; i < 3000; i++) {
+            int value = -1;
+            if (spill_pop(spill, out, sizeof(out)) == 1000) memcpy(&value, out, sizeof(int));
+            if (value == i) in_order++;
+        }
+        TEST_ASSERT_EQ(in_order, 3000);
+        TEST_ASSERT_EQ(spill_trim(spill), 0);
+        TEST_ASSERT_EQ(spill->mapped, 0);
+    );
+
+    TEST_CASE("spill should reuse popped space under a sustained backlog",
+        spill_close(spill);
+        spill = spill_new("/tmp", SPILL_GROW_MIN);
+        int ok = 1;
+        // Ten times the limit passes through while only a handful of records are ever live
+        for (int i = 0; i < 10 * SPILL_GROW_MIN / 1000 && ok; i++) {
+            memset(out, 0, sizeof(out));
+            memcpy(out, &i, sizeof(int));
+            if (spill_push(spill, out, 1000) != 0) ok = 0;
+            if (i < 8) continue;
+
+            int value = -1;
+            if (spill_pop(spill, out, sizeof(out)) == 1000) memcpy(&value, out, sizeof(int));
+            if (value != i - 8) ok = 0;
+        }
+        TEST_ASSERT(ok);
+        TEST_ASSERT_EQ(spill->count, 8);
+        TEST_ASSERT_EQ(spill->mapped, SPILL_GROW_MIN);
+    );
+
+    TEST_CASE("spill should refuse records past its size limit",
+        spill_close(spill);
+        spill = spill_new("/tmp", SPILL_GROW_MIN);
+        int pushed = 0;
+        while (pushed < 2000 && spill_push(spill, out, 1000) == 0) pushed++;
+        TEST_ASSERT_EQ(pushed, SPILL_GROW_MIN / SPILL_RECORD_SIZE(1000));
+        TEST_ASSERT_EQ(spill->count, pushed);
+        spill_close(spill);
+        TEST_ASSERT_EQ(spill->fd, -1);
+    );
+)
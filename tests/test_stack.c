@@ -0,0 +1,31 @@
+#define STACK_IMPL
+#include "stack.h"
+#include "testutil.h"
+
+DEFINE_STACK(test_int_stack, int)
+
+TEST_SUITE(stack,
+    test_int_stack* stack = test_int_stack_new(3);
+
+    TEST_CASE("typed stack should push and get items by value",
+        TEST_ASSERT_NOT(stack, NULL);
+        TEST_ASSERT_EQ(test_int_stack_push(stack, 10), 0);
+        TEST_ASSERT_EQ(test_int_stack_push(stack, 20), 1);
+        TEST_ASSERT_EQ(test_int_stack_push(stack, 30), 2);
+        TEST_ASSERT_EQ(test_int_stack_push(stack, 40), -1);
+        TEST_ASSERT_EQ(*test_int_stack_get(stack, 1), 20);
+        TEST_ASSERT_EQ(test_int_stack_get(stack, 3), NULL);
+    );
+
+    TEST_CASE("typed stack should share its layout with the generic stack",
+        TEST_ASSERT_EQ(*(int*)stack_get((Stack*)stack, 2), 30);
+        TEST_ASSERT_EQ(test_int_stack_remove_at_fast(stack, 0), 1);
+        TEST_ASSERT_EQ(*test_int_stack_get(stack, 0), 30);
+        TEST_ASSERT_EQ(*test_int_stack_pop(stack), 20);
+        TEST_ASSERT_EQ(stack->count, 1);
+        test_int_stack_reset(stack);
+        TEST_ASSERT_EQ(test_int_stack_pop(stack), NULL);
+    );
+
+    free(stack);
+)
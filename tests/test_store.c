@@ -7,6 +7,8 @@ typedef struct {
     char* text;
 } TestStruct;
 
+DEFINE_STORE(test_store, TestStruct)
+
 TEST_SUITE(store,
     Store* store;
     TestStruct* t1;
@@ -77,4 +79,62 @@ TEST_SUITE(store,
     );
 
     store_free(store);
+
+    TEST_CASE("store items should be cache line aligned",
+        store = store_new(4, 3);
+        TEST_ASSERT_EQ(store->stride, STORE_ITEM_ALIGN);
+        for (int i = 0; i < 4; i++) {
+            KeyValue res = store_push_empty(store);
+            TEST_ASSERT_EQ((uintptr_t)res.value % STORE_ITEM_ALIGN, 0);
+        }
+        store_free(store);
+    );
+
+    TEST_CASE("store_next_used should skip unused slots across bitmap words",
+        store = store_new(200, sizeof(int));
+        TEST_ASSERT_EQ(store_next_used(store, 0), -1);
+        for (int i = 0; i < 200; i++) store_push_empty(store);
+        for (int i = 0; i < 200; i++) {
+            if (i != 3 && i != 64 && i != 130 && i != 199) store_remove_at(store, i);
+        }
+        TEST_ASSERT_EQ(store_next_used(store, 0), 3);
+        TEST_ASSERT_EQ(store_next_used(store, 4), 64);
+        TEST_ASSERT_EQ(store_next_used(store, 65), 130);
+        TEST_ASSERT_EQ(store_next_used(store, 131), 199);
+        TEST_ASSERT_EQ(store_next_used(store, 200), -1);
+
+        int visited = 0;
+        store_foreach(store, i) {
+            store_remove_at(store, i);
+            visited++;
+        }
+        TEST_ASSERT_EQ(visited, 4);
+        TEST_ASSERT_EQ(store_length(store), 0);
+        TEST_ASSERT_EQ(store_next_used(store, 0), -1);
+        store_free(store);
+    );
+
+    TEST_CASE("typed store should push, get and remove items like the generic store",
+        test_store* typed = test_store_new(70);
+        TestStruct item;
+        item.key = 7;
+        item.text = "typed";
+        int idx = -1;
+        TEST_ASSERT_EQ(test_store_push(typed, &item), 0);
+        TestStruct* empty = test_store_push_empty(typed, &idx);
+        TEST_ASSERT_EQ(idx, 1);
+        TEST_ASSERT_EQ(empty->key, 0);
+        TEST_ASSERT_EQ(test_store_get(typed, 0)->key, 7);
+        TEST_ASSERT_EQ(((TestStruct*)store_get((Store*)typed, 0).value)->key, 7);
+
+        TEST_ASSERT_EQ(test_store_remove_at(typed, 0), 1);
+        TEST_ASSERT_EQ(test_store_remove_at(typed, 0), 0);
+        TEST_ASSERT_EQ(test_store_get(typed, 0), NULL);
+        TEST_ASSERT_EQ(store_length((Store*)typed), 1);
+
+        int visited = 0;
+        store_foreach(typed, i) visited += i;
+        TEST_ASSERT_EQ(visited, 1);
+        store_free((Store*)typed);
+    );
 )
@@ -0,0 +1,92 @@
+#define STRHEAP_IMPL
+#include "strheap.h"
+#include "testutil.h"
+
+TEST_SUITE(strheap,
+    StrHeap* heap;
+
+    TEST_CASE("strheap should copy strings into size classed blocks",
+        heap = strheap_new(64 * 1024);
+        TEST_ASSERT_NOT(heap, NULL);
+        char* a = strheap_dup(heap, "hello");
+        TEST_ASSERT_NOT(a, NULL);
+        TEST_ASSERT_EQ(strcmp(a, "hello"), 0);
+        TEST_ASSERT_EQ(heap->used, 32);
+        TEST_ASSERT_EQ(heap->reserved, STRHEAP_SLAB_SIZE);
+        TEST_ASSERT_EQ(strheap_block_size(a), 32 - sizeof(StrHeapBlock));
+
+        char* b = strheap_alloc(heap, 100);
+        TEST_ASSERT_NOT(b, NULL);
+        TEST_ASSERT_EQ(strheap_block_size(b), 128 - sizeof(StrHeapBlock));
+    );
+
+    TEST_CASE("strheap should reuse freed blocks of the same class",
+        heap = strheap_new(64 * 1024);
+        char* a = strheap_alloc(heap, 40);
+        char* b = strheap_alloc(heap, 40);
+        TEST_ASSERT_NOT(a, b);
+
+        strheap_free(heap, a);
+        TEST_ASSERT_EQ(strheap_alloc(heap, 40), a);
+        strheap_free(heap, a);
+        strheap_free(heap, b);
+        TEST_ASSERT_EQ(heap->used, 0);
+        TEST_ASSERT_EQ(heap->peak, 128);
+
+        // Freed last, so handed out first
+        TEST_ASSERT_EQ(strheap_alloc(heap, 40), b);
+    );
+
+    TEST_CASE("strheap should ignore freeing a block twice",
+        heap = strheap_new(64 * 1024);
+        char* a = strheap_alloc(heap, 10);
+        strheap_free(heap, a);
+        strheap_free(heap, a);
+        TEST_ASSERT_EQ(heap->used, 0);
+        TEST_ASSERT_EQ(strheap_alloc(heap, 10), a);
+        TEST_ASSERT_NOT(strheap_alloc(heap, 10), a);
+    );
+
+    TEST_CASE("strheap should map large blocks separately",
+        heap = strheap_new(64 * 1024);
+        char* big = strheap_alloc(heap, 10000);
+        TEST_ASSERT_NOT(big, NULL);
+        TEST_ASSERT(strheap_block_size(big) >= 10000);
+        memset(big, 'x', 10000);
+        TEST_ASSERT_EQ(heap->reserved, 12288);
+
+        strheap_free(heap, big);
+        TEST_ASSERT_EQ(heap->reserved, 0);
+        TEST_ASSERT_EQ(heap->used, 0);
+    );
+
+    TEST_CASE("strheap should fail when capacity would be exceeded",
+        heap = strheap_new(STRHEAP_SLAB_SIZE);
+        TEST_ASSERT_EQ(strheap_alloc(heap, STRHEAP_SLAB_SIZE), NULL);
+        for (int i = 0; i < STRHEAP_SLAB_SIZE / 4096; i++) {
+            TEST_ASSERT_NOT(strheap_alloc(heap, 4000), NULL);
+        }
+        TEST_ASSERT_EQ(strheap_alloc(heap, 4000), NULL);
+        TEST_ASSERT_EQ(strheap_alloc(heap, 10), NULL);
+    );
+
+    TEST_CASE("strheap should release slabs while keeping large blocks",
+        heap = strheap_new(256 * 1024);
+        for (int i = 0; i < 20; i++) {
+            TEST_ASSERT_NOT(strheap_alloc(heap, 2000), NULL);
+        }
+        char* big = strheap_alloc(heap, 10000);
+        TEST_ASSERT_EQ(heap->slab_count, 3);
+
+        strheap_release(heap);
+        TEST_ASSERT_EQ(heap->reserved, 12288);
+        TEST_ASSERT_EQ(heap->used, 12288);
+        TEST_ASSERT_EQ(heap->slab_count, 0);
+        strheap_free(heap, big);
+        TEST_ASSERT_EQ(heap->reserved, 0);
+
+        char* a = strheap_dup(heap, "again");
+        TEST_ASSERT_NOT(a, NULL);
+        TEST_ASSERT_EQ(heap->reserved, STRHEAP_SLAB_SIZE);
+    );
+)
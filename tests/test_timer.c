@@ -0,0 +1,81 @@
+#define TIMER_IMPL
+#include "timer.h"
+#include "testutil.h"
+
+static int timer_fired[8];
+
+static void
+timer_test_callback(void* data, int key) {
+    timer_fired[key]++;
+}
+
+TEST_SUITE(timer,
+    TimerWheel* wheel;
+
+    TEST_CASE("timer wheel creation",
+        wheel = timer_wheel_new(4, 10, 1000);
+        TEST_ASSERT_NOT(wheel, NULL);
+        TEST_ASSERT_EQ(wheel->active, 0);
+    );
+
+    TEST_CASE("timers should fire only after their deadline",
+        memset(timer_fired, 0, sizeof(timer_fired));
+        TEST_ASSERT(timer_add(wheel, 1050, timer_test_callback, NULL, 0) != TIMER_NONE);
+        TEST_ASSERT_EQ(timer_wheel_advance(wheel, 1040), 0);
+        TEST_ASSERT_EQ(timer_fired[0], 0);
+        TEST_ASSERT_EQ(timer_wheel_advance(wheel, 1050), 1);
+        TEST_ASSERT_EQ(timer_fired[0], 1);
+        TEST_ASSERT_EQ(wheel->active, 0);
+    );
+
+    TEST_CASE("timers on coarser levels should cascade down and fire",
+        memset(timer_fired, 0, sizeof(timer_fired));
+        // 64 ticks and 64^2 ticks away from the current tick
+        TEST_ASSERT(timer_add(wheel, 1050 + 640 + 10, timer_test_callback, NULL, 1) != TIMER_NONE);
+        TEST_ASSERT(timer_add(wheel, 1050 + 40960 + 10, timer_test_callback, NULL, 2) != TIMER_NONE);
+        TEST_ASSERT_EQ(timer_wheel_advance(wheel, 1050 + 640), 0);
+        TEST_ASSERT_EQ(timer_wheel_advance(wheel, 1050 + 650), 1);
+        TEST_ASSERT_EQ(timer_fired[1], 1);
+        TEST_ASSERT_EQ(timer_wheel_advance(wheel, 1050 + 40960), 0);
+        TEST_ASSERT_EQ(timer_wheel_advance(wheel, 1050 + 40970), 1);
+        TEST_ASSERT_EQ(timer_fired[2], 1);
+    );
+
+    TEST_CASE("cancelled timers should not fire and should free capacity",
+        memset(timer_fired, 0, sizeof(timer_fired));
+        uint64_t now = 1050 + 40970;
+        int ids[4];
+        for (int i = 0; i < 4; i++) {
+            ids[i] = timer_add(wheel, now + 100, timer_test_callback, NULL, i);
+            TEST_ASSERT(ids[i] != TIMER_NONE);
+        }
+        TEST_ASSERT_EQ(timer_add(wheel, now + 100, timer_test_callback, NULL, 4), TIMER_NONE);
+        TEST_ASSERT_EQ(timer_cancel(wheel, ids[1]), 1);
+        TEST_ASSERT_EQ(timer_cancel(wheel, ids[1]), 0);
+        TEST_ASSERT_EQ(wheel->active, 3);
+        TEST_ASSERT_EQ(timer_wheel_advance(wheel, now + 100), 3);
+        TEST_ASSERT_EQ(timer_fired[1], 0);
+        TEST_ASSERT_EQ(timer_fired[3], 1);
+    );
+
+    TEST_CASE("timers added in the past should fire on the next tick",
+        memset(timer_fired, 0, sizeof(timer_fired));
+        TEST_ASSERT(timer_add(wheel, 0, timer_test_callback, NULL, 0) != TIMER_NONE);
+        TEST_ASSERT_EQ(timer_wheel_advance(wheel, 1050 + 41080), 1);
+        TEST_ASSERT_EQ(timer_fired[0], 1);
+    );
+
+    free(wheel);
+
+    TEST_CASE("timers due exactly on a level boundary should fire on time",
+        memset(timer_fired, 0, sizeof(timer_fired));
+        wheel = timer_wheel_new(4, 10, 0);
+        TEST_ASSERT_NOT(wheel, NULL);
+        // Tick 64 sits on level 1 until it is cascaded down on that same tick
+        TEST_ASSERT(timer_add(wheel, 640, timer_test_callback, NULL, 0) != TIMER_NONE);
+        TEST_ASSERT_EQ(timer_wheel_advance(wheel, 630), 0);
+        TEST_ASSERT_EQ(timer_wheel_advance(wheel, 640), 1);
+        TEST_ASSERT_EQ(timer_fired[0], 1);
+        free(wheel);
+    );
+)
@@ -0,0 +1,71 @@
+#define TRACE_IMPL
+#include "trace.h"
+#include "testutil.h"
+
+#define TEST_TRACE_FILE "/tmp/dpatch-test-trace.json"
+
+static long
+test_trace_read(char* buf, size_t size) {
+    int fd = open(TEST_TRACE_FILE, O_RDONLY);
+    if (fd < 0) return -1;
+    ssize_t len = read(fd, buf, size - 1);
+    close(fd);
+    if (len >= 0) buf[len] = '\0';
+    return len;
+}
+
+TEST_SUITE(trace,
+    char out[8192];
+
+    TEST_CASE("trace should refuse to dump when not enabled",
+        TEST_ASSERT_EQ(trace_dump(), -1);
+    );
+
+    TEST_CASE("trace should write task runs as nested async spans",
+        TEST_ASSERT_EQ(trace_init(TEST_TRACE_FILE, 16), 0);
+        trace_record(TRACE_SUBMITTED, 1, 0, "build \"all\"", 0, 1000);
+        trace_record(TRACE_QUEUED, 1, 0, "build \"all\"", 0, 2000);
+        trace_record(TRACE_LAUNCHED, 1, 42, "build \"all\"", 1, 3500);
+        trace_record(TRACE_EXITED, 1, 42, "build \"all\"", 2, 9000);
+        trace_record(TRACE_REAPED, 1, 42, "build \"all\"", 0, 9100);
+        TEST_ASSERT_EQ(trace_dump(), 5);
+
+        TEST_ASSERT(test_trace_read(out, sizeof(out)) > 0);
+        TEST_ASSERT_NOT(strstr(out, "\"ph\":\"b\",\"id\":1,\"ts\":1.000,"), NULL);
+        TEST_ASSERT_NOT(strstr(out, "\"name\":\"build \\\"all\\\"\"}"), NULL);
+        TEST_ASSERT_NOT(strstr(out, "\"ph\":\"e\",\"id\":1,\"ts\":3.500,"), NULL);
+        TEST_ASSERT_NOT(strstr(out, "\"name\":\"running\",\"args\":{\"pid\":42}"), NULL);
+        TEST_ASSERT_NOT(strstr(out, "\"name\":\"running\",\"args\":{\"status\":2}"), NULL);
+        TEST_ASSERT_EQ(strcmp(out + strlen(out) - 4, "\n]}\n"), 0);
+    );
+
+    TEST_CASE("trace should keep only the newest events once the buffer is full",
+        for (int i = 0; i < 40; i++) trace_record(TRACE_FIRST_OUTPUT, 100 + i, 1, "spam", 0, 1000);
+        TEST_ASSERT_EQ(trace_dump(), 16);
+        test_trace_read(out, sizeof(out));
+        TEST_ASSERT_EQ(strstr(out, "\"id\":123,"), NULL);
+        TEST_ASSERT_NOT(strstr(out, "\"id\":124,"), NULL);
+        TEST_ASSERT_NOT(strstr(out, "\"id\":139,"), NULL);
+    );
+
+    TEST_CASE("trace should keep the queued span of a run open when its launch is retried",
+        trace_record(TRACE_SUBMITTED, 9, 0, "flaky", 0, 1000);
+        trace_record(TRACE_QUEUED, 9, 0, "flaky", 0, 2000);
+        trace_record(TRACE_LAUNCH_RETRY, 9, 0, "flaky", 0, 4000);
+        TEST_ASSERT_EQ(trace_dump(), 16);
+        test_trace_read(out, sizeof(out));
+        TEST_ASSERT_NOT(strstr(out, "\"ph\":\"n\",\"id\":9,\"ts\":4.000,"), NULL);
+        TEST_ASSERT_NOT(strstr(out, "\"name\":\"launch failed\"}"), NULL);
+        TEST_ASSERT_EQ(strstr(out, "\"ph\":\"e\",\"id\":9,"), NULL);
+    );
+
+    TEST_CASE("trace should cut long task names short",
+        trace_record(TRACE_SUBMITTED, 7, 0, "a task name that is longer than the inline name buffer", 0, 1000);
+        TraceEvent* event = &__trace.events[(__trace.head - 1) % __trace.capacity];
+        TEST_ASSERT_EQ(strlen(event->name), TRACE_NAME_MAX - 1);
+
+        trace_close();
+        TEST_ASSERT_EQ(__trace.events, NULL);
+        unlink(TEST_TRACE_FILE);
+    );
+)